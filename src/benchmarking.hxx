@@ -0,0 +1,60 @@
+#pragma once
+
+#include "hard_config.hxx"
+#include "types.hxx"
+
+#include <chrono>
+#include <cstdio>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Benchmarking
+// Switched on by defining PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER in hard-wired settings
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace Benchmarking
+{
+    // Wall-clock stopwatch. Unlike clock(), it doesn't sum up the time of all running threads.
+    class Timer
+    {
+    public:
+        Timer()
+        {
+            Restart();
+        }
+
+        void Restart()
+        {
+            mStart = std::chrono::high_resolution_clock::now();
+        }
+
+        double ElapsedSeconds() const
+        {
+            const auto now = std::chrono::high_resolution_clock::now();
+            return std::chrono::duration<double>(now - mStart).count();
+        }
+
+    private:
+        std::chrono::high_resolution_clock::time_point mStart;
+    };
+
+    void PrintHeader(const char *aBenchmarkName)
+    {
+        printf("\nBenchmark \"%s\":\n", aBenchmarkName);
+        fflush(stdout);
+    }
+
+    // Prints the throughput of one measured case in millions of operations per second
+    void PrintThroughput(
+        const char      *aCaseName,
+        const uint64_t   aOperationCount,
+        const double     aSeconds,
+        const char      *aOperationName)
+    {
+        const double throughput = (aSeconds > 0.) ? (aOperationCount / aSeconds) : 0.;
+        printf(
+            "\t%-44s: %10.3f M%s/s (%llu in %.3f s)\n",
+            aCaseName, throughput * 1e-6, aOperationName,
+            (unsigned long long)aOperationCount, aSeconds);
+        fflush(stdout);
+    }
+} // namespace Benchmarking
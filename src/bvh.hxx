@@ -0,0 +1,755 @@
+#pragma once
+
+#include "scene_graph.hxx"
+#include "geometry_soa.hxx"
+#include "math.hxx"
+#include "ray.hxx"
+#include "debugging.hxx"
+#include "unit_testing.hxx"
+#include "rng.hxx"
+#include "sampling.hxx"
+#include "benchmarking.hxx"
+#include "hard_config.hxx"
+#include "types.hxx"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Bounding volume hierarchy over the geometry of a GeometryList
+//
+// The hierarchy is built top-down using the binned surface area heuristic (SAH) from the bounds
+// provided by AbstractGeometry::GrowBBox(). Nodes are stored in a flat array in depth-first
+// order: the left child of an inner node always immediately follows its parent, so only
+// the index of the right child is stored. The geometry list is reordered during build so that
+// each leaf references a contiguous range of primitives.
+//
+// With PG3_USE_SIMD_INTERSECTION, leaves are intersected 4 primitives at a time using
+// the structure-of-arrays copy of the geometry (see GeometrySoA).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class BVH : public GeometryList
+{
+public:
+
+    // 32 bytes, two nodes per cache line
+    struct Node
+    {
+        Vec3f       bboxMin;
+        uint32_t    firstOrRight;   // Leaf: index of the first primitive; inner node: index of the right child
+        Vec3f       bboxMax;
+        uint32_t    primCount;      // Zero for inner nodes
+
+        bool IsLeaf() const { return primCount > 0; }
+    };
+
+    struct Stats
+    {
+        uint32_t    nodeCount;
+        uint32_t    leafCount;
+        uint32_t    maxDepth;
+        uint32_t    maxLeafSize;
+    };
+
+public:
+
+    BVH() {}
+
+    virtual ~BVH() {}
+
+    // Builds the hierarchy over the current content of mGeometry. Must be called before
+    // the first intersection query and after each modification of mGeometry.
+    void Build()
+    {
+        mNodes.clear();
+
+        const uint32_t primCount = (uint32_t)mGeometry.size();
+        if (primCount == 0)
+            return;
+
+        std::vector<BuildPrimitive> prims(primCount);
+        for (uint32_t i = 0; i < primCount; i++)
+        {
+            auto &prim = prims[i];
+            prim.bboxMin = Vec3f( Math::InfinityF());
+            prim.bboxMax = Vec3f(-Math::InfinityF());
+            mGeometry[i]->GrowBBox(prim.bboxMin, prim.bboxMax);
+            prim.centroid = (prim.bboxMin + prim.bboxMax) * 0.5f;
+            prim.index = i;
+        }
+
+        mNodes.reserve(2 * primCount);
+        BuildNode(prims, 0, primCount, 0);
+
+        // Reorder the geometry to match the leaves' primitive ranges
+        std::vector<AbstractGeometry*> orderedGeometry(primCount);
+        for (uint32_t i = 0; i < primCount; i++)
+            orderedGeometry[i] = mGeometry[prims[i].index];
+        mGeometry.swap(orderedGeometry);
+
+        mNodes.shrink_to_fit();
+
+#ifdef PG3_USE_SIMD_INTERSECTION
+        mGeometrySoA.Build(mGeometry);
+#endif
+    }
+
+    virtual bool Intersect(
+        const Ray       &aRay,
+        RayIntersection &oResult) const override
+    {
+        PG3_ASSERT(mGeometry.empty() == mNodes.empty()); // Build() must have been called
+
+        if (mNodes.empty())
+            return false;
+
+        const Vec3f invDir = Vec3f(1.f) / aRay.dir;
+
+        float tEntry;
+        if (!IntersectBBox(mNodes[0], aRay.org, invDir, aRay.tmin, oResult.dist, tEntry))
+            return false;
+
+#ifdef PG3_USE_SIMD_INTERSECTION
+        const GeometrySoA::RaySimd raySimd(aRay);
+#endif
+
+        StackEntry stack[kMaxDepth];
+        uint32_t stackSize = 0;
+        uint32_t nodeIdx = 0;
+        bool anyIntersection = false;
+
+        for (;;)
+        {
+            const Node &node = mNodes[nodeIdx];
+
+            if (node.IsLeaf())
+            {
+                const uint32_t primEnd = node.firstOrRight + node.primCount;
+#ifdef PG3_USE_SIMD_INTERSECTION
+                if (mGeometrySoA.Intersect(node.firstOrRight, primEnd, mGeometry, raySimd, aRay, oResult))
+                    anyIntersection = true;
+#else
+                for (uint32_t primIdx = node.firstOrRight; primIdx < primEnd; primIdx++)
+                    if (mGeometry[primIdx]->Intersect(aRay, oResult))
+                        anyIntersection = true;
+#endif
+            }
+            else
+            {
+                // Visit the closer child first and postpone the other one
+                const uint32_t leftIdx  = nodeIdx + 1;
+                const uint32_t rightIdx = node.firstOrRight;
+
+                float tLeft, tRight;
+                const bool hitLeft =
+                    IntersectBBox(mNodes[leftIdx],  aRay.org, invDir, aRay.tmin, oResult.dist, tLeft);
+                const bool hitRight =
+                    IntersectBBox(mNodes[rightIdx], aRay.org, invDir, aRay.tmin, oResult.dist, tRight);
+
+                if (hitLeft && hitRight)
+                {
+                    PG3_ASSERT_INTEGER_LESS_THAN(stackSize, kMaxDepth);
+
+                    if (tLeft <= tRight)
+                    {
+                        stack[stackSize++] = StackEntry{ rightIdx, tRight };
+                        nodeIdx = leftIdx;
+                    }
+                    else
+                    {
+                        stack[stackSize++] = StackEntry{ leftIdx, tLeft };
+                        nodeIdx = rightIdx;
+                    }
+                    continue;
+                }
+                else if (hitLeft)
+                {
+                    nodeIdx = leftIdx;
+                    continue;
+                }
+                else if (hitRight)
+                {
+                    nodeIdx = rightIdx;
+                    continue;
+                }
+            }
+
+            // Pop the next postponed node which can still contain a closer intersection
+            for (;;)
+            {
+                if (stackSize == 0)
+                    return anyIntersection;
+
+                const StackEntry &entry = stack[--stackSize];
+                if (entry.tEntry <= oResult.dist)
+                {
+                    nodeIdx = entry.nodeIdx;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Any-hit traversal for shadow rays: terminates at the first found intersection
+    virtual bool IntersectP(
+        const Ray       &aRay,
+        RayIntersection &oResult) const override
+    {
+        PG3_ASSERT(mGeometry.empty() == mNodes.empty()); // Build() must have been called
+
+        if (mNodes.empty())
+            return false;
+
+        const Vec3f invDir = Vec3f(1.f) / aRay.dir;
+
+        float tEntry;
+        if (!IntersectBBox(mNodes[0], aRay.org, invDir, aRay.tmin, oResult.dist, tEntry))
+            return false;
+
+#ifdef PG3_USE_SIMD_INTERSECTION
+        const GeometrySoA::RaySimd raySimd(aRay);
+#endif
+
+        uint32_t stack[kMaxDepth];
+        uint32_t stackSize = 0;
+        uint32_t nodeIdx = 0;
+
+        for (;;)
+        {
+            const Node &node = mNodes[nodeIdx];
+
+            if (node.IsLeaf())
+            {
+                const uint32_t primEnd = node.firstOrRight + node.primCount;
+#ifdef PG3_USE_SIMD_INTERSECTION
+                if (mGeometrySoA.IntersectP(node.firstOrRight, primEnd, mGeometry, raySimd, aRay, oResult))
+                    return true;
+#else
+                for (uint32_t primIdx = node.firstOrRight; primIdx < primEnd; primIdx++)
+                    if (mGeometry[primIdx]->IntersectP(aRay, oResult))
+                        return true;
+#endif
+            }
+            else
+            {
+                // Order doesn't matter here
+                const uint32_t leftIdx  = nodeIdx + 1;
+                const uint32_t rightIdx = node.firstOrRight;
+
+                float tLeft, tRight;
+                const bool hitLeft =
+                    IntersectBBox(mNodes[leftIdx],  aRay.org, invDir, aRay.tmin, oResult.dist, tLeft);
+                const bool hitRight =
+                    IntersectBBox(mNodes[rightIdx], aRay.org, invDir, aRay.tmin, oResult.dist, tRight);
+
+                if (hitLeft && hitRight)
+                {
+                    PG3_ASSERT_INTEGER_LESS_THAN(stackSize, kMaxDepth);
+
+                    stack[stackSize++] = rightIdx;
+                    nodeIdx = leftIdx;
+                    continue;
+                }
+                else if (hitLeft)
+                {
+                    nodeIdx = leftIdx;
+                    continue;
+                }
+                else if (hitRight)
+                {
+                    nodeIdx = rightIdx;
+                    continue;
+                }
+            }
+
+            if (stackSize == 0)
+                return false;
+            nodeIdx = stack[--stackSize];
+        }
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax) const override
+    {
+        if (mNodes.empty())
+        {
+            GeometryList::GrowBBox(aoBBoxMin, aoBBoxMax);
+            return;
+        }
+
+        aoBBoxMin = Min(aoBBoxMin, mNodes[0].bboxMin);
+        aoBBoxMax = Max(aoBBoxMax, mNodes[0].bboxMax);
+    }
+
+    Stats GetStats() const
+    {
+        Stats stats = {};
+        stats.nodeCount = (uint32_t)mNodes.size();
+        if (!mNodes.empty())
+            GatherStats(0, 1, stats);
+        return stats;
+    }
+
+    const std::vector<Node> &GetNodes() const
+    {
+        return mNodes;
+    }
+
+    // Nodes, the reordered primitive list and the SIMD copy of the primitives
+    virtual size_t GetStorageSize() const override
+    {
+        size_t size = GeometryList::GetStorageSize() + mNodes.capacity() * sizeof(Node);
+#ifdef PG3_USE_SIMD_INTERSECTION
+        size += mGeometrySoA.GetStorageSize();
+#endif
+        return size;
+    }
+
+protected:
+
+    struct BuildPrimitive
+    {
+        Vec3f       bboxMin;
+        Vec3f       bboxMax;
+        Vec3f       centroid;
+        uint32_t    index;
+    };
+
+    struct Bin
+    {
+        Bin() :
+            bboxMin( Math::InfinityF()),
+            bboxMax(-Math::InfinityF()),
+            count(0)
+        {}
+
+        Vec3f       bboxMin;
+        Vec3f       bboxMax;
+        uint32_t    count;
+    };
+
+    struct StackEntry
+    {
+        uint32_t    nodeIdx;
+        float       tEntry;
+    };
+
+    static float HalfSurfaceArea(const Vec3f &aBBoxMin, const Vec3f &aBBoxMax)
+    {
+        const Vec3f extent = aBBoxMax - aBBoxMin;
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+
+    // Slab test. Relies on IEEE infinities for axis-parallel rays. The exit distance is
+    // conservatively enlarged to compensate for rounding errors (see PBRT, 3rd ed., 3.9.2),
+    // otherwise we could miss primitives touching the box faces.
+    static bool IntersectBBox(
+        const Node      &aNode,
+        const Vec3f     &aRayOrg,
+        const Vec3f     &aRayInvDir,
+        const float      aTMin,
+        const float      aTMax,
+              float     &oTEntry)
+    {
+        // 1 + 2 * gamma(3)
+        const float kBBoxExitScale = 1.0000008f;
+
+        const Vec3f t0 = (aNode.bboxMin - aRayOrg) * aRayInvDir;
+        const Vec3f t1 = (aNode.bboxMax - aRayOrg) * aRayInvDir;
+
+        const float tEntry = std::max(Min(t0, t1).Max(), aTMin);
+        const float tExit  = std::min(Max(t0, t1).Min() * kBBoxExitScale, aTMax);
+
+        oTEntry = tEntry;
+        return tEntry <= tExit;
+    }
+
+    // Recursively builds the subtree for primitives [aBegin, aEnd), returns index of its root
+    uint32_t BuildNode(
+        std::vector<BuildPrimitive> &aPrims,
+        const uint32_t               aBegin,
+        const uint32_t               aEnd,
+        const uint32_t               aDepth)
+    {
+        PG3_ASSERT_INTEGER_LESS_THAN(aBegin, aEnd);
+
+        const uint32_t nodeIdx = (uint32_t)mNodes.size();
+        mNodes.emplace_back();
+
+        Vec3f bboxMin( Math::InfinityF());
+        Vec3f bboxMax(-Math::InfinityF());
+        Vec3f centroidMin( Math::InfinityF());
+        Vec3f centroidMax(-Math::InfinityF());
+        for (uint32_t i = aBegin; i < aEnd; i++)
+        {
+            bboxMin     = Min(bboxMin, aPrims[i].bboxMin);
+            bboxMax     = Max(bboxMax, aPrims[i].bboxMax);
+            centroidMin = Min(centroidMin, aPrims[i].centroid);
+            centroidMax = Max(centroidMax, aPrims[i].centroid);
+        }
+
+        mNodes[nodeIdx].bboxMin = bboxMin;
+        mNodes[nodeIdx].bboxMax = bboxMax;
+
+        const uint32_t primCount = aEnd - aBegin;
+
+        // Leaf?
+        // Too deep subtrees would overflow the fixed-size traversal stacks, we stop them by
+        // creating (possibly large) leaves
+        if ((primCount <= kMinLeafSize) || (aDepth + 1 >= kMaxDepth))
+        {
+            MakeLeaf(nodeIdx, aBegin, primCount);
+            return nodeIdx;
+        }
+
+        // Find the best split candidate using binned SAH
+        uint32_t bestAxis   = 0;
+        uint32_t bestSplit  = 0; // Bins [0, bestSplit) go to the left child
+        float    bestCost   = Math::InfinityF();
+        const Vec3f centroidExtent = centroidMax - centroidMin;
+        for (uint32_t axis = 0; axis < 3; axis++)
+        {
+            if (centroidExtent.Get(axis) <= 0.f)
+                continue;
+
+            const float binScale = kBinCount / centroidExtent.Get(axis);
+
+            Bin bins[kBinCount];
+            for (uint32_t i = aBegin; i < aEnd; i++)
+            {
+                const uint32_t binIdx =
+                    CentroidToBin(aPrims[i].centroid.Get(axis), centroidMin.Get(axis), binScale);
+                auto &bin = bins[binIdx];
+                bin.count++;
+                bin.bboxMin = Min(bin.bboxMin, aPrims[i].bboxMin);
+                bin.bboxMax = Max(bin.bboxMax, aPrims[i].bboxMax);
+            }
+
+            // Sweep from the right to get the costs of right-hand sides...
+            float    rightAreas[kBinCount];
+            uint32_t rightCounts[kBinCount];
+            Vec3f    sweepMin( Math::InfinityF());
+            Vec3f    sweepMax(-Math::InfinityF());
+            uint32_t sweepCount = 0;
+            for (uint32_t binIdx = kBinCount - 1; binIdx > 0; binIdx--)
+            {
+                sweepMin    = Min(sweepMin, bins[binIdx].bboxMin);
+                sweepMax    = Max(sweepMax, bins[binIdx].bboxMax);
+                sweepCount += bins[binIdx].count;
+                rightAreas[binIdx]  = (sweepCount > 0) ? HalfSurfaceArea(sweepMin, sweepMax) : 0.f;
+                rightCounts[binIdx] = sweepCount;
+            }
+
+            // ...and evaluate all splits during the sweep from the left
+            sweepMin    = Vec3f( Math::InfinityF());
+            sweepMax    = Vec3f(-Math::InfinityF());
+            sweepCount  = 0;
+            for (uint32_t split = 1; split < kBinCount; split++)
+            {
+                sweepMin    = Min(sweepMin, bins[split - 1].bboxMin);
+                sweepMax    = Max(sweepMax, bins[split - 1].bboxMax);
+                sweepCount += bins[split - 1].count;
+
+                if ((sweepCount == 0) || (rightCounts[split] == 0))
+                    continue;
+
+                const float cost =
+                      HalfSurfaceArea(sweepMin, sweepMax) * sweepCount
+                    + rightAreas[split] * rightCounts[split];
+                if (cost < bestCost)
+                {
+                    bestCost  = cost;
+                    bestAxis  = axis;
+                    bestSplit = split;
+                }
+            }
+        }
+
+        uint32_t mid;
+        if (bestSplit == 0)
+        {
+            // All centroids coincide - SAH cannot separate them
+            if (primCount <= kMaxLeafSize)
+            {
+                MakeLeaf(nodeIdx, aBegin, primCount);
+                return nodeIdx;
+            }
+
+            mid = aBegin + primCount / 2;
+        }
+        else
+        {
+            // Cost of one traversal step relative to one primitive intersection
+            const float kTraversalCost = 1.0f;
+
+            const float nodeArea = HalfSurfaceArea(bboxMin, bboxMax);
+            const float splitCost = kTraversalCost + ((nodeArea > 0.f) ? (bestCost / nodeArea) : 0.f);
+            const float leafCost  = (float)primCount;
+            if ((leafCost <= splitCost) && (primCount <= kMaxLeafSize))
+            {
+                MakeLeaf(nodeIdx, aBegin, primCount);
+                return nodeIdx;
+            }
+
+            const float axisMin  = centroidMin.Get(bestAxis);
+            const float binScale = kBinCount / centroidExtent.Get(bestAxis);
+            const auto midIt = std::partition(
+                aPrims.begin() + aBegin, aPrims.begin() + aEnd,
+                [&](const BuildPrimitive &aPrim)
+                {
+                    return CentroidToBin(aPrim.centroid.Get(bestAxis), axisMin, binScale) < bestSplit;
+                });
+            mid = (uint32_t)(midIt - aPrims.begin());
+
+            PG3_ASSERT((mid > aBegin) && (mid < aEnd));
+        }
+
+        const uint32_t leftIdx = BuildNode(aPrims, aBegin, mid, aDepth + 1);
+        PG3_ASSERT_INTEGER_EQUAL(leftIdx, nodeIdx + 1);
+        leftIdx; // unused variable in release
+
+        const uint32_t rightIdx = BuildNode(aPrims, mid, aEnd, aDepth + 1);
+
+        mNodes[nodeIdx].firstOrRight = rightIdx;
+        mNodes[nodeIdx].primCount    = 0;
+
+        return nodeIdx;
+    }
+
+    static uint32_t CentroidToBin(float aCentroid, float aAxisMin, float aBinScale)
+    {
+        const uint32_t binIdx = (uint32_t)((aCentroid - aAxisMin) * aBinScale);
+        return std::min(binIdx, kBinCount - 1);
+    }
+
+    void MakeLeaf(uint32_t aNodeIdx, uint32_t aFirstPrim, uint32_t aPrimCount)
+    {
+        mNodes[aNodeIdx].firstOrRight = aFirstPrim;
+        mNodes[aNodeIdx].primCount    = aPrimCount;
+    }
+
+    void GatherStats(uint32_t aNodeIdx, uint32_t aDepth, Stats &oStats) const
+    {
+        const Node &node = mNodes[aNodeIdx];
+
+        oStats.maxDepth = std::max(oStats.maxDepth, aDepth);
+
+        if (node.IsLeaf())
+        {
+            oStats.leafCount++;
+            oStats.maxLeafSize = std::max(oStats.maxLeafSize, node.primCount);
+        }
+        else
+        {
+            GatherStats(aNodeIdx + 1,       aDepth + 1, oStats);
+            GatherStats(node.firstOrRight,  aDepth + 1, oStats);
+        }
+    }
+
+protected:
+
+    static const uint32_t kBinCount     = 16;
+    static const uint32_t kMinLeafSize  = 2;    // Nodes with this many primitives are never split
+    static const uint32_t kMaxLeafSize  = 8;    // Nodes with more primitives are always split if possible
+    static const uint32_t kMaxDepth     = 64;   // Also the size of traversal stacks
+
+    std::vector<Node> mNodes;
+
+#ifdef PG3_USE_SIMD_INTERSECTION
+    GeometrySoA mGeometrySoA;
+#endif
+
+public:
+
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+
+    // Generates a soup of small random triangles and spheres inside a unit cube
+    static void _GenerateRandomGeometry(
+        GeometryList    &aoList,
+        const uint32_t   aTriangleCount,
+        const uint32_t   aSphereCount,
+        Rng             &aRng)
+    {
+        for (uint32_t i = 0; i < aTriangleCount; i++)
+        {
+            const Vec3f p0 = aRng.GetVec3f();
+            const float size = 0.05f;
+            aoList.mGeometry.push_back(new Triangle(
+                p0,
+                p0 + (aRng.GetVec3f() - Vec3f(0.5f)) * size,
+                p0 + (aRng.GetVec3f() - Vec3f(0.5f)) * size,
+                (int32_t)i));
+        }
+        for (uint32_t i = 0; i < aSphereCount; i++)
+            aoList.mGeometry.push_back(
+                new Sphere(aRng.GetVec3f(), 0.01f + 0.04f * aRng.GetFloat(), (int32_t)(aTriangleCount + i)));
+    }
+
+    static bool _UT_IntersectionsMatchList(
+        const UnitTestBlockLevel     aMaxUtBlockPrintLevel,
+        const uint32_t               aTriangleCount,
+        const uint32_t               aSphereCount)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1,
+            "%d triangles, %d spheres", aTriangleCount, aSphereCount);
+
+        // Both structures own their geometry, generate the same soup twice
+        GeometryList list;
+        BVH bvh;
+        {
+            Rng rng(7);
+            _GenerateRandomGeometry(list, aTriangleCount, aSphereCount, rng);
+        }
+        {
+            Rng rng(7);
+            _GenerateRandomGeometry(bvh, aTriangleCount, aSphereCount, rng);
+        }
+        bvh.Build();
+
+        Rng rayRng(13);
+        for (uint32_t rayIdx = 0; rayIdx < 10000; rayIdx++)
+        {
+            const Vec3f org = rayRng.GetVec3f() * 1.5f - Vec3f(0.25f);
+            const Vec3f dir = Sampling::SampleUniformSphereW(rayRng.GetVec2f());
+            const Ray ray(org, dir, 0.f);
+
+            RayIntersection listIsect(1e36f);
+            RayIntersection bvhIsect(1e36f);
+            const bool listHit = list.Intersect(ray, listIsect);
+            const bool bvhHit  = bvh.Intersect(ray, bvhIsect);
+
+            RayIntersection listIsectP(1e36f);
+            RayIntersection bvhIsectP(1e36f);
+            const bool listHitP = list.IntersectP(ray, listIsectP);
+            const bool bvhHitP  = bvh.IntersectP(ray, bvhIsectP);
+
+            const char *failure = nullptr;
+            if (listHit != bvhHit)
+                failure = "Closest-hit query disagrees on whether there is an intersection";
+            else if (listHit && (listIsect.dist != bvhIsect.dist))
+                failure = "Closest-hit query found a different intersection distance";
+            else if (listHitP != bvhHitP)
+                failure = "Any-hit query disagrees on whether there is an intersection";
+
+            if (failure != nullptr)
+            {
+                std::ostringstream errorDescription;
+                errorDescription << failure << " (ray " << rayIdx << ")";
+                PG3_UT_FAILED(
+                    aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%d triangles, %d spheres",
+                    errorDescription.str().c_str(), aTriangleCount, aSphereCount);
+                return false;
+            }
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1,
+            "%d triangles, %d spheres", aTriangleCount, aSphereCount);
+        return true;
+    }
+
+    static bool _UnitTests(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblWholeTest, "BVH: Intersections match GeometryList");
+
+        if (!_UT_IntersectionsMatchList(aMaxUtBlockPrintLevel, 1, 0))
+            return false;
+        if (!_UT_IntersectionsMatchList(aMaxUtBlockPrintLevel, 0, 5))
+            return false;
+        if (!_UT_IntersectionsMatchList(aMaxUtBlockPrintLevel, 100, 10))
+            return false;
+        if (!_UT_IntersectionsMatchList(aMaxUtBlockPrintLevel, 5000, 100))
+            return false;
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblWholeTest, "BVH: Intersections match GeometryList");
+        return true;
+    }
+
+#endif
+
+#ifdef PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+    // Generates a soup of small random triangles inside a unit cube
+    static void _BM_GenerateRandomTriangles(
+        GeometryList    &aoList,
+        const uint32_t   aTriangleCount)
+    {
+        Rng rng(7);
+        for (uint32_t i = 0; i < aTriangleCount; i++)
+        {
+            const Vec3f p0 = rng.GetVec3f();
+            const float size = 2.0f / std::cbrt((float)aTriangleCount);
+            aoList.mGeometry.push_back(new Triangle(
+                p0,
+                p0 + (rng.GetVec3f() - Vec3f(0.5f)) * size,
+                p0 + (rng.GetVec3f() - Vec3f(0.5f)) * size,
+                0));
+        }
+    }
+
+    static void _BM_TraceRays(
+        const char          *aCaseName,
+        const GeometryList  &aGeometry,
+        const uint32_t       aRayCount,
+        const bool           aAnyHit)
+    {
+        Rng rng(13);
+        std::vector<Ray> rays(aRayCount);
+        for (auto &ray : rays)
+        {
+            ray.org  = rng.GetVec3f();
+            ray.dir  = Sampling::SampleUniformSphereW(rng.GetVec2f());
+            ray.tmin = 0.f;
+        }
+
+        Benchmarking::Timer timer;
+        for (const auto &ray : rays)
+        {
+            RayIntersection isect(aAnyHit ? 0.5f : 1e36f);
+            if (aAnyHit)
+                aGeometry.IntersectP(ray, isect);
+            else
+                aGeometry.Intersect(ray, isect);
+        }
+        const double seconds = timer.ElapsedSeconds();
+
+        Benchmarking::PrintThroughput(aCaseName, aRayCount, seconds, "rays");
+    }
+
+    static void _Benchmark()
+    {
+        Benchmarking::PrintHeader("BVH vs. GeometryList ray casting (single thread)");
+
+        const uint32_t triangleCounts[] = { 16, 256, 4096, 65536 };
+        for (uint32_t triangleCount : triangleCounts)
+        {
+            GeometryList list;
+            _BM_GenerateRandomTriangles(list, triangleCount);
+
+            BVH bvh;
+            _BM_GenerateRandomTriangles(bvh, triangleCount);
+            Benchmarking::Timer buildTimer;
+            bvh.Build();
+            const double buildSeconds = buildTimer.ElapsedSeconds();
+            const Stats stats = bvh.GetStats();
+
+            printf(
+                "\t%d triangles (BVH: build %.3f s, %d nodes, %d leaves, depth %d, max leaf %d):\n",
+                triangleCount, buildSeconds,
+                stats.nodeCount, stats.leafCount, stats.maxDepth, stats.maxLeafSize);
+
+            // Keep the total work of the linear list bounded
+            const uint32_t listRayCount = std::max(1000u, 50000000u / triangleCount);
+            const uint32_t bvhRayCount  = 1000000u;
+
+            _BM_TraceRays("GeometryList closest hit",   list, listRayCount, false);
+            _BM_TraceRays("BVH closest hit",            bvh,  bvhRayCount,  false);
+            _BM_TraceRays("GeometryList any hit",       list, listRayCount, true);
+            _BM_TraceRays("BVH any hit",                bvh,  bvhRayCount,  true);
+        }
+    }
+
+#endif
+};
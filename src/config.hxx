@@ -30,9 +30,18 @@ enum Algorithm
     kDirectIllumMis,
     kPathTracingNaive,
     kPathTracing,
+    kPathTracingWavefront,
     kAlgorithmCount
 };
 
+// Machine-readable renderer profiling report, saved next to the output image
+enum class ProfilingReportFormat
+{
+    kNone,
+    kJson,
+    kCsv,
+};
+
 // Hardwired scene configurations
 #define GEOM_FULL_BOX           Scene::kWalls | Scene::kFloor | Scene::k2Spheres
 #define GEOM_2SPHERES_ON_FLOOR                  Scene::kFloor | Scene::k2Spheres
@@ -112,6 +121,12 @@ const Scene::BoxMask g_SceneConfigs[] =
 
     // Debug: Layered material reference: 38 
     Scene::BoxMask(Scene::kLightEnv | GEOM_LAYERED_SPHERE),
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Many lights (picked using the light tree): 39, 40
+    Scene::BoxMask(Scene::kLightGrid                                        | GEOM_FULL_BOX | MATS_PHONG_DIFFUSE),
+    Scene::BoxMask(Scene::kLightGrid | Scene::kLightPoint | Scene::kLightEnv | GEOM_FULL_BOX | MATS_PHONG_DIFFUSE),
 };
 
 // Renderer configuration, holds algorithm, scene, and all other settings. Provides related routines.
@@ -119,6 +134,12 @@ class Config
 {
 public:
 
+    // Random number generator used by the renderers unless chosen on the command line
+    static RngType GetDefaultRngType()
+    {
+        return RngType::kMersenneTwister;
+    }
+
     static const char* GetName(Algorithm aAlgorithm)
     {
         switch (aAlgorithm)
@@ -139,6 +160,8 @@ public:
             return "naive path tracing";
         case kPathTracing:
             return "path tracing";
+        case kPathTracingWavefront:
+            return "wavefront path tracing";
         default:
             return "unknown algorithm";
         }
@@ -164,6 +187,8 @@ public:
             return "ptn";
         case kPathTracing:
             return "pt";
+        case kPathTracingWavefront:
+            return "ptw";
         default:
             return "unknown";
         }
@@ -186,7 +211,8 @@ public:
 
         // Path length
         if (   (mAlgorithm == kPathTracingNaive)
-            || (mAlgorithm == kPathTracing))
+            || (mAlgorithm == kPathTracing)
+            || (mAlgorithm == kPathTracingWavefront))
         {
             filename += "_";
             if (mMaxPathLength == 0)
@@ -235,6 +261,15 @@ public:
         filename += "_emcs";
 #endif
 
+        // Environment map storage
+        if (mEmStorageFormat.layout != EmStorageFormat().layout)
+        {
+            filename += "_eml";
+            filename += EmStorageFormat::GetLayoutAcronym(mEmStorageFormat.layout);
+        }
+        if (mEmStorageFormat.precision != EmStorageFormat().precision)
+            filename += "_emh";
+
         // Sample count
         filename += "_";
         if (mMaxTime > 0)
@@ -254,6 +289,21 @@ public:
             filename += "s";
         }
 
+        // Adaptive sampling
+        if (mAdaptiveMaxRelError > 0.f)
+        {
+            std::ostringstream outStream;
+            outStream << mAdaptiveMaxRelError;
+            filename += "_ae" + outStream.str();
+        }
+
+        // Random number generator
+        if (mRngType != GetDefaultRngType())
+        {
+            filename += "_";
+            filename += Rng::GetTypeAcronym(mRngType);
+        }
+
         // Custom trail text
         if (!aOutputNameTrail.empty())
         {
@@ -267,17 +317,6 @@ public:
         return filename;
     }
 
-    static void PrintRngWarning()
-    {
-    #if defined(LEGACY_RNG)
-        printf("The code was not compiled for C++11.\n");
-        printf("It will be using Tiny Encryption Algorithm-based random number generator.\n");
-        printf("This is worse than the Mersenne Twister from C++11.\n");
-        printf("Consider setting up for C++11.\n");
-        printf("Visual Studio 2010, and g++ 4.6.3 and later work.\n\n");
-    #endif
-    }
-
     void PrintConfiguration() const
     {
         if (mQuietMode)
@@ -287,9 +326,24 @@ public:
 
         printf("Scene:      %s\n", mScene->mSceneName.c_str());
 
+        for (const auto &mesh : mScene->mMeshes)
+        {
+            // The acceleration structure also copies the primitives (for the SIMD intersection)
+            const GeometryList &geometryList = mScene->GetGeometryList();
+            const double meshBytes  = (double)mesh->GetStorageSize() / mesh->GetTriangleCount();
+            const double accelBytes =
+                (double)geometryList.GetStorageSize() / std::max<size_t>(geometryList.mGeometry.size(), 1);
+            printf(
+                "Mesh:       %s, %u triangles, %u vertices, loaded in %.2f s, "
+                "%.1f B/triangle (%.1f mesh + %.1f acceleration structure)\n",
+                mMeshPath.c_str(), mesh->GetTriangleCount(), mesh->GetVertexCount(),
+                mesh->GetLoadSeconds(), meshBytes + accelBytes, meshBytes, accelBytes);
+        }
+
         printf("Algorithm:  %s", GetName(mAlgorithm));
         if (   (mAlgorithm == kPathTracingNaive)
-            || (mAlgorithm == kPathTracing))
+            || (mAlgorithm == kPathTracing)
+            || (mAlgorithm == kPathTracingWavefront))
         {
             if (mMaxPathLength == 0)
                 printf(", Russian roulette path ending");
@@ -315,7 +369,7 @@ public:
         else
             printf("Config:     %d iteration(s)", mIterations);
         printf(""
-            ", %d threads, "
+            ", %d threads, %s sampler, "
             #if !defined _DEBUG
                 "release"
             #else
@@ -325,8 +379,13 @@ public:
                 " with assertions"
             #endif
             "\n",
-            mNumThreads
+            mNumThreads,
+            Rng::GetTypeName(mRngType)
             );
+        if (mAdaptiveMaxRelError > 0.f)
+            printf(
+                "Adaptive:   max. relative error %g, at least %d samples per pixel\n",
+                mAdaptiveMaxRelError, mAdaptiveMinSamples);
 
         // Debugging options
         if (!mAuxDbgParams.IsEmpty())
@@ -381,12 +440,17 @@ public:
         printf("\n");
         printf(
             "Usage: %s "
-            "[-s <scene_id>] [-a <algorithm>] [-t <time> | -i <iterations>] [-minpl <min_path_length>] "
+            "[-s <scene_id>] [-a <algorithm>] [-t <time> | -i <iterations>] "
+            "[-ae|--adaptive-error <max_relative_error>] [-ams|--adaptive-min-samples <min_samples>] "
+            "[-minpl <min_path_length>] "
             "[-maxpl <max_path_length>] [-iic <indirect_illum_clipping_value>] "
             "[-sb|--splitting-budget <splitting_budget>] "
             "[-slbr|--splitting-light-to-bsdf-ratio <splitting_light_to_bsdf_ratio>] "
-            "[-em <env_map_type>] [-e <def_output_ext>] [-od <output_directory>] [-o <output_name>] "
-            "[-ot <output_trail>] [-j <threads_count>] [-q] "
+            "[-em <env_map_type>] [-eml|--env-map-layout <layout>] [-emh|--env-map-half] "
+            "[-emd|--env-map-distribution <method>] [-m|--mesh <mesh_file>] "
+            "[-e <def_output_ext>] [-od <output_directory>] [-o <output_name>] "
+            "[-ot <output_trail>] [-j <threads_count>] [-rng <generator>] [-q] "
+            "[-pr|--profiling-report <format>] "
             "[-opop|--only-print-output-pathname] "
             "[-opof|--only-print-output-filename] "
             "[-auxf1|--dbg_aux_float1 <value>] "
@@ -409,6 +473,28 @@ public:
         printf("    -em    Selects the environment map type (default 0; ignored if the scene doesn't use an environment map):\n");
         for (int32_t i = 0; i < Scene::kEMCount; i++)
             printf("          %2d    %s\n", i, Scene::GetEnvMapName(i).c_str());
+        printf("    -eml | --env-map-layout \n");
+        printf("           Memory layout of the environment map texels (default %s):\n",
+            EmStorageFormat::GetLayoutAcronym(EmStorageFormat().layout));
+        for (int32_t i = 0; i < (int32_t)EmTexelLayout::kCount; i++)
+            printf("          %-4s  %s\n",
+                EmStorageFormat::GetLayoutAcronym(EmTexelLayout(i)),
+                EmStorageFormat::GetLayoutName(EmTexelLayout(i)));
+        printf("    -emh | --env-map-half \n");
+        printf("           Stores the environment map texels as 16-bit half floats, which halves the memory\n");
+        printf("           footprint at the cost of precision (values are clamped to 65504)\n");
+        printf("    -emd | --env-map-distribution \n");
+        printf("           Sampling method of the environment map luminance distribution (default %s):\n",
+            Distribution2D::GetMethodAcronym(Distribution2D::GetDefaultMethod()));
+        for (int32_t i = 0; i < (int32_t)Distribution1DMethod::kCount; i++)
+            printf("          %-5s %s\n",
+                Distribution2D::GetMethodAcronym(Distribution1DMethod(i)),
+                Distribution2D::GetMethodName(Distribution1DMethod(i)));
+
+        printf("    -m | --mesh \n");
+        printf("           Wavefront OBJ or Stanford PLY (ascii or binary) triangle mesh, which replaces\n");
+        printf("           the sphere(s) of the scene. It is expected to have the y axis pointing up and it is\n");
+        printf("           scaled to stand in the middle of the floor.\n");
 
         printf("    -a     Selects the rendering algorithm (default pt):\n");
         for (int32_t i = 0; i < (int32_t)kAlgorithmCount; i++)
@@ -429,13 +515,30 @@ public:
 
         printf("    -t     Number of seconds to run the algorithm\n");
         printf("    -i     Number of iterations to run the algorithm (default 1)\n");
+        printf("    -ae | --adaptive-error \n");
+        printf("           Adaptive sampling: pixels stop receiving samples once the relative standard error\n");
+        printf("           of their mean luminance drops under this value. Their samples go to the remaining\n");
+        printf("           pixels in proportion to their error, so an iteration still takes about one sample\n");
+        printf("           per pixel. Rendering stops when all pixels converge or the time/iteration limit\n");
+        printf("           is reached. 0 means no adaptive sampling (default 0).\n");
+        printf("    -ams | --adaptive-min-samples \n");
+        printf("           Adaptive sampling: number of samples per pixel taken before testing convergence (default 16).\n");
         printf("    -e     Extension of the default output file: bmp or hdr (default bmp)\n");
         printf("    -od    User specified directory for the output, whose existence is not checked (default \"\")\n");
         printf("    -o     User specified output name, with extension .bmp or .hdr (default .bmp)\n");
         printf("    -ot    Trail text to be added at the end the output file name\n");
         printf("           (only used to alter a default filename; '_' is pasted automatically before the trail).\n");
         printf("    -j     Number of threads (\"jobs\") to be used\n");
+        printf("    -rng   Random number generator used by the renderers (default %s):\n",
+            Rng::GetTypeAcronym(GetDefaultRngType()));
+        for (int32_t i = 0; i < (int32_t)RngType::kCount; i++)
+            printf("          %-5s %s\n", Rng::GetTypeAcronym(RngType(i)), Rng::GetTypeName(RngType(i)));
         printf("    -q     Quiet mode - doesn't print anything except for warnings and errors\n");
+        printf("    -pr | --profiling-report \n");
+        printf("           Saves rays and samples per second, stage times and thread utilisation next to\n");
+        printf("           the output image, e.g. image.profile.json for image.bmp:\n");
+        printf("          json  One JSON object with the totals and per-thread data\n");
+        printf("          csv   One row per thread and one for all threads, with a header\n");
 
         printf("\n");
 
@@ -565,7 +668,14 @@ public:
         mNumThreads                 = 0;
         mQuietMode                  = false;
         mBaseSeed                   = 1234;
+        mRngType                    = GetDefaultRngType();          // [cmd]
+        mProfilingReportFormat      = ProfilingReportFormat::kNone; // [cmd]
         mResolution                 = Vec2i(512, 512);
+        mAdaptiveMaxRelError        = 0.f;                          // [cmd]
+        mAdaptiveMinSamples         = 16;                           // [cmd]
+        mEmStorageFormat            = EmStorageFormat();            // [cmd]
+        mEmDistributionMethod       = Distribution2D::GetDefaultMethod(); // [cmd]
+        mMeshPath                   = "";                           // [cmd]
 
         mAlgorithm                  = kAlgorithmCount;              // [cmd]
         mMinPathLength              = 1;                            // [cmd]
@@ -674,6 +784,113 @@ public:
                     return false;
                 }
             }
+            else if ((arg == "-eml") || (arg == "--env-map-layout")) // environment map texel layout
+            {
+                if (++i == argc)
+                {
+                    printf("Error: Missing <layout> argument, please see help (-h)\n");
+                    return false;
+                }
+
+                const std::string layout(argv[i]);
+                int32_t layoutID = 0;
+                while (   (layoutID < (int32_t)EmTexelLayout::kCount)
+                       && (layout != EmStorageFormat::GetLayoutAcronym(EmTexelLayout(layoutID))))
+                    layoutID++;
+
+                if (layoutID == (int32_t)EmTexelLayout::kCount)
+                {
+                    printf(
+                        "Error: Invalid <layout> argument \"%s\", please see help (-h)\n",
+                        argv[i]);
+                    return false;
+                }
+
+                mEmStorageFormat.layout = EmTexelLayout(layoutID);
+            }
+            else if ((arg == "-emh") || (arg == "--env-map-half")) // half-float environment map texels
+            {
+                mEmStorageFormat.precision = EmTexelPrecision::kHalf;
+            }
+            else if ((arg == "-emd") || (arg == "--env-map-distribution")) // environment map distribution
+            {
+                if (++i == argc)
+                {
+                    printf("Error: Missing <method> argument, please see help (-h)\n");
+                    return false;
+                }
+
+                const std::string method(argv[i]);
+                int32_t methodID = 0;
+                while (   (methodID < (int32_t)Distribution1DMethod::kCount)
+                       && (method != Distribution2D::GetMethodAcronym(Distribution1DMethod(methodID))))
+                    methodID++;
+
+                if (methodID == (int32_t)Distribution1DMethod::kCount)
+                {
+                    printf(
+                        "Error: Invalid <method> argument \"%s\", please see help (-h)\n",
+                        argv[i]);
+                    return false;
+                }
+
+                mEmDistributionMethod = Distribution1DMethod(methodID);
+            }
+            else if ((arg == "-m") || (arg == "--mesh")) // triangle mesh file
+            {
+                if (++i == argc)
+                {
+                    printf("Error: Missing <mesh_file> argument, please see help (-h)\n");
+                    return false;
+                }
+
+                mMeshPath = argv[i];
+            }
+            else if (arg == "-rng") // random number generator
+            {
+                if (++i == argc)
+                {
+                    printf("Error: Missing <generator> argument, please see help (-h)\n");
+                    return false;
+                }
+
+                const std::string generator(argv[i]);
+                int32_t typeID = 0;
+                while (   (typeID < (int32_t)RngType::kCount)
+                       && (generator != Rng::GetTypeAcronym(RngType(typeID))))
+                    typeID++;
+
+                if (typeID == (int32_t)RngType::kCount)
+                {
+                    printf(
+                        "Error: Invalid <generator> argument \"%s\", please see help (-h)\n",
+                        argv[i]);
+                    return false;
+                }
+
+                mRngType = RngType(typeID);
+            }
+            else if ((arg == "-pr") || (arg == "--profiling-report")) // profiling report format
+            {
+                if (++i == argc)
+                {
+                    printf("Error: Missing <format> argument, please see help (-h)\n");
+                    return false;
+                }
+
+                const std::string format(argv[i]);
+                if (format == "json")
+                    mProfilingReportFormat = ProfilingReportFormat::kJson;
+                else if (format == "csv")
+                    mProfilingReportFormat = ProfilingReportFormat::kCsv;
+                else
+                {
+                    printf(
+                        "Error: Invalid <format> argument \"%s\", please see help (-h)\n",
+                        argv[i]);
+                    return false;
+                }
+            }
             else if (arg == "-a") // algorithm to use
             {
                 if (++i == argc)
@@ -704,7 +921,8 @@ public:
                 }
 
                 if (   (mAlgorithm != kPathTracingNaive)
-                    && (mAlgorithm != kPathTracing))
+                    && (mAlgorithm != kPathTracing)
+                    && (mAlgorithm != kPathTracingWavefront))
                 {
                     printf(
                         "\n"
@@ -735,7 +953,8 @@ public:
                 }
 
                 if (   (mAlgorithm != kPathTracingNaive)
-                    && (mAlgorithm != kPathTracing))
+                    && (mAlgorithm != kPathTracing)
+                    && (mAlgorithm != kPathTracingWavefront))
                 {
                     printf(
                         "\n"
@@ -917,6 +1136,47 @@ public:
 
                 mIterations = -1; // time has precedence
             }
+            else if ((arg == "-ae") || (arg == "--adaptive-error")) // adaptive sampling error threshold
+            {
+                if (++i == argc)
+                {
+                    printf("Error: Missing <max_relative_error> argument, please see help (-h)\n");
+                    return false;
+                }
+
+                std::istringstream iss(argv[i]);
+                iss >> mAdaptiveMaxRelError;
+
+                if (iss.fail() || mAdaptiveMaxRelError < 0.f)
+                {
+                    printf(
+                        "Error: Invalid <max_relative_error> argument \"%s\", please see help (-h)\n",
+                        argv[i]);
+                    return false;
+                }
+            }
+            else if ((arg == "-ams") || (arg == "--adaptive-min-samples")) // adaptive sampling minimal sample count
+            {
+                if (++i == argc)
+                {
+                    printf("Error: Missing <min_samples> argument, please see help (-h)\n");
+                    return false;
+                }
+
+                int32_t tmp;
+                std::istringstream iss(argv[i]);
+                iss >> tmp;
+
+                if (iss.fail() || tmp < 2)
+                {
+                    printf(
+                        "Error: Invalid <min_samples> argument \"%s\", please see help (-h)\n",
+                        argv[i]);
+                    return false;
+                }
+
+                mAdaptiveMinSamples = tmp;
+            }
             else if (arg == "-e") // extension of default output file name
             {
                 if (++i == argc)
@@ -1080,7 +1340,8 @@ public:
         // Load scene
         Scene *scene = new Scene;
         scene->LoadCornellBox(
-            mResolution, mAuxDbgParams, g_SceneConfigs[sceneID], Scene::EnvironmentMapType(envMapID));
+            mResolution, mAuxDbgParams, g_SceneConfigs[sceneID], Scene::EnvironmentMapType(envMapID),
+            mEmStorageFormat, mEmDistributionMethod, mMeshPath);
         mScene = scene;
 
         // If no output name is chosen, create a default one
@@ -1114,11 +1375,24 @@ public:
     uint32_t                 mNumThreads;
     bool                     mQuietMode;
     int32_t                  mBaseSeed;
+    RngType                  mRngType;
+    ProfilingReportFormat    mProfilingReportFormat;
     std::string              mDefOutputExtension;
     std::string              mOutputName;
     std::string              mOutputDirectory;
     Vec2i                    mResolution;
 
+    // Adaptive sampling; disabled if the error threshold is zero
+    float                    mAdaptiveMaxRelError;
+    uint32_t                 mAdaptiveMinSamples;
+
+    // Texel storage and sampling of the environment map
+    EmStorageFormat          mEmStorageFormat;
+    Distribution1DMethod     mEmDistributionMethod;
+
+    // Optional triangle mesh file; empty if not used
+    std::string              mMeshPath;
+
     Algorithm                mAlgorithm;
 
     // Only used for path-based algorithms
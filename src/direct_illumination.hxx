@@ -18,10 +18,10 @@ public:
               SpectrumF     &oRadiance
         ) override
     {
-        LightSamplingContext lightSamplingCtx(mConfig.mScene->GetLightCount());
+        LightSamplingContext lightSamplingCtx;
 
         RayIntersection isect(1e36f);
-        if (mConfig.mScene->Intersect(aRay, isect))
+        if (Intersect(aRay, isect, kCameraRay))
         {
             const Vec3f surfPt = aRay.PointAt(isect.dist);
             Frame surfFrame;
@@ -48,7 +48,7 @@ public:
                     PG3_ASSERT(light != 0);
 
                     LightSample lightSample;
-                    if (light->SampleIllumination(surfPt, surfFrame, mat, mRng, lightSample))
+                    if (SampleIllumination(*light, surfPt, surfFrame, mat, lightSample))
                         AddSingleLightSampleContribution(
                             lightSample, surfPt, surfFrame, mat, wol,
                             LoDirect);
@@ -66,7 +66,7 @@ public:
             {
                 // Sample BSDF
                 MaterialRecord matRecord(wol);
-                mat.SampleBsdf(mRng, matRecord);
+                SampleBsdf(mat, matRecord);
                 if (!matRecord.IsBlocker())
                 {
                     SpectrumF LiLight;
@@ -109,7 +109,7 @@ public:
 
                 // Generate one sample by sampling the BSDF
                 MaterialRecord matRecord(wol);
-                mat.SampleBsdf(mRng, matRecord);
+                SampleBsdf(mat, matRecord);
                 AddDirectIllumMISBrdfSampleContribution(
                     matRecord, 1, 1, surfPt, surfFrame, mat, lightSamplingCtx,
                     LoDirect);
@@ -149,7 +149,7 @@ public:
             // No intersection - get radiance from the background
             const BackgroundLight *backgroundLight = mConfig.mScene->GetBackgroundLight();
             if (showBckg && backgroundLight != nullptr)
-                oRadiance = backgroundLight->GetEmmision(aRay.dir);
+                oRadiance = GetBackgroundEmmision(*backgroundLight, aRay.dir);
             else
                 oRadiance.MakeZero(); // No background light
         }
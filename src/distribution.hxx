@@ -31,12 +31,32 @@
 #pragma once
 
 #include "math.hxx"
+#include "rng.hxx"
 #include "types.hxx"
 #include "memory.hxx"
+#include "unit_testing.hxx"
+#include "benchmarking.hxx"
+#include "hard_config.hxx"
 
+#include <emmintrin.h> // SSE2
 #include <algorithm>
+#include <memory>
+#include <string>
 #include <vector>
 
+// Method used for sampling 1D distributions and the marginal and conditional
+// distributions of 2D ones. Can be chosen at runtime; the default is selected by
+// PG3_USE_HIERARCHICAL_1D_DISTRIBUTION.
+enum class Distribution1DMethod
+{
+    kBinarySearch,      // Binary search in the whole CDF
+    kHierarchical,      // Hierarchy of cache-line-sized CDF blocks, binary search within blocks
+    kHierarchicalSimd,  // Hierarchy of cache-line-sized CDF blocks, SSE linear scan of blocks
+    kAliasTable,        // Walker/Vose alias table; O(1), but doesn't preserve sample stratification
+
+    kCount
+};
+
 // Representation of a probability density function over the interval [0,1] - common ancestor class
 class Distribution1DBase
 {
@@ -175,7 +195,12 @@ public:
     Distribution1DHierachical & operator=(const Distribution1DHierachical&) = delete;
     //Distribution1DHierachical(const Distribution1DHierachical&) = delete;
 
-    Distribution1DHierachical(const float * const aFunc, std::size_t aCount)
+    Distribution1DHierachical(
+        const float * const  aFunc,
+        std::size_t          aCount,
+        bool                 aUseSimdSearch = false)
+        :
+        mUseSimdSearch(aUseSimdSearch)
     {
         BuildHierachy(aFunc, aCount);
     }
@@ -387,8 +412,44 @@ private:
         return mCdfLevels.empty();
     }
 
+    // Equivalent of std::upper_bound() within one (full) CDF block: counts the block values
+    // not greater than the searched one, four at a time
+    static const float* UpperBoundInBlockSimd(const float *aBlockBegin, const float aValue)
+    {
+        PG3_ASSERT(((std::size_t)aBlockBegin % 16u) == 0u);
+        PG3_ASSERT((CdfLevel::GetBlockMaxCount() % 4u) == 0u);
+
+        const std::size_t blockMaxCount = CdfLevel::GetBlockMaxCount();
+        const __m128 value = _mm_set1_ps(aValue);
+
+        // Each lower-or-equal comparison yields -1 (all bits set)
+        __m128i count = _mm_setzero_si128();
+        for (std::size_t i = 0; i < blockMaxCount; i += 4u)
+        {
+            const __m128 lessEqual = _mm_cmple_ps(_mm_load_ps(aBlockBegin + i), value);
+            count = _mm_sub_epi32(count, _mm_castps_si128(lessEqual));
+        }
+        count = _mm_add_epi32(count, _mm_shuffle_epi32(count, _MM_SHUFFLE(1, 0, 3, 2)));
+        count = _mm_add_epi32(count, _mm_shuffle_epi32(count, _MM_SHUFFLE(2, 3, 0, 1)));
+
+        return aBlockBegin + _mm_cvtsi128_si32(count);
+    }
+
+public:
+
     PG3_PROFILING_NOINLINE
     void SampleContinuous(const float aUniSample, float &oX, std::size_t &oSegm, float &oPdf) const 
+    {
+        if (mUseSimdSearch)
+            SampleContinuousImpl<true>(aUniSample, oX, oSegm, oPdf);
+        else
+            SampleContinuousImpl<false>(aUniSample, oX, oSegm, oPdf);
+    }
+
+private:
+
+    template <bool tUseSimdSearch>
+    void SampleContinuousImpl(const float aUniSample, float &oX, std::size_t &oSegm, float &oPdf) const 
     {
         PG3_ASSERT(!IsInitialized());
         PG3_ASSERT_FLOAT_IN_RANGE(aUniSample, 0.f, 1.f);
@@ -407,7 +468,10 @@ private:
 
             PG3_ASSERT(block < currentLevel.blockCount);
 
-            const auto itSegm = std::upper_bound(blockBegin, blockEnd, uniSampleTrim);
+            const auto itSegm =
+                tUseSimdSearch
+                ? UpperBoundInBlockSimd(blockBegin, uniSampleTrim)
+                : std::upper_bound(blockBegin, blockEnd, uniSampleTrim);
             
             segPos = itSegm - levelBegin;
 
@@ -454,6 +518,8 @@ private:
         PG3_ASSERT_FLOAT_IN_RANGE(oX, 0.0f, 1.0f);
     }
 
+public:
+
     float Pdf(const std::size_t aSegm) const
     {
         PG3_ASSERT(!IsInitialized());
@@ -473,69 +539,641 @@ private:
 
     std::vector<CdfLevel>   mCdfLevels; // The last level is the full one
     float                   mFuncIntegral;
+    const bool              mUseSimdSearch;
+};
+
+
+// Hierarchical distribution which scans the CDF blocks with SSE instead of the binary search
+class Distribution1DHierachicalSimd : public Distribution1DHierachical
+{
+public:
+
+    Distribution1DHierachicalSimd(const float * const aFunc, std::size_t aCount) :
+        Distribution1DHierachical(aFunc, aCount, true)
+    {}
 };
 
-#ifndef PG3_USE_HIERARCHICAL_1D_DISTRIBUTION
-typedef Distribution1DSimple Distribution1D;
-#else
-typedef Distribution1DHierachical Distribution1D;
-#endif
+
+// Representation of a probability density function over the interval [0,1]
+// sampled in constant time using the Walker's alias method (Vose's construction).
+// Unlike the CDF inversion, the mapping from the uniform sample to the segment is not monotonic,
+// therefore stratification of the input samples is not preserved.
+class Distribution1DAlias : public Distribution1DBase
+{
+public:
+
+    Distribution1DAlias(const float * const aFunc, std::size_t aCount) :
+        mSegmCount(aCount)
+    {
+        PG3_ASSERT(aCount > 0);
+
+        BuildTable(aFunc);
+    }
+
+    std::size_t SegmCount() const
+    {
+        return mSegmCount;
+    }
+
+    float FuncIntegral() const
+    {
+        return mFuncIntegral;
+    }
+
+    PG3_PROFILING_NOINLINE
+    void SampleContinuous(const float aUniSample, float &oX, std::size_t &oSegm, float &oPdf) const 
+    {
+        PG3_ASSERT_FLOAT_IN_RANGE(aUniSample, 0.f, 1.f);
+
+        const float uniSampleTrim = aUniSample * 0.999999f/*solves the zero ending problem*/;
+        const float oneMinusEps = 0.99999994f; // largest float below 1
+
+        // The integer part of the scaled sample picks the bin, the fractional part chooses
+        // between the bin's own segment and its alias and is then reused as the offset
+        const float scaledSample = uniSampleTrim * mSegmCount;
+        const std::size_t bin = std::min((std::size_t)scaledSample, mSegmCount - 1u);
+        const float binSample = std::min(scaledSample - bin, oneMinusEps);
+        const AliasBin &aliasBin = mBins[bin];
+
+        float offset;
+        if (binSample < aliasBin.threshold)
+        {
+            oSegm  = bin;
+            offset = binSample / aliasBin.threshold;
+        }
+        else
+        {
+            oSegm  = aliasBin.alias;
+            offset = (binSample - aliasBin.threshold) / (1.f - aliasBin.threshold);
+        }
+        offset = std::min(offset, oneMinusEps);
+
+        PG3_ASSERT_INTEGER_IN_RANGE(oSegm, 0, mSegmCount - 1);
+        PG3_ASSERT_FLOAT_IN_RANGE(offset, 0.0f, 1.0f);
+
+        oPdf = mPdfs[oSegm];
+        PG3_ASSERT(oPdf > 0.f);
+
+        // Return $x\in{}[0,1]$
+        oX = (oSegm + offset) / mSegmCount;
+    }
+
+    float Pdf(const std::size_t aSegm) const
+    {
+        PG3_ASSERT_INTEGER_IN_RANGE(aSegm, 0, mSegmCount - 1);
+
+        return mPdfs[aSegm];
+    }
+
+private:
+
+    void BuildTable(const float * const aFunc)
+    {
+        // Function integral and segment PDFs (probability / segment width)
+        double funcSum = 0.;
+        for (std::size_t i = 0; i < mSegmCount; ++i)
+        {
+            PG3_ASSERT_FLOAT_NONNEGATIVE(aFunc[i]);
+
+            funcSum += aFunc[i];
+        }
+        mFuncIntegral = (float)(funcSum / mSegmCount);
+
+        // Segment PDFs scaled to the average of 1; the zero function falls back to the uniform PDF
+        std::vector<double> scaledProbs(mSegmCount, 1.);
+        if (funcSum > 0.)
+            for (std::size_t i = 0; i < mSegmCount; ++i)
+                scaledProbs[i] = aFunc[i] * (mSegmCount / funcSum);
+
+        mPdfs.resize(mSegmCount);
+        for (std::size_t i = 0; i < mSegmCount; ++i)
+            mPdfs[i] = (float)scaledProbs[i];
+
+        // Vose: pair each under-full bin with an over-full one which fills the remainder
+        std::vector<uint32_t> smallBins, largeBins;
+        for (std::size_t i = 0; i < mSegmCount; ++i)
+            (scaledProbs[i] < 1. ? smallBins : largeBins).push_back((uint32_t)i);
+
+        mBins.resize(mSegmCount);
+        while (!smallBins.empty() && !largeBins.empty())
+        {
+            const uint32_t small = smallBins.back();
+            const uint32_t large = largeBins.back();
+            smallBins.pop_back();
+
+            mBins[small].threshold  = (float)scaledProbs[small];
+            mBins[small].alias      = large;
+
+            scaledProbs[large] = (scaledProbs[large] + scaledProbs[small]) - 1.;
+            if (scaledProbs[large] < 1.)
+            {
+                largeBins.pop_back();
+                smallBins.push_back(large);
+            }
+        }
+
+        // The rest is (up to round-off errors) exactly full
+        for (auto bin : largeBins)
+            mBins[bin] = AliasBin(1.f, bin);
+        for (auto bin : smallBins)
+            mBins[bin] = AliasBin(1.f, bin);
+    }
+
+    struct AliasBin
+    {
+        AliasBin(float aThreshold = 1.f, uint32_t aAlias = 0u) :
+            threshold(aThreshold),
+            alias(aAlias)
+        {}
+
+        float       threshold;  // probability of the bin's own segment
+        uint32_t    alias;      // segment used otherwise
+    };
+
+    std::vector<AliasBin>   mBins;
+    std::vector<float>      mPdfs;
+    float                   mFuncIntegral;
+    const std::size_t       mSegmCount;
+};
 
 class Distribution2D
 {
 public:
 
-    Distribution2D(const float *aFunc, int32_t sCountU, int32_t sCountV)
+    Distribution2D(
+        const float             *aFunc,
+        int32_t                  sCountU,
+        int32_t                  sCountV,
+        Distribution1DMethod     aMethod = GetDefaultMethod())
+        :
+        mMethod(aMethod)
+    {
+        switch (aMethod)
+        {
+        case Distribution1DMethod::kBinarySearch:
+            mImpl.reset(new Impl<Distribution1DSimple>(aFunc, sCountU, sCountV));
+            break;
+        case Distribution1DMethod::kHierarchical:
+            mImpl.reset(new Impl<Distribution1DHierachical>(aFunc, sCountU, sCountV));
+            break;
+        case Distribution1DMethod::kHierarchicalSimd:
+            mImpl.reset(new Impl<Distribution1DHierachicalSimd>(aFunc, sCountU, sCountV));
+            break;
+        case Distribution1DMethod::kAliasTable:
+            mImpl.reset(new Impl<Distribution1DAlias>(aFunc, sCountU, sCountV));
+            break;
+        default:
+            PG3_FATAL_ERROR("Unknown 1D distribution method %d", (int32_t)aMethod);
+        }
+    }
+
+    static Distribution1DMethod GetDefaultMethod()
+    {
+#ifdef PG3_USE_HIERARCHICAL_1D_DISTRIBUTION
+        return Distribution1DMethod::kHierarchical;
+#else
+        return Distribution1DMethod::kBinarySearch;
+#endif
+    }
+
+    static const char* GetMethodAcronym(Distribution1DMethod aMethod)
     {
-        mConditionals.reserve(sCountV);
-        for (int32_t v = 0; v < sCountV; ++v) 
-            // Compute conditional sampling distributions for $\tilde{v}$
-            mConditionals.push_back(new Distribution1D(&aFunc[v*sCountU], sCountU));
+        static const char* acronyms[] = { "bin", "hier", "simd", "alias" };
+        static_assert(
+            sizeof(acronyms) / sizeof(acronyms[0]) == (size_t)Distribution1DMethod::kCount,
+            "Not enough method acronyms");
 
-        // Compute marginal sampling distribution $p[\tilde{v}]$
-        std::vector<float> marginalFunc;
-        marginalFunc.reserve(sCountV);
-        for (int32_t v = 0; v < sCountV; ++v)
-            marginalFunc.push_back(mConditionals[v]->FuncIntegral());
-        mMarginal = new Distribution1D(&marginalFunc[0], sCountV);
+        return acronyms[(size_t)aMethod];
+    }
+
+    static const char* GetMethodName(Distribution1DMethod aMethod)
+    {
+        static const char* names[] = {
+            "binary search",
+            "hierarchical CDF",
+            "hierarchical CDF, SIMD block scan",
+            "alias table" };
+        static_assert(
+            sizeof(names) / sizeof(names[0]) == (size_t)Distribution1DMethod::kCount,
+            "Not enough method names");
+
+        return names[(size_t)aMethod];
     }
 
-    ~Distribution2D()
+    Distribution1DMethod GetMethod() const
     {
-        delete mMarginal;
-        for (auto& conditional : mConditionals)
-            delete conditional;
+        return mMethod;
     }
 
     void SampleContinuous(const Vec2f &rndSamples, Vec2f &oUV, Vec2ui &oSegm, float *oPdf) const
     {
-        float margPdf, condPdf;
-        std::size_t segmX, segmY;
+        mImpl->SampleContinuous(rndSamples, oUV, oSegm, oPdf);
+    }
+
+    float Pdf(const Vec2f &aUV) const
+    {
+        return mImpl->Pdf(aUV);
+    }
+
+private:
+
+    // The method is dispatched once per 2D query; the 1D distributions are called directly
+    class ImplBase
+    {
+    public:
+        virtual ~ImplBase() {}
+
+        virtual void SampleContinuous(
+            const Vec2f &rndSamples, Vec2f &oUV, Vec2ui &oSegm, float *oPdf) const = 0;
+        virtual float Pdf(const Vec2f &aUV) const = 0;
+    };
+
+    template <typename TDistribution1D>
+    class Impl : public ImplBase
+    {
+    public:
+
+        Impl(const float *aFunc, int32_t sCountU, int32_t sCountV)
+        {
+            mConditionals.reserve(sCountV);
+            for (int32_t v = 0; v < sCountV; ++v) 
+                // Compute conditional sampling distributions for $\tilde{v}$
+                mConditionals.push_back(new TDistribution1D(&aFunc[v*sCountU], sCountU));
+
+            // Compute marginal sampling distribution $p[\tilde{v}]$
+            std::vector<float> marginalFunc;
+            marginalFunc.reserve(sCountV);
+            for (int32_t v = 0; v < sCountV; ++v)
+                marginalFunc.push_back(mConditionals[v]->FuncIntegral());
+            mMarginal = new TDistribution1D(&marginalFunc[0], sCountV);
+        }
+
+        virtual ~Impl()
+        {
+            delete mMarginal;
+            for (auto& conditional : mConditionals)
+                delete conditional;
+        }
+
+        virtual void SampleContinuous(
+            const Vec2f &rndSamples, Vec2f &oUV, Vec2ui &oSegm, float *oPdf) const override
+        {
+            float margPdf, condPdf;
+            std::size_t segmX, segmY;
+
+            mMarginal->SampleContinuous(rndSamples.x, oUV.y, segmY, margPdf);
+            mConditionals[segmY]->SampleContinuous(rndSamples.y, oUV.x, segmX, condPdf);
+
+            oSegm.x = (uint32_t)segmX;
+            oSegm.y = (uint32_t)segmY;
+
+            if (oPdf != nullptr)
+                *oPdf = margPdf * condPdf;
+        }
+
+        virtual float Pdf(const Vec2f &aUV) const override
+        {
+            // Find u and v segments
+            std::size_t iu = Math::Clamp<std::size_t>(
+                (std::size_t)(aUV.x * mConditionals[0]->SegmCount()), 0u, mConditionals[0]->SegmCount() - 1);
+            std::size_t iv = Math::Clamp<std::size_t>(
+                (std::size_t)(aUV.y * mMarginal->SegmCount()), 0u, mMarginal->SegmCount() - 1);
+
+            // Compute probabilities
+            return mConditionals[iv]->Pdf(iu) * mMarginal->Pdf(iv);
+        }
 
-        mMarginal->SampleContinuous(rndSamples.x, oUV.y, segmY, margPdf);
-        mConditionals[segmY]->SampleContinuous(rndSamples.y, oUV.x, segmX, condPdf);
+    private:
 
-        oSegm.x = (uint32_t)segmX;
-        oSegm.y = (uint32_t)segmY;
+        std::vector<TDistribution1D*>    mConditionals;
+        TDistribution1D                 *mMarginal;
+    };
+
+#if defined PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER || defined PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+public:
 
-        if (oPdf != nullptr)
-            *oPdf = margPdf * condPdf;
+    // Non-negative function with zero segments and sharp peaks, similar to an environment map
+    static std::vector<float> _GenerateTestFunction(std::size_t aCount, Rng &aRng)
+    {
+        std::vector<float> func(aCount);
+        for (auto &value : func)
+        {
+            const float rnd = aRng.GetFloat();
+            value = (rnd < 0.2f) ? 0.f : std::pow(rnd, 8.f) * 1000.f;
+        }
+        return func;
     }
 
-    float Pdf(const Vec2f &aUV) const
+#endif
+
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+
+public:
+
+    template <typename TDistribution1D>
+    static bool _UT_Distribution1D(
+        const UnitTestBlockLevel     aMaxUtBlockPrintLevel,
+        const Distribution1DMethod   aMethod,
+        const std::vector<float>    &aFunc)
     {
-        // Find u and v segments
-        std::size_t iu = Math::Clamp<std::size_t>(
-            (std::size_t)(aUV.x * mConditionals[0]->SegmCount()), 0u, mConditionals[0]->SegmCount() - 1);
-        std::size_t iv = Math::Clamp<std::size_t>(
-            (std::size_t)(aUV.y * mMarginal->SegmCount()), 0u, mMarginal->SegmCount() - 1);
+        const std::size_t count = aFunc.size();
+
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel2,
+            "%s, %d segments", GetMethodName(aMethod), (int32_t)count);
+
+        const Distribution1DSimple reference(aFunc.data(), count);
+        const TDistribution1D distribution(aFunc.data(), count);
+
+        // The CDF-based methods must invert the same CDF; the alias table has its own mapping,
+        // which is checked statistically
+        const bool isInverseCdf = (aMethod != Distribution1DMethod::kAliasTable);
+
+        const char *failure = nullptr;
+        if (   (distribution.SegmCount() != count)
+            || (  std::abs(distribution.FuncIntegral() - reference.FuncIntegral())
+                > 1e-4f * reference.FuncIntegral()))
+            failure = "Function integral differs from the binary search distribution";
+
+        // Exact segment PDFs. The ones derived from a float CDF lose precision by subtracting
+        // neighbouring CDF values, which are close to 1 at the end of the CDF.
+        double funcSum = 0.;
+        for (auto value : aFunc)
+            funcSum += value;
+        std::vector<double> exactPdfs(count, 1.);
+        if (funcSum > 0.)
+            for (std::size_t i = 0; i < count; i++)
+                exactPdfs[i] = aFunc[i] * count / funcSum;
+        const double pdfTolerance = count * 2.4e-7;
+
+        for (std::size_t i = 0; (i < count) && (failure == nullptr); i++)
+            if (std::abs(distribution.Pdf(i) - exactPdfs[i]) > 1e-4 * exactPdfs[i] + pdfTolerance)
+                failure = "Segment PDF differs from the exact one";
+
+        const uint32_t sampleCount = 200000;
+        std::vector<uint32_t> histogram(count, 0u);
+        Rng rng(23);
+        for (uint32_t i = 0; (i < sampleCount) && (failure == nullptr); i++)
+        {
+            // Include the interval ends
+            const float uniSample = (i == 0) ? 0.f : ((i == 1) ? 1.f : rng.GetFloat());
+
+            float x, pdf;
+            std::size_t segm;
+            distribution.SampleContinuous(uniSample, x, segm, pdf);
+
+            if (segm >= count)
+                failure = "Sampled segment out of range";
+            else if (!(pdf > 0.f) || (pdf != distribution.Pdf(segm)))
+                failure = "Sampled PDF doesn't match the segment PDF";
+            else if ((x < (float)segm / count) || (x > (float)(segm + 1) / count))
+                failure = "Sampled position lies outside the sampled segment";
+            else if (isInverseCdf)
+            {
+                float refX, refPdf;
+                std::size_t refSegm;
+                reference.SampleContinuous(uniSample, refX, refSegm, refPdf);
+                if ((segm != refSegm) || (x != refX))
+                    failure = "Sample differs from the binary search distribution";
+            }
+
+            if (failure == nullptr)
+                histogram[segm]++;
+        }
+
+        // Sampling frequencies must match the segment probabilities
+        for (std::size_t i = 0; (i < count) && (failure == nullptr); i++)
+        {
+            const double probability = exactPdfs[i] / count;
+            const double frequency   = (double)histogram[i] / sampleCount;
+            const double stdDev      = std::sqrt(probability * (1. - probability) / sampleCount);
+            if (std::abs(frequency - probability) > 5. * stdDev + 1e-5)
+                failure = "Sampling frequency doesn't match the segment probability";
+        }
 
-        // Compute probabilities
-        return mConditionals[iv]->Pdf(iu) * mMarginal->Pdf(iv);
+        if (failure != nullptr)
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, eutblSubTestLevel2, "%s, %d segments",
+                failure, GetMethodName(aMethod), (int32_t)count);
+            return false;
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel2,
+            "%s, %d segments", GetMethodName(aMethod), (int32_t)count);
+        return true;
     }
 
+    static bool _UT_Distribution2D(
+        const UnitTestBlockLevel     aMaxUtBlockPrintLevel,
+        const Distribution1DMethod   aMethod)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel2, "%s", GetMethodName(aMethod));
+
+        const int32_t countU = 37, countV = 19;
+        Rng rng(29);
+        const std::vector<float> func = _GenerateTestFunction(countU * countV, rng);
+        const Distribution2D distribution(func.data(), countU, countV, aMethod);
+
+        // The PDF integrates to one
+        const char *failure = nullptr;
+        double pdfIntegral = 0.;
+        for (int32_t v = 0; v < countV; v++)
+            for (int32_t u = 0; u < countU; u++)
+                pdfIntegral += distribution.Pdf(Vec2f((u + 0.5f) / countU, (v + 0.5f) / countV));
+        pdfIntegral /= countU * countV;
+        if (std::abs(pdfIntegral - 1.) > 1e-4)
+            failure = "PDF doesn't integrate to one";
+
+        // Sampled PDF matches the evaluated one
+        for (uint32_t i = 0; (i < 10000) && (failure == nullptr); i++)
+        {
+            Vec2f uv;
+            Vec2ui segm;
+            float pdf;
+            distribution.SampleContinuous(rng.GetVec2f(), uv, segm, &pdf);
+
+            const Vec2f segmCenter((segm.x + 0.5f) / countU, (segm.y + 0.5f) / countV);
+            if (!(pdf > 0.f) || (std::abs(pdf - distribution.Pdf(segmCenter)) > 1e-5f * pdf))
+                failure = "Sampled PDF doesn't match the evaluated one";
+        }
+
+        if (failure != nullptr)
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, eutblSubTestLevel2, "%s",
+                failure, GetMethodName(aMethod));
+            return false;
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel2, "%s", GetMethodName(aMethod));
+        return true;
+    }
+
+    static bool _UnitTests(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblWholeTest, "Distribution: sampling methods");
+
+        // Single block, exactly full blocks, incomplete blocks, several hierarchy levels
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "1D");
+        const std::size_t sizes[] = { 1, 7, 15, 16, 17, 255, 300, 5000 };
+        Rng rng(19);
+        for (auto size : sizes)
+        {
+            const std::vector<float> func = _GenerateTestFunction(size, rng);
+            const std::vector<float> zeroFunc(size, 0.f);
+            for (const std::vector<float> *testFunc : { &func, &zeroFunc })
+            {
+                if (!_UT_Distribution1D<Distribution1DSimple>(
+                        aMaxUtBlockPrintLevel, Distribution1DMethod::kBinarySearch, *testFunc))
+                    return false;
+                if (!_UT_Distribution1D<Distribution1DHierachical>(
+                        aMaxUtBlockPrintLevel, Distribution1DMethod::kHierarchical, *testFunc))
+                    return false;
+                if (!_UT_Distribution1D<Distribution1DHierachicalSimd>(
+                        aMaxUtBlockPrintLevel, Distribution1DMethod::kHierarchicalSimd, *testFunc))
+                    return false;
+                if (!_UT_Distribution1D<Distribution1DAlias>(
+                        aMaxUtBlockPrintLevel, Distribution1DMethod::kAliasTable, *testFunc))
+                    return false;
+            }
+        }
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "1D");
+
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "2D");
+        for (uint32_t method = 0; method < (uint32_t)Distribution1DMethod::kCount; method++)
+            if (!_UT_Distribution2D(aMaxUtBlockPrintLevel, (Distribution1DMethod)method))
+                return false;
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "2D");
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblWholeTest, "Distribution: sampling methods");
+        return true;
+    }
+
+#endif
+
+#ifdef PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+public:
+
+    template <typename TDistribution1D>
+    static void _BM_Distribution1D(
+        const Distribution1DMethod   aMethod,
+        const std::vector<float>    &aFunc,
+        const std::vector<float>    &aUniSamples)
+    {
+        Benchmarking::Timer timer;
+        const TDistribution1D distribution(aFunc.data(), aFunc.size());
+        const double buildTime = timer.ElapsedSeconds();
+
+        printf("\t  %s (built in %.3f ms)\n", GetMethodName(aMethod), buildTime * 1e3);
+
+        float resultSum = 0.f; // Keeps the optimiser from removing the measured code
+
+        const std::size_t sampleCount = aUniSamples.size();
+        std::size_t segmSum = 0;
+        timer.Restart();
+        for (std::size_t i = 0; i < sampleCount; i++)
+        {
+            float x, pdf;
+            std::size_t segm;
+            distribution.SampleContinuous(aUniSamples[i], x, segm, pdf);
+            resultSum += x;
+            segmSum += segm;
+        }
+        Benchmarking::PrintThroughput("    sample", sampleCount, timer.ElapsedSeconds(), "samples");
+
+        // Segments are picked in a random order, as when evaluating the PDF of BSDF samples
+        const std::size_t count = aFunc.size();
+        timer.Restart();
+        for (std::size_t i = 0; i < sampleCount; i++)
+        {
+            const std::size_t segm = std::min((std::size_t)(aUniSamples[i] * count), count - 1u);
+            resultSum += distribution.Pdf(segm);
+        }
+        Benchmarking::PrintThroughput("    PDF", sampleCount, timer.ElapsedSeconds(), "evals");
+
+        if ((resultSum < 0.f) || (segmSum == (std::size_t)-1))
+            printf("\t(%f)\n", resultSum);
+    }
+
+    static void _BM_Distribution2D(
+        const Distribution1DMethod   aMethod,
+        const std::vector<float>    &aFunc,
+        const int32_t                aCountU,
+        const int32_t                aCountV,
+        const std::vector<float>    &aUniSamples)
+    {
+        Benchmarking::Timer timer;
+        const Distribution2D distribution(aFunc.data(), aCountU, aCountV, aMethod);
+        const double buildTime = timer.ElapsedSeconds();
+
+        printf("\t  %s (built in %.3f ms)\n", GetMethodName(aMethod), buildTime * 1e3);
+
+        float resultSum = 0.f; // Keeps the optimiser from removing the measured code
+
+        const std::size_t sampleCount = aUniSamples.size() / 2;
+        timer.Restart();
+        for (std::size_t i = 0; i < sampleCount; i++)
+        {
+            Vec2f uv;
+            Vec2ui segm;
+            float pdf;
+            distribution.SampleContinuous(
+                Vec2f(aUniSamples[2 * i], aUniSamples[2 * i + 1]), uv, segm, &pdf);
+            resultSum += pdf;
+        }
+        Benchmarking::PrintThroughput("    sample", sampleCount, timer.ElapsedSeconds(), "samples");
+
+        timer.Restart();
+        for (std::size_t i = 0; i < sampleCount; i++)
+            resultSum += distribution.Pdf(Vec2f(aUniSamples[2 * i + 1], aUniSamples[2 * i]));
+        Benchmarking::PrintThroughput("    PDF", sampleCount, timer.ElapsedSeconds(), "evals");
+
+        if (resultSum < 0.f)
+            printf("\t(%f)\n", resultSum);
+    }
+
+    static void _Benchmark()
+    {
+        Benchmarking::PrintHeader("Distribution sampling methods (single thread)");
+
+        Rng rng(31);
+        std::vector<float> uniSamples(1u << 22);
+        for (auto &sample : uniSamples)
+            sample = rng.GetFloat();
+
+        for (std::size_t count = 64; count <= (1u << 22); count *= 16)
+        {
+            const std::vector<float> func = _GenerateTestFunction(count, rng);
+
+            printf("\t1D, %d segments:\n", (int32_t)count);
+            _BM_Distribution1D<Distribution1DSimple>(
+                Distribution1DMethod::kBinarySearch, func, uniSamples);
+            _BM_Distribution1D<Distribution1DHierachical>(
+                Distribution1DMethod::kHierarchical, func, uniSamples);
+            _BM_Distribution1D<Distribution1DHierachicalSimd>(
+                Distribution1DMethod::kHierarchicalSimd, func, uniSamples);
+            _BM_Distribution1D<Distribution1DAlias>(
+                Distribution1DMethod::kAliasTable, func, uniSamples);
+        }
+
+        // Typical environment map resolutions
+        for (int32_t countU = 256; countU <= 4096; countU *= 4)
+        {
+            const int32_t countV = countU / 2;
+            const std::vector<float> func = _GenerateTestFunction(countU * countV, rng);
+
+            printf("\t2D, %dx%d segments:\n", countU, countV);
+            for (uint32_t method = 0; method < (uint32_t)Distribution1DMethod::kCount; method++)
+                _BM_Distribution2D((Distribution1DMethod)method, func, countU, countV, uniSamples);
+        }
+    }
+
+#endif
+
 private:
 
-    std::vector<Distribution1D*>     mConditionals;
-    Distribution1D                  *mMarginal;
+    const Distribution1DMethod   mMethod;
+    std::unique_ptr<ImplBase>    mImpl;
 };
@@ -23,11 +23,13 @@ class EnvironmentMap
 public:
     // Loads an OpenEXR image with an environment map with latitude-longitude mapping.
     EnvironmentMap(
-        const std::string    aFilename,
-        float                aRotate,
-        float                aScale,
-        bool                 aDoBilinFiltering,
-        const AuxDbgParams  &aAuxDbgParams = AuxDbgParams())
+        const std::string      aFilename,
+        float                  aRotate,
+        float                  aScale,
+        bool                   aDoBilinFiltering,
+        const EmStorageFormat &aStorageFormat = EmStorageFormat(),
+        Distribution1DMethod   aDistributionMethod = Distribution2D::GetDefaultMethod(),
+        const AuxDbgParams    &aAuxDbgParams = AuxDbgParams())
     {
         aAuxDbgParams; // sometimes unused param
 
@@ -35,7 +37,7 @@ public:
         {
             mEmImage.reset(
                 EnvironmentMapImage::LoadImage(
-                    aFilename.c_str(), aRotate, aScale, aDoBilinFiltering));
+                    aFilename.c_str(), aRotate, aScale, aDoBilinFiltering, aStorageFormat));
         }
         catch (...)
         {
@@ -43,7 +45,7 @@ public:
         }
 
         mTmpCosineSampler           = std::make_shared<CosineImageEmSampler>();
-        mTmpSimpleSphericalSampler  = std::make_shared<SimpleSphericalImageEmSampler>();
+        mTmpSimpleSphericalSampler  = std::make_shared<SimpleSphericalImageEmSampler>(aDistributionMethod);
 
         if (mTmpCosineSampler)
             mTmpCosineSampler->Init(mEmImage);
@@ -110,6 +112,17 @@ public:
             (oPdfW != nullptr) ? *oPdfW : -1.f);
     }
 
+    // Gets radiance stored for each of the given directions
+    void EvalRadiance(
+        SpectrumF       *oRadiance,
+        const Vec3f     *aDirections,
+        size_t           aCount) const
+    {
+        PG3_ASSERT(mEmImage != nullptr);
+
+        mEmImage->Evaluate(aDirections, oRadiance, aCount);
+    }
+
     float PdfW(
         const Vec3f     &aDirection,
         const Frame     &aSurfFrame,
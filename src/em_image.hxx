@@ -1,12 +1,92 @@
 #pragma once
 
 #include <ImfRgbaFile.h>    // OpenEXR
+#include <half.h>           // OpenEXR
 #include "filter.hxx"
 #include "spectrum.hxx"
 #include "geom.hxx"
+#include "memory.hxx"
+#include "rng.hxx"
+#include "sampling.hxx"
+#include "unit_testing.hxx"
+#include "benchmarking.hxx"
+#include "hard_config.hxx"
 #include "debugging.hxx"
 #include "types.hxx"
 
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Memory layout of the environment map texels
+enum class EmTexelLayout
+{
+    kRowMajor,  // Scan lines
+    kTiled,     // 8x8 texel tiles (in scan line order), scan lines within a tile
+    kMorton,    // Z-order curve; the texel array is padded up to the Morton code of the last texel
+
+    kCount
+};
+
+// Precision of the stored environment map texels
+enum class EmTexelPrecision
+{
+    kFloat,     // 3x 32-bit float
+    kHalf,      // 3x 16-bit OpenEXR half: half the memory, ~3 significant digits, max. 65504
+
+    kCount
+};
+
+// Texel storage of an environment map image. Can be chosen at runtime; the default layout is
+// selected by PG3_USE_EM_MORTON_MAPPING.
+class EmStorageFormat
+{
+public:
+
+    EmStorageFormat(
+#ifdef PG3_USE_EM_MORTON_MAPPING
+        EmTexelLayout       aLayout     = EmTexelLayout::kMorton,
+#else
+        EmTexelLayout       aLayout     = EmTexelLayout::kRowMajor,
+#endif
+        EmTexelPrecision    aPrecision  = EmTexelPrecision::kFloat)
+        :
+        layout(aLayout),
+        precision(aPrecision)
+    {}
+
+    static const char* GetLayoutAcronym(EmTexelLayout aLayout)
+    {
+        static const char* acronyms[] = { "row", "tile", "mort" };
+        static_assert(
+            sizeof(acronyms) / sizeof(acronyms[0]) == (size_t)EmTexelLayout::kCount,
+            "Not enough layout acronyms");
+
+        return acronyms[(size_t)aLayout];
+    }
+
+    static const char* GetLayoutName(EmTexelLayout aLayout)
+    {
+        static const char* names[] = { "row-major", "tiled", "Morton" };
+        static_assert(
+            sizeof(names) / sizeof(names[0]) == (size_t)EmTexelLayout::kCount,
+            "Not enough layout names");
+
+        return names[(size_t)aLayout];
+    }
+
+    std::string GetName() const
+    {
+        return
+              std::string(GetLayoutName(layout))
+            + ((precision == EmTexelPrecision::kHalf) ? ", half" : ", float");
+    }
+
+    EmTexelLayout       layout;
+    EmTexelPrecision    precision;
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // EnvironmentMapImage is adopted from SmallUPBP project and used as a reference for my own 
 // implementations.
@@ -17,27 +97,33 @@ class EnvironmentMapImage
 {
 public:
     EnvironmentMapImage(
-        const char *aFilename,
-        uint32_t    aWidth,
-        uint32_t    aHeight,
-        bool        aDoBilinFiltering)
+        const char              *aFilename,
+        uint32_t                 aWidth,
+        uint32_t                 aHeight,
+        bool                     aDoBilinFiltering,
+        const EmStorageFormat   &aStorageFormat = EmStorageFormat())
         :
         mFilename(aFilename),
         mWidth(aWidth),
         mHeight(aHeight),
         mDoBilinFiltering(aDoBilinFiltering),
-#ifdef PG3_USE_EM_MORTON_MAPPING
-        mImgDataSize(Math::MortonCode2D(aWidth - 1, aHeight - 1) + 1) // based on the last element 
-#else
-        mImgDataSize(mWidth * mHeight)
-#endif
+        mStorageFormat(aStorageFormat),
+        mTileCountX((aWidth + kTileSize - 1) / kTileSize),
+        mTexelCount(ComputeTexelCount(aWidth, aHeight, aStorageFormat.layout))
     {
-        mImgData = new SpectrumF[mImgDataSize];
+        mTexelData = static_cast<uint8_t*>(
+            Memory::AlignedMalloc(GetTexelDataSize(), Memory::kCacheLine, true));
+        if (mTexelData == nullptr)
+            PG3_FATAL_ERROR(
+                "Not enough memory for the environment map \"%s\" (%ux%u, %.1f MB)!",
+                aFilename, aWidth, aHeight, GetTexelDataSize() / (1024. * 1024.));
+
+        SelectEvaluateFunctions();
     }
 
     ~EnvironmentMapImage()
     {
-        delete mImgData;
+        Memory::AlignedFree(mTexelData);
     }
 
     // This class is not copyable because of a const member.
@@ -45,14 +131,15 @@ public:
     // explicitly, the compiler may complain about not being able 
     // to create its default implementation.
     EnvironmentMapImage & operator=(const EnvironmentMapImage&) = delete;
-    //EnvironmentMapImage(const EnvironmentMapImage&) = delete;
+    EnvironmentMapImage(const EnvironmentMapImage&) = delete;
 
     // Loads, scales and rotates an environment map from an OpenEXR image on the given path.
     static EnvironmentMapImage* LoadImage(
-        const char *aFilename,
-        float       aAzimuthRotation = 0.0f,
-        float       aScale = 1.0f,
-        bool        aDoBilinFiltering = true)
+        const char              *aFilename,
+        float                    aAzimuthRotation = 0.0f,
+        float                    aScale = 1.0f,
+        bool                     aDoBilinFiltering = true,
+        const EmStorageFormat   &aStorageFormat = EmStorageFormat())
     {
         aAzimuthRotation = Math::FmodX(aAzimuthRotation, 1.0f);
         PG3_ASSERT_FLOAT_IN_RANGE(aAzimuthRotation, 0.0f, 1.0f);
@@ -68,7 +155,7 @@ public:
         file.readPixels(dw.min.y, dw.max.y);
 
         EnvironmentMapImage* image =
-            new EnvironmentMapImage(aFilename, width, height, aDoBilinFiltering);
+            new EnvironmentMapImage(aFilename, width, height, aDoBilinFiltering, aStorageFormat);
 
         int32_t c = 0;
         int32_t iRot = (int32_t)(aAzimuthRotation * width);
@@ -78,11 +165,13 @@ public:
             {
                 int32_t x = i + iRot;
                 if (x >= width) x -= width;
-                image->ElementAt(x, j).SetSRGBLight(
+                SpectrumF texel;
+                texel.SetSRGBLight(
                     rgbaData[c].r * aScale,
                     rgbaData[c].g * aScale,
                     rgbaData[c].b * aScale
                     );
+                image->SetTexel(x, j, texel);
                 c++;
             }
         }
@@ -94,51 +183,7 @@ public:
 
     SpectrumF Evaluate(const Vec2f &aUV) const
     {
-        PG3_ASSERT_FLOAT_IN_RANGE(aUV.x, 0.0f, 1.0f);
-        PG3_ASSERT_FLOAT_IN_RANGE(aUV.y, 0.0f, 1.0f);
-
-        // UV to image coords
-        const float xFull = aUV.x * (float)mWidth;
-        const float yFull = aUV.y * (float)mHeight;
-
-        // Eval
-        if (!mDoBilinFiltering)
-        {
-            // Box filter
-
-            const uint32_t x0 = Math::Clamp((uint32_t)xFull, 0u, mWidth  - 1u);
-            const uint32_t y0 = Math::Clamp((uint32_t)yFull, 0u, mHeight - 1u);
-            
-            return ElementAt(x0, y0);
-        }
-        else
-        {
-            // Triangle (tent) filter
-
-            // Find the centre of the enclosing rectangle (vertices are middle points of EM pixels)
-            const Vec2i centre(
-                (int32_t)(xFull + 0.5f),
-                (int32_t)(yFull + 0.5f));
-
-            const Vec2i coords0 = centre - Vec2i(1, 1);
-            const Vec2i coords1 = centre;
-
-            const float xLocal = xFull - ((float)coords0.x + 0.5f);
-            const float yLocal = yFull - ((float)coords0.y + 0.5f);
-
-            PG3_ASSERT_FLOAT_IN_RANGE(xLocal, 0.f, 1.0f);
-            PG3_ASSERT_FLOAT_IN_RANGE(yLocal, 0.f, 1.0f);
-
-            const Vec2ui normCoords0 = NormalizeImgCoords(coords0);
-            const Vec2ui normCoords1 = NormalizeImgCoords(coords1);
-
-            return Filter::Triangle(
-                xLocal, yLocal,
-                ElementAt(normCoords0.x, normCoords0.y),
-                ElementAt(normCoords1.x, normCoords0.y),
-                ElementAt(normCoords0.x, normCoords1.y),
-                ElementAt(normCoords1.x, normCoords1.y));
-        }
+        return (this->*mEvaluateFunc)(aUV);
     }
 
     SpectrumF Evaluate(const Vec3f &aDirection) const
@@ -149,6 +194,17 @@ public:
         return Evaluate(uv);
     }
 
+    // Evaluates a batch of directions, e.g. all rays of a wavefront escaping the scene.
+    // The storage format is resolved once per batch and the texels loaded for a direction are
+    // reused by the following ones which fall into the same texels (coherent rays).
+    void Evaluate(
+        const Vec3f     *aDirections,
+        SpectrumF       *oValues,
+        size_t           aCount) const
+    {
+        (this->*mEvaluateBatchFunc)(aDirections, oValues, aCount);
+    }
+
     float AveragePixelLuminance(uint32_t aX, uint32_t aY) const
     {
         PG3_ASSERT_INTEGER_IN_RANGE(aX, 0, mWidth);
@@ -157,7 +213,7 @@ public:
         if (!mDoBilinFiltering)
         {
             // Box filter
-            return ElementAt(aX, aY).Luminance();
+            return GetTexel(aX, aY).Luminance();
         }
         else
         {
@@ -168,50 +224,48 @@ public:
             const Vec2ui coords2 = NormalizeImgCoords(Vec2i(aX + 1, aY + 1));
 
             const float integral = Filter::TriangleIntegral(
-                ElementAt(coords0.x, coords0.y).Luminance(),
-                ElementAt(coords1.x, coords0.y).Luminance(),
-                ElementAt(coords2.x, coords0.y).Luminance(),
-                ElementAt(coords0.x, coords1.y).Luminance(),
-                ElementAt(coords1.x, coords1.y).Luminance(),
-                ElementAt(coords2.x, coords1.y).Luminance(),
-                ElementAt(coords0.x, coords2.y).Luminance(),
-                ElementAt(coords1.x, coords2.y).Luminance(),
-                ElementAt(coords2.x, coords2.y).Luminance());
+                GetTexel(coords0.x, coords0.y).Luminance(),
+                GetTexel(coords1.x, coords0.y).Luminance(),
+                GetTexel(coords2.x, coords0.y).Luminance(),
+                GetTexel(coords0.x, coords1.y).Luminance(),
+                GetTexel(coords1.x, coords1.y).Luminance(),
+                GetTexel(coords2.x, coords1.y).Luminance(),
+                GetTexel(coords0.x, coords2.y).Luminance(),
+                GetTexel(coords1.x, coords2.y).Luminance(),
+                GetTexel(coords2.x, coords2.y).Luminance());
 
             return integral;
         }
     }
 
-    SpectrumF& ElementAt(uint32_t aX, uint32_t aY)
+    // Texels are returned by value since they don't have to be stored as SpectrumF
+    SpectrumF GetTexel(uint32_t aX, uint32_t aY) const
     {
         PG3_ASSERT_INTEGER_IN_RANGE(aX, 0, mWidth);
         PG3_ASSERT_INTEGER_IN_RANGE(aY, 0, mHeight);
 
-#ifdef PG3_USE_EM_MORTON_MAPPING
-        const uint32_t offset = Math::MortonCode2D(aX, aY);
-#else
-        const uint32_t offset = mWidth*aY + aX;
-#endif
-
-        PG3_ASSERT(offset < mImgDataSize);
-
-        return mImgData[offset];
+        const uint32_t index = TexelIndex(aX, aY);
+        if (mStorageFormat.precision == EmTexelPrecision::kHalf)
+            return LoadTexel<EmTexelPrecision::kHalf>(index);
+        else
+            return LoadTexel<EmTexelPrecision::kFloat>(index);
     }
 
-    const SpectrumF& ElementAt(uint32_t aX, uint32_t aY) const
+    void SetTexel(uint32_t aX, uint32_t aY, const SpectrumF &aValue)
     {
         PG3_ASSERT_INTEGER_IN_RANGE(aX, 0, mWidth);
         PG3_ASSERT_INTEGER_IN_RANGE(aY, 0, mHeight);
 
-#ifdef PG3_USE_EM_MORTON_MAPPING
-        const uint32_t offset = Math::MortonCode2D(aX, aY);
-#else
-        const uint32_t offset = mWidth*aY + aX;
-#endif
-
-        PG3_ASSERT(offset < mImgDataSize);
-
-        return mImgData[offset];
+        const uint32_t index = TexelIndex(aX, aY);
+        if (mStorageFormat.precision == EmTexelPrecision::kHalf)
+        {
+            // Values out of the half range are clamped to avoid infinities
+            HalfTexel &texel = reinterpret_cast<HalfTexel*>(mTexelData)[index];
+            for (uint32_t i = 0; i < 3; i++)
+                texel.values[i] = Math::Clamp(aValue.Get(i), -HALF_MAX, HALF_MAX);
+        }
+        else
+            reinterpret_cast<SpectrumF*>(mTexelData)[index] = aValue;
     }
 
     Vec2ui Size() const
@@ -239,8 +293,333 @@ public:
         return mDoBilinFiltering;
     }
 
+    const EmStorageFormat &GetStorageFormat() const
+    {
+        return mStorageFormat;
+    }
+
+    // Memory occupied by the texels including the layout padding
+    size_t GetTexelDataSize() const
+    {
+        return (size_t)mTexelCount * GetTexelSize();
+    }
+
+    // 64-bit FNV-1a hash of the image size and pixel values. Doesn't depend on the memory layout
+    // of the image data, so it can be used to validate data pre-computed from the image.
+    uint64_t ComputeContentHash() const
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto hashWord = [&hash](uint32_t aWord)
+        {
+            hash ^= aWord;
+            hash *= 1099511628211ull;
+        };
+
+        hashWord(mWidth);
+        hashWord(mHeight);
+        for (uint32_t y = 0; y < mHeight; y++)
+        {
+            for (uint32_t x = 0; x < mWidth; x++)
+            {
+                const SpectrumF value = GetTexel(x, y);
+                for (uint32_t i = 0; i < 3; i++)
+                {
+                    uint32_t bits;
+                    std::memcpy(&bits, &value.Get(i), sizeof(bits));
+                    hashWord(bits);
+                }
+            }
+        }
+
+        return hash;
+    }
+
 private:
 
+    struct HalfTexel
+    {
+        half values[3];
+    };
+
+    static const uint32_t kTileSize         = 8u;
+    static const uint32_t kTileTexelCount   = kTileSize * kTileSize;
+
+    static uint32_t ComputeTexelCount(uint32_t aWidth, uint32_t aHeight, EmTexelLayout aLayout)
+    {
+        switch (aLayout)
+        {
+        case EmTexelLayout::kTiled:
+            return
+                  ((aWidth  + kTileSize - 1) / kTileSize)
+                * ((aHeight + kTileSize - 1) / kTileSize)
+                * kTileTexelCount;
+        case EmTexelLayout::kMorton:
+            return Math::MortonCode2D(aWidth - 1, aHeight - 1) + 1; // based on the last element
+        default:
+            return aWidth * aHeight;
+        }
+    }
+
+    size_t GetTexelSize() const
+    {
+        return
+              (mStorageFormat.precision == EmTexelPrecision::kHalf)
+            ? sizeof(HalfTexel)
+            : sizeof(SpectrumF);
+    }
+
+    template <EmTexelLayout tLayout>
+    uint32_t TexelIndex(uint32_t aX, uint32_t aY) const
+    {
+        uint32_t index;
+        switch (tLayout)
+        {
+        case EmTexelLayout::kTiled:
+            index =
+                  ((aY / kTileSize) * mTileCountX + (aX / kTileSize)) * kTileTexelCount
+                + (aY % kTileSize) * kTileSize
+                + (aX % kTileSize);
+            break;
+        case EmTexelLayout::kMorton:
+            index = Math::MortonCode2D(aX, aY);
+            break;
+        default:
+            index = mWidth * aY + aX;
+            break;
+        }
+
+        PG3_ASSERT(index < mTexelCount);
+
+        return index;
+    }
+
+    uint32_t TexelIndex(uint32_t aX, uint32_t aY) const
+    {
+        switch (mStorageFormat.layout)
+        {
+        case EmTexelLayout::kTiled:
+            return TexelIndex<EmTexelLayout::kTiled>(aX, aY);
+        case EmTexelLayout::kMorton:
+            return TexelIndex<EmTexelLayout::kMorton>(aX, aY);
+        default:
+            return TexelIndex<EmTexelLayout::kRowMajor>(aX, aY);
+        }
+    }
+
+    template <EmTexelPrecision tPrecision>
+    SpectrumF LoadTexel(uint32_t aIndex) const
+    {
+        switch (tPrecision)
+        {
+        case EmTexelPrecision::kHalf:
+        {
+            const HalfTexel &texel = reinterpret_cast<const HalfTexel*>(mTexelData)[aIndex];
+            SpectrumF value;
+            value.SetSRGBLight(texel.values[0], texel.values[1], texel.values[2]);
+            return value;
+        }
+        default:
+            return reinterpret_cast<const SpectrumF*>(mTexelData)[aIndex];
+        }
+    }
+
+    // Loads the 2x2 texel block with the given top-left texel. Within a row or a tile,
+    // the texel indices are derived from the first one.
+    template <EmTexelLayout tLayout, EmTexelPrecision tPrecision>
+    void LoadTexelBlock(uint32_t aX, uint32_t aY, SpectrumF (&oTexels)[4]) const
+    {
+        PG3_ASSERT(aX + 1 < mWidth);
+        PG3_ASSERT(aY + 1 < mHeight);
+
+        uint32_t index00, index10, index01, index11;
+        switch (tLayout)
+        {
+        case EmTexelLayout::kRowMajor:
+            index00 = TexelIndex<tLayout>(aX, aY);
+            index10 = index00 + 1;
+            index01 = index00 + mWidth;
+            index11 = index01 + 1;
+            break;
+        case EmTexelLayout::kTiled:
+            if (((aX % kTileSize) != (kTileSize - 1)) && ((aY % kTileSize) != (kTileSize - 1)))
+            {
+                index00 = TexelIndex<tLayout>(aX, aY);
+                index10 = index00 + 1;
+                index01 = index00 + kTileSize;
+                index11 = index01 + 1;
+                break;
+            }
+            // The block crosses the tile boundary - fall through
+        default:
+            index00 = TexelIndex<tLayout>(aX,     aY);
+            index10 = TexelIndex<tLayout>(aX + 1, aY);
+            index01 = TexelIndex<tLayout>(aX,     aY + 1);
+            index11 = TexelIndex<tLayout>(aX + 1, aY + 1);
+            break;
+        }
+
+        oTexels[0] = LoadTexel<tPrecision>(index00);
+        oTexels[1] = LoadTexel<tPrecision>(index10);
+        oTexels[2] = LoadTexel<tPrecision>(index01);
+        oTexels[3] = LoadTexel<tPrecision>(index11);
+    }
+
+    // The last texels loaded by a batched evaluation
+    struct TexelCache
+    {
+        TexelCache() : x(UINT32_MAX), y(UINT32_MAX) {}
+
+        uint32_t    x, y;       // The texel (box filter) or the top-left texel of the 2x2 block
+        SpectrumF   texels[4];
+    };
+
+    template <EmTexelLayout tLayout, EmTexelPrecision tPrecision>
+    SpectrumF EvaluateImpl(const Vec2f &aUV) const
+    {
+        return EvaluateCachedImpl<tLayout, tPrecision>(aUV, nullptr);
+    }
+
+    template <EmTexelLayout tLayout, EmTexelPrecision tPrecision>
+    SpectrumF EvaluateCachedImpl(const Vec2f &aUV, TexelCache *aoCache) const
+    {
+        PG3_ASSERT_FLOAT_IN_RANGE(aUV.x, 0.0f, 1.0f);
+        PG3_ASSERT_FLOAT_IN_RANGE(aUV.y, 0.0f, 1.0f);
+
+        // UV to image coords
+        const float xFull = aUV.x * (float)mWidth;
+        const float yFull = aUV.y * (float)mHeight;
+
+        // Eval
+        if (!mDoBilinFiltering)
+        {
+            // Box filter
+
+            const uint32_t x0 = Math::Clamp((uint32_t)xFull, 0u, mWidth  - 1u);
+            const uint32_t y0 = Math::Clamp((uint32_t)yFull, 0u, mHeight - 1u);
+
+            if (aoCache == nullptr)
+                return LoadTexel<tPrecision>(TexelIndex<tLayout>(x0, y0));
+
+            if ((aoCache->x != x0) || (aoCache->y != y0))
+            {
+                aoCache->texels[0] = LoadTexel<tPrecision>(TexelIndex<tLayout>(x0, y0));
+                aoCache->x = x0;
+                aoCache->y = y0;
+            }
+            return aoCache->texels[0];
+        }
+        else
+        {
+            // Triangle (tent) filter
+
+            // Find the centre of the enclosing rectangle (vertices are middle points of EM pixels)
+            const Vec2i centre(
+                (int32_t)(xFull + 0.5f),
+                (int32_t)(yFull + 0.5f));
+
+            const Vec2i coords0 = centre - Vec2i(1, 1);
+            const Vec2i coords1 = centre;
+
+            const float xLocal = xFull - ((float)coords0.x + 0.5f);
+            const float yLocal = yFull - ((float)coords0.y + 0.5f);
+
+            PG3_ASSERT_FLOAT_IN_RANGE(xLocal, 0.f, 1.0f);
+            PG3_ASSERT_FLOAT_IN_RANGE(yLocal, 0.f, 1.0f);
+
+            SpectrumF localTexels[4];
+            const SpectrumF *texels = localTexels;
+            if (   (coords0.x >= 0) && (coords1.x < (int32_t)mWidth)
+                && (coords0.y >= 0) && (coords1.y < (int32_t)mHeight))
+            {
+                // The whole filter footprint lies inside the image (almost always)
+                if (aoCache == nullptr)
+                    LoadTexelBlock<tLayout, tPrecision>(coords0.x, coords0.y, localTexels);
+                else
+                {
+                    if ((aoCache->x != (uint32_t)coords0.x) || (aoCache->y != (uint32_t)coords0.y))
+                    {
+                        LoadTexelBlock<tLayout, tPrecision>(coords0.x, coords0.y, aoCache->texels);
+                        aoCache->x = (uint32_t)coords0.x;
+                        aoCache->y = (uint32_t)coords0.y;
+                    }
+                    texels = aoCache->texels;
+                }
+            }
+            else
+            {
+                const Vec2ui normCoords0 = NormalizeImgCoords(coords0);
+                const Vec2ui normCoords1 = NormalizeImgCoords(coords1);
+
+                localTexels[0] = LoadTexel<tPrecision>(TexelIndex<tLayout>(normCoords0.x, normCoords0.y));
+                localTexels[1] = LoadTexel<tPrecision>(TexelIndex<tLayout>(normCoords1.x, normCoords0.y));
+                localTexels[2] = LoadTexel<tPrecision>(TexelIndex<tLayout>(normCoords0.x, normCoords1.y));
+                localTexels[3] = LoadTexel<tPrecision>(TexelIndex<tLayout>(normCoords1.x, normCoords1.y));
+            }
+
+            return Filter::Triangle(
+                xLocal, yLocal,
+                texels[0], texels[1],
+                texels[2], texels[3]);
+        }
+    }
+
+    template <EmTexelLayout tLayout, EmTexelPrecision tPrecision>
+    void EvaluateBatchImpl(
+        const Vec3f     *aDirections,
+        SpectrumF       *oValues,
+        size_t           aCount) const
+    {
+        // The lat-long coordinates are computed for a whole chunk first, so that the loop
+        // with the trigonometric functions isn't interleaved with the texel loads
+        static const size_t kChunkSize = 64;
+        Vec2f uvs[kChunkSize];
+        TexelCache cache;
+
+        for (size_t begin = 0; begin < aCount; begin += kChunkSize)
+        {
+            const size_t count = std::min(kChunkSize, aCount - begin);
+            for (size_t i = 0; i < count; i++)
+            {
+                PG3_ASSERT_VEC3F_NORMALIZED(aDirections[begin + i]);
+
+                uvs[i] = Geom::Dir2LatLong(aDirections[begin + i]);
+            }
+            for (size_t i = 0; i < count; i++)
+                oValues[begin + i] = EvaluateCachedImpl<tLayout, tPrecision>(uvs[i], &cache);
+        }
+    }
+
+    template <EmTexelLayout tLayout>
+    void SelectEvaluateFunctions()
+    {
+        if (mStorageFormat.precision == EmTexelPrecision::kHalf)
+        {
+            mEvaluateFunc       = &EnvironmentMapImage::EvaluateImpl<tLayout, EmTexelPrecision::kHalf>;
+            mEvaluateBatchFunc  = &EnvironmentMapImage::EvaluateBatchImpl<tLayout, EmTexelPrecision::kHalf>;
+        }
+        else
+        {
+            mEvaluateFunc       = &EnvironmentMapImage::EvaluateImpl<tLayout, EmTexelPrecision::kFloat>;
+            mEvaluateBatchFunc  = &EnvironmentMapImage::EvaluateBatchImpl<tLayout, EmTexelPrecision::kFloat>;
+        }
+    }
+
+    void SelectEvaluateFunctions()
+    {
+        switch (mStorageFormat.layout)
+        {
+        case EmTexelLayout::kTiled:
+            SelectEvaluateFunctions<EmTexelLayout::kTiled>();
+            break;
+        case EmTexelLayout::kMorton:
+            SelectEvaluateFunctions<EmTexelLayout::kMorton>();
+            break;
+        default:
+            SelectEvaluateFunctions<EmTexelLayout::kRowMajor>();
+            break;
+        }
+    }
+
     // Wraps coordinates around the edges of the environment image
     Vec2ui NormalizeImgCoords(const Vec2i &aCoords) const
     {
@@ -277,14 +656,208 @@ private:
         return Vec2ui((uint32_t)resultX, (uint32_t)resultY);
     }
 
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+
+public:
+
+    static void _GenerateTestImage(EnvironmentMapImage &aImage)
+    {
+        Rng rng(7);
+        for (uint32_t y = 0; y < aImage.Height(); y++)
+            for (uint32_t x = 0; x < aImage.Width(); x++)
+                aImage.SetTexel(x, y, SpectrumF(rng.GetVec3f() * 10.f));
+    }
+
+    static bool _UT_StorageFormat(
+        const UnitTestBlockLevel     aMaxUtBlockPrintLevel,
+        const EmStorageFormat       &aStorageFormat,
+        bool                         aDoBilinFiltering)
+    {
+        const std::string formatName = aStorageFormat.GetName();
+
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1,
+            "%s, %s filtering", formatName.c_str(), aDoBilinFiltering ? "bilinear" : "box");
+
+        // Odd size: incomplete tiles, non-power-of-two Morton footprint
+        const uint32_t width = 37, height = 19;
+        const EmStorageFormat referenceFormat(EmTexelLayout::kRowMajor, EmTexelPrecision::kFloat);
+        EnvironmentMapImage reference("reference", width, height, aDoBilinFiltering, referenceFormat);
+        EnvironmentMapImage image("tested", width, height, aDoBilinFiltering, aStorageFormat);
+        _GenerateTestImage(reference);
+        _GenerateTestImage(image);
+
+        // Float texels must be exact, half ones within the half precision
+        const bool isHalf = (aStorageFormat.precision == EmTexelPrecision::kHalf);
+        const float relTolerance = isHalf ? 1e-3f : 0.f;
+        auto isClose = [relTolerance](const SpectrumF &aValue, const SpectrumF &aRefValue)
+        {
+            for (uint32_t i = 0; i < 3; i++)
+                if (std::abs(aValue.Get(i) - aRefValue.Get(i)) > relTolerance * std::abs(aRefValue.Get(i)))
+                    return false;
+            return true;
+        };
+
+        const char *failure = nullptr;
+        for (uint32_t y = 0; (y < height) && (failure == nullptr); y++)
+            for (uint32_t x = 0; (x < width) && (failure == nullptr); x++)
+                if (!isClose(image.GetTexel(x, y), reference.GetTexel(x, y)))
+                    failure = "Texel differs from the stored value";
+
+        // Single and batched evaluation. Every other direction repeats the previous one with
+        // a small offset to hit the texels cached by the batched evaluation.
+        const uint32_t dirCount = 10000;
+        Rng rng(13);
+        std::vector<Vec3f> directions(dirCount);
+        for (uint32_t i = 0; i < dirCount; i++)
+            directions[i] =
+                  ((i % 2) == 0)
+                ? Sampling::SampleUniformSphereW(rng.GetVec2f())
+                : Normalize(directions[i - 1] + 0.01f * (rng.GetVec3f() - Vec3f(0.5f)));
+        std::vector<SpectrumF> batchValues(dirCount);
+        image.Evaluate(directions.data(), batchValues.data(), dirCount);
+        for (uint32_t i = 0; (i < dirCount) && (failure == nullptr); i++)
+        {
+            const SpectrumF value = image.Evaluate(directions[i]);
+            if (!isClose(value, reference.Evaluate(directions[i])))
+                failure = "Evaluation differs from the reference format";
+            else if (!(value == batchValues[i]))
+                failure = "Batched evaluation differs from the single one";
+        }
+
+        // Hash doesn't depend on the layout
+        if ((failure == nullptr) && !isHalf
+            && (image.ComputeContentHash() != reference.ComputeContentHash()))
+            failure = "Content hash depends on the layout";
+
+        if (failure != nullptr)
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s, %s filtering",
+                failure, formatName.c_str(), aDoBilinFiltering ? "bilinear" : "box");
+            return false;
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1,
+            "%s, %s filtering", formatName.c_str(), aDoBilinFiltering ? "bilinear" : "box");
+        return true;
+    }
+
+    static bool _UnitTests(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblWholeTest, "EnvironmentMapImage: Storage formats");
+
+        for (uint32_t layout = 0; layout < (uint32_t)EmTexelLayout::kCount; layout++)
+            for (uint32_t precision = 0; precision < (uint32_t)EmTexelPrecision::kCount; precision++)
+                for (uint32_t bilinear = 0; bilinear < 2; bilinear++)
+                    if (!_UT_StorageFormat(
+                            aMaxUtBlockPrintLevel,
+                            EmStorageFormat(EmTexelLayout(layout), EmTexelPrecision(precision)),
+                            bilinear != 0))
+                        return false;
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblWholeTest, "EnvironmentMapImage: Storage formats");
+        return true;
+    }
+
+#endif
+
+#ifdef PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+public:
+
+    static void _BM_Evaluate(
+        const char                  *aCaseName,
+        const EnvironmentMapImage   &aImage,
+        const std::vector<Vec3f>    &aDirections,
+        bool                         aBatched)
+    {
+        // Roughly the escaped rays of a wavefront tile
+        const size_t kBatchSize = 256u;
+        const size_t dirCount = aDirections.size();
+        std::vector<SpectrumF> values(kBatchSize);
+
+        float sum = 0.f; // Keeps the optimiser from removing the measured code
+
+        Benchmarking::Timer timer;
+        for (size_t begin = 0; begin < dirCount; begin += kBatchSize)
+        {
+            const size_t count = std::min(kBatchSize, dirCount - begin);
+            if (aBatched)
+                aImage.Evaluate(&aDirections[begin], values.data(), count);
+            else
+                for (size_t i = 0; i < count; i++)
+                    values[i] = aImage.Evaluate(aDirections[begin + i]);
+            for (size_t i = 0; i < count; i++)
+                sum += values[i].Get(0);
+        }
+        const double seconds = timer.ElapsedSeconds();
+        if (sum < 0.f)
+            printf("\t(%f)\n", sum);
+
+        // Bilinear filtering reads 4 texels per evaluation
+        const uint64_t texelCount = dirCount * (aImage.IsUsingBilinearFiltering() ? 4u : 1u);
+        Benchmarking::PrintThroughput(aCaseName, texelCount, seconds, "texels");
+    }
+
+    static void _Benchmark()
+    {
+        Benchmarking::PrintHeader("EnvironmentMapImage evaluation (bilinear, single thread)");
+
+        // Random directions (light sampling) and coherent directions (camera rays hitting
+        // the background) - a slowly rotating scan over the upper hemisphere
+        const uint32_t dirCount = 4000000;
+        std::vector<Vec3f> randomDirections(dirCount);
+        std::vector<Vec3f> coherentDirections(dirCount);
+        Rng rng(17);
+        for (auto &direction : randomDirections)
+            direction = Sampling::SampleUniformSphereW(rng.GetVec2f());
+        const uint32_t scanWidth = 2000;
+        for (uint32_t i = 0; i < dirCount; i++)
+        {
+            const Vec2f uv(
+                0.3f * (i % scanWidth) / scanWidth,
+                0.5f * (i / scanWidth) / (dirCount / scanWidth));
+            coherentDirections[i] = Geom::LatLong2Dir(uv);
+        }
+
+        for (uint32_t layout = 0; layout < (uint32_t)EmTexelLayout::kCount; layout++)
+        {
+            for (uint32_t precision = 0; precision < (uint32_t)EmTexelPrecision::kCount; precision++)
+            {
+                const EmStorageFormat format((EmTexelLayout)layout, (EmTexelPrecision)precision);
+                EnvironmentMapImage image("procedural", 4096, 2048, true, format);
+                for (uint32_t y = 0; y < image.Height(); y++)
+                    for (uint32_t x = 0; x < image.Width(); x++)
+                        image.SetTexel(x, y, SpectrumF(Vec3f((float)x, (float)y, 1.f)));
+
+                printf("\t%s: %.1f MB\n", format.GetName().c_str(), image.GetTexelDataSize() / 1048576.);
+                _BM_Evaluate("  random directions",            image, randomDirections,   false);
+                _BM_Evaluate("  random directions, batched",   image, randomDirections,   true);
+                _BM_Evaluate("  coherent directions",          image, coherentDirections, false);
+                _BM_Evaluate("  coherent directions, batched", image, coherentDirections, true);
+            }
+        }
+    }
+
+#endif
+
 private:
 
-    const std::string    mFilename;
-    const uint32_t       mWidth;
-    const uint32_t       mHeight;
-    const bool           mDoBilinFiltering;
-    SpectrumF           *mImgData;
-    const uint32_t       mImgDataSize;
+    typedef SpectrumF (EnvironmentMapImage::*EvaluateFunc)(const Vec2f&) const;
+    typedef void (EnvironmentMapImage::*EvaluateBatchFunc)(const Vec3f*, SpectrumF*, size_t) const;
+
+    const std::string        mFilename;
+    const uint32_t           mWidth;
+    const uint32_t           mHeight;
+    const bool               mDoBilinFiltering;
+    const EmStorageFormat    mStorageFormat;
+    const uint32_t           mTileCountX;
+    const uint32_t           mTexelCount;    // including the layout padding
+    uint8_t                 *mTexelData;     // SpectrumF or HalfTexel texels
+
+    // Evaluation specialised for the storage format
+    EvaluateFunc             mEvaluateFunc;
+    EvaluateBatchFunc        mEvaluateBatchFunc;
 };
 
 // Wrapper for constant environment
@@ -296,7 +869,7 @@ public:
     SpectrumF Evaluate(const Vec3f &aDirection) const
     {
         aDirection; //unused params
-        
+
         PG3_ASSERT_VEC3F_NORMALIZED(aDirection);
 
         return mConstantValue;
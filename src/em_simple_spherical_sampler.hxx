@@ -9,7 +9,10 @@ class EnvironmentMapSimpleSphericalSampler : public EnvironmentMapSampler<TEmVal
 {
 public:
 
-    EnvironmentMapSimpleSphericalSampler() :
+    EnvironmentMapSimpleSphericalSampler(
+        Distribution1DMethod aDistributionMethod = Distribution2D::GetDefaultMethod())
+        :
+        mDistributionMethod(aDistributionMethod),
         mPlan2AngPdfCoeff(1.0f / (2.0f * Math::kPiF * Math::kPiF))
     {}
 
@@ -146,7 +149,8 @@ private:
             }
         }
 
-        Distribution2D* distribution = new Distribution2D(srcData.get(), size.x, size.y);
+        Distribution2D* distribution =
+            new Distribution2D(srcData.get(), size.x, size.y, mDistributionMethod);
 
         return distribution;
     }
@@ -160,7 +164,7 @@ private:
         PG3_ASSERT_INTEGER_IN_RANGE(aSegm.x, 0u, mEmImage->Width());
         PG3_ASSERT_INTEGER_IN_RANGE(aSegm.y, 0u, mEmImage->Height());
 
-        return mEmImage->ElementAt(aSegm.x, aSegm.y);
+        return mEmImage->GetTexel(aSegm.x, aSegm.y);
     }
 
     // Returns radiance for the given segment of the image
@@ -205,6 +209,7 @@ private:
 private:
 
     std::unique_ptr<Distribution2D> mDistribution;      // 2D distribution of the environment map
+    const Distribution1DMethod      mDistributionMethod;
     const float                     mPlan2AngPdfCoeff;  // Coefficient for conversion from planar to angular PDF
 };
 
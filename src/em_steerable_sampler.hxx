@@ -9,12 +9,18 @@
 #include "spectrum.hxx"
 #include "geom.hxx"
 #include "types.hxx"
+#include "mapped_file.hxx"
+#include "benchmarking.hxx"
 
 #include <list>
 #include <stack>
 #include <array>
 #include <memory>
-#include <time.h>
+#include <random>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <omp.h>
 
 // Environment map sampler based on the paper "Steerable Importance Sampling"
 // from Kartic Subr and Jim Arvo, 2007
@@ -1000,13 +1006,20 @@ public:
 
 public:
 
+    // Vertices are either owned by the storage or they are kept elsewhere (e.g. in a memory-mapped
+    // file) and the storage only references them. Referenced vertices can't be modified.
     class VertexStorage
     {
     public:
 
+        VertexStorage() :
+            mExternalVertices(nullptr),
+            mExternalCount(0u)
+        {}
+
         bool IsEmpty() const
         {
-            return mVertices.empty();
+            return GetCount() == 0u;
         }
 
         void PreAllocate(uint32_t aSize)
@@ -1017,6 +1030,7 @@ public:
         bool AddVertex(const Vertex &aVertex, uint32_t oIndex)
         {
             PG3_ERROR_CODE_NOT_TESTED("");
+            PG3_ASSERT(mExternalVertices == nullptr);
 
             mVertices.push_back(aVertex);
 
@@ -1031,6 +1045,8 @@ public:
 
         bool AddVertex(Vertex &&aVertex, uint32_t &oIndex)
         {
+            PG3_ASSERT(mExternalVertices == nullptr);
+
             mVertices.push_back(aVertex);
 
             if (!mVertices.empty())
@@ -1042,8 +1058,18 @@ public:
                 return false;
         }
 
+        // Makes the storage reference external vertices instead of owning them.
+        // The vertices have to stay valid until Free() is called.
+        void AttachExternal(const Vertex *aVertices, uint32_t aCount)
+        {
+            mVertices.clear();
+            mExternalVertices   = aVertices;
+            mExternalCount      = aCount;
+        }
+
         Vertex *Get(uint32_t aIndex)
         {
+            PG3_ASSERT(mExternalVertices == nullptr);
             PG3_ASSERT(aIndex < static_cast<uint32_t>(mVertices.size()));
 
             if (aIndex < static_cast<uint32_t>(mVertices.size()))
@@ -1054,27 +1080,44 @@ public:
 
         const Vertex *Get(uint32_t aIndex) const
         {
-            PG3_ASSERT(aIndex < static_cast<uint32_t>(mVertices.size()));
+            PG3_ASSERT(aIndex < GetCount());
 
-            if (aIndex < static_cast<uint32_t>(mVertices.size()))
-                return &mVertices[aIndex];
+            if (aIndex < GetCount())
+                return &GetData()[aIndex];
             else
                 return nullptr;
         }
 
+        // All vertices in one contiguous array
+        const Vertex *GetData() const
+        {
+            return (mExternalVertices != nullptr) ? mExternalVertices : mVertices.data();
+        }
+
         uint32_t GetCount() const
         {
-            return static_cast<uint32_t>(mVertices.size());
+            return
+                  (mExternalVertices != nullptr)
+                ? mExternalCount
+                : static_cast<uint32_t>(mVertices.size());
         }
 
         void Free()
         {
             mVertices.clear();
+            mExternalVertices   = nullptr;
+            mExternalCount      = 0u;
         }
 
         bool operator == (const VertexStorage &aStorage) const
         {
-            return mVertices == aStorage.mVertices;
+            const uint32_t count = GetCount();
+            if (count != aStorage.GetCount())
+                return false;
+            for (uint32_t i = 0; i < count; ++i)
+                if (!(GetData()[i] == aStorage.GetData()[i]))
+                    return false;
+            return true;
         }
 
         bool operator != (const VertexStorage &aStorage) const
@@ -1084,6 +1127,8 @@ public:
 
     protected:
         std::vector<Vertex> mVertices;
+        const Vertex       *mExternalVertices;
+        uint32_t            mExternalCount;
     };
 
 
@@ -1200,6 +1245,13 @@ public:
             return (idx < mChildrenCount) ? mChildrenPtrs[idx].get() : nullptr;
         }
 
+        const SteerableBasisValue &GetChildWeight(const size_t idx) const
+        {
+            PG3_ASSERT(idx < mChildrenCount);
+
+            return mChildrenWeights[idx];
+        }
+
     protected:
         // Children - owned by the node
         std::array<SteerableBasisValue, maxChildrenCount>           mChildrenWeights;
@@ -1543,6 +1595,301 @@ public:
     }
 
 
+    // Flat, pointer-free counterpart of TriangleSetNode.
+    // Children are referenced through node references (see FlatTree).
+    struct FlatTriangleSetNode
+    {
+        SteerableBasisValue childrenWeights[MAX_TRIANGLE_SET_CHILDREN];
+        uint32_t            children[MAX_TRIANGLE_SET_CHILDREN];
+        uint32_t            childrenCount;
+        uint32_t            padding;
+    };
+
+
+    // Flat, pointer-free counterpart of TriangleNode
+    struct FlatTriangleNode
+    {
+        uint32_t            vertexIndices[3];
+        uint32_t            subdivLevel;
+    };
+
+
+    // Sampling tree stored in two flat arrays: inner nodes (triangle sets) and leaves (triangles),
+    // both in depth-first order. Nodes reference each other through indices only, so the arrays
+    // can be written to disk and used again directly from a memory-mapped file.
+    //
+    // The arrays are either owned by the tree (tree built in this run) or they are referenced
+    // (e.g. memory-mapped from a cache file).
+    class FlatTree
+    {
+    public:
+
+        // Node references are indices into the set node array or, if marked with this flag,
+        // indices into the triangle node array
+        static const uint32_t kTriangleNodeFlag = 0x80000000u;
+
+        FlatTree() :
+            mSetNodes(nullptr),
+            mTriangleNodes(nullptr),
+            mSetNodeCount(0u),
+            mTriangleNodeCount(0u),
+            mRoot(0u)
+        {}
+
+        // Converts the pointer-based tree into the owned flat representation
+        bool Flatten(const TreeNodeBase *aRoot)
+        {
+            Free();
+
+            if (aRoot == nullptr)
+                return false;
+
+            uint32_t nonTriangleCount = 0u, triangleCount = 0u;
+            CountNodes(aRoot, nonTriangleCount, triangleCount);
+            if (triangleCount >= kTriangleNodeFlag)
+                return false;
+            mOwnedSetNodes.reserve(nonTriangleCount);
+            mOwnedTriangleNodes.reserve(triangleCount);
+
+            mRoot = FlattenNode(aRoot);
+
+            mSetNodes           = mOwnedSetNodes.data();
+            mTriangleNodes      = mOwnedTriangleNodes.data();
+            mSetNodeCount       = static_cast<uint32_t>(mOwnedSetNodes.size());
+            mTriangleNodeCount  = static_cast<uint32_t>(mOwnedTriangleNodes.size());
+
+            return true;
+        }
+
+        // Makes the tree reference external arrays instead of owning them.
+        // The arrays have to stay valid until Free() is called.
+        void AttachExternal(
+            const FlatTriangleSetNode   *aSetNodes,
+            uint32_t                     aSetNodeCount,
+            const FlatTriangleNode      *aTriangleNodes,
+            uint32_t                     aTriangleNodeCount,
+            uint32_t                     aRoot)
+        {
+            Free();
+
+            mSetNodes           = aSetNodes;
+            mSetNodeCount       = aSetNodeCount;
+            mTriangleNodes      = aTriangleNodes;
+            mTriangleNodeCount  = aTriangleNodeCount;
+            mRoot               = aRoot;
+        }
+
+        void Free()
+        {
+            mOwnedSetNodes.clear();
+            mOwnedTriangleNodes.clear();
+
+            mSetNodes           = nullptr;
+            mTriangleNodes      = nullptr;
+            mSetNodeCount       = 0u;
+            mTriangleNodeCount  = 0u;
+            mRoot               = 0u;
+        }
+
+        bool IsEmpty() const
+        {
+            return mTriangleNodeCount == 0u;
+        }
+
+        // Checks that all references point into the arrays, that the vertex indices are valid,
+        // that children follow their parents (no cycles) and that the node counts match.
+        // Used for validating data loaded from disk.
+        bool IsValid(uint32_t aVertexCount) const
+        {
+            if (IsEmpty() || !IsValidNodeRef(mRoot))
+                return false;
+
+            for (uint32_t i = 0; i < mTriangleNodeCount; ++i)
+                for (uint32_t j = 0; j < 3; ++j)
+                    if (mTriangleNodes[i].vertexIndices[j] >= aVertexCount)
+                        return false;
+
+            uint32_t referencedSetNodes = IsTriangleNodeRef(mRoot) ? 0u : 1u;
+            uint32_t referencedTriangles = IsTriangleNodeRef(mRoot) ? 1u : 0u;
+            for (uint32_t i = 0; i < mSetNodeCount; ++i)
+            {
+                const FlatTriangleSetNode &setNode = mSetNodes[i];
+                if ((setNode.childrenCount == 0u)
+                    || (setNode.childrenCount > MAX_TRIANGLE_SET_CHILDREN))
+                    return false;
+                for (uint32_t j = 0; j < setNode.childrenCount; ++j)
+                {
+                    const uint32_t child = setNode.children[j];
+                    if (!IsValidNodeRef(child))
+                        return false;
+                    if (IsTriangleNodeRef(child))
+                        referencedTriangles++;
+                    else if (GetNodeIndex(child) <= i)
+                        return false;
+                    else
+                        referencedSetNodes++;
+                }
+            }
+
+            return (referencedSetNodes  == mSetNodeCount)
+                && (referencedTriangles == mTriangleNodeCount);
+        }
+
+        static bool IsTriangleNodeRef(uint32_t aNodeRef)
+        {
+            return (aNodeRef & kTriangleNodeFlag) != 0u;
+        }
+
+        static uint32_t GetNodeIndex(uint32_t aNodeRef)
+        {
+            return aNodeRef & ~kTriangleNodeFlag;
+        }
+
+        uint32_t GetRoot() const
+        {
+            return mRoot;
+        }
+
+        const FlatTriangleSetNode &GetSetNode(uint32_t aIndex) const
+        {
+            PG3_ASSERT(aIndex < mSetNodeCount);
+
+            return mSetNodes[aIndex];
+        }
+
+        const FlatTriangleNode &GetTriangleNode(uint32_t aIndex) const
+        {
+            PG3_ASSERT(aIndex < mTriangleNodeCount);
+
+            return mTriangleNodes[aIndex];
+        }
+
+        const FlatTriangleSetNode *GetSetNodes() const
+        {
+            return mSetNodes;
+        }
+
+        const FlatTriangleNode *GetTriangleNodes() const
+        {
+            return mTriangleNodes;
+        }
+
+        uint32_t GetSetNodeCount() const
+        {
+            return mSetNodeCount;
+        }
+
+        uint32_t GetTriangleNodeCount() const
+        {
+            return mTriangleNodeCount;
+        }
+
+        bool operator == (const FlatTree &aTree) const
+        {
+            if (   (mSetNodeCount      != aTree.mSetNodeCount)
+                || (mTriangleNodeCount != aTree.mTriangleNodeCount)
+                || (mRoot              != aTree.mRoot))
+                return false;
+
+            for (uint32_t i = 0; i < mSetNodeCount; ++i)
+            {
+                const FlatTriangleSetNode &node1 = mSetNodes[i];
+                const FlatTriangleSetNode &node2 = aTree.mSetNodes[i];
+                if (node1.childrenCount != node2.childrenCount)
+                    return false;
+                for (uint32_t j = 0; j < node1.childrenCount; ++j)
+                    if (   (node1.children[j]        != node2.children[j])
+                        || (node1.childrenWeights[j] != node2.childrenWeights[j]))
+                        return false;
+            }
+
+            for (uint32_t i = 0; i < mTriangleNodeCount; ++i)
+            {
+                const FlatTriangleNode &node1 = mTriangleNodes[i];
+                const FlatTriangleNode &node2 = aTree.mTriangleNodes[i];
+                if (   (node1.vertexIndices[0] != node2.vertexIndices[0])
+                    || (node1.vertexIndices[1] != node2.vertexIndices[1])
+                    || (node1.vertexIndices[2] != node2.vertexIndices[2])
+                    || (node1.subdivLevel      != node2.subdivLevel))
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool operator != (const FlatTree &aTree) const
+        {
+            return !(*this == aTree);
+        }
+
+    protected:
+
+        bool IsValidNodeRef(uint32_t aNodeRef) const
+        {
+            return IsTriangleNodeRef(aNodeRef)
+                ? (GetNodeIndex(aNodeRef) < mTriangleNodeCount)
+                : (GetNodeIndex(aNodeRef) < mSetNodeCount);
+        }
+
+        uint32_t FlattenNode(const TreeNodeBase *aNode)
+        {
+            if (aNode->IsTriangleNode())
+            {
+                const TriangleNode *triangle = static_cast<const TriangleNode*>(aNode);
+
+                FlatTriangleNode flatTriangle;
+                flatTriangle.vertexIndices[0]   = triangle->vertexIndices[0];
+                flatTriangle.vertexIndices[1]   = triangle->vertexIndices[1];
+                flatTriangle.vertexIndices[2]   = triangle->vertexIndices[2];
+                flatTriangle.subdivLevel        = triangle->subdivLevel;
+                mOwnedTriangleNodes.push_back(flatTriangle);
+
+                return kTriangleNodeFlag | static_cast<uint32_t>(mOwnedTriangleNodes.size() - 1u);
+            }
+            else
+            {
+                const TriangleSetNode *triangleSet = static_cast<const TriangleSetNode*>(aNode);
+
+                // Reserve the slot first to keep the parent in front of its children
+                const uint32_t setIndex = static_cast<uint32_t>(mOwnedSetNodes.size());
+                mOwnedSetNodes.emplace_back();
+
+                FlatTriangleSetNode flatSet;
+                flatSet.childrenCount   = static_cast<uint32_t>(triangleSet->GetChildrenCount());
+                flatSet.padding         = 0u;
+                for (uint32_t i = 0; i < MAX_TRIANGLE_SET_CHILDREN; ++i)
+                {
+                    if (i < flatSet.childrenCount)
+                    {
+                        flatSet.childrenWeights[i]  = triangleSet->GetChildWeight(i);
+                        flatSet.children[i]         = FlattenNode(triangleSet->GetChild(i));
+                    }
+                    else
+                    {
+                        flatSet.childrenWeights[i]  = SteerableBasisValue(0.f);
+                        flatSet.children[i]         = 0u;
+                    }
+                }
+                mOwnedSetNodes[setIndex] = flatSet;
+
+                return setIndex;
+            }
+        }
+
+    protected:
+
+        const FlatTriangleSetNode          *mSetNodes;
+        const FlatTriangleNode             *mTriangleNodes;
+        uint32_t                            mSetNodeCount;
+        uint32_t                            mTriangleNodeCount;
+        uint32_t                            mRoot;
+
+        // Used only when the tree owns its data
+        std::vector<FlatTriangleSetNode>    mOwnedSetNodes;
+        std::vector<FlatTriangleNode>       mOwnedTriangleNodes;
+    };
+
+
 protected:
 
     // Builds the internal structures needed for sampling
@@ -1558,7 +1905,12 @@ protected:
         if (!TriangulateEm(tmpTriangles, mVertexStorage, *mEmImage, mParams))
             return false;
 
-        if (!BuildTriangleTree(tmpTriangles, mVertexStorage, mTreeRoot))
+        std::unique_ptr<TreeNodeBase> treeRoot;
+        if (!BuildTriangleTree(tmpTriangles, mVertexStorage, treeRoot))
+            return false;
+
+        // Sampling uses the flat representation only
+        if (!mTree.Flatten(treeRoot.get()))
             return false;
 
         return true;
@@ -1567,7 +1919,7 @@ protected:
 
     bool IsBuilt() const
     {
-        return mEmImage && (mTreeRoot.get() != nullptr) && (!mVertexStorage.IsEmpty());
+        return mEmImage && (!mTree.IsEmpty()) && (!mVertexStorage.IsEmpty());
     }
 
 
@@ -1615,6 +1967,10 @@ protected:
 
         ossPath << (aEmImage.IsUsingBilinearFiltering() ? "bi" : "nn");
 
+        // Half-precision texels change the luminance the tree is built from
+        if (aEmImage.GetStorageFormat().precision == EmTexelPrecision::kHalf)
+            ossPath << "_half";
+
         ossPath << "_e";
         ossPath << std::fixed << std::setprecision(2) << aParams.GetMaxApproxError();
 
@@ -1647,366 +2003,380 @@ protected:
 
     static const char * SaveLoadFileVersion()
     {
-        return "2.1";
-    }
-
-    static const char * SaveLoadFileHeader()
-    {
-        return "Environment Map Steerable Sampler Data, format ver. 2.1\n";
+        return "5.0";
     }
 
 
-    static bool SaveToDisk_HeaderAndParams(
-        std::ofstream                   &aOfs,
-        const BuildParameters           &aParams,
-        const bool                       aUseDebugSave)
+    // The cache file is a header followed by the vertex, set node and triangle node arrays in
+    // their in-memory form. Each array starts at an offset aligned to kCacheFileAlignment.
+    // The file is used directly through memory mapping, no data is converted or copied.
+    // The cache file path is derived from the EM file path and the data is validated against
+    // the EM file size and last write time (100 ns resolution). The EM content hash is only
+    // computed when these don't match (e.g. a copied or touched file; the stamp is refreshed
+    // then) or when the EM file can't be queried.
+    struct CacheFileHeader
     {
-        // Header
-        Utils::IO::WriteStringToStream(aOfs, SaveLoadFileHeader(), aUseDebugSave);
+        char        magic[8];
+        uint64_t    fileSize;
+        uint64_t    emContentHash;
+        uint64_t    emFileSize;
+        uint64_t    emFileWriteTime;
+        uint64_t    vertexOffset;
+        uint64_t    setNodeOffset;
+        uint64_t    triangleNodeOffset;
+
+        // Format and data layout
+        uint32_t    version;
+        uint32_t    byteOrderMark;
+        uint32_t    headerSize;
+        uint32_t    vertexSize;
+        uint32_t    setNodeSize;
+        uint32_t    triangleNodeSize;
 
         // Build parameters
-        Utils::IO::WriteVariableToStream(aOfs, aParams.GetMaxApproxError(),             aUseDebugSave);
-        Utils::IO::WriteVariableToStream(aOfs, aParams.GetMinSubdivLevel(),             aUseDebugSave);
-        Utils::IO::WriteVariableToStream(aOfs, aParams.GetMaxSubdivLevel(),             aUseDebugSave);
-        Utils::IO::WriteVariableToStream(aOfs, aParams.GetMaxTriangleSamplesPerDimDbg(),aUseDebugSave);
-        Utils::IO::WriteVariableToStream(aOfs, aParams.GetMaxTriangleSpanDbg(),         aUseDebugSave);
-        Utils::IO::WriteVariableToStream(aOfs, aParams.GetOversamplingFactorDbg(),      aUseDebugSave);
-        Utils::IO::WriteVariableToStream(aOfs, uint32_t(MAX_TRIANGLE_SET_CHILDREN),     aUseDebugSave);
-
-        return true;
-    }
+        float       maxApproxError;
+        uint32_t    minSubdivLevel;
+        uint32_t    maxSubdivLevel;
+        uint32_t    maxTriangleSamplesPerDimDbg;
+        float       maxTriangleSpanDbg;
+        float       oversamplingFactorDbg;
+        uint32_t    maxTriangleSetChildren;
+
+        // Environment map
+        uint32_t    emWidth;
+        uint32_t    emHeight;
+        uint32_t    emBilinearFiltering;
+        uint32_t    emHalfPrecision;
+        uint32_t    emFileStampValid;
+
+        // Data
+        uint32_t    vertexCount;
+        uint32_t    setNodeCount;
+        uint32_t    triangleNodeCount;
+        uint32_t    rootNode;
+    };
 
+    static const uint32_t kCacheFileVersion     = 0x00050000u; // 5.0
+    static const uint32_t kCacheFileByteOrder   = 0x01020304u;
+    static const uint64_t kCacheFileAlignment   = 64u;
 
-    static bool SaveToDisk_Vertices(
-        std::ofstream                   &aOfs,
-        const VertexStorage             &aVertexStorage,
-        const bool                       aUseDebugSave)
+    static const char * CacheFileMagic()
     {
-        // Count
-        const uint32_t count = aVertexStorage.GetCount();
-        Utils::IO::WriteVariableToStream(aOfs, count, aUseDebugSave);
+        return "PG3EMSS"; // including the trailing zero it fills the magic field
+    }
 
-        // List of vertices
-        for (uint32_t vertexIndex = 0u; vertexIndex < count; ++vertexIndex)
-        {
-            const Vertex *vertex = aVertexStorage.Get(vertexIndex);
-            Utils::IO::WriteVariableToStream(aOfs, vertex->dir, aUseDebugSave);
-            Utils::IO::WriteVariableToStream(aOfs, vertex->weight, aUseDebugSave);
-        }
 
-        return true;
+    // Fills the header part which describes the format, the build parameters and
+    // the environment map. The counts and offsets are left zero. The EM content hash is
+    // computed only if requested, otherwise it is left zero.
+    static void FillCacheFileHeader(
+        CacheFileHeader                 &oHeader,
+        const EnvironmentMapImage       &aEmImage,
+        const BuildParameters           &aParams,
+        bool                             aComputeContentHash)
+    {
+        oHeader = CacheFileHeader();
+
+        std::memcpy(oHeader.magic, CacheFileMagic(), sizeof(oHeader.magic));
+
+        oHeader.version                     = kCacheFileVersion;
+        oHeader.byteOrderMark               = kCacheFileByteOrder;
+        oHeader.headerSize                  = sizeof(CacheFileHeader);
+        oHeader.vertexSize                  = sizeof(Vertex);
+        oHeader.setNodeSize                 = sizeof(FlatTriangleSetNode);
+        oHeader.triangleNodeSize            = sizeof(FlatTriangleNode);
+
+        oHeader.maxApproxError              = aParams.GetMaxApproxError();
+        oHeader.minSubdivLevel              = aParams.GetMinSubdivLevel();
+        oHeader.maxSubdivLevel              = aParams.GetMaxSubdivLevel();
+        oHeader.maxTriangleSamplesPerDimDbg = aParams.GetMaxTriangleSamplesPerDimDbg();
+        oHeader.maxTriangleSpanDbg          = aParams.GetMaxTriangleSpanDbg();
+        oHeader.oversamplingFactorDbg       = aParams.GetOversamplingFactorDbg();
+        oHeader.maxTriangleSetChildren      = MAX_TRIANGLE_SET_CHILDREN;
+
+        oHeader.emWidth                     = aEmImage.Width();
+        oHeader.emHeight                    = aEmImage.Height();
+        oHeader.emBilinearFiltering         = aEmImage.IsUsingBilinearFiltering() ? 1u : 0u;
+        oHeader.emHalfPrecision             =
+            (aEmImage.GetStorageFormat().precision == EmTexelPrecision::kHalf) ? 1u : 0u;
+        oHeader.emFileStampValid            =
+            MappedFile::GetFileStamp(
+                aEmImage.Filename().c_str(), oHeader.emFileSize, oHeader.emFileWriteTime) ? 1u : 0u;
+        if (aComputeContentHash)
+            oHeader.emContentHash           = aEmImage.ComputeContentHash();
     }
 
 
-    static bool SaveToDisk_TreeNode(
-        std::ofstream                   &aOfs,
-        const TreeNodeBase              *aNode,
-        const bool                       aUseDebugSave)
+    // Checks whether the loaded header describes data built by this code version
+    // with the given parameters from an environment map of the same size, filtering and
+    // precision. The environment map content is checked separately (IsCacheFileStampCurrent).
+    static bool IsCacheFileHeaderCompatible(
+        const CacheFileHeader           &aHeader,
+        const CacheFileHeader           &aExpected)
     {
-        if (aNode == nullptr)
-            return false;
-
-        Utils::IO::WriteVariableToStream(aOfs, aNode->IsTriangleNode(), aUseDebugSave);
+        return (std::memcmp(aHeader.magic, aExpected.magic, sizeof(aHeader.magic)) == 0)
+            && (aHeader.version                     == aExpected.version)
+            && (aHeader.byteOrderMark               == aExpected.byteOrderMark)
+            && (aHeader.headerSize                  == aExpected.headerSize)
+            && (aHeader.vertexSize                  == aExpected.vertexSize)
+            && (aHeader.setNodeSize                 == aExpected.setNodeSize)
+            && (aHeader.triangleNodeSize            == aExpected.triangleNodeSize)
+            && (aHeader.maxApproxError              == aExpected.maxApproxError)
+            && (aHeader.minSubdivLevel              == aExpected.minSubdivLevel)
+            && (aHeader.maxSubdivLevel              == aExpected.maxSubdivLevel)
+            && (aHeader.maxTriangleSamplesPerDimDbg == aExpected.maxTriangleSamplesPerDimDbg)
+            && (aHeader.maxTriangleSpanDbg          == aExpected.maxTriangleSpanDbg)
+            && (aHeader.oversamplingFactorDbg       == aExpected.oversamplingFactorDbg)
+            && (aHeader.maxTriangleSetChildren      == aExpected.maxTriangleSetChildren)
+            && (aHeader.emWidth                     == aExpected.emWidth)
+            && (aHeader.emHeight                    == aExpected.emHeight)
+            && (aHeader.emBilinearFiltering         == aExpected.emBilinearFiltering)
+            && (aHeader.emHalfPrecision             == aExpected.emHalfPrecision);
+    }
 
-        if (!aNode->IsTriangleNode())
-        {
-            const TriangleSetNode *triangleSetNode = static_cast<const TriangleSetNode*>(aNode);
-            const uint32_t childCount = (uint32_t)triangleSetNode->GetChildrenCount();
-            Utils::IO::WriteVariableToStream(aOfs, childCount, aUseDebugSave);
-            for (size_t i = 0; i < childCount; ++i)
-                SaveToDisk_TreeNode(aOfs, triangleSetNode->GetChild(i), aUseDebugSave);
-        }
-        else
-        {
-            const TriangleNode *triangleNode = static_cast<const TriangleNode*>(aNode);
-            Utils::IO::WriteVariableToStream(aOfs, triangleNode->subdivLevel, aUseDebugSave);
-            Utils::IO::WriteVariableToStream(aOfs, triangleNode->vertexIndices, aUseDebugSave);
-        }
 
-        return true;
+    // If the EM file size and last write time match the stored ones, the EM file is assumed
+    // to be unchanged. Otherwise the (slow to compute) content hash has to be compared.
+    static bool IsCacheFileStampCurrent(
+        const CacheFileHeader           &aHeader,
+        const CacheFileHeader           &aExpected)
+    {
+        return (aHeader.emFileStampValid != 0u)
+            && (aExpected.emFileStampValid != 0u)
+            && (aHeader.emFileSize       == aExpected.emFileSize)
+            && (aHeader.emFileWriteTime  == aExpected.emFileWriteTime);
     }
 
-        
-    static bool SaveToDisk_Tree(
-        std::ofstream                   &aOfs,
-        const TreeNodeBase              *aTreeRoot,
-        const bool                       aUseDebugSave)
+
+    // Overwrites the EM file stamp stored in the cache file header. The file must not be mapped.
+    static bool WriteCacheFileStamp(
+        const std::string               &aPath,
+        const CacheFileHeader           &aExpected)
     {
-        // Counts
-        uint32_t nonTriangleCount = 0u, triangleCount = 0u;
-        CountNodes(aTreeRoot, nonTriangleCount, triangleCount);
-        Utils::IO::WriteVariableToStream(aOfs, nonTriangleCount, aUseDebugSave);
-        Utils::IO::WriteVariableToStream(aOfs,    triangleCount, aUseDebugSave);
+        std::fstream fs(aPath, std::ios::in | std::ios::out | std::ios::binary);
+        CacheFileHeader header;
+        if (!fs.read(reinterpret_cast<char*>(&header), sizeof(header)))
+            return false;
 
-        // Nodes
-        SaveToDisk_TreeNode(aOfs, aTreeRoot, aUseDebugSave);
+        header.emFileSize       = aExpected.emFileSize;
+        header.emFileWriteTime  = aExpected.emFileWriteTime;
+        header.emFileStampValid = aExpected.emFileStampValid;
 
-        return true;
+        fs.seekp(0);
+        return !fs.write(reinterpret_cast<const char*>(&header), sizeof(header)).fail();
     }
 
 
-    // Save internal structures needed for sampling to disk
-    static bool SaveToDisk(
-        const VertexStorage             &aVertexStorage,
-        const TreeNodeBase              *aTreeRoot,
-        const EnvironmentMapImage       &aEmImage,
-        const BuildParameters           &aParams,
-        const bool                       aUseDebugSave = false)
+    // Maps the cache file and checks its header. The header points into the mapped data.
+    static bool MapCacheFile(
+        MappedFile                      &oFile,
+        const CacheFileHeader          *&oHeader,
+        const std::string               &aPath,
+        const CacheFileHeader           &aExpected)
     {
-        // Is tree built?
-        if ((aTreeRoot == nullptr) || aVertexStorage.IsEmpty())
+        if (!oFile.Open(aPath.c_str()))
             return false;
-
-        // Open file
-        std::string savePath;
-        if (!GenerateSaveFilePath(savePath, aEmImage, aParams))
-            return false;
-        std::ofstream ofs(savePath, std::ios::binary | std::ios::trunc);
-        if (ofs.fail())
-            return false;
-        if (!ofs.is_open())
-            return false;
-
-        // Header and Params
-        if (!SaveToDisk_HeaderAndParams(ofs, aParams, aUseDebugSave))
-            return false;
-
-        // Vertices
-        if (!SaveToDisk_Vertices(ofs, aVertexStorage, aUseDebugSave))
+        if (oFile.GetSize() < sizeof(CacheFileHeader))
             return false;
 
-        // Tree
-        if (!SaveToDisk_Tree(ofs, aTreeRoot, aUseDebugSave))
-            return false;
+        oHeader = reinterpret_cast<const CacheFileHeader*>(oFile.GetData());
 
-        return true;
+        return IsCacheFileHeaderCompatible(*oHeader, aExpected)
+            && (oHeader->fileSize == oFile.GetSize()); // not truncated or corrupted
     }
 
 
-    // Save internal structures needed for sampling to disk
-    bool SaveToDisk() const
+    static uint64_t AlignCacheFileOffset(uint64_t aOffset)
     {
-        if (!IsBuilt())
-            return false;
-
-        return SaveToDisk(mVertexStorage, mTreeRoot.get(), *mEmImage, mParams);
+        return (aOffset + kCacheFileAlignment - 1u) & ~(kCacheFileAlignment - 1u);
     }
 
 
-    static bool LoadFromDisk_HeaderAndParams(
-        std::ifstream                   &aIfs,
-        const BuildParameters           &aParams)
+    // Writes a block of data at the given file offset, pads the gap before it with zeros
+    static bool WriteCacheFileBlock(
+        std::ofstream                   &aOfs,
+        uint64_t                        &aCurrentOffset,
+        const uint64_t                   aOffset,
+        const void                      *aData,
+        const uint64_t                   aSize)
     {
-        // Header
-        const char *header = SaveLoadFileHeader();
-        const size_t buffSize = strlen(header) + 1; // with trailing zero
-        std::unique_ptr<char> buff(new char[buffSize]);
-        if (!Utils::IO::LoadStringFromStream(aIfs, buff.get(), buffSize))
-            return false;
-        if (strcmp(header, buff.get()) != 0)
-            return false; // Wrong header
+        PG3_ASSERT(aCurrentOffset <= aOffset);
 
-        // Build parameters
+        static const char zeros[kCacheFileAlignment] = {};
+        while (aCurrentOffset < aOffset)
+        {
+            const uint64_t padding =
+                std::min<uint64_t>(aOffset - aCurrentOffset, uint64_t(kCacheFileAlignment));
+            aOfs.write(zeros, static_cast<std::streamsize>(padding));
+            aCurrentOffset += padding;
+        }
 
-        float maxApproxError;
-        uint32_t minSubdivLevel;
-        uint32_t maxSubdivLevel;
-        uint32_t maxTriangleSamplesPerDimDbg;
-        float maxTriangleSpanDbg;
-        float oversamplingFactorDbg;
-        uint32_t maxTriangleSetChildren;
+        if (aSize > 0u)
+            aOfs.write(reinterpret_cast<const char*>(aData), static_cast<std::streamsize>(aSize));
+        aCurrentOffset += aSize;
 
-        if (!Utils::IO::LoadVariableFromStream(aIfs, maxApproxError))
-            return false;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, minSubdivLevel))
-            return false;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, maxSubdivLevel))
-            return false;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, maxTriangleSamplesPerDimDbg))
-            return false;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, maxTriangleSpanDbg))
-            return false;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, oversamplingFactorDbg))
-            return false;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, maxTriangleSetChildren))
-            return false;
-
-        if (maxApproxError != aParams.GetMaxApproxError())
-            return false;
-        if (minSubdivLevel != aParams.GetMinSubdivLevel())
-            return false;
-        if (maxSubdivLevel != aParams.GetMaxSubdivLevel())
-            return false;
-        if (maxTriangleSamplesPerDimDbg != aParams.GetMaxTriangleSamplesPerDimDbg())
-            return false;
-        if (maxTriangleSpanDbg != aParams.GetMaxTriangleSpanDbg())
-            return false;
-        if (oversamplingFactorDbg != aParams.GetOversamplingFactorDbg())
-            return false;
-        if (maxTriangleSetChildren != MAX_TRIANGLE_SET_CHILDREN)
-            return false;
-
-        return true;
+        return !aOfs.fail();
     }
 
 
-    static bool LoadFromDisk_Vertices(
-        std::ifstream                   &aIfs,
-        VertexStorage                   &aVertexStorage)
+    // Save internal structures needed for sampling to disk
+    static bool SaveToDisk(
+        const VertexStorage             &aVertexStorage,
+        const FlatTree                  &aTree,
+        const EnvironmentMapImage       &aEmImage,
+        const BuildParameters           &aParams)
     {
-        // Count
-        uint32_t count;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, count))
+        // Is tree built?
+        if (aTree.IsEmpty() || aVertexStorage.IsEmpty())
             return false;
-        aVertexStorage.PreAllocate(count); // TODO: count check and/or exception handling?
 
-        // List of vertices
-        for (uint32_t vertexIndex = 0u; vertexIndex < count; ++vertexIndex)
-        {
-            Vec3f dir;
-            SteerableBasisValue weight;
-            if (!Utils::IO::LoadVariableFromStream(aIfs, dir))
-                return false;
-            if (!Utils::IO::LoadVariableFromStream(aIfs, weight))
-                return false;
-            aVertexStorage.AddVertex(Vertex(dir, weight), vertexIndex);
-        }
+        std::string savePath;
+        if (!GenerateSaveFilePath(savePath, aEmImage, aParams))
+            return false;
 
-        return true;
-    }
+        // Layout
+        CacheFileHeader header;
+        FillCacheFileHeader(header, aEmImage, aParams, true);
+        header.vertexCount          = aVertexStorage.GetCount();
+        header.setNodeCount         = aTree.GetSetNodeCount();
+        header.triangleNodeCount    = aTree.GetTriangleNodeCount();
+        header.rootNode             = aTree.GetRoot();
 
+        const uint64_t vertexDataSize       = uint64_t(header.vertexCount)       * sizeof(Vertex);
+        const uint64_t setNodeDataSize      = uint64_t(header.setNodeCount)      * sizeof(FlatTriangleSetNode);
+        const uint64_t triangleNodeDataSize = uint64_t(header.triangleNodeCount) * sizeof(FlatTriangleNode);
 
-    static bool LoadFromDisk_TreeNode(
-        std::ifstream                   &aIfs,
-        VertexStorage                   &aVertexStorage,
-        std::unique_ptr<TreeNodeBase>   &oNode)
-    {
-        bool isTriangleNode;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, isTriangleNode))
-            return false;
+        header.vertexOffset         = AlignCacheFileOffset(sizeof(CacheFileHeader));
+        header.setNodeOffset        = AlignCacheFileOffset(header.vertexOffset  + vertexDataSize);
+        header.triangleNodeOffset   = AlignCacheFileOffset(header.setNodeOffset + setNodeDataSize);
+        header.fileSize             = header.triangleNodeOffset + triangleNodeDataSize;
 
-        if (!isTriangleNode)
+        // Write into a temporary file which is renamed when complete, so that other processes
+        // never map a partially written file
+        std::ostringstream ossTmpPath;
+        ossTmpPath << savePath << ".tmp" << std::random_device()();
+        const std::string tmpPath = ossTmpPath.str();
         {
-            uint32_t childCount;
-            if (!Utils::IO::LoadVariableFromStream(aIfs, childCount))
+            std::ofstream ofs(tmpPath, std::ios::binary | std::ios::trunc);
+            if (ofs.fail() || !ofs.is_open())
                 return false;
 
-            PG3_ASSERT(childCount <= MAX_TRIANGLE_SET_CHILDREN);
-
-            std::list<TreeNodeBase*> nodes;
-            for (size_t i = 0; i < childCount; ++i)
+            uint64_t offset = 0u;
+            const bool written =
+                   WriteCacheFileBlock(ofs, offset, 0u, &header, sizeof(CacheFileHeader))
+                && WriteCacheFileBlock(ofs, offset, header.vertexOffset,
+                                       aVertexStorage.GetData(), vertexDataSize)
+                && WriteCacheFileBlock(ofs, offset, header.setNodeOffset,
+                                       aTree.GetSetNodes(), setNodeDataSize)
+                && WriteCacheFileBlock(ofs, offset, header.triangleNodeOffset,
+                                       aTree.GetTriangleNodes(), triangleNodeDataSize);
+            ofs.close();
+
+            if (!written || ofs.fail())
             {
-                std::unique_ptr<TreeNodeBase> child;
-                if (!LoadFromDisk_TreeNode(aIfs, aVertexStorage, child))
-                    return false;
-                nodes.push_back(child.release());
+                std::remove(tmpPath.c_str());
+                return false;
             }
-
-            oNode.reset(new TriangleSetNode(nodes, aVertexStorage));
         }
-        else
-        {
-            uint32_t subdivLevel;
-            uint32_t vertexIndices[3];
-            if (!Utils::IO::LoadVariableFromStream(aIfs, subdivLevel))
-                return false;
-            if (!Utils::IO::LoadVariableFromStream(aIfs, vertexIndices))
-                return false;
-
-            if (   (aVertexStorage.Get(vertexIndices[0]) == nullptr)
-                || (aVertexStorage.Get(vertexIndices[1]) == nullptr)
-                || (aVertexStorage.Get(vertexIndices[2]) == nullptr))
-                return false;
 
-            oNode.reset(
-                new TriangleNode(
-                    vertexIndices[0],
-                    vertexIndices[1],
-                    vertexIndices[2],
-                    0, // Ignoring index - it is used only for debugging triangle sub-division
-                    subdivLevel));
+        // An outdated or corrupted file may be in the way. It is replaced in one step, so there
+        // is no moment when the cache file is missing.
+        if (!MappedFile::RenameReplacing(tmpPath.c_str(), savePath.c_str()))
+        {
+            std::remove(tmpPath.c_str());
+            return false;
         }
 
         return true;
     }
 
 
-    static bool LoadFromDisk_Tree(
-        std::ifstream                   &aIfs,
-        VertexStorage                   &aVertexStorage,
-        std::unique_ptr<TreeNodeBase>   &aTreeRoot)
+    // Save internal structures needed for sampling to disk
+    bool SaveToDisk() const
     {
-        // TODO: Pre-allocate nodes (nodes storage/tree wrapper?) with count check and/or exception handling?
-
-        // Counts
-        uint32_t nonTriangleCount, triangleCount;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, nonTriangleCount))
-            return false;
-        if (!Utils::IO::LoadVariableFromStream(aIfs, triangleCount))
-            return false;
-
-        // Nodes
-        if (!LoadFromDisk_TreeNode(aIfs, aVertexStorage, aTreeRoot))
-            return false;
-
-        // Sanity check: node counts
-        uint32_t treeNonTriangleCount = 0u, treeTriangleCount = 0u;
-        CountNodes(aTreeRoot.get(), treeNonTriangleCount, treeTriangleCount);
-        if ((nonTriangleCount != treeNonTriangleCount) || (triangleCount != treeTriangleCount))
+        if (!IsBuilt())
             return false;
 
-        return true;
+        return SaveToDisk(mVertexStorage, mTree, *mEmImage, mParams);
     }
 
 
-    // Loads pre-built internal structures needed for sampling
+    // Maps pre-built internal structures needed for sampling from disk. The vertex storage and
+    // the tree reference the mapped data, so the file has to stay open while they are used.
     static bool LoadFromDisk(
-        VertexStorage                   &aVertexStorage,
-        std::unique_ptr<TreeNodeBase>   &aTreeRoot,
+        MappedFile                      &oFile,
+        VertexStorage                   &oVertexStorage,
+        FlatTree                        &oTree,
         const EnvironmentMapImage       &aEmImage,
         const BuildParameters           &aParams)
     {
         // Clean-up data structures
-        aTreeRoot.reset(nullptr);
-        aVertexStorage.Free();
+        oTree.Free();
+        oVertexStorage.Free();
+        oFile.Close();
 
         // Open file
         std::string savePath;
         if (!GenerateSaveFilePath(savePath, aEmImage, aParams))
             return false;
-        std::ifstream ifs(savePath, std::ios::binary);
-        if (ifs.fail())
-            return false;
-        if (!ifs.is_open())
+        CacheFileHeader expectedHeader;
+        FillCacheFileHeader(expectedHeader, aEmImage, aParams, false);
+        const CacheFileHeader *loadedHeader = nullptr;
+        if (!MapCacheFile(oFile, loadedHeader, savePath, expectedHeader))
             return false;
 
-        // Header
-        if (!LoadFromDisk_HeaderAndParams(ifs, aParams))
-            return false;
+        if (!IsCacheFileStampCurrent(*loadedHeader, expectedHeader))
+        {
+            // The EM file was copied, touched or it can't be queried: compare its content
+            if (loadedHeader->emContentHash != aEmImage.ComputeContentHash())
+                return false;
 
-        // Vertices
-        if (!LoadFromDisk_Vertices(ifs, aVertexStorage))
-            return false;
+            // Same content. Refresh the stamp, so that the next runs don't need to hash the EM;
+            // the file can't be written while mapped. Failing to do so is not an error.
+            if (expectedHeader.emFileStampValid != 0u)
+            {
+                oFile.Close();
+                WriteCacheFileStamp(savePath, expectedHeader);
+                if (!MapCacheFile(oFile, loadedHeader, savePath, expectedHeader))
+                    return false;
+            }
+        }
 
-        // Tree
-        if (!LoadFromDisk_Tree(ifs, aVertexStorage, aTreeRoot))
-            return false;
+        const uint8_t *data     = oFile.GetData();
+        const uint64_t dataSize = oFile.GetSize();
+        const CacheFileHeader &header = *loadedHeader;
 
-        // Sanity tests on stream
+        // Arrays must be aligned and fit into the file
+        auto isValidBlock = [&](uint64_t aOffset, uint64_t aCount, uint64_t aItemSize)
         {
-            if (ifs.bad())
-                return false;
+            return ((aOffset % kCacheFileAlignment) == 0u)
+                && (aOffset >= sizeof(CacheFileHeader))
+                && (aOffset <= dataSize)
+                && (aCount <= (dataSize - aOffset) / aItemSize);
+        };
+        if (   !isValidBlock(header.vertexOffset,       header.vertexCount,       sizeof(Vertex))
+            || !isValidBlock(header.setNodeOffset,      header.setNodeCount,      sizeof(FlatTriangleSetNode))
+            || !isValidBlock(header.triangleNodeOffset, header.triangleNodeCount, sizeof(FlatTriangleNode)))
+            return false;
 
-            // Did we reach the end of file just now?
-            // ...we need to try read something to find out
-            char dummy;
-            ifs >> dummy;
-            if (!ifs.eof())
-                return false;
-        }
+        // Use the data in place
+        oVertexStorage.AttachExternal(
+            reinterpret_cast<const Vertex*>(data + header.vertexOffset),
+            header.vertexCount);
+        oTree.AttachExternal(
+            reinterpret_cast<const FlatTriangleSetNode*>(data + header.setNodeOffset),
+            header.setNodeCount,
+            reinterpret_cast<const FlatTriangleNode*>(data + header.triangleNodeOffset),
+            header.triangleNodeCount,
+            header.rootNode);
 
-        // TODO: Possible sanity checks:
-        // magic numbers padding, numbers validity, usage of all vertices, spherical coverage, ...
+        // Sanity check
+        if (!oTree.IsValid(oVertexStorage.GetCount()))
+        {
+            oTree.Free();
+            oVertexStorage.Free();
+            return false;
+        }
 
         return true;
     }
@@ -2020,7 +2390,7 @@ protected:
         if (!mEmImage)
             return false;
 
-        if (!LoadFromDisk(mVertexStorage, mTreeRoot, *mEmImage, mParams))
+        if (!LoadFromDisk(mCacheFile, mVertexStorage, mTree, *mEmImage, mParams))
         {
             ReleaseSamplingData();
             return false;
@@ -2029,29 +2399,16 @@ protected:
             return true;
     }
 
-    template <typename Worker>
-    static bool ForEachTriangleImpl(const TreeNodeBase *aNode, Worker worker)
-    {
-        if (aNode == nullptr)
-            return false;
-
-        if (!aNode->IsTriangleNode())
-        {
-            auto triangleSet = static_cast<const TriangleSetNode*>(aNode);
-
-            const size_t childCount = triangleSet->GetChildrenCount();
-            for (size_t i = 0; i < childCount; ++i)
-                if (!ForEachTriangleImpl(triangleSet->GetChild(i), worker))
-                    return false;
-        }
-        else
-        {
-            auto triangle = static_cast<const TriangleNode*>(aNode);
-            if (!worker(triangle))
-                return false;
-        }
 
-        return true;
+    TriangleNode GetTriangle(uint32_t aTriangleIndex) const
+    {
+        const FlatTriangleNode &triangle = mTree.GetTriangleNode(aTriangleIndex);
+        return TriangleNode(
+            triangle.vertexIndices[0],
+            triangle.vertexIndices[1],
+            triangle.vertexIndices[2],
+            0, // Ignoring index - it is used only for debugging triangle sub-division
+            triangle.subdivLevel);
     }
 
 
@@ -2178,14 +2535,14 @@ public:
         PG3_ASSERT_FLOAT_IN_RANGE(sample.y, 0.0f, 1.0f);
 
         // Pick a triangle (descend the tree)
-        const TriangleNode *triangle = nullptr;
-        PickTriangle(triangle, aClampedCosCoeffs, sample.x);
-        if (triangle == nullptr)
+        uint32_t triangleIndex;
+        if (!PickTriangle(triangleIndex, aClampedCosCoeffs, sample.x))
             return false;
 
         // Sample triangle surface (linear approximation)
         float sampleValue = 0.f;
-        if (!SampleTriangleSurface(oDirGlobal, sampleValue, *triangle, aClampedCosCoeffs, sample))
+        const TriangleNode triangle = GetTriangle(triangleIndex);
+        if (!SampleTriangleSurface(oDirGlobal, sampleValue, triangle, aClampedCosCoeffs, sample))
             return false;
 
         // PDF can be computed efficiently...
@@ -2360,8 +2717,9 @@ public:
     // Releases the data structures used for sampling
     void ReleaseSamplingData()
     {
-        mTreeRoot.reset(nullptr);
+        mTree.Free();
         mVertexStorage.Free();
+        mCacheFile.Close(); // after releasing the structures which might reference it
     }
 
 
@@ -2418,45 +2776,48 @@ protected:
         if (!IsBuilt())
             return 0.f;
 
-        //return mTreeRoot->ComputeIntegral(aClampedCosCoeffs);
-        if (mTreeRoot->IsTriangleNode())
+        const uint32_t root = mTree.GetRoot();
+        if (FlatTree::IsTriangleNodeRef(root))
         {
-            const auto triangle = static_cast<const TriangleNode*>(mTreeRoot.get());
-            return triangle->ComputeIntegral(mVertexStorage, aClampedCosCoeffs);
+            const TriangleNode triangle = GetTriangle(FlatTree::GetNodeIndex(root));
+            return triangle.ComputeIntegral(mVertexStorage, aClampedCosCoeffs);
         }
         else
         {
-            const auto set = static_cast<const TriangleSetNode*>(mTreeRoot.get());
-            return set->ComputeIntegral(aClampedCosCoeffs);
+            const FlatTriangleSetNode &set = mTree.GetSetNode(FlatTree::GetNodeIndex(root));
+            SteerableBasisValue weight(0.f);
+            for (uint32_t i = 0; i < set.childrenCount; ++i)
+                weight += set.childrenWeights[i];
+            return Dot(weight, aClampedCosCoeffs);
         }
     }
 
 
+    // Calls worker(triangleIndex, triangle) for all triangles in the depth-first order
     template <typename Worker>
     bool ForEachTriangle(Worker worker) const
     {
         if (!IsBuilt())
             return false;
 
-        return ForEachTriangleImpl(mTreeRoot.get(), worker);
+        const uint32_t triangleCount = mTree.GetTriangleNodeCount();
+        for (uint32_t i = 0; i < triangleCount; ++i)
+        {
+            const TriangleNode triangle = GetTriangle(i);
+            if (!worker(i, triangle))
+                return false;
+        }
+
+        return true;
     }
 
 
     size_t GetTriangleCount() const
     {
-        size_t count = 0u;
-
-        const bool success =
-            ForEachTriangle([&count](const TriangleNode*)
-            {
-                count++;
-                return true;
-            });
-
-        if (!success)
+        if (!IsBuilt())
             return 0u;
-        else
-            return count;
+
+        return mTree.GetTriangleNodeCount();
     }
 
 
@@ -2556,16 +2917,19 @@ protected:
 
         void AddTriangle()
         {
+#pragma omp atomic
             mAllTriangleCount++;
         }
 
         void RemoveTriangle()
         {
+#pragma omp atomic
             mRemovedTriangleCount++;
         }
 
         void AddSample()
         {
+#pragma omp atomic
             mSampleCount++;
         }
 
@@ -2610,8 +2974,12 @@ protected:
             //mEmHasSampleFlags(aEmImage.Height(), std::vector<std::string>(aEmImage.Width(), "*"))
             mEmHasSampleFrom(aEmImage.Height(), std::vector<uint32_t>(aEmImage.Width(), 0)),
 #endif
-            mStartTime(clock())
+            mRefinementTaskCount(0u),
+            mRefinementTaskSeconds(0.)
         {
+            // Pre-allocated, because the statistics are updated concurrently during refinement
+            mLevelStats.resize(aBuildParams.GetMaxSubdivLevel() + 1);
+
             if (!mQuiet)
                 printf(
                     "\nSteerable Sampler - Triangulation Parameters:\n"
@@ -2643,26 +3011,32 @@ protected:
 
         void AddTriangle(const TriangleNode &aTriangle)
         {
-            if (mLevelStats.size() < (aTriangle.subdivLevel + 1))
-                mLevelStats.resize(aTriangle.subdivLevel + 1);
+            PG3_ASSERT(aTriangle.subdivLevel < mLevelStats.size());
 
             mLevelStats[aTriangle.subdivLevel].AddTriangle();
         }
 
         void RemoveTriangle(const TriangleNode &aTriangle)
         {
-            if (mLevelStats.size() < (aTriangle.subdivLevel + 1))
-                mLevelStats.resize(aTriangle.subdivLevel + 1);
+            PG3_ASSERT(aTriangle.subdivLevel < mLevelStats.size());
 
             mLevelStats[aTriangle.subdivLevel].RemoveTriangle();
         }
 
+        // Called by each finished refinement task (can be called concurrently)
+        void AddRefinementTask(double aSeconds)
+        {
+#pragma omp atomic
+            mRefinementTaskCount++;
+#pragma omp atomic
+            mRefinementTaskSeconds += aSeconds;
+        }
+
         void AddSample(
             const TriangleNode  &aTriangle,
             const Vec3f         &aSampleDir)
         {
-            if (mLevelStats.size() < (aTriangle.subdivLevel + 1))
-                mLevelStats.resize(aTriangle.subdivLevel + 1);
+            PG3_ASSERT(aTriangle.subdivLevel < mLevelStats.size());
 
             mLevelStats[aTriangle.subdivLevel].AddSample();
 
@@ -2679,6 +3053,7 @@ protected:
                 const uint32_t x0 = Math::Clamp((uint32_t)x, 0u, mEmWidth - 1u);
                 const uint32_t y0 = Math::Clamp((uint32_t)y, 0u, mEmHeight - 1u);
 
+#pragma omp atomic
                 mEmSampleCounts[y0][x0]++;
 #ifdef _DEBUG
                 //mEmHasSampleFlags[y0][x0] = aTriangle.index;
@@ -2692,20 +3067,34 @@ protected:
             if (mQuiet)
                 return;
 
-            const time_t endTime = clock();
-            const float timeSeconds = float(endTime - mStartTime) / CLOCKS_PER_SEC;
-            std::string timeHumanReadable;
+            // The occupancy is the sum of the time spent in the refinement tasks related to
+            // the wall-clock time of the whole triangulation, i.e. the average number of busy
+            // threads. It is not a speedup: the tasks are slower than the serial refinement.
+            const float timeSeconds = (float)mTimer.ElapsedSeconds();
+            std::string timeHumanReadable, taskTimeHumanReadable;
             Utils::SecondsToHumanReadable(timeSeconds, timeHumanReadable);
-            printf("Steerable Sampler - Triangulation Time: %s\n", timeHumanReadable.c_str());
+            Utils::SecondsToHumanReadable((float)mRefinementTaskSeconds, taskTimeHumanReadable);
+            printf(
+                "Steerable Sampler - Triangulation Time: %s "
+                "(%u tasks on %d threads, %s in tasks, avg. occupancy %.2f threads)\n",
+                timeHumanReadable.c_str(),
+                mRefinementTaskCount,
+                omp_get_max_threads(),
+                taskTimeHumanReadable.c_str(),
+                (timeSeconds > 0.f) ? (mRefinementTaskSeconds / timeSeconds) : 0.);
+
+            // Skip the unused levels at the end
+            size_t levels = mLevelStats.size();
+            while ((levels > 0) && (mLevelStats[levels - 1].GetAllTriangleCount() == 0))
+                levels--;
 
             printf("\nSteerable Sampler - Triangulation Statistics:\n");
-            if (mLevelStats.size() > 0)
+            if (levels > 0)
             {
                 uint32_t totalAllTriangleCount = 0u;
                 uint32_t totalFinalTriangleCount = 0u;
                 uint32_t totalSampleCount = 0u;
 
-                const size_t levels = mLevelStats.size();
                 for (size_t i = 0; i < levels; ++i)
                 {
                     const auto &level = mLevelStats[i];
@@ -2884,7 +3273,9 @@ protected:
         std::vector<std::vector<uint32_t>>          mEmHasSampleFrom; // to be inspected within debugger
 #endif
 
-        const clock_t                               mStartTime;
+        const Benchmarking::Timer                   mTimer; // wall-clock time
+        uint32_t                                    mRefinementTaskCount;
+        double                                      mRefinementTaskSeconds;
     };
 
 
@@ -2916,6 +3307,11 @@ protected:
             aTriangle; // unused param
         }
 
+        void AddRefinementTask(double aSeconds)
+        {
+            aSeconds; // unused param
+        }
+
         void AddSample(
             const TriangleNode  &aTriangle,
             const Vec3f         &aSampleDir)
@@ -3109,13 +3505,240 @@ protected:
     }
 
 
+    // Minimal number of independent sub-trees the refinement is split into. Fixed, so that 
+    // the work decomposition (not the result, which is always the same) doesn't depend 
+    // on the number of threads.
+    static const uint32_t kMinRefinementTaskCount = 256u;
+
+    // Independent part of the refinement: sub-tree of a single triangle
+    struct RefinementTask
+    {
+        TriangleNode                *triangle;          // triangle to refine, local vertex indices
+        uint32_t                     cornerVertices[3]; // plan vertex indices of the triangle corners
+        VertexStorage                vertexStorage;     // local; the corners are vertices 0, 1 and 2
+        std::list<TreeNodeBase*>     refinedTriangles;  // local vertex indices
+        bool                         succeeded;
+    };
+
+    // Part of the refinement which is done serially before the tasks are started.
+    // Inner nodes are triangles subdivided unconditionally (below the minimal subdivision level),
+    // leaves are the tasks.
+    struct RefinementPlanNode
+    {
+        RefinementPlanNode() : firstNewVertex(0u), taskIndex(-1) {}
+
+        uint32_t                     firstNewVertex;    // inner node: plan index of the 3 new vertices
+        std::vector<uint32_t>        children;          // inner node: in the serial processing order
+        int32_t                      taskIndex;         // leaf
+    };
+
+
+    // Parallel version of RefineEmTriangulationSerial() producing exactly the same result.
+    //
+    // The coarse triangles are first subdivided serially into independent sub-trees, each of 
+    // which is then refined by a task with its own vertex storage. The results are merged in 
+    // the order in which the serial algorithm would have processed the sub-trees, so that all
+    // the vertices and triangles end up in the same order. The vertices created before 
+    // the tasks are kept aside in a plan storage until the merge, because their final indices 
+    // depend on the vertices created by the preceding sub-trees.
+    template <class TTriangulationStats>
+    static bool RefineEmTriangulation(
+        std::list<TreeNodeBase*>    &oRefinedTriangles,
+        std::deque<TriangleNode*>   &aToDoTriangles,
+        VertexStorage               &aVertexStorage,
+        const EnvironmentMapImage   &aEmImage,
+        const BuildParameters       &aParams,
+        TTriangulationStats         &aStats)
+    {
+        PG3_ASSERT(!aToDoTriangles.empty());
+        PG3_ASSERT(oRefinedTriangles.empty());
+
+        // How many levels have to be subdivided up front to get enough tasks
+        uint32_t splitDepth = 0u;
+        for (size_t count = aToDoTriangles.size();
+             (count < kMinRefinementTaskCount) && (splitDepth < aParams.GetMinSubdivLevel());
+             count *= 4)
+            splitDepth++;
+
+        // Plan (serial)
+        VertexStorage planVertices(aVertexStorage);
+        std::vector<RefinementPlanNode> planNodes(1); // root: the "to do" triangles
+        std::vector<RefinementTask> tasks;
+        while (!aToDoTriangles.empty())
+        {
+            auto currentTriangle = aToDoTriangles.front();
+            aToDoTriangles.pop_front();
+
+            PG3_ASSERT(currentTriangle != nullptr);
+            PG3_ASSERT(currentTriangle->IsTriangleNode());
+
+            if (currentTriangle == nullptr)
+                continue;
+
+            const uint32_t childIdx = PlanRefinement(
+                planNodes, tasks, currentTriangle, splitDepth, planVertices, aEmImage, aParams, aStats);
+            planNodes[0].children.push_back(childIdx);
+        }
+
+        // Refine the sub-trees (parallel)
+        const VertexStorage &planVerticesConst = planVertices;
+        const int32_t taskCount = (int32_t)tasks.size();
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int32_t taskIdx = 0; taskIdx < taskCount; taskIdx++)
+        {
+            RefinementTask &task = tasks[taskIdx];
+            Benchmarking::Timer timer;
+
+            for (uint32_t i = 0; i < 3; i++)
+            {
+                uint32_t localIndex;
+                task.vertexStorage.AddVertex(
+                    Vertex(*planVerticesConst.Get(task.cornerVertices[i])), localIndex);
+                PG3_ASSERT(localIndex == i);
+            }
+
+            std::deque<TriangleNode*> toDoTriangles(1, task.triangle);
+            task.triangle = nullptr; // owned by the refinement from now on
+            task.succeeded = RefineEmTriangulationSerial(
+                task.refinedTriangles, toDoTriangles, task.vertexStorage, aEmImage, aParams, aStats);
+
+            aStats.AddRefinementTask(timer.ElapsedSeconds());
+        }
+
+        bool succeeded = true;
+        for (const auto &task : tasks)
+            succeeded &= task.succeeded;
+        if (!succeeded)
+        {
+            for (auto &task : tasks)
+                FreeNodesList(task.refinedTriangles);
+            return false;
+        }
+
+        // Merge (serial)
+        std::vector<uint32_t> planToGlobalVertex(planVertices.GetCount());
+        for (uint32_t i = 0; i < aVertexStorage.GetCount(); i++)
+            planToGlobalVertex[i] = i;
+        MergeRefinementPlanNode(
+            oRefinedTriangles, aVertexStorage, planToGlobalVertex, 0u, planNodes, tasks, planVertices);
+
+        PG3_ASSERT(aToDoTriangles.empty());
+
+        return true;
+    }
+
+
+    // Creates the plan node for the given triangle. The triangle is either subdivided (up to 
+    // the given depth and only below the minimal subdivision level, where the refinement 
+    // subdivides unconditionally) or handed over to a new task.
+    template <class TTriangulationStats>
+    static uint32_t PlanRefinement(
+        std::vector<RefinementPlanNode> &aPlanNodes,
+        std::vector<RefinementTask>     &aTasks,
+        TriangleNode                    *aTriangle,
+        uint32_t                         aRemainingDepth,
+        VertexStorage                   &aPlanVertices,
+        const EnvironmentMapImage       &aEmImage,
+        const BuildParameters           &aParams,
+        TTriangulationStats             &aStats)
+    {
+        const uint32_t nodeIdx = (uint32_t)aPlanNodes.size();
+        aPlanNodes.emplace_back();
+
+        if ((aRemainingDepth == 0) || (aTriangle->subdivLevel >= aParams.GetMinSubdivLevel()))
+        {
+            aPlanNodes[nodeIdx].taskIndex = (int32_t)aTasks.size();
+            aTasks.emplace_back();
+            RefinementTask &task = aTasks.back();
+            for (uint32_t i = 0; i < 3; i++)
+            {
+                task.cornerVertices[i] = aTriangle->vertexIndices[i];
+                aTriangle->vertexIndices[i] = i;
+            }
+            task.triangle = aTriangle;
+            task.succeeded = false;
+            return nodeIdx;
+        }
+
+        // Same as in RefineEmTriangulationSerial()
+        aStats.AddTriangle(*aTriangle);
+        std::list<TriangleNode*> subdivisionTriangles;
+        aPlanNodes[nodeIdx].firstNewVertex = aPlanVertices.GetCount();
+        SubdivideTriangle(subdivisionTriangles, *aTriangle, aPlanVertices, aEmImage);
+        aStats.RemoveTriangle(*aTriangle);
+        delete aTriangle;
+
+        // The serial refinement processes the sub-division triangles in reverse order
+        for (auto it = subdivisionTriangles.rbegin(); it != subdivisionTriangles.rend(); ++it)
+        {
+            const uint32_t childIdx = PlanRefinement(
+                aPlanNodes, aTasks, *it, aRemainingDepth - 1, aPlanVertices, aEmImage, aParams, aStats);
+            aPlanNodes[nodeIdx].children.push_back(childIdx);
+        }
+
+        return nodeIdx;
+    }
+
+
+    // Moves the vertices and triangles of the plan sub-tree into the output in the order 
+    // of the serial refinement
+    static void MergeRefinementPlanNode(
+        std::list<TreeNodeBase*>                &oRefinedTriangles,
+        VertexStorage                           &aVertexStorage,
+        std::vector<uint32_t>                   &aPlanToGlobalVertex,
+        uint32_t                                 aNodeIdx,
+        const std::vector<RefinementPlanNode>   &aPlanNodes,
+        std::vector<RefinementTask>             &aTasks,
+        const VertexStorage                     &aPlanVertices)
+    {
+        const RefinementPlanNode &node = aPlanNodes[aNodeIdx];
+
+        if (node.taskIndex >= 0)
+        {
+            RefinementTask &task = aTasks[node.taskIndex];
+
+            const uint32_t localVertexCount = task.vertexStorage.GetCount();
+            const uint32_t firstGlobalVertex = aVertexStorage.GetCount();
+            for (uint32_t i = 3; i < localVertexCount; i++)
+            {
+                uint32_t globalIndex;
+                aVertexStorage.AddVertex(Vertex(*task.vertexStorage.Get(i)), globalIndex);
+            }
+
+            for (auto refinedNode : task.refinedTriangles)
+            {
+                auto triangle = static_cast<TriangleNode*>(refinedNode);
+                for (auto &index : triangle->vertexIndices)
+                    index =
+                          (index < 3)
+                        ? aPlanToGlobalVertex[task.cornerVertices[index]]
+                        : firstGlobalVertex + index - 3;
+            }
+
+            // The task's triangles are the most recently refined ones
+            oRefinedTriangles.splice(oRefinedTriangles.begin(), task.refinedTriangles);
+            task.vertexStorage.Free();
+            return;
+        }
+
+        if (aNodeIdx != 0)
+            for (uint32_t i = node.firstNewVertex; i < node.firstNewVertex + 3; i++)
+                aVertexStorage.AddVertex(Vertex(*aPlanVertices.Get(i)), aPlanToGlobalVertex[i]);
+
+        for (auto childIdx : node.children)
+            MergeRefinementPlanNode(
+                oRefinedTriangles, aVertexStorage, aPlanToGlobalVertex,
+                childIdx, aPlanNodes, aTasks, aPlanVertices);
+    }
+
+
     // Sub-divides the "to do" triangle set of triangles according to the refinement rule and
     // fills the output list of triangles. The refined triangles are released. The triangles 
     // are either moved from the "to do" set into the output list or deleted on error.
     // Although the "to do" triangle set is a TreeNodeBase* container, it must contain 
     // TriangleNode* data only, otherwise an error will occur.
     template <class TTriangulationStats>
-    static bool RefineEmTriangulation(
+    static bool RefineEmTriangulationSerial(
         std::list<TreeNodeBase*>    &oRefinedTriangles,
         std::deque<TriangleNode*>   &aToDoTriangles,
         VertexStorage               &aVertexStorage,
@@ -3759,35 +4382,40 @@ protected:
     {
         oTreeRoot.reset(nullptr);
 
-        // TODO: Switch to a more efficient container? (e.g. deque - less allocations?)
+        std::vector<TreeNodeBase*> layerNodes;
+        layerNodes.reserve(aNodesToProcess.size());
+        for (auto node : aNodesToProcess)
+            if (node != nullptr)
+                layerNodes.push_back(node);
+        aNodesToProcess.clear();
 
         // Process in layers from bottom to top.
-        while (aNodesToProcess.size() > 1)
+        // Each node of the next layer is built from a fixed group of consecutive nodes (using 
+        // as many nodes as possible), so the groups are independent and can be built in parallel.
+        while (layerNodes.size() > 1)
         {
-            std::list<TreeNodeBase*> nextLayerNodes;
-            while (!aNodesToProcess.empty())
+            const size_t layerSize = layerNodes.size();
+            const int32_t groupCount =
+                (int32_t)((layerSize + MAX_TRIANGLE_SET_CHILDREN - 1) / MAX_TRIANGLE_SET_CHILDREN);
+            std::vector<TreeNodeBase*> nextLayerNodes(groupCount, nullptr);
+
+#pragma omp parallel for schedule(static) if (groupCount >= 256)
+            for (int32_t groupIdx = 0; groupIdx < groupCount; groupIdx++)
             {
-                // Use as many nodes as possible
-                auto newNode = new TriangleSetNode(aNodesToProcess, aVertexStorage);
-                if (newNode == nullptr)
-                {
-                    FreeNodesList(aNodesToProcess);
-                    FreeNodesList(nextLayerNodes);
-                    return false;
-                }
-                nextLayerNodes.push_back(newNode);
+                const size_t groupBegin = groupIdx * MAX_TRIANGLE_SET_CHILDREN;
+                const size_t groupEnd   =
+                    std::min<size_t>(groupBegin + MAX_TRIANGLE_SET_CHILDREN, layerSize);
+                std::list<TreeNodeBase*> groupNodes(
+                    layerNodes.begin() + groupBegin, layerNodes.begin() + groupEnd);
+                nextLayerNodes[groupIdx] = new TriangleSetNode(groupNodes, aVertexStorage);
             }
-            std::swap(nextLayerNodes, aNodesToProcess);
-        }
 
-        // Fill tree root
-        if (aNodesToProcess.size() == 1u)
-        {
-            oTreeRoot.reset(aNodesToProcess.front());
-            aNodesToProcess.pop_front();
+            std::swap(nextLayerNodes, layerNodes);
         }
 
-        PG3_ASSERT(aNodesToProcess.empty());
+        // Fill tree root
+        if (layerNodes.size() == 1u)
+            oTreeRoot.reset(layerNodes.front());
 
         return true;
     }
@@ -3796,7 +4424,7 @@ protected:
     // Randomly pick a triangle with probability proportional to the integral of 
     // the piece-wise bilinear EM approximation over the triangle surface.
     bool PickTriangle(
-        const TriangleNode          *&oTriangle,
+        uint32_t                     &oTriangleIndex,
         const SteerableCoefficients  &aClampedCosCoeffs,
         float                        &aUniSample //modified and used by the triangle area sampling later on
         ) const
@@ -3804,16 +4432,16 @@ protected:
         if (!IsBuilt())
             return false;
 
-        const TreeNodeBase *node = mTreeRoot.get();
-        while ((node != nullptr) && (!node->IsTriangleNode()))
+        uint32_t node = mTree.GetRoot();
+        while (!FlatTree::IsTriangleNodeRef(node))
         {
-            auto triangleSet = static_cast<const TriangleSetNode*>(node);
-            const size_t childCount = triangleSet->GetChildrenCount();
+            const FlatTriangleSetNode &triangleSet = mTree.GetSetNode(FlatTree::GetNodeIndex(node));
+            const size_t childCount = triangleSet.childrenCount;
 
             // Get integrals
             std::array<float, MAX_TRIANGLE_SET_CHILDREN> childrenIntegrals;
             for (size_t i = 0; i < childCount; ++i)
-                childrenIntegrals[i] = triangleSet->ComputeChildIntegral(i, aClampedCosCoeffs);
+                childrenIntegrals[i] = Dot(triangleSet.childrenWeights[i], aClampedCosCoeffs);
 
             // Compute sums
             std::array<float, MAX_TRIANGLE_SET_CHILDREN + 1> childrenIntegralSums;
@@ -3840,10 +4468,6 @@ protected:
                     childrenIntegrals[i] = 1.f / childCount;
 
             PG3_ASSERT_FLOAT_LARGER_THAN_OR_EQUAL_TO(wholeIntegral, 0.f);
-            PG3_ASSERT_FLOAT_EQUAL(
-                wholeIntegral,
-                triangleSet->ComputeIntegral(aClampedCosCoeffs),
-                0.001f);
 
             // Choose child
 
@@ -3854,7 +4478,7 @@ protected:
                 --itUpBound; // last element
 
             const auto childIdx = itUpBound - childrenIntegralSums.begin() - 1u;
-            node = triangleSet->GetChild(childIdx);
+            node = triangleSet.children[childIdx];
 
             const float lowBound = *(itUpBound - 1);
             const float integral = *itUpBound - lowBound;
@@ -3867,10 +4491,7 @@ protected:
             aUniSample = std::min(newUniSample, 1.f); // Larger values can invoke "zero ending problem"
         }
 
-        if (node == nullptr)
-            return false; // corrupted data?
-
-        oTriangle = static_cast<const TriangleNode*>(node);
+        oTriangleIndex = FlatTree::GetNodeIndex(node);
         return true;
     }
 
@@ -3956,12 +4577,15 @@ protected:
     const BuildParameters                   mParams;
 
     // Contains all used vertices.
-    // Referenced from mTreeRoot through indices
+    // Referenced from mTree through indices
     VertexStorage                   mVertexStorage;
 
     // Sampling tree. Leaves represent triangles, inner nodes represent sets of triangles.
     // Triangles reference vertices in mVertexStorage through indices.
-    std::unique_ptr<TreeNodeBase>   mTreeRoot;
+    FlatTree                        mTree;
+
+    // Cache file with the pre-built data when loaded from disk
+    MappedFile                      mCacheFile;
 
 public:
 
@@ -4136,6 +4760,17 @@ public:
     {
         PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel2, "Triangulation refinement");
 
+        // Serial reference
+        VertexStorage serialVertexStorage(aVertexStorage);
+        std::deque<TriangleNode*> serialInitialTriangles;
+        for (auto triangle : aInitialTriangles)
+            serialInitialTriangles.push_back(new TriangleNode(*triangle));
+        std::list<TreeNodeBase*> serialRefinedTriangles;
+        TriangulationStatsDummy serialStats(aEmImage, aParams, true);
+        const bool serialSucceeded = RefineEmTriangulationSerial(
+            serialRefinedTriangles, serialInitialTriangles, serialVertexStorage,
+            aEmImage, aParams, serialStats);
+
         if (!RefineEmTriangulation(
                 oRefinedTriangles, aInitialTriangles, aVertexStorage,
                 aEmImage, aParams, aStats))
@@ -4144,6 +4779,31 @@ public:
                 aMaxUtBlockPrintLevel, eutblSubTestLevel2, "Triangulation refinement",
                 "RefineEmTriangulation() failed!");
             FreeNodesList(oRefinedTriangles);
+            FreeNodesList(serialRefinedTriangles);
+            return false;
+        }
+
+        // The parallel refinement must give exactly the same vertices and triangles
+        const bool isSameAsSerial =
+               serialSucceeded
+            && (serialVertexStorage == aVertexStorage)
+            && (serialRefinedTriangles.size() == oRefinedTriangles.size())
+            && std::equal(
+                oRefinedTriangles.begin(), oRefinedTriangles.end(),
+                serialRefinedTriangles.begin(),
+                [](const TreeNodeBase *aNode1, const TreeNodeBase *aNode2)
+                {
+                    return (*aNode1 == *aNode2)
+                        && (static_cast<const TriangleNode*>(aNode1)->subdivLevel
+                            == static_cast<const TriangleNode*>(aNode2)->subdivLevel);
+                });
+        FreeNodesList(serialRefinedTriangles);
+        if (!isSameAsSerial)
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, eutblSubTestLevel2, "Triangulation refinement",
+                "Parallel refinement differs from the serial one!");
+            FreeNodesList(oRefinedTriangles);
             return false;
         }
 
@@ -4638,10 +5298,30 @@ public:
     {
         PG3_UT_BEGIN(aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk");
 
-        const bool isDebugging = false; // makes the file more human readable (but machine un-readable!)
+        // Flatten
+        FlatTree tree;
+        if (!tree.Flatten(aTreeRoot.get()))
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
+                "FlatTree::Flatten() failed!");
+            return false;
+        }
+
+        uint32_t nonTriangleCount = 0u, triangleCount = 0u;
+        CountNodes(aTreeRoot.get(), nonTriangleCount, triangleCount);
+        if (   (tree.GetSetNodeCount()      != nonTriangleCount)
+            || (tree.GetTriangleNodeCount() != triangleCount)
+            || !tree.IsValid(aVertexStorage.GetCount()))
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
+                "Flat tree doesn't match the original tree!");
+            return false;
+        }
 
         // Save
-        if (!SaveToDisk(aVertexStorage, aTreeRoot.get(), aEmImage, aParams, isDebugging))
+        if (!SaveToDisk(aVertexStorage, tree, aEmImage, aParams))
         {
             PG3_UT_FAILED(
                 aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
@@ -4650,9 +5330,10 @@ public:
         }
 
         // Load
-        VertexStorage                   loadedVertexStorage;
-        std::unique_ptr<TreeNodeBase>   loadedTreeRoot;
-        if (!LoadFromDisk(loadedVertexStorage, loadedTreeRoot, aEmImage, aParams))
+        MappedFile      loadedFile;
+        VertexStorage   loadedVertexStorage;
+        FlatTree        loadedTree;
+        if (!LoadFromDisk(loadedFile, loadedVertexStorage, loadedTree, aEmImage, aParams))
         {
             PG3_UT_FAILED(
                 aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
@@ -4669,7 +5350,7 @@ public:
             return false;
         }
 
-        if (!loadedTreeRoot)
+        if (loadedTree.IsEmpty())
         {
             PG3_UT_FAILED(
                 aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
@@ -4678,7 +5359,7 @@ public:
         }
 
         // Compare with the original tree
-        if (*aTreeRoot != *loadedTreeRoot)
+        if (tree != loadedTree)
         {
             PG3_UT_FAILED(
                 aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
@@ -4686,6 +5367,95 @@ public:
             return false;
         }
 
+        // Data built with different parameters must be rejected
+        const BuildParameters otherParams(
+            aParams.GetMaxApproxError() + 1.f,
+            (float)aParams.GetMinSubdivLevel(),
+            (float)aParams.GetMaxSubdivLevel(),
+            (float)aParams.GetMaxTriangleSamplesPerDimDbg(),
+            aParams.GetOversamplingFactorDbg(),
+            aParams.GetMaxTriangleSpanDbg());
+        std::string path, otherPath;
+        if (   GenerateSaveFilePath(path, aEmImage, aParams)
+            && GenerateSaveFilePath(otherPath, aEmImage, otherParams))
+        {
+            loadedTree.Free();
+            loadedVertexStorage.Free();
+            loadedFile.Close();
+            std::remove(otherPath.c_str());
+            std::rename(path.c_str(), otherPath.c_str());
+            const bool loaded =
+                LoadFromDisk(loadedFile, loadedVertexStorage, loadedTree, aEmImage, otherParams);
+            loadedTree.Free();
+            loadedVertexStorage.Free();
+            loadedFile.Close();
+            std::rename(otherPath.c_str(), path.c_str());
+            if (loaded)
+            {
+                PG3_UT_FAILED(
+                    aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
+                    "Data built with different parameters have been loaded!");
+                return false;
+            }
+        }
+
+        // A changed EM file stamp falls back to the content hash and gets refreshed
+        if (GenerateSaveFilePath(path, aEmImage, aParams))
+        {
+            CacheFileHeader expectedHeader;
+            FillCacheFileHeader(expectedHeader, aEmImage, aParams, false);
+
+            auto patchHeaderAndLoad = [&](uint64_t aWriteTimeDelta, uint64_t aHashDelta)
+            {
+                CacheFileHeader header;
+                {
+                    std::fstream fs(path, std::ios::in | std::ios::out | std::ios::binary);
+                    if (!fs.read(reinterpret_cast<char*>(&header), sizeof(header)))
+                        return false;
+                    header.emFileWriteTime += aWriteTimeDelta;
+                    header.emContentHash += aHashDelta;
+                    fs.seekp(0);
+                    if (!fs.write(reinterpret_cast<const char*>(&header), sizeof(header)))
+                        return false;
+                }
+                const bool loaded =
+                    LoadFromDisk(loadedFile, loadedVertexStorage, loadedTree, aEmImage, aParams);
+                loadedTree.Free();
+                loadedVertexStorage.Free();
+                loadedFile.Close();
+                return loaded;
+            };
+
+            if (!patchHeaderAndLoad(1u, 0u))
+            {
+                PG3_UT_FAILED(
+                    aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
+                    "Data with an outdated EM file stamp and a matching content hash have been rejected!");
+                return false;
+            }
+            if (expectedHeader.emFileStampValid != 0u)
+            {
+                CacheFileHeader header;
+                std::ifstream fs(path, std::ios::binary);
+                if (   !fs.read(reinterpret_cast<char*>(&header), sizeof(header))
+                    || !IsCacheFileStampCurrent(header, expectedHeader))
+                {
+                    PG3_UT_FAILED(
+                        aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
+                        "The outdated EM file stamp has not been refreshed!");
+                    return false;
+                }
+            }
+            if (patchHeaderAndLoad(1u, 1u))
+            {
+                PG3_UT_FAILED(
+                    aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk",
+                    "Data with an outdated EM file stamp and a different content hash have been loaded!");
+                return false;
+            }
+            patchHeaderAndLoad(~0ull, ~0ull); // restore the original stamp and hash
+        }
+
         PG3_UT_PASSED(aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "SaveToDisk and LoadFromDisk");
         return true;
     }
@@ -4792,7 +5562,7 @@ public:
             uint32_t hitCount;
             float probability;
         };
-        std::map<const TriangleNode*, TriangleHitRecord> triangleHitMap;
+        std::map<uint32_t, TriangleHitRecord> triangleHitMap;
         uint32_t totalTriangleHits = 0;
 
         // Compute statistics for many sample triangles
@@ -4803,9 +5573,8 @@ public:
             Vec2f sample(rngSamples.GetVec2f());
 
             // Pick triangle
-            const TriangleNode *triangle;
-            if (   !aSampler.PickTriangle(triangle, aClampedCosCoeffs, sample.x)
-                || (triangle == nullptr))
+            uint32_t triangleIndex;
+            if (!aSampler.PickTriangle(triangleIndex, aClampedCosCoeffs, sample.x))
             {
                 PG3_UT_FATAL_ERROR(
                     aMaxUtBlockPrintLevel, aUtBlockPrintLevel,
@@ -4813,10 +5582,11 @@ public:
                 return false;
             }
 
-            auto &triangleHitRecord = triangleHitMap[triangle];
+            auto &triangleHitRecord = triangleHitMap[triangleIndex];
 
+            const TriangleNode triangle  = aSampler.GetTriangle(triangleIndex);
             const float wholeIntegral    = aSampler.ComputeWholeIntegral(aClampedCosCoeffs);
-            const float triangleIntegral = triangle->ComputeIntegral(aSampler.mVertexStorage, aClampedCosCoeffs);
+            const float triangleIntegral = triangle.ComputeIntegral(aSampler.mVertexStorage, aClampedCosCoeffs);
             const float triangleProbability =
                   Math::IsTiny(wholeIntegral)
                 ? 0.f
@@ -4856,16 +5626,17 @@ public:
         // Evaluate triangle picking quality
         // TODO: Zero integrals (triangle, whole) cases?
         const float wholeIntegral = aSampler.ComputeWholeIntegral(aClampedCosCoeffs);
-        bool forEachReturn = aSampler.ForEachTriangle([&](const TriangleNode* aTriangle)
+        bool forEachReturn = aSampler.ForEachTriangle(
+            [&](uint32_t aTriangleIndex, const TriangleNode &aTriangle)
         {
             // This works also for nonhit triangles - defaults to hit count 0
-            auto triangleHitRecord = triangleHitMap[aTriangle];
+            auto triangleHitRecord = triangleHitMap[aTriangleIndex];
 
             const float relativeHitCount =
                 (float)triangleHitRecord.hitCount / totalTriangleHits;
 
             const float triangleIntegral =
-                aTriangle->ComputeIntegral(aSampler.mVertexStorage, aClampedCosCoeffs);
+                aTriangle.ComputeIntegral(aSampler.mVertexStorage, aClampedCosCoeffs);
             const float relativeIntegral = triangleIntegral / wholeIntegral; // probability
 
             // Sanity test
@@ -5178,12 +5949,13 @@ public:
     {
         PG3_UT_BEGIN(aMaxUtBlockPrintLevel, aUtBlockPrintLevel, "Triangle sampling");
 
-        bool forEachReturn = aSampler.ForEachTriangle([&](const TriangleNode* aTriangle)
+        bool forEachReturn = aSampler.ForEachTriangle(
+            [&](uint32_t, const TriangleNode &aTriangle)
         {
             Vec3f vertex0;
             Vec3f vertex1;
             Vec3f vertex2;
-            if (!aSampler.GetTriangleVertices(vertex0, vertex1, vertex2, *aTriangle))
+            if (!aSampler.GetTriangleVertices(vertex0, vertex1, vertex2, aTriangle))
             {
                 PG3_UT_FAILED(
                     aMaxUtBlockPrintLevel, aUtBlockPrintLevel,
@@ -5196,7 +5968,7 @@ public:
             float vertexValue2;
             if (!aSampler.GetTriangleVertexValues(
                     vertexValue0, vertexValue1, vertexValue2,
-                    *aTriangle, aClampedCosCoeffs))
+                    aTriangle, aClampedCosCoeffs))
             {
                 PG3_UT_FAILED(
                     aMaxUtBlockPrintLevel, aUtBlockPrintLevel,
@@ -5458,6 +6230,115 @@ public:
         return true;
     }
 
+#endif
+
+#ifdef PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+public:
+
+    // Sky-like environment map: smooth gradient with a small and very bright sun
+    static void _BM_GenerateSkyImage(EnvironmentMapImage &aImage)
+    {
+        const Vec3f sunDir = Vec3f(0.3f, 0.4f, 0.6f).Normalize();
+        for (uint32_t y = 0; y < aImage.Height(); y++)
+        {
+            for (uint32_t x = 0; x < aImage.Width(); x++)
+            {
+                const Vec2f uv(
+                    (x + 0.5f) / aImage.Width(),
+                    (y + 0.5f) / aImage.Height());
+                const Vec3f dir = Geom::LatLong2Dir(uv);
+                const float sky = 0.05f + std::max(dir.z, 0.f);
+                const float sun = (Dot(dir, sunDir) > 0.999f) ? 500.f : 0.f;
+                SpectrumF radiance;
+                radiance.SetSRGBLight(sky + sun, sky + sun, 1.5f * sky + sun);
+                aImage.SetTexel(x, y, radiance);
+            }
+        }
+    }
+
+    static void _Benchmark()
+    {
+        Benchmarking::PrintHeader("EnvironmentMapSteerableSampler build (triangulation + tree)");
+
+        EnvironmentMapImage image("procedural sky", 1024, 512, true);
+        _BM_GenerateSkyImage(image);
+        const BuildParameters params;
+
+        const int32_t procCount = omp_get_num_procs();
+        std::vector<int32_t> threadCounts;
+        for (int32_t threadCount = 1; threadCount < procCount; threadCount *= 2)
+            threadCounts.push_back(threadCount);
+        threadCounts.push_back(procCount);
+
+        // The serial refinement is the reference for the triangulation speedup
+        double serialTriangulationSeconds = 0.;
+        {
+            VertexStorage vertexStorage;
+            std::deque<TriangleNode*> toDoTriangles;
+            std::list<TreeNodeBase*> triangles;
+            TriangulationStatsDummy stats(image, params, true);
+
+            Benchmarking::Timer triangulationTimer;
+            GenerateInitialEmTriangulation(toDoTriangles, vertexStorage, image);
+            RefineEmTriangulationSerial(triangles, toDoTriangles, vertexStorage, image, params, stats);
+            serialTriangulationSeconds = triangulationTimer.ElapsedSeconds();
+
+            printf(
+                "\t    serial: triangulation %7.3f s, %llu triangles\n",
+                serialTriangulationSeconds, (unsigned long long)triangles.size());
+            fflush(stdout);
+
+            FreeNodesList(triangles);
+        }
+
+        VertexStorage referenceVertices;
+        FlatTree referenceTree;
+        double referenceTreeSeconds = 0.;
+        for (const int32_t threadCount : threadCounts)
+        {
+            omp_set_num_threads(threadCount);
+
+            VertexStorage vertexStorage;
+            std::deque<TriangleNode*> toDoTriangles;
+            std::list<TreeNodeBase*> triangles;
+            TriangulationStatsDummy stats(image, params, true);
+
+            Benchmarking::Timer triangulationTimer;
+            GenerateInitialEmTriangulation(toDoTriangles, vertexStorage, image);
+            RefineEmTriangulation(triangles, toDoTriangles, vertexStorage, image, params, stats);
+            const double triangulationSeconds = triangulationTimer.ElapsedSeconds();
+            const size_t triangleCount = triangles.size();
+
+            Benchmarking::Timer treeTimer;
+            std::unique_ptr<TreeNodeBase> treeRoot;
+            BuildTriangleTree(triangles, vertexStorage, treeRoot);
+            const double treeSeconds = treeTimer.ElapsedSeconds();
+
+            FlatTree tree;
+            tree.Flatten(treeRoot.get());
+            if (threadCount == 1)
+            {
+                referenceVertices               = vertexStorage;
+                referenceTree.Flatten(treeRoot.get());
+                referenceTreeSeconds            = treeSeconds;
+            }
+            const bool isSame = (vertexStorage == referenceVertices) && (tree == referenceTree);
+
+            printf(
+                "\t%2d threads: triangulation %7.3f s (%5.2fx vs. serial), "
+                "tree %6.3f s (%5.2fx vs. 1 thread), %llu triangles%s\n",
+                threadCount,
+                triangulationSeconds, serialTriangulationSeconds / triangulationSeconds,
+                treeSeconds, referenceTreeSeconds / treeSeconds,
+                (unsigned long long)triangleCount,
+                isSame ? "" : " - DIFFERS FROM SINGLE THREAD!");
+            fflush(stdout);
+        }
+
+        omp_set_num_threads(procCount);
+    }
+
 #endif
 };
 
@@ -2,6 +2,8 @@
 
 #include <vector>
 #include <cmath>
+#include <limits>
+#include <algorithm>
 #include <fstream>
 #include <string.h>
 #include "spectrum.hxx"
@@ -43,6 +45,13 @@ public:
         // For some reason the following line only works if I create a SpectrumF instance first
         //mRadiance[x + y * mResX] = mRadiance[x + y * mResX] + aRadiance;
         mRadiance[x + y * mResX] += aRadiance;
+
+        if (!mSampleCounts.empty())
+        {
+            const FramebufferFloat luminance = aRadiance.Luminance();
+            mLuminanceSum[x + y * mResX]    += luminance;
+            mLuminanceSqrSum[x + y * mResX] += luminance * luminance;
+        }
     }
 
     //////////////////////////////////////////////////////////////////////////
@@ -59,6 +68,9 @@ public:
     void Clear()
     {
         memset(&mRadiance[0], 0, sizeof(FramebufferSpectrum) * mRadiance.size());
+
+        if (!mSampleCounts.empty())
+            EnableSampleStatistics();
     }
 
     void Add(const Framebuffer& aOther)
@@ -76,6 +88,229 @@ public:
             spectrum *= scaleAttenuation;
     }
 
+    //////////////////////////////////////////////////////////////////////////
+    // Per-pixel sample statistics for adaptive sampling
+    //
+    // Sample counts and the first two moments of sample luminance are tracked for each pixel.
+    // Pixels whose relative standard error of the mean luminance drops below a threshold
+    // become inactive and renderers skip them. The samples saved this way are given to
+    // the remaining pixels in proportion to their relative error.
+
+    // Upper bound of the samples a pixel gets in one iteration, keeps the tiles balanced
+    static const uint32_t kMaxIterationSamples = 64;
+
+    // Pixels whose samples all had the same luminance (typically all zero) have zero error
+    // estimate, which says nothing about rare bright paths (caustics, small lights seen through
+    // gaps). Such pixels need this many times the minimum sample count to be deactivated.
+    static const uint32_t kZeroVarianceMinSamplesFactor = 4;
+
+    // Resets the statistics and makes all pixels active
+    void EnableSampleStatistics()
+    {
+        const size_t pixelCount = mRadiance.size();
+        mSampleCounts.assign(pixelCount, 0u);
+        mLuminanceSum.assign(pixelCount, FramebufferFloat(0.));
+        mLuminanceSqrSum.assign(pixelCount, FramebufferFloat(0.));
+        mIterationSamples.assign(pixelCount, 1u);
+        mExtraSampleCredit.assign(pixelCount, FramebufferFloat(0.));
+    }
+
+    // Number of samples the renderers take in the pixel during the current iteration;
+    // zero for converged pixels. Always one without the sample statistics.
+    uint32_t GetIterationSampleCount(uint32_t x, uint32_t y) const
+    {
+        return mIterationSamples.empty() ? 1u : mIterationSamples[x + y * mResX];
+    }
+
+    // Index of the first sample the pixel gets in the current iteration
+    uint32_t GetFirstSampleIndex(uint32_t x, uint32_t y, uint32_t aIteration) const
+    {
+        return mSampleCounts.empty() ? aIteration : mSampleCounts[x + y * mResX];
+    }
+
+    // Relative standard error of the mean luminance of the pixel. Values darker than
+    // aMinLuminance are treated as aMinLuminance to avoid division by (almost) zero.
+    FramebufferFloat PixelRelativeError(
+        const size_t            aPixelIdx,
+        const FramebufferFloat  aMinLuminance = FramebufferFloat(1e-3)) const
+    {
+        const uint32_t count = mSampleCounts[aPixelIdx];
+        if (count < 2)
+            return Math::InfinityF();
+
+        const FramebufferFloat mean     = mLuminanceSum[aPixelIdx] / count;
+        const FramebufferFloat variance =
+            std::max(mLuminanceSqrSum[aPixelIdx] / count - mean * mean, FramebufferFloat(0.));
+        const FramebufferFloat meanStdError = std::sqrt(variance / (count - 1));
+
+        return meanStdError / std::max(std::abs(mean), aMinLuminance);
+    }
+
+    // Whether all samples of the pixel had (almost) the same luminance, e.g. all were zero
+    bool HasZeroVariance(const size_t aPixelIdx) const
+    {
+        const uint32_t count = mSampleCounts[aPixelIdx];
+        if (count == 0)
+            return true;
+
+        const FramebufferFloat mean     = mLuminanceSum[aPixelIdx] / count;
+        const FramebufferFloat variance = mLuminanceSqrSum[aPixelIdx] / count - mean * mean;
+
+        return variance <= FramebufferFloat(1e-6) * mean * mean;
+    }
+
+    // Must be called after each iteration. Counts the new samples in the given row and
+    // deactivates converged pixels. Returns the number of pixels in the row which remain active
+    // and adds their sample allocation weights to aoWeightSum.
+    uint32_t UpdateActivePixels(
+        const uint32_t           aRow,
+        const FramebufferFloat   aMaxRelativeError,
+        const uint32_t           aMinSampleCount,
+        FramebufferFloat        &aoWeightSum)
+    {
+        PG3_ASSERT(!mSampleCounts.empty());
+
+        uint32_t activeCount = 0;
+        for (size_t i = aRow * mResX; i < (aRow + 1) * (size_t)mResX; i++)
+        {
+            if (mIterationSamples[i] == 0)
+                continue;
+
+            mSampleCounts[i] += mIterationSamples[i];
+
+            const uint32_t minSampleCount =
+                  HasZeroVariance(i)
+                ? aMinSampleCount * kZeroVarianceMinSamplesFactor
+                : aMinSampleCount;
+            if (   (mSampleCounts[i] >= minSampleCount)
+                && (PixelRelativeError(i) <= aMaxRelativeError))
+                mIterationSamples[i] = 0;
+            else
+            {
+                aoWeightSum += SampleAllocationWeight(i, aMinSampleCount);
+                activeCount++;
+            }
+        }
+
+        return activeCount;
+    }
+
+    // Sets the samples of the active pixels in the given row for the next iteration: one sample
+    // plus aExtraSamplesPerWeight times the allocation weight (the relative error) of the pixel.
+    // Fractions of samples are carried over to the next iterations so that the budget is not
+    // lost to rounding. Must be called after UpdateActivePixels() has processed all rows.
+    void AllocatePixelSamples(
+        const uint32_t           aRow,
+        const FramebufferFloat   aExtraSamplesPerWeight,
+        const uint32_t           aMinSampleCount)
+    {
+        PG3_ASSERT(!mSampleCounts.empty());
+
+        for (size_t i = aRow * mResX; i < (aRow + 1) * (size_t)mResX; i++)
+        {
+            if (mIterationSamples[i] == 0)
+                continue;
+
+            const FramebufferFloat credit = std::min(
+                mExtraSampleCredit[i] + SampleAllocationWeight(i, aMinSampleCount) * aExtraSamplesPerWeight,
+                FramebufferFloat(kMaxIterationSamples - 1));
+            const uint32_t extraSamples = (uint32_t)credit;
+            mExtraSampleCredit[i] = credit - extraSamples;
+            mIterationSamples[i] = 1u + extraSamples;
+        }
+    }
+
+    // Pixels without a reliable error estimate yet don't get any extra samples
+    FramebufferFloat SampleAllocationWeight(
+        const size_t     aPixelIdx,
+        const uint32_t   aMinSampleCount) const
+    {
+        if ((mSampleCounts[aPixelIdx] < aMinSampleCount) || (mSampleCounts[aPixelIdx] < 2))
+            return FramebufferFloat(0.);
+        return PixelRelativeError(aPixelIdx);
+    }
+
+    // Divides accumulated radiance by the per-pixel sample counts
+    void NormalizeBySampleCounts()
+    {
+        PG3_ASSERT(!mSampleCounts.empty());
+
+        for (size_t i = 0; i < mRadiance.size(); i++)
+        {
+            if (mSampleCounts[i] == 0)
+                continue;
+
+            FramebufferSpectrum scaleAttenuation;
+            scaleAttenuation.SetGreyAttenuation(FramebufferFloat(1.) / mSampleCounts[i]);
+            mRadiance[i] *= scaleAttenuation;
+        }
+    }
+
+    struct SampleStatistics
+    {
+        uint32_t            minSamples;
+        uint32_t            maxSamples;
+        FramebufferFloat    avgSamples;
+        FramebufferFloat    convergedRatio;     // Pixels with relative error under the threshold
+        FramebufferFloat    avgRelativeError;   // Over pixels with at least 2 samples
+        FramebufferFloat    maxRelativeError;
+        FramebufferFloat    unsampledRatio;     // Pixels without any sample, not in the histogram
+
+        // Pixel ratios with [2^i, 2^(i+1)) samples
+        static const uint32_t kHistogramSize = 32;
+        FramebufferFloat    histogram[kHistogramSize];
+    };
+
+    void GetSampleStatistics(
+        const FramebufferFloat   aMaxRelativeError,
+        SampleStatistics        &oStats) const
+    {
+        PG3_ASSERT(!mSampleCounts.empty());
+
+        oStats = SampleStatistics();
+        oStats.minSamples = std::numeric_limits<uint32_t>::max();
+
+        uint64_t samplesSum = 0;
+        uint32_t convergedCount = 0;
+        uint32_t errorCount = 0;
+        for (size_t i = 0; i < mSampleCounts.size(); i++)
+        {
+            const uint32_t count = mSampleCounts[i];
+            oStats.minSamples = std::min(oStats.minSamples, count);
+            oStats.maxSamples = std::max(oStats.maxSamples, count);
+            samplesSum += count;
+
+            if (count == 0)
+                oStats.unsampledRatio += FramebufferFloat(1.);
+            else
+            {
+                uint32_t bucket = 0;
+                while ((bucket + 1 < SampleStatistics::kHistogramSize) && ((count >> (bucket + 1)) > 0))
+                    bucket++;
+                oStats.histogram[bucket] += FramebufferFloat(1.);
+            }
+
+            const FramebufferFloat relError = PixelRelativeError(i);
+            if (relError <= aMaxRelativeError)
+                convergedCount++;
+            if (count >= 2)
+            {
+                oStats.avgRelativeError += relError;
+                oStats.maxRelativeError  = std::max(oStats.maxRelativeError, relError);
+                errorCount++;
+            }
+        }
+
+        const FramebufferFloat pixelCount = (FramebufferFloat)mSampleCounts.size();
+        oStats.avgSamples       = samplesSum / pixelCount;
+        oStats.convergedRatio   = convergedCount / pixelCount;
+        if (errorCount > 0)
+            oStats.avgRelativeError /= errorCount;
+        oStats.unsampledRatio /= pixelCount;
+        for (auto &bucket : oStats.histogram)
+            bucket /= pixelCount;
+    }
+
     //////////////////////////////////////////////////////////////////////////
     // Statistics
     FramebufferFloat TotalLuminance()
@@ -89,6 +324,28 @@ public:
         return lum;
     }
 
+    // Root mean square error of the pixel luminances relative to the mean luminance
+    // of the reference image
+    FramebufferFloat RelativeRmse(const Framebuffer &aReference) const
+    {
+        PG3_ASSERT(mRadiance.size() == aReference.mRadiance.size());
+
+        double sqrErrorSum = 0., referenceSum = 0.;
+        for (size_t i = 0; i < mRadiance.size(); i++)
+        {
+            const double reference = aReference.mRadiance[i].Luminance();
+            const double error     = mRadiance[i].Luminance() - reference;
+            sqrErrorSum  += error * error;
+            referenceSum += reference;
+        }
+
+        if (!(referenceSum > 0.))
+            return 0.;
+
+        const double pixelCount = (double)mRadiance.size();
+        return (FramebufferFloat)(std::sqrt(sqrErrorSum / pixelCount) / (referenceSum / pixelCount));
+    }
+
     //////////////////////////////////////////////////////////////////////////
     // Saving BMP
     struct BmpHeader
@@ -199,9 +456,94 @@ public:
         }
     }
 
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+
+    // A pixel which gets a bright sample only once in a while (e.g. a caustic) must not be
+    // deactivated because its first samples were all zero
+    static bool _UT_SparseHitPixel(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Sparse hit pixel stays active");
+
+        const FramebufferFloat maxRelativeError = FramebufferFloat(0.1);
+        const uint32_t minSampleCount = 16;
+        const uint32_t hitSampleIdx = 40;   // Beyond the minimum sample count
+
+        Framebuffer framebuffer;
+        framebuffer.Setup(Vec2f(2.f, 1.f));
+        framebuffer.EnableSampleStatistics();
+
+        // Pixel 0: zero except for one bright sample; pixel 1: converging noise (1, 3, 1, ...)
+        auto sampleValue = [&](uint32_t aX, uint32_t aSampleIdx) -> SpectrumF
+        {
+            SpectrumF value;
+            if (aX == 0)
+                value.SetGreyAttenuation((aSampleIdx == hitSampleIdx) ? 40.f : 0.f);
+            else
+                value.SetGreyAttenuation(((aSampleIdx % 2) == 0) ? 1.f : 3.f);
+            return value;
+        };
+
+        for (uint32_t iteration = 0; iteration < 100; iteration++)
+        {
+            for (uint32_t x = 0; x < 2; x++)
+            {
+                const uint32_t firstSample = framebuffer.GetFirstSampleIndex(x, 0, iteration);
+                const uint32_t sampleCount = framebuffer.GetIterationSampleCount(x, 0);
+                for (uint32_t sampleIdx = firstSample; sampleIdx < firstSample + sampleCount; sampleIdx++)
+                    framebuffer.AddRadiance(x, 0, sampleValue(x, sampleIdx));
+            }
+
+            FramebufferFloat errorSum = FramebufferFloat(0.);
+            const uint32_t activeCount =
+                framebuffer.UpdateActivePixels(0, maxRelativeError, minSampleCount, errorSum);
+            const FramebufferFloat extraSamplesPerError = (errorSum > FramebufferFloat(0.))
+                ? (2 - activeCount) / errorSum
+                : FramebufferFloat(0.);
+            framebuffer.AllocatePixelSamples(0, extraSamplesPerError, minSampleCount);
+        }
+
+        const char *failure = nullptr;
+        if (framebuffer.mSampleCounts[0] <= hitSampleIdx)
+            failure = "The pixel was deactivated before its first non-zero sample";
+        else if (!(framebuffer.mLuminanceSum[0] > FramebufferFloat(0.)))
+            failure = "The non-zero sample is missing";
+        else if (framebuffer.GetIterationSampleCount(1, 0) != 0)
+            failure = "The converged pixel is still active";
+
+        if (failure != nullptr)
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Sparse hit pixel stays active", failure);
+            return false;
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Sparse hit pixel stays active");
+        return true;
+    }
+
+    static bool _UnitTests(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblWholeTest, "Framebuffer: adaptive sampling");
+
+        if (!_UT_SparseHitPixel(aMaxUtBlockPrintLevel))
+            return false;
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblWholeTest, "Framebuffer: adaptive sampling");
+        return true;
+    }
+
+#endif
+
 private:
 
     std::vector<FramebufferSpectrum>    mRadiance;
+
+    // Adaptive sampling statistics; empty if not enabled
+    std::vector<uint32_t>               mSampleCounts;
+    std::vector<FramebufferFloat>       mLuminanceSum;
+    std::vector<FramebufferFloat>       mLuminanceSqrSum;
+    std::vector<uint32_t>               mIterationSamples;  // zero for converged pixels
+    std::vector<FramebufferFloat>       mExtraSampleCredit; // fractional extra samples carried over
     Vec2f                               mResolution;
     int32_t                             mResX;
     int32_t                             mResY;
@@ -0,0 +1,675 @@
+#pragma once
+
+#include "scene_graph.hxx"
+#include "math.hxx"
+#include "ray.hxx"
+#include "rng.hxx"
+#include "sampling.hxx"
+#include "debugging.hxx"
+#include "unit_testing.hxx"
+#include "types.hxx"
+
+#include <emmintrin.h> // SSE2
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Structure-of-arrays copy of triangles and spheres with SSE kernels which intersect one ray
+// with 4 primitives at once.
+//
+// The arrays are indexed by the index of the primitive in the source geometry vector, so any
+// contiguous range of primitives (e.g. a BVH leaf) can be processed in chunks of 4 using
+// unaligned loads. Other geometry types are not copied; they are processed by the scalar
+// virtual code path.
+//
+// The kernels perform exactly the same floating point operations in the same order as the
+// scalar Triangle::Intersect() and Sphere::Intersect() and therefore produce bit-identical
+// results. The double-precision part of the sphere test (after the discriminant) is evaluated
+// 2 lanes at a time. The final selection of the closest candidate is done lane by lane
+// in primitive order, what keeps the semantics of the sequential scalar loop.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class GeometrySoA
+{
+public:
+
+    static const uint32_t kLaneCount = 4;
+
+    enum PrimitiveType : uint8_t
+    {
+        kOther      = 0,    // Handled by the virtual scalar path
+        kTriangle   = 1,
+        kSphere     = 2,
+    };
+
+    // Ray broadcast into all SIMD lanes
+    struct RaySimd
+    {
+        RaySimd(const Ray &aRay)
+        {
+            orgX = _mm_set1_ps(aRay.org.x);
+            orgY = _mm_set1_ps(aRay.org.y);
+            orgZ = _mm_set1_ps(aRay.org.z);
+            dirX = _mm_set1_ps(aRay.dir.x);
+            dirY = _mm_set1_ps(aRay.dir.y);
+            dirZ = _mm_set1_ps(aRay.dir.z);
+            tMin = _mm_set1_ps(aRay.tmin);
+        }
+
+        __m128 orgX, orgY, orgZ;
+        __m128 dirX, dirY, dirZ;
+        __m128 tMin;
+    };
+
+public:
+
+    // Copies triangles (including mesh triangles) and spheres from the given geometry vector.
+    // Must be rebuilt whenever the vector changes.
+    void Build(const std::vector<AbstractGeometry*> &aGeometry)
+    {
+        const size_t primCount = aGeometry.size();
+
+        // Chunks starting near the end read up to kLaneCount-1 elements past the last primitive
+        const size_t paddedCount = primCount + kLaneCount;
+
+        mTypes.assign(paddedCount, kOther);
+        mMatIds.assign(paddedCount, 0);
+        for (auto *data : { &mP0x, &mP0y, &mP0z, &mP1x, &mP1y, &mP1z, &mP2x, &mP2y, &mP2z,
+                            &mNx, &mNy, &mNz, &mCx, &mCy, &mCz, &mRadius })
+            data->assign(paddedCount, 0.f);
+
+        for (size_t i = 0; i < primCount; i++)
+        {
+            if (const Triangle *triangle = dynamic_cast<const Triangle*>(aGeometry[i]))
+                SetTriangle(
+                    i, triangle->p[0], triangle->p[1], triangle->p[2],
+                    triangle->mNormal, triangle->mMatId);
+            else if (const MeshTriangle *meshTriangle = dynamic_cast<const MeshTriangle*>(aGeometry[i]))
+                SetTriangle(
+                    i, meshTriangle->GetVertex(0), meshTriangle->GetVertex(1), meshTriangle->GetVertex(2),
+                    meshTriangle->GetNormal(), meshTriangle->mMatId);
+            else if (const Sphere *sphere = dynamic_cast<const Sphere*>(aGeometry[i]))
+            {
+                mTypes[i]   = kSphere;
+                mMatIds[i]  = sphere->mMatId;
+                mCx[i]      = sphere->mCenter.x;
+                mCy[i]      = sphere->mCenter.y;
+                mCz[i]      = sphere->mCenter.z;
+                mRadius[i]  = sphere->mRadius;
+            }
+        }
+    }
+
+    // Allocated size of all the arrays
+    size_t GetStorageSize() const
+    {
+        size_t size = mTypes.capacity() * sizeof(uint8_t) + mMatIds.capacity() * sizeof(int32_t);
+        for (auto *data : { &mP0x, &mP0y, &mP0z, &mP1x, &mP1y, &mP1z, &mP2x, &mP2y, &mP2z,
+                            &mNx, &mNy, &mNz, &mCx, &mCy, &mCz, &mRadius })
+            size += data->capacity() * sizeof(float);
+        return size;
+    }
+
+    // Finds the closest intersection with primitives [aFirst, aEnd).
+    // Returns true if any of them was hit closer than oResult.dist.
+    bool Intersect(
+        const uint32_t                          aFirst,
+        const uint32_t                          aEnd,
+        const std::vector<AbstractGeometry*>   &aGeometry,
+        const RaySimd                          &aRaySimd,
+        const Ray                              &aRay,
+        RayIntersection                        &oResult) const
+    {
+        bool anyIntersection = false;
+
+        for (uint32_t chunk = aFirst; chunk < aEnd; chunk += kLaneCount)
+        {
+            uint32_t triangleMask, sphereMask, otherMask;
+            ChunkLaneMasks(chunk, aEnd, triangleMask, sphereMask, otherMask);
+
+            const uint32_t typeCount =
+                (triangleMask != 0 ? 1u : 0u) + (sphereMask != 0 ? 1u : 0u) + (otherMask != 0 ? 1u : 0u);
+            if (typeCount == 1)
+            {
+                if (triangleMask && IntersectTriangles4(chunk, triangleMask, aRaySimd, aRay, oResult))
+                    anyIntersection = true;
+                if (sphereMask && IntersectSpheres4(chunk, sphereMask, aRaySimd, aRay, oResult))
+                    anyIntersection = true;
+                for (uint32_t lane = 0; otherMask != 0; lane++, otherMask >>= 1)
+                    if ((otherMask & 1u) && aGeometry[chunk + lane]->Intersect(aRay, oResult))
+                        anyIntersection = true;
+            }
+            else
+            {
+                // Chunks with mixed primitive types (rare) are processed lane by lane, so that
+                // hits at exactly the same distance resolve to the same primitive as in the scalar loop
+                for (uint32_t lane = 0; lane < kLaneCount; lane++)
+                {
+                    const uint32_t laneBit = 1u << lane;
+                    if ((triangleMask & laneBit) && IntersectTriangles4(chunk, laneBit, aRaySimd, aRay, oResult))
+                        anyIntersection = true;
+                    else if ((sphereMask & laneBit) && IntersectSpheres4(chunk, laneBit, aRaySimd, aRay, oResult))
+                        anyIntersection = true;
+                    else if ((otherMask & laneBit) && aGeometry[chunk + lane]->Intersect(aRay, oResult))
+                        anyIntersection = true;
+                }
+            }
+        }
+
+        return anyIntersection;
+    }
+
+    // Finds any intersection with primitives [aFirst, aEnd) closer than oResult.dist
+    bool IntersectP(
+        const uint32_t                          aFirst,
+        const uint32_t                          aEnd,
+        const std::vector<AbstractGeometry*>   &aGeometry,
+        const RaySimd                          &aRaySimd,
+        const Ray                              &aRay,
+        RayIntersection                        &oResult) const
+    {
+        for (uint32_t chunk = aFirst; chunk < aEnd; chunk += kLaneCount)
+        {
+            uint32_t triangleMask, sphereMask, otherMask;
+            ChunkLaneMasks(chunk, aEnd, triangleMask, sphereMask, otherMask);
+
+            if (triangleMask && OccludedTriangles4(chunk, triangleMask, aRaySimd, aRay, oResult))
+                return true;
+            if (sphereMask && OccludedSpheres4(chunk, sphereMask, aRaySimd, aRay, oResult))
+                return true;
+            for (uint32_t lane = 0; otherMask != 0; lane++, otherMask >>= 1)
+                if ((otherMask & 1u) && aGeometry[chunk + lane]->IntersectP(aRay, oResult))
+                    return true;
+        }
+
+        return false;
+    }
+
+protected:
+
+    void ChunkLaneMasks(
+        const uint32_t   aChunk,
+        const uint32_t   aEnd,
+        uint32_t        &oTriangleMask,
+        uint32_t        &oSphereMask,
+        uint32_t        &oOtherMask) const
+    {
+        oTriangleMask = oSphereMask = oOtherMask = 0u;
+
+        const uint32_t laneCount = std::min((uint32_t)kLaneCount, aEnd - aChunk);
+        for (uint32_t lane = 0; lane < laneCount; lane++)
+        {
+            switch (mTypes[aChunk + lane])
+            {
+            case kTriangle: oTriangleMask   |= 1u << lane; break;
+            case kSphere:   oSphereMask     |= 1u << lane; break;
+            default:        oOtherMask      |= 1u << lane; break;
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Triangles
+
+    void SetTriangle(
+        const size_t     aIdx,
+        const Vec3f     &aP0,
+        const Vec3f     &aP1,
+        const Vec3f     &aP2,
+        const Vec3f     &aNormal,
+        const int32_t    aMatId)
+    {
+        mTypes[aIdx]    = kTriangle;
+        mMatIds[aIdx]   = aMatId;
+        mP0x[aIdx] = aP0.x; mP0y[aIdx] = aP0.y; mP0z[aIdx] = aP0.z;
+        mP1x[aIdx] = aP1.x; mP1y[aIdx] = aP1.y; mP1z[aIdx] = aP1.z;
+        mP2x[aIdx] = aP2.x; mP2y[aIdx] = aP2.y; mP2z[aIdx] = aP2.z;
+        mNx[aIdx]  = aNormal.x;
+        mNy[aIdx]  = aNormal.y;
+        mNz[aIdx]  = aNormal.z;
+    }
+
+    // Mirrors Triangle::Intersect(). Returns the mask of lanes which are hit within
+    // (tmin, aTMax) and the respective distances.
+    int32_t TriangleCandidates4(
+        const uint32_t   aFirst,
+        const RaySimd   &aRaySimd,
+        const float      aTMax,
+        __m128          &oDistance) const
+    {
+        const __m128 aoX = _mm_sub_ps(_mm_loadu_ps(&mP0x[aFirst]), aRaySimd.orgX);
+        const __m128 aoY = _mm_sub_ps(_mm_loadu_ps(&mP0y[aFirst]), aRaySimd.orgY);
+        const __m128 aoZ = _mm_sub_ps(_mm_loadu_ps(&mP0z[aFirst]), aRaySimd.orgZ);
+        const __m128 boX = _mm_sub_ps(_mm_loadu_ps(&mP1x[aFirst]), aRaySimd.orgX);
+        const __m128 boY = _mm_sub_ps(_mm_loadu_ps(&mP1y[aFirst]), aRaySimd.orgY);
+        const __m128 boZ = _mm_sub_ps(_mm_loadu_ps(&mP1z[aFirst]), aRaySimd.orgZ);
+        const __m128 coX = _mm_sub_ps(_mm_loadu_ps(&mP2x[aFirst]), aRaySimd.orgX);
+        const __m128 coY = _mm_sub_ps(_mm_loadu_ps(&mP2y[aFirst]), aRaySimd.orgY);
+        const __m128 coZ = _mm_sub_ps(_mm_loadu_ps(&mP2z[aFirst]), aRaySimd.orgZ);
+
+        // v0 = Cross(co, bo), v1 = Cross(bo, ao), v2 = Cross(ao, co), projected onto ray direction
+        const __m128 v0d = CrossDot(coX, coY, coZ, boX, boY, boZ, aRaySimd);
+        const __m128 v1d = CrossDot(boX, boY, boZ, aoX, aoY, aoZ, aRaySimd);
+        const __m128 v2d = CrossDot(aoX, aoY, aoZ, coX, coY, coZ, aRaySimd);
+
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 allNeg =
+            _mm_and_ps(_mm_and_ps(_mm_cmplt_ps(v0d, zero), _mm_cmplt_ps(v1d, zero)), _mm_cmplt_ps(v2d, zero));
+        const __m128 allPos =
+            _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(v0d, zero), _mm_cmpge_ps(v1d, zero)), _mm_cmpge_ps(v2d, zero));
+        const __m128 inside = _mm_or_ps(allNeg, allPos);
+
+        const __m128 nX = _mm_loadu_ps(&mNx[aFirst]);
+        const __m128 nY = _mm_loadu_ps(&mNy[aFirst]);
+        const __m128 nZ = _mm_loadu_ps(&mNz[aFirst]);
+        const __m128 distance = _mm_div_ps(
+            Dot(nX, nY, nZ, aoX, aoY, aoZ),
+            Dot(nX, nY, nZ, aRaySimd.dirX, aRaySimd.dirY, aRaySimd.dirZ));
+
+        const __m128 inRange = _mm_and_ps(
+            _mm_cmpgt_ps(distance, aRaySimd.tMin),
+            _mm_cmplt_ps(distance, _mm_set1_ps(aTMax)));
+
+        oDistance = distance;
+        return _mm_movemask_ps(_mm_and_ps(inside, inRange));
+    }
+
+    bool IntersectTriangles4(
+        const uint32_t   aFirst,
+        const uint32_t   aLaneMask,
+        const RaySimd   &aRaySimd,
+        const Ray       &aRay,
+        RayIntersection &oResult) const
+    {
+        aRay; // unused parameter
+
+        __m128 distanceSimd;
+        const uint32_t candidates =
+            (uint32_t)TriangleCandidates4(aFirst, aRaySimd, oResult.dist, distanceSimd) & aLaneMask;
+        if (candidates == 0)
+            return false;
+
+        float distance[kLaneCount];
+        _mm_storeu_ps(distance, distanceSimd);
+
+        // Sequential selection keeps the semantics of the scalar loop
+        bool anyIntersection = false;
+        for (uint32_t lane = 0; lane < kLaneCount; lane++)
+        {
+            if (((candidates & (1u << lane)) != 0) && (distance[lane] < oResult.dist))
+            {
+                const uint32_t primIdx = aFirst + lane;
+                oResult.normal = Vec3f(mNx[primIdx], mNy[primIdx], mNz[primIdx]);
+                oResult.matID  = mMatIds[primIdx];
+                oResult.dist   = distance[lane];
+                anyIntersection = true;
+            }
+        }
+
+        return anyIntersection;
+    }
+
+    bool OccludedTriangles4(
+        const uint32_t   aFirst,
+        const uint32_t   aLaneMask,
+        const RaySimd   &aRaySimd,
+        const Ray       &aRay,
+        RayIntersection &oResult) const
+    {
+        aRay; // unused parameter
+
+        __m128 distanceSimd;
+        return (TriangleCandidates4(aFirst, aRaySimd, oResult.dist, distanceSimd) & aLaneMask) != 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Spheres
+
+    // Mirrors Sphere::Intersect() up to the ordering of the two roots. Returns the mask of lanes
+    // with non-negative discriminant and both roots (t0 <= t1) in double precision.
+    uint32_t SphereCandidates4(
+        const uint32_t   aFirst,
+        const uint32_t   aLaneMask,
+        const RaySimd   &aRaySimd,
+        double           oT0[kLaneCount],
+        double           oT1[kLaneCount]) const
+    {
+        const __m128 toX = _mm_sub_ps(aRaySimd.orgX, _mm_loadu_ps(&mCx[aFirst]));
+        const __m128 toY = _mm_sub_ps(aRaySimd.orgY, _mm_loadu_ps(&mCy[aFirst]));
+        const __m128 toZ = _mm_sub_ps(aRaySimd.orgZ, _mm_loadu_ps(&mCz[aFirst]));
+        const __m128 radius = _mm_loadu_ps(&mRadius[aFirst]);
+
+        const __m128 A = Dot(aRaySimd.dirX, aRaySimd.dirY, aRaySimd.dirZ, aRaySimd.dirX, aRaySimd.dirY, aRaySimd.dirZ);
+        const __m128 B = _mm_mul_ps(_mm_set1_ps(2.f), Dot(aRaySimd.dirX, aRaySimd.dirY, aRaySimd.dirZ, toX, toY, toZ));
+        const __m128 C = _mm_sub_ps(Dot(toX, toY, toZ, toX, toY, toZ), _mm_mul_ps(radius, radius));
+
+        // The scalar code evaluates the discriminant expression in float and only stores it as double
+        const __m128 discriminant =
+            _mm_sub_ps(_mm_mul_ps(B, B), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.f), A), C));
+
+        const uint32_t candidates =
+            ~(uint32_t)_mm_movemask_ps(_mm_cmplt_ps(discriminant, _mm_setzero_ps())) & aLaneMask;
+        if (candidates == 0)
+            return 0u;
+
+        // Double precision part, two lanes at a time
+        for (uint32_t half = 0; half < 2; half++)
+        {
+            if (((candidates >> (2 * half)) & 3u) == 0)
+                continue;
+
+            const __m128d discD = ToDoubleHalf(discriminant, half);
+            const __m128d AD    = ToDoubleHalf(A, half);
+            const __m128d BD    = ToDoubleHalf(B, half);
+            const __m128d CD    = ToDoubleHalf(C, half);
+
+            const __m128d discSqrt = _mm_sqrt_pd(discD);
+            const __m128d negB = _mm_sub_pd(_mm_setzero_pd(), BD);
+            const __m128d half2 = _mm_set1_pd(2.);
+
+            // q = (B >= 0) ? ((-B - discSqrt) / 2.f) : ((-B + discSqrt) / 2.f)
+            const __m128d bNonNeg = _mm_cmpge_pd(BD, _mm_setzero_pd());
+            const __m128d q = Select(
+                bNonNeg,
+                _mm_div_pd(_mm_sub_pd(negB, discSqrt), half2),
+                _mm_div_pd(_mm_add_pd(negB, discSqrt), half2));
+
+            // t1 = (std::abs(q) > 0.1) ? (C / q) : t0
+            const __m128d t0 = _mm_div_pd(q, AD);
+            const __m128d absQ = _mm_andnot_pd(_mm_set1_pd(-0.), q);
+            const __m128d t1 = Select(_mm_cmpgt_pd(absQ, _mm_set1_pd(0.1)), _mm_div_pd(CD, q), t0);
+
+            // if (t0 > t1) std::swap(t0, t1);
+            _mm_storeu_pd(&oT0[2 * half], _mm_min_pd(t1, t0));
+            _mm_storeu_pd(&oT1[2 * half], _mm_max_pd(t0, t1));
+        }
+
+        return candidates;
+    }
+
+    bool IntersectSpheres4(
+        const uint32_t   aFirst,
+        const uint32_t   aLaneMask,
+        const RaySimd   &aRaySimd,
+        const Ray       &aRay,
+        RayIntersection &oResult) const
+    {
+        double t0[kLaneCount], t1[kLaneCount];
+        const uint32_t candidates = SphereCandidates4(aFirst, aLaneMask, aRaySimd, t0, t1);
+        if (candidates == 0)
+            return false;
+
+        // Sequential selection keeps the semantics of the scalar loop
+        bool anyIntersection = false;
+        for (uint32_t lane = 0; lane < kLaneCount; lane++)
+        {
+            if ((candidates & (1u << lane)) == 0)
+                continue;
+
+            float resT;
+            if (t0[lane] > aRay.tmin && t0[lane] < oResult.dist)
+                resT = float(t0[lane]);
+            else if (t1[lane] > aRay.tmin && t1[lane] < oResult.dist)
+                resT = float(t1[lane]);
+            else
+                continue;
+
+            const uint32_t primIdx = aFirst + lane;
+            const Vec3f transformedOrigin = aRay.org - Vec3f(mCx[primIdx], mCy[primIdx], mCz[primIdx]);
+            oResult.dist   = resT;
+            oResult.matID  = mMatIds[primIdx];
+            oResult.normal = Normalize(transformedOrigin + Vec3f(resT) * aRay.dir);
+            anyIntersection = true;
+        }
+
+        return anyIntersection;
+    }
+
+    bool OccludedSpheres4(
+        const uint32_t   aFirst,
+        const uint32_t   aLaneMask,
+        const RaySimd   &aRaySimd,
+        const Ray       &aRay,
+        RayIntersection &oResult) const
+    {
+        double t0[kLaneCount], t1[kLaneCount];
+        const uint32_t candidates = SphereCandidates4(aFirst, aLaneMask, aRaySimd, t0, t1);
+
+        for (uint32_t lane = 0; lane < kLaneCount; lane++)
+        {
+            if ((candidates & (1u << lane)) == 0)
+                continue;
+
+            if (   (t0[lane] > aRay.tmin && t0[lane] < oResult.dist)
+                || (t1[lane] > aRay.tmin && t1[lane] < oResult.dist))
+                return true;
+        }
+
+        return false;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // SIMD helpers
+
+    // Same evaluation order as Dot() in math.hxx
+    static __m128 Dot(
+        const __m128 aX, const __m128 aY, const __m128 aZ,
+        const __m128 bX, const __m128 bY, const __m128 bZ)
+    {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(aX, bX), _mm_mul_ps(aY, bY)), _mm_mul_ps(aZ, bZ));
+    }
+
+    // Dot(Cross(a, b), rayDir), same evaluation order as Cross() and Dot() in math.hxx
+    static __m128 CrossDot(
+        const __m128 aX, const __m128 aY, const __m128 aZ,
+        const __m128 bX, const __m128 bY, const __m128 bZ,
+        const RaySimd &aRaySimd)
+    {
+        const __m128 cX = _mm_sub_ps(_mm_mul_ps(aY, bZ), _mm_mul_ps(aZ, bY));
+        const __m128 cY = _mm_sub_ps(_mm_mul_ps(aZ, bX), _mm_mul_ps(aX, bZ));
+        const __m128 cZ = _mm_sub_ps(_mm_mul_ps(aX, bY), _mm_mul_ps(aY, bX));
+        return Dot(cX, cY, cZ, aRaySimd.dirX, aRaySimd.dirY, aRaySimd.dirZ);
+    }
+
+    // Converts lanes 0-1 (aHalf == 0) or 2-3 (aHalf == 1) to doubles
+    static __m128d ToDoubleHalf(const __m128 aVal, const uint32_t aHalf)
+    {
+        return _mm_cvtps_pd((aHalf == 0) ? aVal : _mm_movehl_ps(aVal, aVal));
+    }
+
+    static __m128d Select(const __m128d aMask, const __m128d aTrue, const __m128d aFalse)
+    {
+        return _mm_or_pd(_mm_and_pd(aMask, aTrue), _mm_andnot_pd(aMask, aFalse));
+    }
+
+protected:
+
+    std::vector<uint8_t>    mTypes;
+    std::vector<int32_t>    mMatIds;
+
+    // Triangles
+    std::vector<float>      mP0x, mP0y, mP0z;
+    std::vector<float>      mP1x, mP1y, mP1z;
+    std::vector<float>      mP2x, mP2y, mP2z;
+    std::vector<float>      mNx,  mNy,  mNz;
+
+    // Spheres
+    std::vector<float>      mCx,  mCy,  mCz;
+    std::vector<float>      mRadius;
+
+public:
+
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+
+    static bool _UT_IsectEqual(
+        const bool               aHit1,
+        const RayIntersection   &aIsect1,
+        const bool               aHit2,
+        const RayIntersection   &aIsect2)
+    {
+        if (aHit1 != aHit2)
+            return false;
+        if (std::memcmp(&aIsect1.dist, &aIsect2.dist, sizeof(float)) != 0)
+            return false;
+        if (!aHit1)
+            return true;
+        return
+               (aIsect1.matID == aIsect2.matID)
+            && (std::memcmp(&aIsect1.normal, &aIsect2.normal, sizeof(Vec3f)) == 0);
+    }
+
+    static bool _UT_MatchesScalar(
+        const UnitTestBlockLevel     aMaxUtBlockPrintLevel,
+        const char                  *aTestName,
+        const uint32_t               aTriangleCount,
+        const uint32_t               aSphereCount,
+        const bool                   aInterleave)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", aTestName);
+
+        // Large primitives around the origin to get many (and overlapping) hits
+        Rng rng(11);
+        GeometryList list;
+        uint32_t trianglesLeft = aTriangleCount;
+        uint32_t spheresLeft   = aSphereCount;
+        while ((trianglesLeft > 0) || (spheresLeft > 0))
+        {
+            const bool addTriangle =
+                (trianglesLeft > 0) && (!aInterleave || (spheresLeft == 0) || (rng.GetFloat() < 0.5f));
+            if (addTriangle)
+            {
+                list.mGeometry.push_back(new Triangle(
+                    rng.GetVec3f() * 2.f - Vec3f(1.f),
+                    rng.GetVec3f() * 2.f - Vec3f(1.f),
+                    rng.GetVec3f() * 2.f - Vec3f(1.f),
+                    (int32_t)list.mGeometry.size()));
+                trianglesLeft--;
+            }
+            else
+            {
+                list.mGeometry.push_back(new Sphere(
+                    rng.GetVec3f() - Vec3f(0.5f),
+                    0.1f + 0.5f * rng.GetFloat(),
+                    (int32_t)list.mGeometry.size()));
+                spheresLeft--;
+            }
+        }
+
+        GeometrySoA soa;
+        soa.Build(list.mGeometry);
+        const uint32_t primCount = (uint32_t)list.mGeometry.size();
+
+        for (uint32_t rayIdx = 0; rayIdx < 20000; rayIdx++)
+        {
+            // Rays from inside and outside of the geometry cluster
+            const float orgScale = (rayIdx % 2 == 0) ? 1.f : 4.f;
+            const Vec3f org = (rng.GetVec3f() * 2.f - Vec3f(1.f)) * orgScale;
+            const Vec3f dir = Sampling::SampleUniformSphereW(rng.GetVec2f());
+            const Ray ray(org, dir, (rayIdx % 3 == 0) ? Geom::kEpsRay : 0.f);
+            const RaySimd raySimd(ray);
+            const float tMax = (rayIdx % 5 == 0) ? 1.f : 1e36f;
+
+            RayIntersection scalarIsect(tMax);
+            RayIntersection simdIsect(tMax);
+            const bool scalarHit = list.Intersect(ray, scalarIsect);
+            const bool simdHit   = soa.Intersect(0, primCount, list.mGeometry, raySimd, ray, simdIsect);
+
+            RayIntersection scalarIsectP(tMax);
+            RayIntersection simdIsectP(tMax);
+            const bool scalarHitP = list.IntersectP(ray, scalarIsectP);
+            const bool simdHitP   = soa.IntersectP(0, primCount, list.mGeometry, raySimd, ray, simdIsectP);
+
+            const char *failure = nullptr;
+            if (!_UT_IsectEqual(scalarHit, scalarIsect, simdHit, simdIsect))
+                failure = "Closest-hit result differs from the scalar code";
+            else if (scalarHitP != simdHitP)
+                failure = "Occlusion result differs from the scalar code";
+
+            if (failure != nullptr)
+            {
+                std::ostringstream errorDescription;
+                errorDescription << failure << " (ray " << rayIdx << ")";
+                PG3_UT_FAILED(
+                    aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s",
+                    errorDescription.str().c_str(), aTestName);
+                return false;
+            }
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", aTestName);
+        return true;
+    }
+
+    // A sphere and a triangle hit at exactly the same distance (1) must resolve to the primitive
+    // which comes first, as in the scalar loop
+    static bool _UT_ExactTie(
+        const UnitTestBlockLevel     aMaxUtBlockPrintLevel,
+        const bool                   aSphereFirst)
+    {
+        const char *testName = aSphereFirst ? "Exact tie, sphere first" : "Exact tie, triangle first";
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", testName);
+
+        GeometryList list;
+        AbstractGeometry *sphere =
+            new Sphere(Vec3f(0.f, 0.f, 2.f), 1.f, 0);
+        AbstractGeometry *triangle =
+            new Triangle(Vec3f(-1.f, -1.f, 1.f), Vec3f(1.f, -1.f, 1.f), Vec3f(0.f, 1.f, 1.f), 1);
+        list.mGeometry.push_back(aSphereFirst ? sphere : triangle);
+        list.mGeometry.push_back(aSphereFirst ? triangle : sphere);
+
+        GeometrySoA soa;
+        soa.Build(list.mGeometry);
+
+        const Ray ray(Vec3f(0.f), Vec3f(0.f, 0.f, 1.f), 0.f);
+        const RaySimd raySimd(ray);
+        RayIntersection scalarIsect(1e36f);
+        RayIntersection simdIsect(1e36f);
+        const bool scalarHit = list.Intersect(ray, scalarIsect);
+        const bool simdHit   = soa.Intersect(0, 2, list.mGeometry, raySimd, ray, simdIsect);
+
+        if (!scalarHit || (scalarIsect.dist != 1.f) || (scalarIsect.matID != (aSphereFirst ? 0 : 1)))
+        {
+            PG3_UT_FATAL_ERROR(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s",
+                "The scalar code doesn't produce the expected tie", testName);
+            return false;
+        }
+        if (!_UT_IsectEqual(scalarHit, scalarIsect, simdHit, simdIsect))
+        {
+            PG3_UT_FAILED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s",
+                "Closest-hit result differs from the scalar code", testName);
+            return false;
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", testName);
+        return true;
+    }
+
+    static bool _UnitTests(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblWholeTest, "GeometrySoA: SIMD kernels match scalar code");
+
+        if (!_UT_MatchesScalar(aMaxUtBlockPrintLevel, "1 triangle", 1, 0, false))
+            return false;
+        if (!_UT_MatchesScalar(aMaxUtBlockPrintLevel, "1 sphere", 0, 1, false))
+            return false;
+        if (!_UT_MatchesScalar(aMaxUtBlockPrintLevel, "4 triangles", 4, 0, false))
+            return false;
+        if (!_UT_MatchesScalar(aMaxUtBlockPrintLevel, "4 spheres", 0, 4, false))
+            return false;
+        if (!_UT_MatchesScalar(aMaxUtBlockPrintLevel, "Triangles, then spheres", 13, 7, false))
+            return false;
+        if (!_UT_MatchesScalar(aMaxUtBlockPrintLevel, "Interleaved triangles and spheres", 37, 29, true))
+            return false;
+        if (!_UT_ExactTie(aMaxUtBlockPrintLevel, true))
+            return false;
+        if (!_UT_ExactTie(aMaxUtBlockPrintLevel, false))
+            return false;
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblWholeTest, "GeometrySoA: SIMD kernels match scalar code");
+        return true;
+    }
+
+#endif
+};
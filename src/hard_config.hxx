@@ -5,21 +5,28 @@
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 //#define PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+//#define PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
 
 //#define PG3_COMPUTE_AND_PRINT_RENDERER_INTROSPECTION
+//#define PG3_COMPUTE_RENDERER_STAGE_TIMES  // Hot-path stage times in the renderer profiling (see -pr); slows rendering down by 10-30%
 #define PG3_COMPUTE_AND_PRINT_EM_STEERABLE_STATISTICS
 
 #define PG3_USE_DOUBLE_FRAMEBUFFER
 
+#define PG3_USE_BVH
+#define PG3_USE_SIMD_INTERSECTION     // SSE kernels for BVH leaves; bit-identical to the scalar code
+
+#define PG3_USE_LIGHT_TREE            // Light hierarchy for picking a light in scenes with many lights
+
 //#define PG3_USE_ART_FRESNEL
 #define PG3_USE_MITSUBA_FRESNEL
 
 #define PG3_USE_ENVMAP_SIMPLE_SPHERICAL_SAMPLER
 //#define PG3_USE_ENVMAP_STEERABLE_SAMPLER
 
-#define PG3_USE_HIERARCHICAL_1D_DISTRIBUTION
+#define PG3_USE_HIERARCHICAL_1D_DISTRIBUTION  // Hierarchical CDF sampling of distributions by default (see -emd)
 
-//#define PG3_USE_EM_MORTON_MAPPING
+//#define PG3_USE_EM_MORTON_MAPPING     // Morton texel layout of environment maps by default (see -eml)
 
 //#define PG3_USE_BALANCE_MIS_HEURISTIC
 #define PG3_USE_POWER_MIS_HEURISTIC
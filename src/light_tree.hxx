@@ -0,0 +1,892 @@
+#pragma once
+
+#include "lights.hxx"
+#include "materials.hxx"
+#include "math.hxx"
+#include "rng.hxx"
+#include "sampling.hxx"
+#include "debugging.hxx"
+#include "unit_testing.hxx"
+#include "benchmarking.hxx"
+#include "hard_config.hxx"
+#include "types.hxx"
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Light hierarchy for picking one of many light sources
+//
+// A binary tree over the finite (area and point) lights of a scene. Each node stores the bounding
+// box, the total radiant intensity and the bounding cone of emission directions of its lights
+// (as in Conty Estevez and Kulla: Importance Sampling of Many Lights with Adaptive Tree Splitting,
+// 2018). For a given shading point, the importance of a node is a conservative bound of the
+// cosine terms divided by squared distance and multiplied by the node's intensity; it is zero
+// only if none of the node's lights can illuminate the point.
+//
+// A light is picked by descending from the root and choosing children proportionally to their
+// importance, which takes O(log N) importance evaluations. The probability of picking a given
+// light is the product of the choices along its path; it is evaluated deterministically (walking
+// from the leaf up to the root), so it exactly matches the picking procedure as required by MIS.
+//
+// Nodes are stored in depth-first order like in BVH: the left child of an inner node immediately
+// follows its parent. Every leaf holds exactly one light.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class LightTree
+{
+public:
+
+    // The tree is only worth building for scenes with at least this many finite lights.
+    // With fewer lights the per-light contribution estimates are both cheap and more precise.
+    static const uint32_t kMinLightCount = 8;
+
+    static const uint32_t kInvalidIndex = 0xFFFFFFFFu;
+
+    struct Node
+    {
+        Vec3f       bboxMin;
+        uint32_t    rightOrLight;   // Leaf: scene index of the light; inner node: index of the right child
+        Vec3f       bboxMax;
+        uint32_t    isLeaf;
+        Vec3f       axis;           // Bounding cone of emission: normal directions...
+        float       thetaO;         // ...are within thetaO from the axis...
+        float       thetaE;         // ...and light is emitted up to thetaE from the normals
+        float       intensity;      // Total luminance of radiant intensity (~power / pi for area lights)
+        float       planeOffset;    // Parallel planar lights only emit to points with Dot(axis, x) > planeOffset
+    };
+
+    struct Stats
+    {
+        uint32_t    lightCount;
+        uint32_t    nodeCount;
+        uint32_t    maxDepth;
+    };
+
+public:
+
+    LightTree() {}
+
+    // Builds the hierarchy over the area and point lights of the given list.
+    // Other lights (e.g. the background light) are ignored.
+    void Build(const std::vector<std::shared_ptr<AbstractLight>> &aLights)
+    {
+        mNodes.clear();
+        mParents.clear();
+        mLightToLeaf.assign(aLights.size(), (uint32_t)kInvalidIndex);
+
+        std::vector<BuildLight> buildLights;
+        buildLights.reserve(aLights.size());
+        for (uint32_t i = 0; i < (uint32_t)aLights.size(); i++)
+        {
+            BuildLight buildLight;
+            if (InitBuildLight(aLights[i].get(), i, buildLight))
+                buildLights.push_back(buildLight);
+        }
+
+        if (buildLights.empty())
+            return;
+
+        mNodes.reserve(2 * buildLights.size() - 1);
+        mParents.reserve(2 * buildLights.size() - 1);
+        BuildNode(buildLights, 0, (uint32_t)buildLights.size(), kInvalidIndex);
+    }
+
+    bool IsEmpty() const
+    {
+        return mNodes.empty();
+    }
+
+    uint32_t GetLightCount() const
+    {
+        return ((uint32_t)mNodes.size() + 1) / 2;
+    }
+
+    bool ContainsLight(const uint32_t aLightId) const
+    {
+        return (aLightId < mLightToLeaf.size()) && (mLightToLeaf[aLightId] != kInvalidIndex);
+    }
+
+    // Upper bound of the contribution of all lights in the tree, comparable with
+    // AbstractLight::EstimateContribution()
+    float RootImportance(
+        const Vec3f             &aSurfPt,
+        const Frame             &aSurfFrame,
+        const AbstractMaterial  &aSurfMaterial) const
+    {
+        if (mNodes.empty())
+            return 0.f;
+
+        const ReceiverSides sides(aSurfMaterial);
+        return Importance(mNodes[0], aSurfPt, aSurfFrame.Normal(), sides);
+    }
+
+    // Picks a light proportionally to the importance of the tree nodes.
+    // Returns the scene index of the light or -1 if the tree is empty.
+    int32_t PickLight(
+        const Vec3f             &aSurfPt,
+        const Frame             &aSurfFrame,
+        const AbstractMaterial  &aSurfMaterial,
+              Rng               &aRng,
+              float             &oProbability) const
+    {
+        oProbability = 0.f;
+        if (mNodes.empty())
+            return -1;
+
+        const ReceiverSides sides(aSurfMaterial);
+        const Vec3f &normal = aSurfFrame.Normal();
+
+        float probability = 1.f;
+        uint32_t nodeIdx = 0;
+        while (!mNodes[nodeIdx].isLeaf)
+        {
+            const uint32_t leftIdx  = nodeIdx + 1;
+            const uint32_t rightIdx = mNodes[nodeIdx].rightOrLight;
+            const float leftProb = LeftChildProbability(leftIdx, rightIdx, aSurfPt, normal, sides);
+
+            if (aRng.GetFloat() < leftProb)
+            {
+                probability *= leftProb;
+                nodeIdx = leftIdx;
+            }
+            else
+            {
+                probability *= 1.f - leftProb;
+                nodeIdx = rightIdx;
+            }
+        }
+
+        oProbability = probability;
+        return (int32_t)mNodes[nodeIdx].rightOrLight;
+    }
+
+    // Probability that PickLight() picks the given light. Zero for lights which are not in the tree.
+    float PickingProbability(
+        const uint32_t           aLightId,
+        const Vec3f             &aSurfPt,
+        const Frame             &aSurfFrame,
+        const AbstractMaterial  &aSurfMaterial) const
+    {
+        if (!ContainsLight(aLightId))
+            return 0.f;
+
+        const ReceiverSides sides(aSurfMaterial);
+        const Vec3f &normal = aSurfFrame.Normal();
+
+        float probability = 1.f;
+        uint32_t nodeIdx = mLightToLeaf[aLightId];
+        for (uint32_t parentIdx = mParents[nodeIdx];
+             parentIdx != kInvalidIndex;
+             nodeIdx = parentIdx, parentIdx = mParents[nodeIdx])
+        {
+            const uint32_t leftIdx  = parentIdx + 1;
+            const uint32_t rightIdx = mNodes[parentIdx].rightOrLight;
+            const float leftProb = LeftChildProbability(leftIdx, rightIdx, aSurfPt, normal, sides);
+
+            probability *= (nodeIdx == leftIdx) ? leftProb : (1.f - leftProb);
+        }
+
+        return probability;
+    }
+
+    Stats GetStats() const
+    {
+        Stats stats = {};
+        stats.lightCount = IsEmpty() ? 0 : GetLightCount();
+        stats.nodeCount  = (uint32_t)mNodes.size();
+        for (uint32_t i = 0; i < (uint32_t)mNodes.size(); i++)
+        {
+            uint32_t depth = 1;
+            for (uint32_t nodeIdx = i; mParents[nodeIdx] != kInvalidIndex; nodeIdx = mParents[nodeIdx])
+                depth++;
+            stats.maxDepth = std::max(stats.maxDepth, depth);
+        }
+        return stats;
+    }
+
+protected:
+
+    struct BuildLight
+    {
+        Vec3f       bboxMin;
+        Vec3f       bboxMax;
+        Vec3f       centroid;
+        Vec3f       axis;
+        float       thetaO;
+        float       thetaE;
+        float       intensity;
+        float       planeOffset;
+        uint32_t    lightId;
+    };
+
+    // Which sides of the shaded surface receive light, see the light sampling code in lights.hxx
+    struct ReceiverSides
+    {
+        ReceiverSides(const AbstractMaterial &aSurfMaterial)
+        {
+            const MaterialProperties matProps = aSurfMaterial.GetProperties();
+            front = Utils::IsMasked(matProps, kBsdfFrontSideLightSampling);
+            back  = Utils::IsMasked(matProps, kBsdfBackSideLightSampling);
+        }
+
+        bool front;
+        bool back;
+    };
+
+    static bool InitBuildLight(
+        const AbstractLight *aLight,
+        const uint32_t       aLightId,
+              BuildLight    &oBuildLight)
+    {
+        oBuildLight.lightId = aLightId;
+
+        if (const AreaLight *areaLight = dynamic_cast<const AreaLight*>(aLight))
+        {
+            const Vec3f p1 = areaLight->mP0 + areaLight->mE1;
+            const Vec3f p2 = areaLight->mP0 + areaLight->mE2;
+            oBuildLight.bboxMin   = Min(Min(areaLight->mP0, p1), p2);
+            oBuildLight.bboxMax   = Max(Max(areaLight->mP0, p1), p2);
+            oBuildLight.axis      = areaLight->mFrame.Normal();
+            oBuildLight.thetaO    = 0.f;
+            oBuildLight.thetaE    = Math::kPiDiv2F;                 // One-sided cosine emitter
+            oBuildLight.intensity = areaLight->mRadiance.Luminance() * areaLight->mArea;
+            oBuildLight.planeOffset = std::min(std::min(       // Conservative w.r.t. rounding
+                Dot(oBuildLight.axis, areaLight->mP0),
+                Dot(oBuildLight.axis, p1)),
+                Dot(oBuildLight.axis, p2));
+        }
+        else if (const PointLight *pointLight = dynamic_cast<const PointLight*>(aLight))
+        {
+            oBuildLight.bboxMin   = pointLight->mPosition;
+            oBuildLight.bboxMax   = pointLight->mPosition;
+            oBuildLight.axis      = Vec3f(0.f, 0.f, 1.f);
+            oBuildLight.thetaO    = Math::kPiF;                     // Isotropic emitter
+            oBuildLight.thetaE    = Math::kPiDiv2F;
+            oBuildLight.intensity = pointLight->mIntensity.Luminance();
+            oBuildLight.planeOffset = -Math::InfinityF();
+        }
+        else
+            return false;
+
+        oBuildLight.centroid = (oBuildLight.bboxMin + oBuildLight.bboxMax) * 0.5f;
+
+        return true;
+    }
+
+    static float SafeAcos(const float aCos)
+    {
+        return std::acos(Math::Clamp(aCos, -1.f, 1.f));
+    }
+
+    // Smallest cone containing both cones (axis, thetaO); thetaE is the max of both
+    static void UnionCones(
+        const Vec3f &aAxisA, const float aThetaOA, const float aThetaEA,
+        const Vec3f &aAxisB, const float aThetaOB, const float aThetaEB,
+              Vec3f &oAxis,        float &oThetaO,       float &oThetaE)
+    {
+        oThetaE = std::max(aThetaEA, aThetaEB);
+
+        // Let A be the wider cone
+        if (aThetaOA < aThetaOB)
+        {
+            UnionCones(aAxisB, aThetaOB, aThetaEB, aAxisA, aThetaOA, aThetaEA, oAxis, oThetaO, oThetaE);
+            return;
+        }
+
+        const float thetaD = SafeAcos(Dot(aAxisA, aAxisB));
+        if (std::min(thetaD + aThetaOB, Math::kPiF) <= aThetaOA)
+        {
+            // A contains B
+            oAxis   = aAxisA;
+            oThetaO = aThetaOA;
+            return;
+        }
+
+        const float thetaO = (aThetaOA + thetaD + aThetaOB) * 0.5f;
+        if (thetaO >= Math::kPiF)
+        {
+            oAxis   = aAxisA;
+            oThetaO = Math::kPiF;
+            return;
+        }
+
+        // Rotate A's axis towards B's axis
+        const float thetaR = thetaO - aThetaOA;
+        Vec3f ortho = aAxisB - aAxisA * Dot(aAxisA, aAxisB);
+        if (ortho.LenSqr() < 1e-12f)
+        {
+            // Opposite axes: any perpendicular direction will do
+            Frame frame;
+            frame.SetFromZ(aAxisA);
+            ortho = frame.Binormal();
+        }
+        else
+            ortho.Normalize();
+
+        oAxis   = Normalize(aAxisA * std::cos(thetaR) + ortho * std::sin(thetaR));
+        oThetaO = thetaO;
+    }
+
+    // Solid angle measure of the cone used by the split heuristic (Conty Estevez and Kulla, eq. 1)
+    static float OrientationMeasure(const float aThetaO, const float aThetaE)
+    {
+        const float thetaW = std::min(aThetaO + aThetaE, Math::kPiF);
+        const float sinO = std::sin(aThetaO);
+        const float cosO = std::cos(aThetaO);
+        return
+              Math::k2PiF * (1.f - cosO)
+            + Math::kPiDiv2F * (   2.f * thetaW * sinO
+                                 - std::cos(aThetaO - 2.f * thetaW)
+                                 - 2.f * aThetaO * sinO
+                                 + cosO);
+    }
+
+    static float HalfSurfaceArea(const Vec3f &aBBoxMin, const Vec3f &aBBoxMax)
+    {
+        const Vec3f extent = aBBoxMax - aBBoxMin;
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+
+    // Conservative estimate of the contribution of the node's lights to the given point
+    static float Importance(
+        const Node              &aNode,
+        const Vec3f             &aSurfPt,
+        const Vec3f             &aSurfNormal,
+        const ReceiverSides     &aSides)
+    {
+        if ((aNode.intensity <= 0.f) || !(aSides.front || aSides.back))
+            return 0.f;
+
+        // Planar lights with the same normal: exact test of the emitting half-space.
+        // The cone bound alone is very loose for points close to the lights.
+        if (Dot(aNode.axis, aSurfPt) <= aNode.planeOffset)
+            return 0.f;
+
+        const Vec3f centre = (aNode.bboxMin + aNode.bboxMax) * 0.5f;
+        const float radiusSqr = (aNode.bboxMax - centre).LenSqr();
+
+        Vec3f toNode = centre - aSurfPt;
+        const float distSqr = toNode.LenSqr();
+
+        // Angle subtended by the bounding sphere of the node; if we are inside it, any direction is possible
+        float thetaU = Math::kPiF;
+        float cosThetaIn = 1.f;
+        float cosThetaOut = 1.f;
+        if (distSqr > radiusSqr)
+        {
+            const float dist = std::sqrt(distSqr);
+            toNode /= dist;
+            thetaU = std::asin(std::min(std::sqrt(radiusSqr) / dist, 1.f));
+
+            // Receiver: minimal angle between the (possibly flipped) normal and the node
+            float thetaIn = SafeAcos(Dot(aSurfNormal, toNode));
+            if (aSides.front && aSides.back)
+                thetaIn = std::min(thetaIn, Math::kPiF - thetaIn);
+            else if (aSides.back)
+                thetaIn = Math::kPiF - thetaIn;
+            const float thetaInBound = std::max(thetaIn - thetaU, 0.f);
+            if (thetaInBound >= Math::kPiDiv2F)
+                return 0.f;
+            cosThetaIn = std::cos(thetaInBound);
+
+            // Emitter: minimal angle between the emission cone and the direction towards the point
+            const float thetaOut = SafeAcos(-Dot(aNode.axis, toNode));
+            const float thetaOutBound = std::max(thetaOut - aNode.thetaO - thetaU, 0.f);
+            if (thetaOutBound >= aNode.thetaE)
+                return 0.f;
+            cosThetaOut = std::cos(thetaOutBound);
+        }
+
+        // Clamp the distance to avoid huge values for close nodes
+        const float clampedDistSqr = std::max(distSqr, radiusSqr);
+        if (clampedDistSqr <= 0.f)
+            return aNode.intensity; // Point light in the shaded point itself
+
+        return aNode.intensity * cosThetaIn * cosThetaOut / clampedDistSqr;
+    }
+
+    float LeftChildProbability(
+        const uint32_t           aLeftIdx,
+        const uint32_t           aRightIdx,
+        const Vec3f             &aSurfPt,
+        const Vec3f             &aSurfNormal,
+        const ReceiverSides     &aSides) const
+    {
+        const float leftImportance  = Importance(mNodes[aLeftIdx],  aSurfPt, aSurfNormal, aSides);
+        const float rightImportance = Importance(mNodes[aRightIdx], aSurfPt, aSurfNormal, aSides);
+        const float importanceSum   = leftImportance + rightImportance;
+
+        // No information: pick uniformly to keep all probabilities non-zero
+        if (!(importanceSum > 0.f) || !std::isfinite(importanceSum))
+            return 0.5f;
+
+        return leftImportance / importanceSum;
+    }
+
+    // Recursively builds the subtree for lights [aBegin, aEnd), returns index of its root
+    uint32_t BuildNode(
+        std::vector<BuildLight> &aLights,
+        const uint32_t           aBegin,
+        const uint32_t           aEnd,
+        const uint32_t           aParentIdx)
+    {
+        PG3_ASSERT_INTEGER_LESS_THAN(aBegin, aEnd);
+
+        const uint32_t nodeIdx = (uint32_t)mNodes.size();
+        mNodes.emplace_back();
+        mParents.push_back(aParentIdx);
+
+        const uint32_t lightCount = aEnd - aBegin;
+        if (lightCount == 1)
+        {
+            const BuildLight &light = aLights[aBegin];
+            Node &node = mNodes[nodeIdx];
+            node.bboxMin        = light.bboxMin;
+            node.bboxMax        = light.bboxMax;
+            node.axis           = light.axis;
+            node.thetaO         = light.thetaO;
+            node.thetaE         = light.thetaE;
+            node.intensity      = light.intensity;
+            node.planeOffset    = light.planeOffset;
+            node.rightOrLight   = light.lightId;
+            node.isLeaf         = 1;
+            mLightToLeaf[light.lightId] = nodeIdx;
+            return nodeIdx;
+        }
+
+        Vec3f centroidMin( Math::InfinityF());
+        Vec3f centroidMax(-Math::InfinityF());
+        for (uint32_t i = aBegin; i < aEnd; i++)
+        {
+            centroidMin = Min(centroidMin, aLights[i].centroid);
+            centroidMax = Max(centroidMax, aLights[i].centroid);
+        }
+
+        // Find the best split candidate using binned surface area orientation heuristic (SAOH)
+        uint32_t bestAxis   = 0;
+        uint32_t bestSplit  = 0; // Bins [0, bestSplit) go to the left child
+        float    bestCost   = Math::InfinityF();
+        const Vec3f centroidExtent = centroidMax - centroidMin;
+        for (uint32_t axis = 0; axis < 3; axis++)
+        {
+            if (centroidExtent.Get(axis) <= 0.f)
+                continue;
+
+            const float binScale = kBinCount / centroidExtent.Get(axis);
+
+            Bin bins[kBinCount];
+            for (uint32_t i = aBegin; i < aEnd; i++)
+            {
+                const uint32_t binIdx =
+                    CentroidToBin(aLights[i].centroid.Get(axis), centroidMin.Get(axis), binScale);
+                bins[binIdx].Add(aLights[i]);
+            }
+
+            // Sweep from the right to get the costs of right-hand sides...
+            float rightCosts[kBinCount];
+            Bin sweep;
+            for (uint32_t binIdx = kBinCount - 1; binIdx > 0; binIdx--)
+            {
+                sweep.Add(bins[binIdx]);
+                rightCosts[binIdx] = sweep.Cost();
+            }
+
+            // ...and evaluate all splits during the sweep from the left
+            sweep = Bin();
+            for (uint32_t split = 1; split < kBinCount; split++)
+            {
+                sweep.Add(bins[split - 1]);
+
+                if ((sweep.count == 0) || (sweep.count == lightCount))
+                    continue;
+
+                const float cost = sweep.Cost() + rightCosts[split];
+                if (cost < bestCost)
+                {
+                    bestCost  = cost;
+                    bestAxis  = axis;
+                    bestSplit = split;
+                }
+            }
+        }
+
+        uint32_t mid;
+        if (bestSplit == 0)
+            // All centroids coincide
+            mid = aBegin + lightCount / 2;
+        else
+        {
+            const float axisMin  = centroidMin.Get(bestAxis);
+            const float binScale = kBinCount / centroidExtent.Get(bestAxis);
+            const auto midIt = std::partition(
+                aLights.begin() + aBegin, aLights.begin() + aEnd,
+                [&](const BuildLight &aLight)
+                {
+                    return CentroidToBin(aLight.centroid.Get(bestAxis), axisMin, binScale) < bestSplit;
+                });
+            mid = (uint32_t)(midIt - aLights.begin());
+
+            PG3_ASSERT((mid > aBegin) && (mid < aEnd));
+        }
+
+        const uint32_t leftIdx = BuildNode(aLights, aBegin, mid, nodeIdx);
+        PG3_ASSERT_INTEGER_EQUAL(leftIdx, nodeIdx + 1);
+        leftIdx; // unused variable in release
+
+        const uint32_t rightIdx = BuildNode(aLights, mid, aEnd, nodeIdx);
+
+        // Merge children
+        const Node &left  = mNodes[nodeIdx + 1];
+        const Node &right = mNodes[rightIdx];
+        Node &node = mNodes[nodeIdx];
+        node.bboxMin        = Min(left.bboxMin, right.bboxMin);
+        node.bboxMax        = Max(left.bboxMax, right.bboxMax);
+        node.intensity      = left.intensity + right.intensity;
+        node.planeOffset    =
+            (   (left.axis.x == right.axis.x)
+             && (left.axis.y == right.axis.y)
+             && (left.axis.z == right.axis.z))
+            ? std::min(left.planeOffset, right.planeOffset)
+            : -Math::InfinityF();
+        UnionCones(
+            left.axis,  left.thetaO,  left.thetaE,
+            right.axis, right.thetaO, right.thetaE,
+            node.axis,  node.thetaO,  node.thetaE);
+        node.rightOrLight   = rightIdx;
+        node.isLeaf         = 0;
+
+        return nodeIdx;
+    }
+
+    struct Bin
+    {
+        Bin() :
+            bboxMin( Math::InfinityF()),
+            bboxMax(-Math::InfinityF()),
+            axis(0.f, 0.f, 1.f),
+            thetaO(0.f),
+            thetaE(0.f),
+            intensity(0.f),
+            count(0)
+        {}
+
+        void Add(const BuildLight &aLight)
+        {
+            AddBounds(aLight.bboxMin, aLight.bboxMax, aLight.axis, aLight.thetaO, aLight.thetaE,
+                      aLight.intensity, 1);
+        }
+
+        void Add(const Bin &aBin)
+        {
+            if (aBin.count > 0)
+                AddBounds(aBin.bboxMin, aBin.bboxMax, aBin.axis, aBin.thetaO, aBin.thetaE,
+                          aBin.intensity, aBin.count);
+        }
+
+        void AddBounds(
+            const Vec3f &aBBoxMin, const Vec3f &aBBoxMax,
+            const Vec3f &aAxis, const float aThetaO, const float aThetaE,
+            const float aIntensity, const uint32_t aCount)
+        {
+            bboxMin = Min(bboxMin, aBBoxMin);
+            bboxMax = Max(bboxMax, aBBoxMax);
+            if (count == 0)
+            {
+                axis   = aAxis;
+                thetaO = aThetaO;
+                thetaE = aThetaE;
+            }
+            else
+                UnionCones(axis, thetaO, thetaE, aAxis, aThetaO, aThetaE, axis, thetaO, thetaE);
+            intensity += aIntensity;
+            count     += aCount;
+        }
+
+        float Cost() const
+        {
+            if (count == 0)
+                return 0.f;
+            return intensity * HalfSurfaceArea(bboxMin, bboxMax) * OrientationMeasure(thetaO, thetaE);
+        }
+
+        Vec3f       bboxMin;
+        Vec3f       bboxMax;
+        Vec3f       axis;
+        float       thetaO;
+        float       thetaE;
+        float       intensity;
+        uint32_t    count;
+    };
+
+    static uint32_t CentroidToBin(float aCentroid, float aAxisMin, float aBinScale)
+    {
+        const uint32_t binIdx = (uint32_t)((aCentroid - aAxisMin) * aBinScale);
+        return std::min(binIdx, kBinCount - 1);
+    }
+
+protected:
+
+    static const uint32_t kBinCount = 12;
+
+    std::vector<Node>       mNodes;
+    std::vector<uint32_t>   mParents;       // Parent index of each node, kInvalidIndex for the root
+    std::vector<uint32_t>   mLightToLeaf;   // Leaf index of each scene light, kInvalidIndex if not in the tree
+
+public:
+
+#if defined PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER || defined PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+    // Generates small randomly oriented area lights of random power inside a unit cube and
+    // (optionally) some point lights
+    static void _GenerateRandomLights(
+        std::vector<std::shared_ptr<AbstractLight>> &aoLights,
+        const uint32_t                               aAreaLightCount,
+        const uint32_t                               aPointLightCount,
+        Rng                                         &aRng)
+    {
+        const float size = 0.5f / std::cbrt((float)std::max(aAreaLightCount, 1u));
+        for (uint32_t i = 0; i < aAreaLightCount; i++)
+        {
+            const Vec3f p0 = aRng.GetVec3f();
+            AreaLight *light = new AreaLight(
+                p0,
+                p0 + (aRng.GetVec3f() - Vec3f(0.5f)) * size,
+                p0 + (aRng.GetVec3f() - Vec3f(0.5f)) * size);
+            SpectrumF power;
+            power.SetSRGBGreyLight(0.1f + aRng.GetFloat());
+            light->SetPower(power);
+            aoLights.push_back(std::shared_ptr<AbstractLight>(light));
+        }
+        for (uint32_t i = 0; i < aPointLightCount; i++)
+        {
+            PointLight *light = new PointLight(aRng.GetVec3f());
+            SpectrumF power;
+            power.SetSRGBGreyLight(0.1f + aRng.GetFloat());
+            light->SetPower(power);
+            aoLights.push_back(std::shared_ptr<AbstractLight>(light));
+        }
+    }
+
+#endif
+
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+
+    static bool _UT_PickingProbabilities(
+        const UnitTestBlockLevel     aMaxUtBlockPrintLevel,
+        const uint32_t               aAreaLightCount,
+        const uint32_t               aPointLightCount)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1,
+            "%d area lights, %d point lights", aAreaLightCount, aPointLightCount);
+
+        std::vector<std::shared_ptr<AbstractLight>> lights;
+        Rng rng(11);
+        _GenerateRandomLights(lights, aAreaLightCount, aPointLightCount, rng);
+
+        LightTree tree;
+        tree.Build(lights);
+
+        const uint32_t lightCount = aAreaLightCount + aPointLightCount;
+        const uint32_t pickCount  = 20000;
+        const PhongMaterial material; // Front-side light sampling
+        std::vector<uint32_t> histogram(lightCount);
+
+        const char *failure = nullptr;
+        for (uint32_t pointIdx = 0; (pointIdx < 20) && (failure == nullptr); pointIdx++)
+        {
+            const Vec3f surfPt = rng.GetVec3f() * 1.4f - Vec3f(0.2f);
+            Frame surfFrame;
+            surfFrame.SetFromZ(Sampling::SampleUniformSphereW(rng.GetVec2f()));
+
+            // Probabilities of all lights must sum up to one
+            std::vector<float> probabilities(lightCount);
+            double probabilitySum = 0.;
+            for (uint32_t i = 0; i < lightCount; i++)
+            {
+                probabilities[i] = tree.PickingProbability(i, surfPt, surfFrame, material);
+                probabilitySum += probabilities[i];
+            }
+            if (std::abs(probabilitySum - 1.) > 1e-4)
+            {
+                failure = "Picking probabilities don't sum up to one";
+                break;
+            }
+
+            // Picking must report the same probabilities and follow them
+            std::fill(histogram.begin(), histogram.end(), 0);
+            for (uint32_t pickIdx = 0; pickIdx < pickCount; pickIdx++)
+            {
+                float probability;
+                const int32_t lightId = tree.PickLight(surfPt, surfFrame, material, rng, probability);
+                if ((lightId < 0) || (lightId >= (int32_t)lightCount))
+                {
+                    failure = "Picked an invalid light";
+                    break;
+                }
+                if (std::abs(probability - probabilities[lightId]) > 1e-5f * std::max(probability, 1.f))
+                {
+                    failure = "Picking reported a different probability than PickingProbability()";
+                    break;
+                }
+                if (probability <= 0.f)
+                {
+                    failure = "Picked a light with zero probability";
+                    break;
+                }
+                histogram[lightId]++;
+            }
+
+            for (uint32_t i = 0; (i < lightCount) && (failure == nullptr); i++)
+            {
+                // Allow 5 standard deviations of the binomial distribution
+                const double expected = pickCount * (double)probabilities[i];
+                const double tolerance = 5. * std::sqrt(expected * (1. - probabilities[i])) + 1.;
+                if (std::abs(histogram[i] - expected) > tolerance)
+                    failure = "Picking frequency doesn't match the picking probability";
+            }
+        }
+
+        if (failure != nullptr)
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%d area lights, %d point lights",
+                failure, aAreaLightCount, aPointLightCount);
+            return false;
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1,
+            "%d area lights, %d point lights", aAreaLightCount, aPointLightCount);
+        return true;
+    }
+
+    static bool _UnitTests(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblWholeTest, "LightTree: Picking probabilities");
+
+        if (!_UT_PickingProbabilities(aMaxUtBlockPrintLevel, 1, 0))
+            return false;
+        if (!_UT_PickingProbabilities(aMaxUtBlockPrintLevel, 0, 3))
+            return false;
+        if (!_UT_PickingProbabilities(aMaxUtBlockPrintLevel, 10, 5))
+            return false;
+        if (!_UT_PickingProbabilities(aMaxUtBlockPrintLevel, 200, 20))
+            return false;
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblWholeTest, "LightTree: Picking probabilities");
+        return true;
+    }
+
+#endif
+
+#ifdef PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+    // Linear picking as done by PathTracerBase without the light tree: estimates the contribution
+    // of every light and picks one proportionally to the estimates
+    static int32_t _BM_PickLightLinear(
+        const std::vector<std::shared_ptr<AbstractLight>>  &aLights,
+        const Vec3f                                         &aSurfPt,
+        const Frame                                         &aSurfFrame,
+        const AbstractMaterial                              &aSurfMaterial,
+              std::vector<float>                            &aCdf,
+              Rng                                           &aRng,
+              float                                         &oProbability)
+    {
+        float estimatesSum = 0.f;
+        for (uint32_t i = 0; i < (uint32_t)aLights.size(); i++)
+        {
+            estimatesSum += aLights[i]->EstimateContribution(aSurfPt, aSurfFrame, aSurfMaterial, aRng);
+            aCdf[i] = estimatesSum;
+        }
+
+        if (!(estimatesSum > 0.f))
+        {
+            oProbability = 0.f;
+            return -1;
+        }
+
+        const float rndVal = aRng.GetFloat() * estimatesSum;
+        const uint32_t lightId = std::min(
+            (uint32_t)(std::lower_bound(aCdf.begin(), aCdf.end(), rndVal) - aCdf.begin()),
+            (uint32_t)aLights.size() - 1);
+        oProbability = (aCdf[lightId] - ((lightId > 0) ? aCdf[lightId - 1] : 0.f)) / estimatesSum;
+        return (int32_t)lightId;
+    }
+
+    static void _BM_PickLights(const uint32_t aLightCount)
+    {
+        std::vector<std::shared_ptr<AbstractLight>> lights;
+        Rng rng(11);
+        _GenerateRandomLights(lights, aLightCount - aLightCount / 8, aLightCount / 8, rng);
+
+        Benchmarking::Timer timer;
+        LightTree tree;
+        tree.Build(lights);
+        const double buildTime = timer.ElapsedSeconds();
+        const Stats stats = tree.GetStats();
+        printf("\t%d lights: tree with %d nodes, depth %d, built in %.3f s\n",
+            aLightCount, stats.nodeCount, stats.maxDepth, buildTime);
+
+        // The linear picking gets very slow with many lights, keep its total work roughly constant
+        const uint32_t linearPointCount = std::max(16u, (1u << 22) / aLightCount);
+        const uint32_t treePointCount   = 1u << 18;
+
+        const PhongMaterial material;
+        std::vector<Vec3f> surfPoints(treePointCount);
+        std::vector<Frame> surfFrames(treePointCount);
+        for (uint32_t i = 0; i < treePointCount; i++)
+        {
+            surfPoints[i] = rng.GetVec3f();
+            surfFrames[i].SetFromZ(Sampling::SampleUniformSphereW(rng.GetVec2f()));
+        }
+
+        float probabilitySum = 0.f; // Keeps the optimiser from removing the measured code
+
+        std::vector<float> cdf(aLightCount);
+        timer.Restart();
+        for (uint32_t i = 0; i < linearPointCount; i++)
+        {
+            float probability;
+            _BM_PickLightLinear(lights, surfPoints[i], surfFrames[i], material, cdf, rng, probability);
+            probabilitySum += probability;
+        }
+        Benchmarking::PrintThroughput(
+            "linear (estimate all lights)", linearPointCount, timer.ElapsedSeconds(), "picks");
+
+        timer.Restart();
+        for (uint32_t i = 0; i < treePointCount; i++)
+        {
+            float probability;
+            tree.PickLight(surfPoints[i], surfFrames[i], material, rng, probability);
+            probabilitySum += probability;
+        }
+        Benchmarking::PrintThroughput(
+            "light tree: pick", treePointCount, timer.ElapsedSeconds(), "picks");
+
+        // MIS needs the picking probability of lights hit by BSDF sampling
+        timer.Restart();
+        for (uint32_t i = 0; i < treePointCount; i++)
+        {
+            const uint32_t lightId = (uint32_t)(rng.GetFloat() * aLightCount) % aLightCount;
+            probabilitySum += tree.PickingProbability(lightId, surfPoints[i], surfFrames[i], material);
+        }
+        Benchmarking::PrintThroughput(
+            "light tree: picking probability", treePointCount, timer.ElapsedSeconds(), "evals");
+
+        if (probabilitySum < 0.f)
+            printf("\t(%f)\n", probabilitySum);
+    }
+
+    static void _Benchmark()
+    {
+        Benchmarking::PrintHeader("Light picking: linear estimates vs. light tree");
+
+        for (uint32_t lightCount = 16; lightCount <= 65536; lightCount *= 8)
+            _BM_PickLights(lightCount);
+    }
+
+#endif
+};
@@ -14,6 +14,7 @@
 #include "hard_config.hxx"
 
 #include <vector>
+#include <algorithm>
 #include <cmath>
 #include <cassert>
 
@@ -348,7 +349,8 @@ class BackgroundLight : public AbstractLight
 {
 public:
     BackgroundLight() :
-        mEnvMap(nullptr)
+        mEnvMap(nullptr),
+        mEmDistributionMethod(Distribution2D::GetDefaultMethod())
     {
         SetConstantRadiance(SpectrumF().MakeZero());
     }
@@ -365,6 +367,18 @@ public:
         mCosineSampler.Init(std::make_shared<ConstEnvironmentValue>(mConstantRadiance));
     }
 
+    // Texel storage of the subsequently loaded environment maps
+    virtual void SetEnvironmentMapStorage(const EmStorageFormat &aStorageFormat)
+    {
+        mEmStorageFormat = aStorageFormat;
+    }
+
+    // Sampling method of the distributions of the subsequently loaded environment maps
+    virtual void SetEnvironmentMapDistribution(Distribution1DMethod aDistributionMethod)
+    {
+        mEmDistributionMethod = aDistributionMethod;
+    }
+
     virtual void LoadEnvironmentMap(
         const std::string    aFilename,
         float                aRotate = 0.0f,
@@ -372,7 +386,9 @@ public:
         bool                 aDoBilinFiltering = true,
         const AuxDbgParams  &aAuxDbgParams = AuxDbgParams())
     {
-        mEnvMap = new EnvironmentMap(aFilename, aRotate, aScale, aDoBilinFiltering, aAuxDbgParams);
+        mEnvMap = new EnvironmentMap(
+            aFilename, aRotate, aScale, aDoBilinFiltering,
+            mEmStorageFormat, mEmDistributionMethod, aAuxDbgParams);
     }
 
     // Returns amount of incoming radiance from the direction.
@@ -406,6 +422,37 @@ public:
         }
     };
 
+    // Returns amount of incoming radiance from each of the directions
+    void GetEmmision(
+        const Vec3f             *aWig,
+              SpectrumF         *oRadiance,
+              size_t             aCount
+        ) const
+    {
+        if (mEnvMap != nullptr)
+            mEnvMap->EvalRadiance(oRadiance, aWig, aCount);
+        else
+            std::fill(oRadiance, oRadiance + aCount, mConstantRadiance);
+    }
+
+    // Returns the PDF of sampling the direction with SampleIllumination(), i.e. the PDF
+    // returned by GetEmmision()
+    float PdfW(
+        const Vec3f             &aWig,
+        const Frame             &aSurfFrame,
+        const AbstractMaterial  &aSurfMaterial
+        ) const
+    {
+        const MaterialProperties matProps = aSurfMaterial.GetProperties();
+        const bool sampleFrontSide = Utils::IsMasked(matProps, kBsdfFrontSideLightSampling);
+        const bool sampleBackSide  = Utils::IsMasked(matProps, kBsdfBackSideLightSampling);
+
+        if (mEnvMap != nullptr)
+            return mEnvMap->PdfW(aWig, aSurfFrame, sampleFrontSide, sampleBackSide);
+        else
+            return mCosineSampler.PdfW(aWig, aSurfFrame, sampleFrontSide, sampleBackSide);
+    }
+
     // Returns amount of outgoing radiance in the direction.
     // The point parameter is unused - it is an heritage of the abstract light interface
     virtual SpectrumF GetEmmision(
@@ -474,4 +521,6 @@ public:
     SpectrumF                mConstantRadiance;
     CosineConstEmSampler     mCosineSampler;
     EnvironmentMap          *mEnvMap;
+    EmStorageFormat          mEmStorageFormat;
+    Distribution1DMethod     mEmDistributionMethod;
 };
@@ -0,0 +1,93 @@
+#include "mapped_file.hxx"
+
+#include <windows.h>
+
+MappedFile::MappedFile() :
+    mData(nullptr),
+    mSize(0),
+    mFileHandle(INVALID_HANDLE_VALUE),
+    mMappingHandle(nullptr)
+{}
+
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+
+bool MappedFile::Open(const char *aPath)
+{
+    Close();
+
+    // Other processes may map the file too, but they are not allowed to write into it
+    mFileHandle = CreateFileA(
+        aPath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (mFileHandle == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(mFileHandle, &fileSize) || (fileSize.QuadPart <= 0))
+    {
+        Close();
+        return false;
+    }
+
+    mMappingHandle = CreateFileMappingA(mFileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mMappingHandle == nullptr)
+    {
+        Close();
+        return false;
+    }
+
+    mData = static_cast<const uint8_t*>(MapViewOfFile(mMappingHandle, FILE_MAP_READ, 0, 0, 0));
+    if (mData == nullptr)
+    {
+        Close();
+        return false;
+    }
+
+    mSize = static_cast<size_t>(fileSize.QuadPart);
+
+    return true;
+}
+
+
+void MappedFile::Close()
+{
+    if (mData != nullptr)
+        UnmapViewOfFile(mData);
+    if (mMappingHandle != nullptr)
+        CloseHandle(mMappingHandle);
+    if (mFileHandle != INVALID_HANDLE_VALUE)
+        CloseHandle(mFileHandle);
+
+    mData           = nullptr;
+    mSize           = 0;
+    mMappingHandle  = nullptr;
+    mFileHandle     = INVALID_HANDLE_VALUE;
+}
+
+
+bool MappedFile::GetFileStamp(const char *aPath, uint64_t &oSize, uint64_t &oWriteTime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(aPath, GetFileExInfoStandard, &attributes))
+        return false;
+
+    oSize =
+          (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32)
+        | static_cast<uint64_t>(attributes.nFileSizeLow);
+    oWriteTime =
+          (static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32)
+        | static_cast<uint64_t>(attributes.ftLastWriteTime.dwLowDateTime);
+
+    return true;
+}
+
+
+bool MappedFile::RenameReplacing(const char *aSrcPath, const char *aDstPath)
+{
+    return MoveFileExA(aSrcPath, aDstPath, MOVEFILE_REPLACE_EXISTING) != 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Read-only memory mapping of a whole file.
+//
+// The mapped pages are backed directly by the file in the system cache: opening a file doesn't
+// read or copy anything and all processes which map the same file share one physical copy of
+// its data. While mapped, the file can't be modified by other processes.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class MappedFile
+{
+public:
+
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile & operator=(const MappedFile&) = delete;
+
+    // Maps the whole file. Fails for missing or empty files.
+    bool Open(const char *aPath);
+
+    void Close();
+
+    bool IsOpen() const
+    {
+        return mData != nullptr;
+    }
+
+    const uint8_t *GetData() const
+    {
+        return mData;
+    }
+
+    size_t GetSize() const
+    {
+        return mSize;
+    }
+
+    // Size and last write time (in 100 ns units) of a file as reported by the file system.
+    // Cheap compared to reading the file, so it can be used to detect changed files.
+    static bool GetFileStamp(const char *aPath, uint64_t &oSize, uint64_t &oWriteTime);
+
+    // Renames a file, atomically replacing an existing destination file. Fails if the
+    // destination file is currently mapped.
+    static bool RenameReplacing(const char *aSrcPath, const char *aDstPath);
+
+private:
+
+    const uint8_t  *mData;
+    size_t          mSize;
+
+    // Platform-specific handles
+    void           *mFileHandle;
+    void           *mMappingHandle;
+};
@@ -17,46 +17,54 @@ public:
         const Config    &aConfig,
         int32_t          aSeed = 1234
         ) :
-        AbstractRenderer(aConfig), mRng(aSeed)
+        AbstractRenderer(aConfig), mRng(aSeed, aConfig.mRngType)
     {}
 
-    virtual void RunIteration(
-        const Algorithm     aAlgorithm,
-        uint32_t            aIteration) override
+    virtual void RenderTile(
+        const Algorithm      aAlgorithm,
+        uint32_t             aIteration,
+        const ImageTile     &aTile,
+        Framebuffer         &oFramebuffer) override
     {
         aAlgorithm; // unused param
 
-        const int32_t resX = int32_t(mConfig.mScene->mCamera.mResolution.x);
-        const int32_t resY = int32_t(mConfig.mScene->mCamera.mResolution.y);
+        mRng = Rng(TileScheduler::TileSeed(mConfig.mBaseSeed, aIteration, aTile.index), mConfig.mRngType);
 
-        for (int32_t pixID = 0; pixID < resX * resY; pixID++)
+        const uint32_t resX = (uint32_t)mConfig.mScene->mCamera.mResolution.x;
+
+        for (uint32_t y = aTile.minY; y < aTile.maxY; y++)
         {
-            // Generate ray
-            const int32_t x = pixID % resX;
-            const int32_t y = pixID / resX;
+            for (uint32_t x = aTile.minX; x < aTile.maxX; x++)
+            {
+                const uint32_t sampleCount = oFramebuffer.GetIterationSampleCount(x, y);
+                const uint32_t firstSample = oFramebuffer.GetFirstSampleIndex(x, y, aIteration);
+                for (uint32_t sampleIdx = firstSample; sampleIdx < firstSample + sampleCount; sampleIdx++)
+                {
+                    mRng.StartPixelSample(y * resX + x, sampleIdx, (uint32_t)mConfig.mBaseSeed);
 
-            const Vec2f sample =
-                Vec2f(float(x), float(y)) +
-                (aIteration == 0 ? Vec2f(0.5f) : mRng.GetVec2f());
+                    // Generate ray
+                    const Vec2f sample =
+                        Vec2f(float(x), float(y)) +
+                        (sampleIdx == 0 ? Vec2f(0.5f) : mRng.GetVec2f());
 
-            Ray ray = mConfig.mScene->mCamera.GenerateRay(sample);
-            RayIntersection isect;
-            isect.dist = 1e36f;
+                    Ray ray = mConfig.mScene->mCamera.GenerateRay(sample);
+                    RayIntersection isect;
+                    isect.dist = 1e36f;
 
-            // Intersect & Shade
-            if (mConfig.mScene->Intersect(ray, isect))
-            {
-                const auto normal = isect.normal;
-                SpectrumF color = SpectrumF().SetSRGBLight(
-                    Math::Clamp(normal.x / 2.f + 0.5f, 0.f, 1.f),
-                    Math::Clamp(normal.y / 2.f + 0.5f, 0.f, 1.f),
-                    Math::Clamp(normal.z / 2.f + 0.5f, 0.f, 1.f));
+                    // Intersect & Shade
+                    if (Intersect(ray, isect, kCameraRay))
+                    {
+                        const auto normal = isect.normal;
+                        SpectrumF color = SpectrumF().SetSRGBLight(
+                            Math::Clamp(normal.x / 2.f + 0.5f, 0.f, 1.f),
+                            Math::Clamp(normal.y / 2.f + 0.5f, 0.f, 1.f),
+                            Math::Clamp(normal.z / 2.f + 0.5f, 0.f, 1.f));
 
-                mFramebuffer.AddRadiance(x, y, color);
+                        oFramebuffer.AddRadiance(x, y, color);
+                    }
+                }
             }
         }
-
-        mIterations++;
     }
 
     Rng mRng;
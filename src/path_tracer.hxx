@@ -56,7 +56,7 @@ protected:
         for (uint32_t pathLength = 1;;)
         {
             RayIntersection isect(1e36f);
-            if (mConfig.mScene->Intersect(currentRay, isect))
+            if (Intersect(currentRay, isect, (pathLength == 1) ? kCameraRay : kBsdfRay))
             {
                 // We hit some geometry
 
@@ -117,7 +117,7 @@ protected:
 
                 // Sample BSDF
                 MaterialRecord matRecord(wol);
-                mat.SampleBsdf(mRng, matRecord);
+                SampleBsdf(mat, matRecord);
                 if (matRecord.IsBlocker())
                     // There is no contribution behind this reflection;
                     // we can cut the path without incorporation of bias
@@ -153,7 +153,7 @@ protected:
                     const BackgroundLight *backgroundLight = mConfig.mScene->GetBackgroundLight();
                     if (backgroundLight != nullptr)
                     {
-                        const SpectrumF emmision = backgroundLight->GetEmmision(currentRay.dir);
+                        const SpectrumF emmision = GetBackgroundEmmision(*backgroundLight, currentRay.dir);
                         oRadiance += emmision * pathThroughput;
                     }
                 }
@@ -182,10 +182,10 @@ protected:
         oEmmittedRadiance.MakeZero();
         oReflectedRadianceEstimate.MakeZero();
 
-        LightSamplingContext lightSamplingCtx(mConfig.mScene->GetLightCount());
+        LightSamplingContext lightSamplingCtx;
 
         RayIntersection isect(1e36f);
-        if (mConfig.mScene->Intersect(aRay, isect))
+        if (Intersect(aRay, isect, (aPathLength == 1) ? kCameraRay : kBsdfRay))
         {
             // We hit some geometry
 
@@ -303,7 +303,7 @@ protected:
                 }
 
                 MaterialRecord matRecord(wol);
-                mat.SampleBsdf(mRng, matRecord);
+                SampleBsdf(mat, matRecord);
                 if (matRecord.IsBlocker())
                     continue;
 
@@ -414,8 +414,8 @@ protected:
                 if (backgroundLight != nullptr)
                 {
                     oEmmittedRadiance +=
-                        backgroundLight->GetEmmision(
-                            aRay.dir, oEmmittedLightPdfW, aShadedSurfFrame, aShadedSurfMat);
+                        GetBackgroundEmmision(
+                            *backgroundLight, aRay.dir, oEmmittedLightPdfW, aShadedSurfFrame, aShadedSurfMat);
                     if (oLightID != nullptr)
                         *oLightID = mConfig.mScene->GetBackgroundLightId();;
                 }
@@ -453,6 +453,147 @@ protected:
             1 + ((aSplitBudget - oBrdfSamplesCount) / (float)oBrdfSamplesCount);
     }
 
+public:
+
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+
+    // Light picking through the scene: the probabilities reported by PickSingleLight() and
+    // computed by LightPickingProbability() (used for MIS weights) must agree with each other
+    // and with the actual picking frequencies
+    static bool _UT_LightPicking(
+        const UnitTestBlockLevel     aMaxUtBlockPrintLevel,
+        const Scene::BoxMask         aBoxMask,
+        const bool                   aExpectLightTree)
+    {
+        const std::string sceneName = Scene::GetSceneName(aBoxMask);
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", sceneName.c_str());
+
+        Scene scene;
+        scene.LoadCornellBox(Vec2i(16, 16), AuxDbgParams(), aBoxMask);
+
+        Config config;
+        config.mScene                           = &scene;
+        config.mRngType                         = Config::GetDefaultRngType();
+        config.mMinPathLength                   = 1;
+        config.mMaxPathLength                   = 0;
+        config.mIndirectIllumClipping           = 0.f;
+        config.mSplittingBudget                 = 1.f;
+        config.mDbgSplittingLevel               = 1.f;
+        config.mDbgSplittingLightToBrdfSmplRatio = 1.f;
+        PathTracer pathTracer(config, 7);
+
+        const uint32_t lightCount = (uint32_t)scene.GetLightCount();
+        const uint32_t pickCount  = 20000;
+        const AbstractMaterial &material = *scene.mMaterials[2]; // White diffuse floor
+        std::vector<uint32_t> histogram(lightCount);
+        Rng rng(13);
+
+        const char *failure = nullptr;
+#ifdef PG3_USE_LIGHT_TREE
+        if ((scene.GetLightTree() != nullptr) != aExpectLightTree)
+            failure = aExpectLightTree
+                ? "The scene doesn't pick lights using the light tree"
+                : "The scene unexpectedly picks lights using the light tree";
+#else
+        aExpectLightTree; // unused parameter
+#endif
+
+        for (uint32_t pointIdx = 0; (pointIdx < 20) && (failure == nullptr); pointIdx++)
+        {
+            // Points inside the box, surfaces facing mostly upwards (towards the ceiling lights)
+            const Vec3f surfPt = (rng.GetVec3f() - Vec3f(0.5f)) * 2.4f;
+            Frame surfFrame;
+            surfFrame.SetFromZ(
+                Normalize(Sampling::SampleUniformSphereW(rng.GetVec2f()) + Vec3f(0.f, 0.f, 1.f)));
+
+            LightSamplingContext context;
+
+            // Probabilities of all lights must sum up to one
+            std::vector<float> probabilities(lightCount);
+            double probabilitySum = 0.;
+            for (uint32_t i = 0; i < lightCount; i++)
+            {
+                pathTracer.LightPickingProbability(
+                    surfPt, surfFrame, material, i, context, probabilities[i]);
+                probabilitySum += probabilities[i];
+            }
+            if (std::abs(probabilitySum - 1.) > 1e-4)
+            {
+                failure = "Picking probabilities don't sum up to one";
+                break;
+            }
+
+            // Picking must report the same probabilities and follow them
+            std::fill(histogram.begin(), histogram.end(), 0);
+            for (uint32_t pickIdx = 0; pickIdx < pickCount; pickIdx++)
+            {
+                int32_t lightId = -1;
+                float probability = 0.f;
+                pathTracer.PickSingleLight(surfPt, surfFrame, material, context, lightId, probability);
+                if ((lightId < 0) || (lightId >= (int32_t)lightCount))
+                {
+                    failure = "Picked an invalid light";
+                    break;
+                }
+                if (std::abs(probability - probabilities[lightId]) > 1e-5f * std::max(probability, 1.f))
+                {
+                    failure = "Picking reported a different probability than LightPickingProbability()";
+                    break;
+                }
+                if (probability <= 0.f)
+                {
+                    failure = "Picked a light with zero probability";
+                    break;
+                }
+                histogram[lightId]++;
+            }
+
+            for (uint32_t i = 0; (i < lightCount) && (failure == nullptr); i++)
+            {
+                // Allow 5 standard deviations of the binomial distribution
+                const double expected = pickCount * (double)probabilities[i];
+                const double tolerance = 5. * std::sqrt(expected * (1. - probabilities[i])) + 1.;
+                if (std::abs(histogram[i] - expected) > tolerance)
+                    failure = "Picking frequency doesn't match the picking probability";
+            }
+        }
+
+        if (failure != nullptr)
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", failure, sceneName.c_str());
+            return false;
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", sceneName.c_str());
+        return true;
+    }
+
+    static bool _UnitTests(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblWholeTest, "PathTracer: Light picking");
+
+        if (!_UT_LightPicking(aMaxUtBlockPrintLevel,
+                Scene::BoxMask(Scene::kLightPoint | Scene::kLightBox | Scene::kLightEnv
+                               | GEOM_FULL_BOX | MATS_PHONG_DIFFUSE),
+                false))
+            return false;
+        if (!_UT_LightPicking(aMaxUtBlockPrintLevel,
+                Scene::BoxMask(Scene::kLightGrid | GEOM_FULL_BOX | MATS_PHONG_DIFFUSE),
+                true))
+            return false;
+        if (!_UT_LightPicking(aMaxUtBlockPrintLevel,
+                Scene::BoxMask(Scene::kLightGrid | Scene::kLightPoint | Scene::kLightEnv
+                               | GEOM_FULL_BOX | MATS_PHONG_DIFFUSE),
+                true))
+            return false;
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblWholeTest, "PathTracer: Light picking");
+        return true;
+    }
+
+#endif
+
 protected:
 
 // Empirical values for cutting too long paths
@@ -5,6 +5,7 @@
 #include "em_cosine_sampler.hxx"
 #include "em_simple_spherical_sampler.hxx"
 #include "em_steerable_sampler.hxx"
+#include "light_tree.hxx"
 
 #include "rng.hxx"
 #include "spectrum.hxx"
@@ -22,12 +23,14 @@ protected:
     class LightSamplingContext
     {
     public:
-        LightSamplingContext(size_t aLightCount) :
-            mLightContribEstsCache(aLightCount, 0.f),
+        LightSamplingContext() :
+            mBackgroundContribEst(0.f),
             mValid(false)
         {};
 
+        // Allocated on first use: not needed when picking lights using the light tree
         std::vector<float>      mLightContribEstsCache;
+        float                   mBackgroundContribEst;  // Only used with the light tree
         bool                    mValid;
     };
 
@@ -37,7 +40,7 @@ public:
         const Config    &aConfig,
         int32_t          aSeed = 1234
     ) :
-        AbstractRenderer(aConfig), mRng(aSeed),
+        AbstractRenderer(aConfig), mRng(aSeed, aConfig.mRngType),
         mMinPathLength(aConfig.mMinPathLength),
         mMaxPathLength(aConfig.mMaxPathLength),
         mIndirectIllumClipping(aConfig.mIndirectIllumClipping),
@@ -54,41 +57,108 @@ public:
               SpectrumF     &oRadiance
         ) = 0;
 
-    virtual void RunIteration(
-        const Algorithm     aAlgorithm,
-        uint32_t            aIteration) override
+    virtual void RenderTile(
+        const Algorithm      aAlgorithm,
+        uint32_t             aIteration,
+        const ImageTile     &aTile,
+        Framebuffer         &oFramebuffer) override
     {
-        aIteration; // unused parameter
+        mRng = Rng(TileScheduler::TileSeed(mConfig.mBaseSeed, aIteration, aTile.index), mConfig.mRngType);
 
-        const uint32_t resX = uint32_t(mConfig.mScene->mCamera.mResolution.x);
-        const uint32_t resY = uint32_t(mConfig.mScene->mCamera.mResolution.y);
+        const uint32_t resX = (uint32_t)mConfig.mScene->mCamera.mResolution.x;
 
-        for (uint32_t pixID = 0; pixID < resX * resY; pixID++)
+        for (uint32_t y = aTile.minY; y < aTile.maxY; y++)
         {
-            //////////////////////////////////////////////////////////////////////////
-            // Generate ray
+            for (uint32_t x = aTile.minX; x < aTile.maxX; x++)
+            {
+                const uint32_t sampleCount = oFramebuffer.GetIterationSampleCount(x, y);
+                const uint32_t firstSample = oFramebuffer.GetFirstSampleIndex(x, y, aIteration);
+                for (uint32_t sampleIdx = firstSample; sampleIdx < firstSample + sampleCount; sampleIdx++)
+                {
+                    // Counter-based generators depend only on the pixel and the sample index
+                    mRng.StartPixelSample(y * resX + x, sampleIdx, (uint32_t)mConfig.mBaseSeed);
 
-            const uint32_t x = pixID % resX;
-            const uint32_t y = pixID / resX;
+                    //////////////////////////////////////////////////////////////////////////
+                    // Generate ray
 
-            const Vec2f randomOffset = mRng.GetVec2f();
-            const Vec2f basedCoords = Vec2f(float(x), float(y));
-            const Vec2f basedCoordsBound = Vec2f(float(x), float(y));
-            const Vec2f sample = basedCoords + randomOffset;
+                    const Vec2f randomOffset = mRng.GetVec2f();
+                    const Vec2f basedCoords = Vec2f(float(x), float(y));
+                    const Vec2f sample = basedCoords + randomOffset;
 
-            Ray ray = mConfig.mScene->mCamera.GenerateRay(sample);
+                    Ray ray = mConfig.mScene->mCamera.GenerateRay(sample);
 
-            //////////////////////////////////////////////////////////////////////////
-            // Estimate radiance
+                    //////////////////////////////////////////////////////////////////////////
+                    // Estimate radiance
 
-            SpectrumF radianceEstimate;
-            EstimateIncomingRadiance(aAlgorithm, ray, radianceEstimate);
-            mFramebuffer.AddRadiance(x, y, radianceEstimate);
+                    SpectrumF radianceEstimate;
+                    EstimateIncomingRadiance(aAlgorithm, ray, radianceEstimate);
+                    oFramebuffer.AddRadiance(x, y, radianceEstimate);
+                }
+            }
         }
-
-        mIterations++;
     };
 
+    // Material and light queries timed by the renderer profiling
+
+    void SampleBsdf(
+        const AbstractMaterial  &aMaterial,
+              MaterialRecord    &oMatRecord)
+    {
+        RendererProfilingData::StageTimer timer(mIntrospectionData.GetProfilingData(), kStageBsdf);
+        aMaterial.SampleBsdf(mRng, oMatRecord);
+    }
+
+    void EvalBsdf(
+        const AbstractMaterial  &aMaterial,
+              MaterialRecord    &oMatRecord)
+    {
+        RendererProfilingData::StageTimer timer(mIntrospectionData.GetProfilingData(), kStageBsdf);
+        aMaterial.EvalBsdf(oMatRecord);
+    }
+
+    bool SampleIllumination(
+        const AbstractLight     &aLight,
+        const Vec3f             &aSurfPt,
+        const Frame             &aSurfFrame,
+        const AbstractMaterial  &aSurfMaterial,
+              LightSample       &oLightSample)
+    {
+        RendererProfilingData::StageTimer timer(mIntrospectionData.GetProfilingData(), kStageLightSampling);
+        return aLight.SampleIllumination(aSurfPt, aSurfFrame, aSurfMaterial, mRng, oLightSample);
+    }
+
+    SpectrumF GetBackgroundEmmision(
+        const BackgroundLight   &aBackgroundLight,
+        const Vec3f             &aWig,
+              float             *oPdfW = nullptr,
+        const Frame             *aSurfFrame = nullptr,
+        const AbstractMaterial  *aSurfMaterial = nullptr)
+    {
+        RendererProfilingData::StageTimer timer(mIntrospectionData.GetProfilingData(), kStageEmEvaluation);
+        return aBackgroundLight.GetEmmision(aWig, oPdfW, aSurfFrame, aSurfMaterial);
+    }
+
+    // Batched GetBackgroundEmmision() without the PDFs, see GetBackgroundPdfW()
+    void GetBackgroundEmmision(
+        const BackgroundLight   &aBackgroundLight,
+        const Vec3f             *aWig,
+              SpectrumF         *oEmission,
+              size_t             aCount)
+    {
+        RendererProfilingData::StageTimer timer(mIntrospectionData.GetProfilingData(), kStageEmEvaluation);
+        aBackgroundLight.GetEmmision(aWig, oEmission, aCount);
+    }
+
+    float GetBackgroundPdfW(
+        const BackgroundLight   &aBackgroundLight,
+        const Vec3f             &aWig,
+        const Frame             &aSurfFrame,
+        const AbstractMaterial  &aSurfMaterial)
+    {
+        RendererProfilingData::StageTimer timer(mIntrospectionData.GetProfilingData(), kStageEmEvaluation);
+        return aBackgroundLight.PdfW(aWig, aSurfFrame, aSurfMaterial);
+    }
+
     void GetDirectRadianceFromDirection(
         const Vec3f                 &aSurfPt,
         const Frame                 &aSurfFrame,
@@ -106,7 +176,7 @@ public:
         const float rayMin = Geom::EpsRayCos(aWil.z);
         const Ray bsdfRay(aSurfPt, wig, rayMin);
         RayIntersection bsdfIsect(1e36f);
-        if (mConfig.mScene->Intersect(bsdfRay, bsdfIsect))
+        if (Intersect(bsdfRay, bsdfIsect, kBsdfRay))
         {
             if (bsdfIsect.lightID >= 0)
             {
@@ -133,7 +203,7 @@ public:
             const BackgroundLight *backgroundLight = mConfig.mScene->GetBackgroundLight();
             if (backgroundLight != nullptr)
             {
-                oLight = backgroundLight->GetEmmision(wig, oPdfW, &aSurfFrame, &aSurfMaterial);
+                oLight = GetBackgroundEmmision(*backgroundLight, wig, oPdfW, &aSurfFrame, &aSurfMaterial);
                 lightId = mConfig.mScene->GetBackgroundLightId();
             }
             else
@@ -178,7 +248,7 @@ public:
             PG3_ASSERT(light != 0);
 
             bool success =
-                light->SampleIllumination(aSurfPt, aSurfFrame, aSurfMaterial, mRng, oLightSample);
+                SampleIllumination(*light, aSurfPt, aSurfFrame, aSurfMaterial, oLightSample);
             oLightSample.lightProbability = lightProbability;
 
             return success;
@@ -197,6 +267,7 @@ public:
               float                 &oLightProbability)
     {
         const size_t lightCount = mConfig.mScene->GetLightCount();
+        const LightTree *lightTree = mConfig.mScene->GetLightTree();
         if (lightCount == 0)
             oChosenLightId = -1;
         else if (lightCount == 1)
@@ -205,12 +276,35 @@ public:
             oChosenLightId = 0;
             oLightProbability = 1.f;
         }
+        else if (lightTree != nullptr)
+        {
+            // Many lights: Descend the light hierarchy instead of estimating all lights
+            const float backgroundProbability =
+                BackgroundPickingProbability(*lightTree, aSurfPt, aSurfFrame, aSurfMaterial, aContext);
+            if (mRng.GetFloat() < backgroundProbability)
+            {
+                oChosenLightId    = mConfig.mScene->GetBackgroundLightId();
+                oLightProbability = backgroundProbability;
+            }
+            else
+            {
+                float treeProbability;
+                oChosenLightId = lightTree->PickLight(
+                    aSurfPt, aSurfFrame, aSurfMaterial, mRng, treeProbability);
+                oLightProbability = (1.f - backgroundProbability) * treeProbability;
+            }
+
+            PG3_ASSERT_INTEGER_IN_RANGE(oChosenLightId, 0, (int32_t)(lightCount - 1));
+        }
         else
         {
             // Non-normalized CDF for all light sources
             // TODO: Make it a PT's member to avoid unnecessary allocations?
             std::vector<float> lightContrPseudoCdf(lightCount + 1);
 
+            if (!aContext.mValid)
+                aContext.mLightContribEstsCache.resize(lightCount);
+
             PG3_ASSERT(aContext.mLightContribEstsCache.size() == lightCount);
 
             // Estimate the contribution of all available light sources
@@ -266,6 +360,7 @@ public:
               float                 &oLightProbability)
     {
         const size_t lightCount = mConfig.mScene->GetLightCount();
+        const LightTree *lightTree = mConfig.mScene->GetLightTree();
 
         PG3_ASSERT((aLightId >= 0) && (aLightId < lightCount));
 
@@ -277,8 +372,23 @@ public:
             // process of computing estimated contributions
             oLightProbability = 1.f;
         }
+        else if (lightTree != nullptr)
+        {
+            // Must match the picking in PickSingleLight()
+            const float backgroundProbability =
+                BackgroundPickingProbability(*lightTree, aSurfPt, aSurfFrame, aSurfMaterial, aContext);
+            if ((int32_t)aLightId == mConfig.mScene->GetBackgroundLightId())
+                oLightProbability = backgroundProbability;
+            else
+                oLightProbability =
+                      (1.f - backgroundProbability)
+                    * lightTree->PickingProbability(aLightId, aSurfPt, aSurfFrame, aSurfMaterial);
+        }
         else
         {
+            if (!aContext.mValid)
+                aContext.mLightContribEstsCache.resize(lightCount);
+
             PG3_ASSERT(aContext.mLightContribEstsCache.size() == lightCount);
 
             // Estimate the contribution of all available light sources
@@ -312,6 +422,36 @@ public:
         }
     }
 
+    // The background light cannot be bounded in the light tree. It is picked with probability
+    // proportional to its estimated contribution relative to the importance of the whole tree.
+    float BackgroundPickingProbability(
+        const LightTree             &aLightTree,
+        const Vec3f                 &aSurfPt,
+        const Frame                 &aSurfFrame,
+        const AbstractMaterial      &aSurfMaterial,
+              LightSamplingContext  &aContext)
+    {
+        const int32_t backgroundLightId = mConfig.mScene->GetBackgroundLightId();
+        if (backgroundLightId < 0)
+            return 0.f;
+
+        if (!aContext.mValid)
+        {
+            const AbstractLight* light = mConfig.mScene->GetLightPtr(backgroundLightId);
+            aContext.mBackgroundContribEst =
+                light->EstimateContribution(aSurfPt, aSurfFrame, aSurfMaterial, mRng);
+            aContext.mValid = true;
+        }
+
+        const float backgroundEstimate = aContext.mBackgroundContribEst;
+        const float treeImportance = aLightTree.RootImportance(aSurfPt, aSurfFrame, aSurfMaterial);
+        const float estimatesSum = backgroundEstimate + treeImportance;
+        if (estimatesSum > 0.f)
+            return backgroundEstimate / estimatesSum;
+        else
+            return 0.5f;
+    }
+
     void AddSingleLightSampleContribution(
         const LightSample       &aLightSample,
         const Vec3f             &aSurfPt,
@@ -323,12 +463,12 @@ public:
         if (aLightSample.sample.Max() <= 0.)
             // The light emmits zero radiance in this direction
             return;
-        if (mConfig.mScene->Occluded(aSurfPt, aLightSample.wig, aLightSample.dist))
+        if (Occluded(aSurfPt, aLightSample.wig, aLightSample.dist))
             // The light is not visible from this point
             return;
 
         MaterialRecord matRec(aSurfFrame.ToLocal(aLightSample.wig), aWol);
-        aSurfMaterial.EvalBsdf(matRec);
+        EvalBsdf(aSurfMaterial, matRec);
 
         if (!aLightSample.IsPointLight())
             // Planar or angular light sources - compute two-step MC estimator.
@@ -360,10 +500,25 @@ public:
         if (aLightSample.sample.Max() <= 0.)
             // The light emmits zero radiance in this direction
             return;
-        if (mConfig.mScene->Occluded(aSurfPt, aLightSample.wig, aLightSample.dist))
+        if (Occluded(aSurfPt, aLightSample.wig, aLightSample.dist))
             // The light is not visible from this point
             return;
 
+        AddUnoccludedMISLightSampleContribution(
+            aLightSample, aLightSamplesCount, aBrdfSamplesCount,
+            aSurfFrame, aWol, aSurfMaterial, oLightBuffer);
+    }
+
+    // Same as AddMISLightSampleContribution(), but doesn't test the light sample visibility
+    void AddUnoccludedMISLightSampleContribution(
+        const LightSample       &aLightSample,
+        const uint32_t           aLightSamplesCount,
+        const uint32_t           aBrdfSamplesCount,
+        const Frame             &aSurfFrame, 
+        const Vec3f             &aWol,
+        const AbstractMaterial  &aSurfMaterial,
+              SpectrumF         &oLightBuffer)
+    {
         const Vec3f wil = aSurfFrame.ToLocal(aLightSample.wig);
 
         // Since Monte Carlo estimation works only for planar and angular light sources, we can't 
@@ -398,7 +553,7 @@ public:
 
             MaterialRecord matRecord(wil, aWol);
             matRecord.RequestOptData(MaterialRecord::kOptSamplingProbs);
-            aSurfMaterial.EvalBsdf(matRecord);
+            EvalBsdf(aSurfMaterial, matRecord);
 
             const float bsdfTotalFinitePdfW = matRecord.pdfW * matRecord.compProb;
             const float lightPdfW = aLightSample.pdfW * aLightSample.lightProbability;
@@ -416,7 +571,7 @@ public:
             // of all light sources.
 
             MaterialRecord matRecord(wil, aWol);
-            aSurfMaterial.EvalBsdf(matRecord);
+            EvalBsdf(aSurfMaterial, matRecord);
 
             oLightBuffer +=
                   (aLightSample.sample * matRecord.attenuation)
@@ -8,10 +8,17 @@
 #include "normal_visualiser.hxx"
 #include "direct_illumination.hxx"
 #include "path_tracer.hxx"
+#include "wavefront_path_tracer.hxx"
 #include "microfacet.hxx"
 #include "filter.hxx"
 #include "config.hxx"
 #include "process.hxx"
+#include "bvh.hxx"
+#include "triangle_mesh.hxx"
+#include "light_tree.hxx"
+#include "tile_scheduler.hxx"
+#include "geometry_soa.hxx"
+#include "benchmarking.hxx"
 
 #include <omp.h>
 #include <string>
@@ -43,6 +50,9 @@ AbstractRenderer* CreateRenderer(
     case kPathTracing:
         return new PathTracer(aConfig, aSeed);
 
+    case kPathTracingWavefront:
+        return new WavefrontPathTracer(aConfig, aSeed);
+
     default:
         PG3_FATAL_ERROR("Unknown algorithm!!");
         return nullptr;
@@ -61,7 +71,8 @@ float Render(
     // Set number of used threads
     omp_set_num_threads(aConfig.mNumThreads);
 
-    // Create 1 renderer per thread
+    // Create 1 renderer per thread. All of them render into the shared framebuffer; renderers
+    // only keep per-thread state (random generator, introspection data, ...)
     typedef AbstractRenderer* AbstractRendererPtr;
     AbstractRendererPtr *renderers;
     renderers = new AbstractRendererPtr[aConfig.mNumThreads];
@@ -69,108 +80,175 @@ float Render(
     for (uint32_t i=0; i<aConfig.mNumThreads; i++)
         renderers[i] = CreateRenderer(aConfig, aConfig.mBaseSeed + i);
 
-    const float startT = (float)clock();
-    const float endT   = startT + aConfig.mMaxTime*CLOCKS_PER_SEC;
-    int32_t iter = 0;
-
-    // Rendering loop, when we have any time limit, use time-based loop,
-    // otherwise go with required iterations
-    if (aConfig.mMaxTime > 0)
+    const Vec2f &resolution = aConfig.mScene->mCamera.mResolution;
+    aConfig.mFramebuffer->Setup(resolution);
+    TileScheduler tileScheduler(resolution, aConfig.mNumThreads);
+
+    const bool timeBased = (aConfig.mMaxTime > 0);
+
+    // Adaptive sampling: pixels are sampled until they converge, the iteration/time limit
+    // (if any) is the upper bound
+    const bool adaptive = (aConfig.mAdaptiveMaxRelError > 0.f);
+    const int32_t resY = int32_t(resolution.y);
+    const uint32_t pixelCount = uint32_t(resolution.x) * uint32_t(resolution.y);
+    uint32_t activePixelCount = pixelCount;
+    FramebufferFloat errorSum = FramebufferFloat(0.);
+    if (adaptive)
+        aConfig.mFramebuffer->EnableSampleStatistics();
+
+    // Wall-clock time; clock() would sum up the time of all threads on some platforms
+    const Benchmarking::Timer timer;
+    const uint64_t startTicks = RendererProfilingData::GetTicks();
+    uint32_t iter = 0;
+    bool finished = false;
+
+    if (!aConfig.mQuietMode)
     {
-        if (!aConfig.mQuietMode)
+        if (timeBased)
             Utils::ProgressBar::PrintTime(0.f, 0.f);
+        else
+            Utils::ProgressBar::PrintIterations(0.f, 0);
+    }
 
-        // Time based loop
+    // Rendering loop. Threads work on the same iteration at a time and share its tiles, so even
+    // a single iteration is load-balanced over all threads. When we have any time limit, render
+    // iterations until it runs out (at least one), otherwise go with required iterations.
 #pragma omp parallel
-        while (clock() < endT)
-        {
-            int32_t threadId = omp_get_thread_num();
-            renderers[threadId]->RunIteration(aConfig.mAlgorithm, iter);
+    {
+        const uint32_t threadId = (uint32_t)omp_get_thread_num();
+        AbstractRenderer &renderer = *renderers[threadId];
 
-            // Print progress bar
-#pragma omp critical
+        for (;;)
+        {
+            // One thread finishes the previous iteration and prepares the next one,
+            // the implicit barrier at the end of the single block holds the others
+#pragma omp single
             {
-                if (!aConfig.mQuietMode)
+                if (timeBased)
+                {
+                    const float elapsed = (float)timer.ElapsedSeconds();
+                    if (iter > 0 && !aConfig.mQuietMode)
+                    {
+                        const float progress = elapsed / aConfig.mMaxTime;
+                        Utils::ProgressBar::PrintTime(progress, elapsed);
+                    }
+                    finished = (iter > 0) && (elapsed >= aConfig.mMaxTime);
+                }
+                else
                 {
-                    const float currentClock = (float)clock();
-                    const float progress = (float)((currentClock - startT) / (endT - startT));
-                    Utils::ProgressBar::PrintTime(progress, (currentClock - startT) / CLOCKS_PER_SEC);
+                    if (iter > 0 && !aConfig.mQuietMode)
+                    {
+                        const float progress = (float)iter / aConfig.mIterations;
+                        Utils::ProgressBar::PrintIterations(progress, iter);
+                    }
+                    finished = (iter >= (uint32_t)aConfig.mIterations);
                 }
+
+                if (activePixelCount == 0)
+                    finished = true;
+
+                if (!finished)
+                    tileScheduler.StartIteration();
             }
 
-#pragma omp atomic
-            iter++; // counts number of iterations
-        }
-    }
-    else
-    {
-        if (!aConfig.mQuietMode)
-            Utils::ProgressBar::PrintIterations(0.f, 0);
+            if (finished)
+                break;
 
-        // Iterations based loop
-        uint32_t globalCounter = 0;
-#pragma omp parallel for
-        for (iter=0; iter < aConfig.mIterations; iter++)
-        {
-            int32_t threadId = omp_get_thread_num();
-            renderers[threadId]->RunIteration(aConfig.mAlgorithm, iter);
+            uint32_t tileIndex;
+            while (tileScheduler.NextTile(threadId, tileIndex))
+            {
+                const uint64_t tileStartTicks = RendererProfilingData::GetTicks();
+                renderer.RenderTile(
+                    aConfig.mAlgorithm, iter, tileScheduler.GetTile(tileIndex), *aConfig.mFramebuffer);
+                renderer.AddBusyTicks(RendererProfilingData::GetTicks() - tileStartTicks);
+            }
 
-            // Print progress bar
-#pragma omp critical
+            // Wait until the whole iteration is rendered
+#pragma omp barrier
+#pragma omp single
             {
-                globalCounter++;
-                if (!aConfig.mQuietMode)
+                iter++;
+                if (adaptive)
                 {
-                    const float progress = (float)globalCounter / aConfig.mIterations;
-                    Utils::ProgressBar::PrintIterations(progress, globalCounter);
+                    activePixelCount = 0;
+                    errorSum = FramebufferFloat(0.);
                 }
             }
-        }
-    }
-
-    clock_t realEndT = clock();
-
-    if (oUsedIterations)
-        *oUsedIterations = iter+1;
 
-    // Accumulate from all renderers into a common framebuffer
-    uint32_t usedRenderers = 0;
+            // Count the new samples, stop sampling converged pixels and give the samples they
+            // would have taken to the remaining pixels, in proportion to their relative errors.
+            // Each iteration thus takes (about) one sample per pixel, as without adaptivity.
+            if (adaptive)
+            {
+#pragma omp for reduction(+:activePixelCount, errorSum)
+                for (int32_t y = 0; y < resY; y++)
+                {
+                    FramebufferFloat rowErrorSum = FramebufferFloat(0.);
+                    activePixelCount += aConfig.mFramebuffer->UpdateActivePixels(
+                        (uint32_t)y, aConfig.mAdaptiveMaxRelError, aConfig.mAdaptiveMinSamples,
+                        rowErrorSum);
+                    errorSum += rowErrorSum;
+                }
 
-    // With very low number of iterations and high number of threads
-    // not all created renderers had to have been used.
-    // Those must not participate in accumulation.
-    for (uint32_t i=0; i<aConfig.mNumThreads; i++)
-    {
-        if (!renderers[i]->WasUsed())
-            continue;
+                const FramebufferFloat extraSamplesPerError = (errorSum > FramebufferFloat(0.))
+                    ? (pixelCount - activePixelCount) / errorSum
+                    : FramebufferFloat(0.);
 
-        if (usedRenderers == 0)
-        {
-            renderers[i]->GetFramebuffer(*aConfig.mFramebuffer);
-        }
-        else
-        {
-            Framebuffer tmp;
-            renderers[i]->GetFramebuffer(tmp);
-            aConfig.mFramebuffer->Add(tmp);
+#pragma omp for
+                for (int32_t y = 0; y < resY; y++)
+                    aConfig.mFramebuffer->AllocatePixelSamples(
+                        (uint32_t)y, extraSamplesPerError, aConfig.mAdaptiveMinSamples);
+            }
         }
-
-        usedRenderers++;
     }
 
-    // Scale framebuffer by the number of used renderers
-    aConfig.mFramebuffer->Scale(FramebufferFloat(1.) / usedRenderers);
+    const double renderTime = timer.ElapsedSeconds();
+    const uint64_t renderTicks = RendererProfilingData::GetTicks() - startTicks;
+
+    if (oUsedIterations)
+        *oUsedIterations = iter;
+
+    // Without adaptivity, each iteration added one sample per pixel
+    if (adaptive)
+        aConfig.mFramebuffer->NormalizeBySampleCounts();
+    else if (iter > 0)
+        aConfig.mFramebuffer->Scale(FramebufferFloat(1.) / iter);
 
     // Aggregate introspection data (e.g. path statistics) from all renderers
     for (uint32_t i = 0; i<aConfig.mNumThreads; i++)
         aIntrospectionAggregator.AddRendererData(renderers[i]->GetRendererIntrospectionData());
+    aIntrospectionAggregator.SetRenderStatistics(renderTime, renderTicks, iter);
 
     // Release renderers
     for (uint32_t i=0; i<aConfig.mNumThreads; i++)
         delete renderers[i];
     delete [] renderers;
 
-    return float(realEndT - startT) / CLOCKS_PER_SEC;
+    return (float)renderTime;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Reports the achieved error and the distribution of samples over pixels
+void PrintAdaptiveSamplingStatistics(
+    const Config        &aConfig,
+    const Framebuffer   &aFramebuffer)
+{
+    Framebuffer::SampleStatistics stats;
+    aFramebuffer.GetSampleStatistics(aConfig.mAdaptiveMaxRelError, stats);
+
+    printf(
+        "Adaptive:   %.1f%% pixels converged to relative error %g (avg. error %.4f, max. %.4f)\n",
+        100. * stats.convergedRatio, aConfig.mAdaptiveMaxRelError,
+        stats.avgRelativeError, stats.maxRelativeError);
+    printf(
+        "            samples per pixel: min %u, avg. %.1f, max %u; distribution:",
+        stats.minSamples, stats.avgSamples, stats.maxSamples);
+    if (stats.unsampledRatio > 0.)
+        printf(" [0] %.1f%%", 100. * stats.unsampledRatio);
+    for (uint32_t i = 0; i < Framebuffer::SampleStatistics::kHistogramSize; i++)
+        if (stats.histogram[i] > 0.)
+            printf(" [%u-%u] %.1f%%", 1u << i, (2u << i) - 1u, 100. * stats.histogram[i]);
+    printf("\n");
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -181,12 +259,39 @@ bool RunUnitTests(UnitTestBlockLevel aMaxUtBlockPrintLevel)
     if (!Utils::_UT_IntegerToHumanReadable(aMaxUtBlockPrintLevel))
         return false;
 
+    if (!Rng::_UnitTests(aMaxUtBlockPrintLevel))
+        return false;
+
     if (!Geom::_UnitTests(aMaxUtBlockPrintLevel))
         return false;
 
+    if (!GeometrySoA::_UnitTests(aMaxUtBlockPrintLevel))
+        return false;
+
+    if (!BVH::_UnitTests(aMaxUtBlockPrintLevel))
+        return false;
+
+    if (!TriangleMesh::_UnitTests(aMaxUtBlockPrintLevel))
+        return false;
+
+    if (!LightTree::_UnitTests(aMaxUtBlockPrintLevel))
+        return false;
+
+    if (!PathTracer::_UnitTests(aMaxUtBlockPrintLevel))
+        return false;
+
+    if (!Framebuffer::_UnitTests(aMaxUtBlockPrintLevel))
+        return false;
+
     if (!Filter::_UnitTests(aMaxUtBlockPrintLevel))
         return false;
 
+    if (!EnvironmentMapImage::_UnitTests(aMaxUtBlockPrintLevel))
+        return false;
+
+    if (!Distribution2D::_UnitTests(aMaxUtBlockPrintLevel))
+        return false;
+
     if (!Sampling::_UT_SampleUniformSphericalTriangle(aMaxUtBlockPrintLevel))
         return false;
 
@@ -200,6 +305,89 @@ bool RunUnitTests(UnitTestBlockLevel aMaxUtBlockPrintLevel)
 }
 #endif
 
+//////////////////////////////////////////////////////////////////////////
+// Benchmarking
+#ifdef PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+// Renders the scene into the framebuffer and returns the wall-clock render time
+double BenchmarkRender(
+    const char      *aSceneId,
+    const char      *aAlgorithm,
+    uint32_t         aIterations,
+    RngType          aRngType,
+    int32_t          aBaseSeed,
+    Framebuffer     &oFramebuffer)
+{
+    const std::string iterations = std::to_string(aIterations);
+    const char *argv[] = {
+        "pg3render", "-s", aSceneId, "-a", aAlgorithm, "-i", iterations.c_str(),
+        "-rng", Rng::GetTypeAcronym(aRngType), "-q" };
+
+    Config config;
+    if (!config.ProcessCommandline((int32_t)Utils::ArrayLength(argv), argv))
+        return 0.;
+    config.mNumThreads  = std::max(1, omp_get_num_procs());
+    config.mBaseSeed    = aBaseSeed;
+    config.mFramebuffer = &oFramebuffer;
+
+    RendererIntrospectionDataAggregator introspectionAggregator;
+    Benchmarking::Timer timer;
+    Render(config, introspectionAggregator);
+    const double seconds = timer.ElapsedSeconds();
+
+    delete config.mScene;
+
+    return seconds;
+}
+
+// Error of the path tracer per generator and its efficiency, i.e. the inverse of
+// the relative MSE times the render time - it is constant for a plain Monte Carlo estimator
+// and grows with the sample count when the samples are well stratified
+void BenchmarkRngConvergence()
+{
+    Benchmarking::PrintHeader("Rendering convergence per random number generator (pt, 512x512)");
+
+    const char *sceneIds[] = { "2", "5" };
+    const uint32_t referenceIterations = 256;
+    const uint32_t maxIterations = 16;
+
+    for (auto sceneId : sceneIds)
+    {
+        // Independent of the tested renders thanks to a different seed
+        Framebuffer reference;
+        const double referenceTime =
+            BenchmarkRender(sceneId, "pt", referenceIterations, RngType::kPcg, 4321, reference);
+        printf("\tscene %s (reference: %d samples per pixel in %.1f s)\n",
+            sceneId, referenceIterations, referenceTime);
+
+        for (uint32_t type = 0; type < (uint32_t)RngType::kCount; type++)
+            for (uint32_t iterations = 1; iterations <= maxIterations; iterations *= 4)
+            {
+                Framebuffer framebuffer;
+                const double seconds =
+                    BenchmarkRender(sceneId, "pt", iterations, (RngType)type, 1234, framebuffer);
+                const double relRmse = framebuffer.RelativeRmse(reference);
+                printf("\t  %-22s %3d spp: rel. RMSE %.4f in %6.3f s, efficiency %8.1f\n",
+                    Rng::GetTypeName((RngType)type), iterations, relRmse, seconds,
+                    1. / (relRmse * relRmse * seconds));
+                fflush(stdout);
+            }
+    }
+}
+
+void RunBenchmarks()
+{
+    Rng::_Benchmark();
+    BVH::_Benchmark();
+    TriangleMesh::_Benchmark();
+    LightTree::_Benchmark();
+    EnvironmentMapImage::_Benchmark();
+    Distribution2D::_Benchmark();
+    SteerableImageEmSampler::_Benchmark();
+    BenchmarkRngConvergence();
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////////
 // Main
 int32_t main(int32_t argc, const char *argv[])
@@ -217,9 +405,15 @@ int32_t main(int32_t argc, const char *argv[])
 
     exit(0);
 
-#else
+#elif defined PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
 
-    Config::PrintRngWarning(); // Warn when not using C++11 Mersenne Twister
+    argc; argv; // unused params
+
+    RunBenchmarks();
+
+    exit(0);
+
+#else
 
     // Setup config based on command line
     Config config;
@@ -264,6 +458,9 @@ int32_t main(int32_t argc, const char *argv[])
     if (!config.mQuietMode)
         printf(" done in %s\n", timeHumanReadable.c_str());
 
+    if (!config.mQuietMode && (config.mAdaptiveMaxRelError > 0.f))
+        PrintAdaptiveSamplingStatistics(config, fbuffer);
+
     // Save the image
     std::string extension = fullOutputPath.substr(fullOutputPath.length() - 3, 3);
     if (extension == "bmp")
@@ -275,6 +472,21 @@ int32_t main(int32_t argc, const char *argv[])
 
     introspectionAggregator.PrintIntrospection();
 
+    if (!config.mQuietMode)
+        introspectionAggregator.PrintProfiling();
+
+    // Save the profiling report next to the image
+    if (config.mProfilingReportFormat != ProfilingReportFormat::kNone)
+    {
+        const std::string reportPath =
+              fullOutputPath.substr(0, fullOutputPath.length() - 4)
+            + ((config.mProfilingReportFormat == ProfilingReportFormat::kJson) ?
+                ".profile.json" : ".profile.csv");
+        if (!introspectionAggregator.SaveProfilingReport(
+                reportPath, config.mProfilingReportFormat, config))
+            printf("Saving:    Failed to save the profiling report %s!\n", reportPath.c_str());
+    }
+
     delete config.mScene;
 
     // debug
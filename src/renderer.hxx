@@ -1,10 +1,19 @@
 #pragma once
 
 #include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
 #include <cmath>
+#ifdef _MSC_VER
+#include <intrin.h>     // __rdtsc
+#else
+#include <x86intrin.h>  // __rdtsc
+#endif
 #include "scene.hxx"
 #include "frame_buffer.hxx"
 #include "config.hxx"
+#include "tile_scheduler.hxx"
 #include "types.hxx"
 #include "hard_config.hxx"
 
@@ -27,6 +36,133 @@ enum PathTerminationReason
     kTerminatedBySafetyLimit
 };
 
+// Rays counted by the renderer profiling
+enum ProfilingRayType
+{
+    kCameraRay,     // One per pixel sample
+    kShadowRay,     // Visibility tests of light samples
+    kBsdfRay,       // Closest-hit rays of BSDF samples (path continuation or MIS)
+    kProfilingRayTypeCount
+};
+
+// Hot-path stages timed by the renderer profiling. The timed blocks never nest.
+enum ProfilingStage
+{
+    kStageIntersection,     // Closest-hit and shadow rays
+    kStageBsdf,             // BSDF sampling and evaluation
+    kStageLightSampling,    // Sampling of light sources (including the environment map)
+    kStageEmEvaluation,     // Environment map radiance of rays escaping the scene
+    kProfilingStageCount
+};
+
+// Per-thread profiling counters. Ray counts and the time spent in tiles are always collected;
+// stage times only with PG3_COMPUTE_RENDERER_STAGE_TIMES. All times are in time stamp counter
+// ticks, which are cheap to read and are converted to seconds using the wall-clock render time.
+class RendererProfilingData
+{
+public:
+    RendererProfilingData() :
+        mBusyTicks(0)
+    {
+        for (uint32_t i = 0; i < kProfilingRayTypeCount; i++)
+            mRayCounts[i] = 0;
+        for (uint32_t i = 0; i < kProfilingStageCount; i++)
+            mStageTicks[i] = 0;
+    }
+
+    static uint64_t GetTicks()
+    {
+        return __rdtsc();
+    }
+
+    void AddRay(const ProfilingRayType aRayType)
+    {
+        mRayCounts[aRayType]++;
+    }
+
+    void AddStageTicks(const ProfilingStage aStage, const uint64_t aTicks)
+    {
+        mStageTicks[aStage] += aTicks;
+    }
+
+    void AddBusyTicks(const uint64_t aTicks)
+    {
+        mBusyTicks += aTicks;
+    }
+
+    uint64_t GetRayCount(const ProfilingRayType aRayType) const
+    {
+        return mRayCounts[aRayType];
+    }
+
+    uint64_t GetStageTicks(const ProfilingStage aStage) const
+    {
+        return mStageTicks[aStage];
+    }
+
+    uint64_t GetBusyTicks() const
+    {
+        return mBusyTicks;
+    }
+
+    void Add(const RendererProfilingData &aData)
+    {
+        for (uint32_t i = 0; i < kProfilingRayTypeCount; i++)
+            mRayCounts[i] += aData.mRayCounts[i];
+        for (uint32_t i = 0; i < kProfilingStageCount; i++)
+            mStageTicks[i] += aData.mStageTicks[i];
+        mBusyTicks += aData.mBusyTicks;
+    }
+
+    static const char* GetRayTypeName(const ProfilingRayType aRayType)
+    {
+        static const char* const names[] = { "camera", "shadow", "bsdf" };
+        return names[aRayType];
+    }
+
+    static const char* GetStageName(const ProfilingStage aStage)
+    {
+        static const char* const names[] = {
+            "intersection", "bsdf", "light_sampling", "em_evaluation" };
+        return names[aStage];
+    }
+
+    // Adds the ticks spent until the end of the scope to the given stage
+    class StageTimer
+    {
+    public:
+        StageTimer(RendererProfilingData &aData, const ProfilingStage aStage)
+#ifdef PG3_COMPUTE_RENDERER_STAGE_TIMES
+            :
+            mData(aData),
+            mStage(aStage),
+            mStart(GetTicks())
+#endif
+        {
+            aData; aStage; // potentially unused params
+        }
+
+#ifdef PG3_COMPUTE_RENDERER_STAGE_TIMES
+        ~StageTimer()
+        {
+            mData.AddStageTicks(mStage, GetTicks() - mStart);
+        }
+
+        StageTimer & operator=(const StageTimer&) = delete;
+
+    private:
+        RendererProfilingData  &mData;
+        const ProfilingStage    mStage;
+        const uint64_t          mStart;
+#endif
+    };
+
+protected:
+    uint64_t    mRayCounts[kProfilingRayTypeCount];
+    uint64_t    mStageTicks[kProfilingStageCount];
+    uint64_t    mBusyTicks; // Time spent rendering tiles
+};
+
 class RendererIntrospectionBase
 {
 #ifdef PG3_COMPUTE_AND_PRINT_RENDERER_INTROSPECTION
@@ -116,6 +252,19 @@ public:
 #endif
     }
 
+    RendererProfilingData &GetProfilingData()
+    {
+        return mProfilingData;
+    }
+
+    const RendererProfilingData &GetProfilingData() const
+    {
+        return mProfilingData;
+    }
+
+protected:
+    RendererProfilingData   mProfilingData;
+
     friend class RendererIntrospectionDataAggregator;
 };
 
@@ -123,9 +272,16 @@ class RendererIntrospectionDataAggregator : public RendererIntrospectionBase
 {
 public:
 
+    RendererIntrospectionDataAggregator() :
+        mWallSeconds(0.),
+        mRenderTicks(0),
+        mIterations(0)
+    {}
+
     void AddRendererData(const RendererIntrospectionData &aRendererData)
     {
-        aRendererData;
+        // Profiling data is kept per thread (one renderer per thread)
+        mThreadProfilingData.push_back(aRendererData.mProfilingData);
 
 #ifdef PG3_COMPUTE_AND_PRINT_RENDERER_INTROSPECTION
 
@@ -188,6 +344,62 @@ public:
 #endif
     }
 
+    // Wall-clock duration of the render, also used for converting profiling ticks to seconds
+    void SetRenderStatistics(
+        const double    aWallSeconds,
+        const uint64_t  aRenderTicks,
+        const uint32_t  aIterations)
+    {
+        mWallSeconds    = aWallSeconds;
+        mRenderTicks    = aRenderTicks;
+        mIterations     = aIterations;
+    }
+
+    void PrintProfiling() const
+    {
+        const RendererProfilingData total = GetTotalProfilingData();
+        const double rayCount = (double)GetTotalRayCount(total);
+
+        printf(
+            "Profiling:  %.3f M samples/s, %.3f M rays/s (camera %.1f%%, shadow %.1f%%, bsdf %.1f%%), "
+            "thread utilisation %.1f%%\n",
+            1e-6 * PerSecond(total.GetRayCount(kCameraRay)),
+            1e-6 * PerSecond(rayCount),
+            100. * total.GetRayCount(kCameraRay) / std::max(rayCount, 1.),
+            100. * total.GetRayCount(kShadowRay) / std::max(rayCount, 1.),
+            100. * total.GetRayCount(kBsdfRay)   / std::max(rayCount, 1.),
+            100. * GetUtilisation(total, (uint32_t)mThreadProfilingData.size()));
+
+#ifdef PG3_COMPUTE_RENDERER_STAGE_TIMES
+        printf("            busy time:");
+        for (uint32_t stage = 0; stage < kProfilingStageCount; stage++)
+            printf(
+                " %s %.1f%%", RendererProfilingData::GetStageName((ProfilingStage)stage),
+                100. * total.GetStageTicks((ProfilingStage)stage) / std::max(total.GetBusyTicks(), (uint64_t)1));
+        printf("\n");
+#endif
+    }
+
+    // Writes a machine-readable report with the total and per-thread profiling data
+    bool SaveProfilingReport(
+        const std::string           &aFilename,
+        const ProfilingReportFormat  aFormat,
+        const Config                &aConfig) const
+    {
+        std::ofstream report(aFilename, std::ios::trunc);
+        if (!report)
+            return false;
+
+        if (aFormat == ProfilingReportFormat::kJson)
+            WriteJsonReport(report, aConfig);
+        else if (aFormat == ProfilingReportFormat::kCsv)
+            WriteCsvReport(report, aConfig);
+        else
+            PG3_FATAL_ERROR("Unknown profiling report format!");
+
+        return !report.fail();
+    }
+
 protected:
 
     void PrintTerminatedPathsCountByLengths(
@@ -225,6 +437,187 @@ protected:
 #endif
     }
 
+    RendererProfilingData GetTotalProfilingData() const
+    {
+        RendererProfilingData total;
+        for (const auto &threadData : mThreadProfilingData)
+            total.Add(threadData);
+        return total;
+    }
+
+    static uint64_t GetTotalRayCount(const RendererProfilingData &aData)
+    {
+        uint64_t count = 0;
+        for (uint32_t rayType = 0; rayType < kProfilingRayTypeCount; rayType++)
+            count += aData.GetRayCount((ProfilingRayType)rayType);
+        return count;
+    }
+
+    double PerSecond(const double aCount) const
+    {
+        return (mWallSeconds > 0.) ? (aCount / mWallSeconds) : 0.;
+    }
+
+    double TicksToSeconds(const uint64_t aTicks) const
+    {
+        return (mRenderTicks > 0) ? (mWallSeconds * aTicks / mRenderTicks) : 0.;
+    }
+
+    // Ratio of the time spent rendering tiles to the whole render time of the given threads
+    double GetUtilisation(const RendererProfilingData &aData, const uint32_t aThreadCount) const
+    {
+        const double available = (double)mRenderTicks * aThreadCount;
+        return (available > 0.) ? (aData.GetBusyTicks() / available) : 0.;
+    }
+
+    static const char* GetBuildName()
+    {
+#if !defined _DEBUG
+        return "release";
+#else
+        return "debug";
+#endif
+    }
+
+    static std::string EscapeJson(const std::string &aText)
+    {
+        std::string escaped;
+        for (const char c : aText)
+        {
+            if ((c == '"') || (c == '\\'))
+                escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    static std::string EscapeCsv(const std::string &aText)
+    {
+        std::string escaped = "\"";
+        for (const char c : aText)
+        {
+            if (c == '"')
+                escaped += '"';
+            escaped += c;
+        }
+        return escaped + "\"";
+    }
+
+    void WriteJsonProfilingData(
+        std::ofstream               &aOfs,
+        const RendererProfilingData &aData,
+        const uint32_t               aThreadCount,
+        const char                  *aIndent) const
+    {
+        aOfs << aIndent << "\"samples\": " << aData.GetRayCount(kCameraRay) << ",\n";
+        aOfs << aIndent << "\"samples_per_s\": " << PerSecond((double)aData.GetRayCount(kCameraRay)) << ",\n";
+        aOfs << aIndent << "\"rays\": {";
+        for (uint32_t rayType = 0; rayType < kProfilingRayTypeCount; rayType++)
+            aOfs << "\"" << RendererProfilingData::GetRayTypeName((ProfilingRayType)rayType) << "\": "
+                 << aData.GetRayCount((ProfilingRayType)rayType) << ", ";
+        aOfs << "\"total\": " << GetTotalRayCount(aData) << "},\n";
+        aOfs << aIndent << "\"rays_per_s\": {";
+        for (uint32_t rayType = 0; rayType < kProfilingRayTypeCount; rayType++)
+            aOfs << "\"" << RendererProfilingData::GetRayTypeName((ProfilingRayType)rayType) << "\": "
+                 << PerSecond((double)aData.GetRayCount((ProfilingRayType)rayType)) << ", ";
+        aOfs << "\"total\": " << PerSecond((double)GetTotalRayCount(aData)) << "},\n";
+        aOfs << aIndent << "\"stage_time_s\": {";
+        for (uint32_t stage = 0; stage < kProfilingStageCount; stage++)
+            aOfs << (stage > 0 ? ", " : "")
+                 << "\"" << RendererProfilingData::GetStageName((ProfilingStage)stage) << "\": "
+                 << TicksToSeconds(aData.GetStageTicks((ProfilingStage)stage));
+        aOfs << "},\n";
+        aOfs << aIndent << "\"busy_time_s\": " << TicksToSeconds(aData.GetBusyTicks()) << ",\n";
+        aOfs << aIndent << "\"utilisation\": " << GetUtilisation(aData, aThreadCount);
+    }
+
+    void WriteJsonReport(std::ofstream &aOfs, const Config &aConfig) const
+    {
+        const uint32_t threadCount = (uint32_t)mThreadProfilingData.size();
+
+        aOfs.precision(9);
+        aOfs << "{\n";
+        aOfs << "  \"scene\": \"" << EscapeJson(aConfig.mScene->mSceneName) << "\",\n";
+        aOfs << "  \"algorithm\": \"" << Config::GetAcronym(aConfig.mAlgorithm) << "\",\n";
+        aOfs << "  \"sampler\": \"" << Rng::GetTypeAcronym(aConfig.mRngType) << "\",\n";
+        aOfs << "  \"resolution\": [" << aConfig.mResolution.x << ", " << aConfig.mResolution.y << "],\n";
+        aOfs << "  \"threads\": " << threadCount << ",\n";
+        aOfs << "  \"iterations\": " << mIterations << ",\n";
+        aOfs << "  \"build\": \"" << GetBuildName() << "\",\n";
+#ifdef PG3_COMPUTE_RENDERER_STAGE_TIMES
+        aOfs << "  \"stage_times\": true,\n";
+#else
+        aOfs << "  \"stage_times\": false,\n";
+#endif
+        aOfs << "  \"wall_time_s\": " << mWallSeconds << ",\n";
+        WriteJsonProfilingData(aOfs, GetTotalProfilingData(), threadCount, "  ");
+        aOfs << ",\n  \"per_thread\": [\n";
+        for (uint32_t thread = 0; thread < threadCount; thread++)
+        {
+            aOfs << "    {\n      \"thread\": " << thread << ",\n";
+            WriteJsonProfilingData(aOfs, mThreadProfilingData[thread], 1, "      ");
+            aOfs << "\n    }" << ((thread + 1 < threadCount) ? "," : "") << "\n";
+        }
+        aOfs << "  ]\n}\n";
+    }
+
+    void WriteCsvProfilingData(
+        std::ofstream               &aOfs,
+        const std::string           &aRunColumns,
+        const char                  *aThread,
+        const RendererProfilingData &aData,
+        const uint32_t               aThreadCount) const
+    {
+        aOfs << aRunColumns << aThread << ","
+             << aData.GetRayCount(kCameraRay) << ","
+             << PerSecond((double)aData.GetRayCount(kCameraRay));
+        for (uint32_t rayType = 0; rayType < kProfilingRayTypeCount; rayType++)
+            aOfs << "," << aData.GetRayCount((ProfilingRayType)rayType);
+        aOfs << "," << PerSecond((double)GetTotalRayCount(aData));
+        for (uint32_t stage = 0; stage < kProfilingStageCount; stage++)
+            aOfs << "," << TicksToSeconds(aData.GetStageTicks((ProfilingStage)stage));
+        aOfs << "," << TicksToSeconds(aData.GetBusyTicks())
+             << "," << GetUtilisation(aData, aThreadCount) << "\n";
+    }
+
+    // One row per thread and one for all of them; the run is described in every row,
+    // so that reports of several runs can be simply concatenated
+    void WriteCsvReport(std::ofstream &aOfs, const Config &aConfig) const
+    {
+        const uint32_t threadCount = (uint32_t)mThreadProfilingData.size();
+
+        aOfs << "scene,algorithm,sampler,width,height,threads,iterations,build,wall_time_s,"
+                "thread,samples,samples_per_s";
+        for (uint32_t rayType = 0; rayType < kProfilingRayTypeCount; rayType++)
+            aOfs << "," << RendererProfilingData::GetRayTypeName((ProfilingRayType)rayType) << "_rays";
+        aOfs << ",rays_per_s";
+        for (uint32_t stage = 0; stage < kProfilingStageCount; stage++)
+            aOfs << "," << RendererProfilingData::GetStageName((ProfilingStage)stage) << "_s";
+        aOfs << ",busy_time_s,utilisation\n";
+
+        std::ostringstream run;
+        run.precision(9);
+        run << EscapeCsv(aConfig.mScene->mSceneName) << ","
+            << Config::GetAcronym(aConfig.mAlgorithm) << ","
+            << Rng::GetTypeAcronym(aConfig.mRngType) << ","
+            << aConfig.mResolution.x << "," << aConfig.mResolution.y << ","
+            << threadCount << "," << mIterations << "," << GetBuildName() << ","
+            << mWallSeconds << ",";
+
+        aOfs.precision(9);
+        for (uint32_t thread = 0; thread < threadCount; thread++)
+            WriteCsvProfilingData(
+                aOfs, run.str(), std::to_string(thread).c_str(), mThreadProfilingData[thread], 1);
+        WriteCsvProfilingData(aOfs, run.str(), "all", GetTotalProfilingData(), threadCount);
+    }
+
+protected:
+
+    // Profiling
+    std::vector<RendererProfilingData>  mThreadProfilingData;
+    double                              mWallSeconds;
+    uint64_t                            mRenderTicks;
+    uint32_t                            mIterations;
 };
 
 
@@ -234,10 +627,7 @@ class AbstractRenderer
 public:
 
     AbstractRenderer(const Config &aConfig) : mConfig(aConfig)
-    {
-        mIterations = 0;
-        mFramebuffer.Setup(mConfig.mScene->mCamera.mResolution);
-    }
+    {}
 
     virtual ~AbstractRenderer(){}
 
@@ -248,30 +638,50 @@ public:
     AbstractRenderer & operator=(const AbstractRenderer&) = delete;
     //AbstractRenderer(const AbstractRenderer&) = delete;
 
-    virtual void RunIteration(
-        const Algorithm     aAlgorithm,
-        uint32_t            aIteration) = 0;
-
-    void GetFramebuffer(Framebuffer& oFramebuffer)
-    {
-        oFramebuffer = mFramebuffer;
-
-        if (mIterations > 0)
-            oFramebuffer.Scale(FramebufferFloat(1.) / mIterations);
-    }
+    // Adds one sample per pixel of the given tile into the framebuffer. The framebuffer is shared
+    // by all renderers; each tile is rendered by exactly one of them in any given iteration.
+    virtual void RenderTile(
+        const Algorithm      aAlgorithm,
+        uint32_t             aIteration,
+        const ImageTile     &aTile,
+        Framebuffer         &oFramebuffer) = 0;
 
     const RendererIntrospectionData &GetRendererIntrospectionData() const
     {
         return mIntrospectionData;
     }
 
-    // Whether this renderer was used at all
-    bool WasUsed() const { return mIterations > 0; }
+    // Time the thread of this renderer spent rendering tiles (see RendererProfilingData)
+    void AddBusyTicks(const uint64_t aTicks)
+    {
+        mIntrospectionData.GetProfilingData().AddBusyTicks(aTicks);
+    }
 
 protected:
 
-    uint32_t         mIterations;
-    Framebuffer      mFramebuffer;
+    // Scene queries counted and timed by the renderer profiling
+    bool Intersect(
+        const Ray               &aRay,
+              RayIntersection   &oResult,
+        const ProfilingRayType   aRayType)
+    {
+        RendererProfilingData &profilingData = mIntrospectionData.GetProfilingData();
+        profilingData.AddRay(aRayType);
+        RendererProfilingData::StageTimer timer(profilingData, kStageIntersection);
+        return mConfig.mScene->Intersect(aRay, oResult);
+    }
+
+    bool Occluded(
+        const Vec3f &aPoint,
+        const Vec3f &aDir,
+        float        aTMax)
+    {
+        RendererProfilingData &profilingData = mIntrospectionData.GetProfilingData();
+        profilingData.AddRay(kShadowRay);
+        RendererProfilingData::StageTimer timer(profilingData, kStageIntersection);
+        return mConfig.mScene->Occluded(aPoint, aDir, aTMax);
+    }
+
     const Config    &mConfig;
 
     RendererIntrospectionData   mIntrospectionData;
@@ -4,39 +4,174 @@
 #include <cmath>
 #include "types.hxx"
 
-#if defined(_MSC_VER)
-#   if (_MSC_VER < 1600)
-#       define LEGACY_RNG
-#   endif
-#endif
-
-#if !defined(LEGACY_RNG)
+#include "unit_testing.hxx"
+#include "benchmarking.hxx"
 
 #include <random>
+#include <memory>
+
+// Generator behind Rng. Can be chosen at runtime (see -rng).
+enum class RngType
+{
+    kMersenneTwister,   // C++11 std::mt19937_64 with the standard distributions, ~2.5 KB of state
+    kPcg,               // PCG32 (O'Neill 2014), 16 bytes of state, restarted for each pixel sample
+    kSobol,             // Owen-scrambled Sobol (0,2)-sequence padded over dimensions (Burley 2020)
+
+    kCount
+};
+
+// Source of uniform random numbers for sampling.
+//
+// By default, the generator produces one stream of numbers. Renderers restart it
+// for each pixel sample via StartPixelSample(), which makes the counter-based generators
+// (PCG, Sobol) addressable by the pixel and sample index - the result doesn't depend on
+// the tile order or the number of threads. The Sobol sampler assigns the consumed numbers
+// to the dimensions of the sample: each GetFloat() takes one dimension and each GetVec2f()
+// takes a pair of dimensions, which is well stratified over the pixel samples.
 class Rng
 {
 public:
-    Rng(int32_t aSeed = 1234):
-        mRng(aSeed)
-    {}
+    Rng(int32_t aSeed = 1234, RngType aType = RngType::kMersenneTwister) :
+        mType(aType),
+        mSampleIndex(0u),
+        mDimension(0u)
+    {
+        if (mType == RngType::kMersenneTwister)
+            mMersenneTwister.reset(new MersenneTwister(aSeed));
+
+        // Single stream unless restarted for a pixel sample
+        SeedPcg(Hash((uint32_t)aSeed), 0u);
+        mSobolSeed = Hash((uint32_t)aSeed);
+    }
+
+    Rng(const Rng &aOther) :
+        mType(aOther.mType),
+        mPcgState(aOther.mPcgState),
+        mPcgIncrement(aOther.mPcgIncrement),
+        mSobolSeed(aOther.mSobolSeed),
+        mSampleIndex(aOther.mSampleIndex),
+        mDimension(aOther.mDimension)
+    {
+        if (aOther.mMersenneTwister)
+            mMersenneTwister.reset(new MersenneTwister(*aOther.mMersenneTwister));
+    }
+
+    Rng& operator=(const Rng &aOther)
+    {
+        if (this == &aOther)
+            return *this;
+
+        mType           = aOther.mType;
+        mPcgState       = aOther.mPcgState;
+        mPcgIncrement   = aOther.mPcgIncrement;
+        mSobolSeed      = aOther.mSobolSeed;
+        mSampleIndex    = aOther.mSampleIndex;
+        mDimension      = aOther.mDimension;
+
+        if (!aOther.mMersenneTwister)
+            mMersenneTwister.reset();
+        else if (mMersenneTwister)
+            *mMersenneTwister = *aOther.mMersenneTwister;
+        else
+            mMersenneTwister.reset(new MersenneTwister(*aOther.mMersenneTwister));
+
+        return *this;
+    }
+
+    static const char* GetTypeAcronym(RngType aType)
+    {
+        static const char* acronyms[] = { "mt", "pcg", "sobol" };
+        static_assert(
+            sizeof(acronyms) / sizeof(acronyms[0]) == (size_t)RngType::kCount,
+            "Not enough generator acronyms");
+
+        return acronyms[(size_t)aType];
+    }
+
+    static const char* GetTypeName(RngType aType)
+    {
+        static const char* names[] = {
+            "Mersenne Twister",
+            "PCG32",
+            "Owen-scrambled Sobol" };
+        static_assert(
+            sizeof(names) / sizeof(names[0]) == (size_t)RngType::kCount,
+            "Not enough generator names");
+
+        return names[(size_t)aType];
+    }
+
+    RngType GetType() const
+    {
+        return mType;
+    }
+
+    // Restarts the generator for the given sample of the given pixel. The Mersenne Twister
+    // is too expensive to re-seed that often and just continues its stream.
+    void StartPixelSample(uint32_t aPixelIndex, uint32_t aSampleIndex, uint32_t aSeed = 0u)
+    {
+        switch (mType)
+        {
+        case RngType::kPcg:
+            SeedPcg(HashCombine(Hash(aSeed), aSampleIndex), aPixelIndex);
+            break;
+
+        case RngType::kSobol:
+            // The pixel keeps its scrambling over all samples, otherwise they wouldn't
+            // be stratified
+            mSobolSeed      = HashCombine(Hash(aSeed), aPixelIndex);
+            mSampleIndex    = aSampleIndex;
+            mDimension      = 0u;
+            break;
+
+        default:
+            break;
+        }
+    }
 
     int32_t GetInt()
     {
-        return mDistInt(mRng);
+        if (mType == RngType::kMersenneTwister)
+            return mMersenneTwister->distInt(mMersenneTwister->engine);
+        else
+            return (int32_t)(GetUint() >> 1); // non-negative, as the standard distribution
     }
 
     uint32_t GetUint()
     {
-        return mDistUint(mRng);
+        switch (mType)
+        {
+        case RngType::kPcg:
+            return NextPcg();
+        case RngType::kSobol:
+            return NextSobol1D();
+        default:
+            return mMersenneTwister->distUint(mMersenneTwister->engine);
+        }
     }
 
     float GetFloat()
     {
-        return mDistFloat(mRng);
+        switch (mType)
+        {
+        case RngType::kPcg:
+            return UintToFloat(NextPcg());
+        case RngType::kSobol:
+            return UintToFloat(NextSobol1D());
+        default:
+            return mMersenneTwister->distFloat(mMersenneTwister->engine);
+        }
     }
 
     Vec2f GetVec2f()
     {
+        if (mType == RngType::kSobol)
+        {
+            uint32_t x, y;
+            NextSobol2D(x, y);
+            return Vec2f(UintToFloat(x), UintToFloat(y));
+        }
+
         float a = GetFloat();
         float b = GetFloat();
 
@@ -45,6 +180,13 @@ public:
 
     Vec3f GetVec3f()
     {
+        if (mType == RngType::kSobol)
+        {
+            const Vec2f ab = GetVec2f();
+            const float c  = GetFloat();
+            return Vec3f(ab.x, ab.y, c);
+        }
+
         float a = GetFloat();
         float b = GetFloat();
         float c = GetFloat();
@@ -54,112 +196,315 @@ public:
 
 private:
 
-    std::mt19937_64                         mRng;
-    std::uniform_int_distribution<int32_t>  mDistInt;
-    std::uniform_int_distribution<uint32_t> mDistUint;
-    std::uniform_real_distribution<float>   mDistFloat;
-};
-
-#else
-
-template<uint32_t rounds>
-class TeaImplTemplate
-{
-public:
-    void Reset(
-        uint32_t aSeed0,
-        uint32_t aSeed1)
+    // Top 24 bits to a float in [0,1)
+    static float UintToFloat(uint32_t aValue)
     {
-        mState0 = aSeed0;
-        mState1 = aSeed1;
+        return (aValue >> 8) * (1.f / 16777216.f);
     }
 
-    uint32_t GetImpl(void)
+    // Integer hash with low bias (lowbias32 by C. Wellons)
+    static uint32_t Hash(uint32_t aValue)
     {
-        uint32_t sum=0;
-        const uint32_t delta=0x9e3779b9U;
-
-        for (uint32_t i=0; i<rounds; i++)
-        {
-            sum+=delta;
-            mState0+=((mState1<<4)+0xa341316cU) ^ (mState1+sum) ^ ((mState1>>5)+0xc8013ea4U);
-            mState1+=((mState0<<4)+0xad90777dU) ^ (mState0+sum) ^ ((mState0>>5)+0x7e95761eU);
-        }
+        aValue ^= aValue >> 16;
+        aValue *= 0x7feb352du;
+        aValue ^= aValue >> 15;
+        aValue *= 0x846ca68bu;
+        aValue ^= aValue >> 16;
+        return aValue;
+    }
 
-        return mState0;
+    static uint32_t HashCombine(uint32_t aSeed, uint32_t aValue)
+    {
+        return Hash(aSeed ^ (aValue + 0x9e3779b9u + (aSeed << 6) + (aSeed >> 2)));
     }
 
-private:
+    static uint32_t ReverseBits(uint32_t aValue)
+    {
+        aValue = ((aValue >> 1) & 0x55555555u) | ((aValue & 0x55555555u) << 1);
+        aValue = ((aValue >> 2) & 0x33333333u) | ((aValue & 0x33333333u) << 2);
+        aValue = ((aValue >> 4) & 0x0F0F0F0Fu) | ((aValue & 0x0F0F0F0Fu) << 4);
+        aValue = ((aValue >> 8) & 0x00FF00FFu) | ((aValue & 0x00FF00FFu) << 8);
+        return (aValue >> 16) | (aValue << 16);
+    }
 
-    uint32_t mState0, mState1;
-};
+    // Hash-based Owen scrambling (Burley 2020, "Practical Hash-based Owen Scrambling"):
+    // the Laine-Karras permutation only mixes bits upwards, so applying it on the reversed
+    // value makes each bit depend on the higher ones, which is a nested uniform scramble
+    static uint32_t NestedUniformScramble(uint32_t aValue, uint32_t aSeed)
+    {
+        uint32_t x = ReverseBits(aValue);
+        x ^= x * 0x3d20adeau;
+        x += aSeed;
+        x *= (aSeed >> 16) | 1u;
+        x ^= x * 0x05526c56u;
+        x ^= x * 0x53a22864u;
+        return ReverseBits(x);
+    }
 
-typedef TeaImplTemplate<6>  TeaImpl;
+    // The first two Sobol dimensions. The second one uses the direction numbers
+    // of the primitive polynomial x+1: v_{k+1} = v_k ^ (v_k >> 1).
+    static uint32_t SobolDimension0(uint32_t aIndex)
+    {
+        return ReverseBits(aIndex);
+    }
 
-template<typename RandomImpl>
-class RandomBase
-{
-public:
+    static uint32_t SobolDimension1(uint32_t aIndex)
+    {
+        uint32_t result = 0u;
+        for (uint32_t v = 1u << 31; aIndex != 0u; aIndex >>= 1, v ^= v >> 1)
+            if (aIndex & 1u)
+                result ^= v;
+        return result;
+    }
 
-    RandomBase(int32_t aSeed = 1234)
+    // Each dimension (pair) takes the sample from its own scrambled permutation of the sample
+    // indices, which decorrelates the dimensions but keeps the power-of-two prefixes intact
+    uint32_t NextSobol1D()
     {
-        mImpl.Reset(uint32_t(aSeed), 5678);
+        const uint32_t dimensionSeed = HashCombine(mSobolSeed, mDimension++);
+        const uint32_t index = NestedUniformScramble(mSampleIndex, dimensionSeed);
+        return NestedUniformScramble(SobolDimension0(index), HashCombine(dimensionSeed, 1u));
     }
 
-    uint32_t GetUint()
+    void NextSobol2D(uint32_t &oX, uint32_t &oY)
     {
-        return getImpl();
+        const uint32_t dimensionSeed = HashCombine(mSobolSeed, mDimension);
+        mDimension += 2u;
+        const uint32_t index = NestedUniformScramble(mSampleIndex, dimensionSeed);
+        oX = NestedUniformScramble(SobolDimension0(index), HashCombine(dimensionSeed, 1u));
+        oY = NestedUniformScramble(SobolDimension1(index), HashCombine(dimensionSeed, 2u));
     }
 
-    float GetFloat()
+    // PCG-XSH-RR with 64-bit state; aSequence selects one of 2^63 independent streams
+    void SeedPcg(uint64_t aInitState, uint64_t aSequence)
     {
-        return (float(GetUint()) + 1.f) * (1.0f / 4294967297.0f);
+        mPcgState       = 0u;
+        mPcgIncrement   = (aSequence << 1u) | 1u;
+        NextPcg();
+        mPcgState      += aInitState;
+        NextPcg();
     }
 
-    Vec2f GetVec2f   (void)
+    uint32_t NextPcg()
     {
-        // cannot do return Vec2f(getF32(), getF32()) because the order is not ensured
-        float a = GetFloat();
-        float b = GetFloat();
-        return Vec2f(a, b);
+        const uint64_t oldState = mPcgState;
+        mPcgState = oldState * 6364136223846793005ull + mPcgIncrement;
+        const uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+        const uint32_t rotation   = (uint32_t)(oldState >> 59u);
+        return (xorShifted >> rotation) | (xorShifted << ((0u - rotation) & 31u));
     }
 
-    Vec3f GetVec3f   (void)
+    struct MersenneTwister
     {
-        float a = GetFloat();
-        float b = GetFloat();
-        float c = GetFloat();
-        return Vec3f(a, b, c);
+        MersenneTwister(int32_t aSeed) :
+            engine(aSeed)
+        {}
+
+        std::mt19937_64                         engine;
+        std::uniform_int_distribution<int32_t>  distInt;
+        std::uniform_int_distribution<uint32_t> distUint;
+        std::uniform_real_distribution<float>   distFloat;
+    };
+
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+
+public:
+
+    // Scrambling and index shuffling must keep the (0,2)-sequence property: every power-of-two
+    // prefix of the samples of one pixel has exactly one point in each elementary interval
+    static bool _UT_SobolStratification(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Sobol stratification");
+
+        const uint32_t log2SampleCount = 8;
+        const uint32_t sampleCount = 1u << log2SampleCount;
+        const uint32_t dimensionPairCount = 8;
+
+        for (uint32_t pixel = 0; pixel < 4; pixel++)
+        {
+            std::vector<Vec2f> samples(sampleCount * dimensionPairCount);
+            Rng rng(0, RngType::kSobol);
+            for (uint32_t i = 0; i < sampleCount; i++)
+            {
+                rng.StartPixelSample(pixel, i, 1234u);
+                for (uint32_t pair = 0; pair < dimensionPairCount; pair++)
+                    samples[pair * sampleCount + i] = rng.GetVec2f();
+            }
+
+            for (uint32_t pair = 0; pair < dimensionPairCount; pair++)
+                for (uint32_t log2ResX = 0; log2ResX <= log2SampleCount; log2ResX++)
+                {
+                    const uint32_t resX = 1u << log2ResX;
+                    const uint32_t resY = sampleCount / resX;
+                    std::vector<uint32_t> counts(sampleCount, 0u);
+                    for (uint32_t i = 0; i < sampleCount; i++)
+                    {
+                        const Vec2f &sample = samples[pair * sampleCount + i];
+                        counts[(uint32_t)(sample.y * resY) * resX + (uint32_t)(sample.x * resX)]++;
+                    }
+
+                    for (uint32_t cell = 0; cell < sampleCount; cell++)
+                        if (counts[cell] != 1u)
+                        {
+                            PG3_UT_FAILED(
+                                aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Sobol stratification",
+                                "Pixel %d, dimension pair %d: %d points in a %dx%d elementary interval",
+                                pixel, pair, counts[cell], resX, resY);
+                            return false;
+                        }
+                }
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Sobol stratification");
+        return true;
     }
 
-    //////////////////////////////////////////////////////////////////////////
-    void StoreState(
-        uint32_t *oState1,
-        uint32_t *oState2)
+    // Restarted generators give the same numbers for the same pixel sample (and different
+    // ones otherwise), and their mean and variance match the uniform distribution
+    static bool _UT_Generator(const UnitTestBlockLevel aMaxUtBlockPrintLevel, RngType aType)
     {
-        mImpl.StoreState(oState1, oState2);
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", GetTypeName(aType));
+
+        const char *failure = nullptr;
+
+        if (aType != RngType::kMersenneTwister)
+        {
+            Rng rng1(1, aType), rng2(2, aType);
+            rng1.StartPixelSample(17, 3, 5);
+            rng2.GetFloat();
+            rng2.StartPixelSample(17, 3, 5);
+            for (uint32_t i = 0; (i < 100) && (failure == nullptr); i++)
+                if (rng1.GetFloat() != rng2.GetFloat())
+                    failure = "Restarted generators differ";
+
+            rng1.StartPixelSample(17, 3, 5);
+            rng2.StartPixelSample(18, 3, 5);
+            uint32_t equalCount = 0;
+            for (uint32_t i = 0; i < 100; i++)
+                equalCount += (rng1.GetFloat() == rng2.GetFloat()) ? 1u : 0u;
+            if ((failure == nullptr) && (equalCount > 2))
+                failure = "Different pixels give the same numbers";
+        }
+
+        // One stream, and many short restarted ones as used by renderers
+        const uint32_t count = 1000000;
+        for (uint32_t restarted = 0; (restarted < 2) && (failure == nullptr); restarted++)
+        {
+            Rng rng(7, aType);
+            double sum = 0., sqrSum = 0.;
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if (restarted != 0)
+                    rng.StartPixelSample(i / 64, i % 64, 3);
+                const float value = rng.GetFloat();
+                if (!(value >= 0.f) || (value > 1.f))
+                {
+                    failure = "Number out of [0,1]";
+                    break;
+                }
+                sum += value;
+                sqrSum += value * value;
+            }
+            const double mean = sum / count;
+            const double variance = sqrSum / count - mean * mean;
+            if ((failure == nullptr) && (std::abs(mean - 0.5) > 0.002))
+                failure = "Mean differs from 1/2";
+            else if ((failure == nullptr) && (std::abs(variance - 1. / 12.) > 0.002))
+                failure = "Variance differs from 1/12";
+        }
+
+        if (failure != nullptr)
+        {
+            PG3_UT_FAILED(
+                aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s",
+                failure, GetTypeName(aType));
+            return false;
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", GetTypeName(aType));
+        return true;
     }
 
-    void LoadState(
-        uint32_t aState1,
-        uint32_t aState2,
-        uint32_t aDimension)
+    static bool _UnitTests(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
     {
-        mImpl.LoadState(aState1, aState2, aDimension);
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblWholeTest, "Rng: generators");
+
+        for (uint32_t type = 0; type < (uint32_t)RngType::kCount; type++)
+            if (!_UT_Generator(aMaxUtBlockPrintLevel, (RngType)type))
+                return false;
+
+        if (!_UT_SobolStratification(aMaxUtBlockPrintLevel))
+            return false;
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblWholeTest, "Rng: generators");
+        return true;
     }
 
-protected:
+#endif
+
+#ifdef PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+public:
 
-    uint32_t getImpl(void)
+    static void _Benchmark()
     {
-        return mImpl.GetImpl();
+        Benchmarking::PrintHeader("Random number generators (single thread)");
+
+        const uint32_t count = 1u << 24;
+        float sum = 0.f; // Keeps the optimiser from removing the measured code
+
+        for (uint32_t type = 0; type < (uint32_t)RngType::kCount; type++)
+        {
+            Rng rng(7, (RngType)type);
+
+            printf("\t%s (%d bytes + %d bytes of heap state)\n",
+                GetTypeName((RngType)type), (int32_t)sizeof(Rng),
+                (type == (uint32_t)RngType::kMersenneTwister) ? (int32_t)sizeof(MersenneTwister) : 0);
+
+            Benchmarking::Timer timer;
+            for (uint32_t i = 0; i < count; i++)
+                sum += rng.GetFloat();
+            Benchmarking::PrintThroughput("  GetFloat", count, timer.ElapsedSeconds(), "floats");
+
+            timer.Restart();
+            for (uint32_t i = 0; i < count / 2; i++)
+            {
+                const Vec2f value = rng.GetVec2f();
+                sum += value.x + value.y;
+            }
+            Benchmarking::PrintThroughput("  GetVec2f", count / 2, timer.ElapsedSeconds(), "vectors");
+
+            // Renderers restart the generator for each pixel sample and take a handful of numbers
+            timer.Restart();
+            for (uint32_t i = 0; i < count / 16; i++)
+            {
+                rng.StartPixelSample(i >> 4, i & 15u, 3);
+                for (uint32_t j = 0; j < 8; j++)
+                    sum += rng.GetVec2f().x;
+            }
+            Benchmarking::PrintThroughput(
+                "  restart + 8x GetVec2f", count / 16, timer.ElapsedSeconds(), "pixel samples");
+        }
+
+        if (sum < 0.f)
+            printf("\t(%f)\n", sum);
     }
 
+#endif
+
 private:
 
-    RandomImpl mImpl;
-};
+    RngType                             mType;
 
-typedef RandomBase<TeaImpl> Rng;
+    // PCG
+    uint64_t                            mPcgState;
+    uint64_t                            mPcgIncrement;
 
-#endif
+    // Sobol
+    uint32_t                            mSobolSeed;     // scrambling of the current pixel
+    uint32_t                            mSampleIndex;
+    uint32_t                            mDimension;     // next dimension to be consumed
+
+    // Mersenne Twister, only allocated when used
+    std::unique_ptr<MersenneTwister>    mMersenneTwister;
+};
@@ -3,9 +3,12 @@
 #include "math.hxx"
 #include "spectrum.hxx"
 #include "scene_graph.hxx"
+#include "bvh.hxx"
+#include "triangle_mesh.hxx"
 #include "camera.hxx"
 #include "materials.hxx"
 #include "lights.hxx"
+#include "light_tree.hxx"
 #include "aux_dbg_params.hxx"
 #include "types.hxx"
 #include "debugging.hxx"
@@ -94,6 +97,13 @@ public:
         return mLights[aLightIdx].get();
     }
 
+    // LoadCornellBox() always puts the geometry into a GeometryList (or BVH)
+    const GeometryList &GetGeometryList() const
+    {
+        PG3_ASSERT(mGeometry != nullptr);
+        return *static_cast<const GeometryList*>(mGeometry);
+    }
+
     size_t GetLightCount() const
     {
         return mLights.size();
@@ -112,6 +122,30 @@ public:
         return mBackgroundLightId;
     }
 
+    // Returns nullptr if lights are not picked using the light hierarchy
+    const LightTree* GetLightTree() const
+    {
+#ifdef PG3_USE_LIGHT_TREE
+        if (!mLightTree.IsEmpty())
+            return &mLightTree;
+#endif
+        return nullptr;
+    }
+
+    // Builds the light hierarchy if there are enough finite lights to benefit from it.
+    // Must be called after all lights have been added to the scene.
+    void BuildLightTree()
+    {
+        mLightTree = LightTree();
+
+#ifdef PG3_USE_LIGHT_TREE
+        const size_t finiteLightCount =
+            mLights.size() - ((mBackgroundLightId >= 0) ? 1 : 0);
+        if (finiteLightCount >= LightTree::kMinLightCount)
+            mLightTree.Build(mLights);
+#endif
+    }
+
     
 
     //////////////////////////////////////////////////////////////////////////
@@ -124,6 +158,7 @@ public:
         kLightBox                           = 0x00000002,
         kLightPoint                         = 0x00000004,
         kLightEnv                           = 0x00000008,
+        kLightGrid                          = 0x01000000,   // grid of small area lights under the ceiling
 
         // geometry flags
         k2Spheres                           = 0x00000010,
@@ -174,20 +209,35 @@ public:
     };
 
     void LoadCornellBox(
-        const Vec2i         &aResolution,
-        const AuxDbgParams  &aAuxDbgParams,
-        BoxMask              aBoxMask = kDefault,
-        EnvironmentMapType   aEnvironmentMapType = kEMDefault
+        const Vec2i           &aResolution,
+        const AuxDbgParams    &aAuxDbgParams,
+        BoxMask                aBoxMask = kDefault,
+        EnvironmentMapType     aEnvironmentMapType = kEMDefault,
+        const EmStorageFormat &aEmStorageFormat = EmStorageFormat(),
+        Distribution1DMethod   aEmDistributionMethod = Distribution2D::GetDefaultMethod(),
+        const std::string     &aMeshPath = std::string()
         )
     {
         aAuxDbgParams; // possibly unused parameter
 
-        mSceneName = GetSceneName(aBoxMask, aEnvironmentMapType, &mSceneAcronym);
+        // The mesh replaces the spheres, so it must be visible in the scene name and acronym,
+        // otherwise mesh renders would overwrite the renders of the original scene
+        std::string meshName;
+        if (!aMeshPath.empty())
+        {
+            if (!Utils::IO::GetFileName(aMeshPath.c_str(), meshName))
+                meshName = aMeshPath;
+            meshName = meshName.substr(0, meshName.find_last_of('.'));
+        }
+
+        mSceneName = GetSceneName(aBoxMask, aEnvironmentMapType, &mSceneAcronym, meshName);
 
         bool useCeilingLight = (aBoxMask & kLightCeiling)    != 0;
         bool useLightBox     = (aBoxMask & kLightBox)        != 0;
         bool usePointLight   = (aBoxMask & kLightPoint)      != 0;
         bool useEnvMap       = (aBoxMask & kLightEnv)        != 0;
+        bool useLightGrid    = (aBoxMask & kLightGrid)       != 0;
+        bool useMesh         = !aMeshPath.empty();
 
         // Camera
         mCamera.Setup(
@@ -433,8 +483,17 @@ public:
 
         }
 
+        // 13+) light grid triangles, will only emit (one material per light)
+        const uint32_t lightGridSize = 4; // tiles per side, two triangular lights per tile
+        const int32_t lightGridFirstMatID = (int32_t)mMaterials.size();
+        if (useLightGrid)
+            for (uint32_t i = 0; i < 2 * lightGridSize * lightGridSize; i++)
+                mMaterials.push_back(new LambertMaterial());
+
+        // The geometry references the mesh triangles
         delete mGeometry;
         mGeometry = nullptr;
+        mMeshes.clear();
 
         //////////////////////////////////////////////////////////////////////////
         // Cornell box - geometry
@@ -450,7 +509,11 @@ public:
             Vec3f(-1.27029f, -1.25549f,  1.28002f)
         };
 
+#ifdef PG3_USE_BVH
+        BVH *geometryList = new BVH;
+#else
         GeometryList *geometryList = new GeometryList;
+#endif
         mGeometry = geometryList;
 
         // Floor
@@ -488,8 +551,8 @@ public:
             }
         }
 
-        // Spheres
-        if ( aBoxMask & k2Spheres )
+        // Spheres (replaced by the mesh, if any)
+        if ((aBoxMask & k2Spheres) && !useMesh)
         {
             float ballRadius = 0.5f;
             Vec3f leftWallCenter  = (cb[0] + cb[4]) * 0.5f + Vec3f(0, 0, ballRadius);
@@ -501,7 +564,7 @@ public:
             geometryList->mGeometry.push_back(new Sphere(leftBallCenter,  ballRadius, 6));
             geometryList->mGeometry.push_back(new Sphere(rightBallCenter, ballRadius, 7));
         }
-        if (aBoxMask & k1Sphere)
+        if ((aBoxMask & k1Sphere) && !useMesh)
         {
             float ballRadius = 1.f; //1.3f; //
             Vec3f floorCenter = (cb[0] + cb[5]) * 0.5f;
@@ -763,6 +826,54 @@ public:
             geometryList->mGeometry.push_back(new Triangle(lb[5], lb[0], lb[1], 1));
         }
 
+        //////////////////////////////////////////////////////////////////////////
+        // Grid of small lights under the ceiling, four corners per tile
+        std::vector<Vec3f> lg;
+        if (useLightGrid)
+        {
+            const float tileSize = 0.2f;
+            const float spacing  = 0.5f;
+            for (uint32_t j = 0; j < lightGridSize; j++)
+                for (uint32_t i = 0; i < lightGridSize; i++)
+                {
+                    const float x = (i - 0.5f * (lightGridSize - 1)) * spacing;
+                    const float y = (j - 0.5f * (lightGridSize - 1)) * spacing;
+                    lg.push_back(Vec3f(x - 0.5f * tileSize, y + 0.5f * tileSize, 1.27002f));
+                    lg.push_back(Vec3f(x + 0.5f * tileSize, y + 0.5f * tileSize, 1.27002f));
+                    lg.push_back(Vec3f(x - 0.5f * tileSize, y - 0.5f * tileSize, 1.27002f));
+                    lg.push_back(Vec3f(x + 0.5f * tileSize, y - 0.5f * tileSize, 1.27002f));
+                }
+
+            // Facing down, same orientation as the light box floor
+            for (uint32_t tile = 0; tile < lightGridSize * lightGridSize; tile++)
+            {
+                const Vec3f *c = &lg[4 * tile];
+                const int32_t matID = lightGridFirstMatID + 2 * tile;
+                geometryList->mGeometry.push_back(new Triangle(c[0], c[3], c[2], matID));
+                geometryList->mGeometry.push_back(new Triangle(c[3], c[0], c[1], matID + 1));
+            }
+        }
+
+        // Mesh, standing in the middle of the floor with the material of the sphere(s)
+        if (useMesh)
+        {
+            std::unique_ptr<TriangleMesh> mesh(new TriangleMesh);
+            std::string error;
+            const int32_t matID = (aBoxMask & k1Sphere) ? 8 : 6;
+            if (!mesh->Load(aMeshPath.c_str(), matID, error))
+                PG3_FATAL_ERROR("Mesh load failed! \"%s\": %s", aMeshPath.c_str(), error.c_str());
+
+            const Vec3f floorCenter = (cb[0] + cb[5]) * 0.5f;
+            mesh->ConvertYUpToZUp();
+            mesh->FitIntoBox(floorCenter - Vec3f(0.9f, 0.9f, 0.f), floorCenter + Vec3f(0.9f, 0.9f, 1.8f));
+            mesh->AddTriangles(geometryList->mGeometry);
+            mMeshes.push_back(std::move(mesh));
+        }
+
+#ifdef PG3_USE_BVH
+        geometryList->Build();
+#endif
+
         //////////////////////////////////////////////////////////////////////////
         // Lights
         
@@ -825,9 +936,38 @@ public:
             mLights.push_back(TLightSharedPtr(light));
         }
 
+        if (useLightGrid)
+        {
+            // Enough lights to make the scene pick them using the light tree
+
+            // The whole grid emmits 25 Watts
+            const float totalPower = 25.0f; // Flux, in Wats
+            SpectrumF lightPower;
+            lightPower.SetSRGBGreyLight(totalPower / (2 * lightGridSize * lightGridSize));
+
+            for (uint32_t tile = 0; tile < lightGridSize * lightGridSize; tile++)
+            {
+                const Vec3f *c = &lg[4 * tile];
+                const int32_t matID = lightGridFirstMatID + 2 * tile;
+                AreaLight *light;
+
+                light = new AreaLight(c[0], c[3], c[2]);
+                light->SetPower(lightPower);
+                mMaterial2Light.insert(std::make_pair(matID, (int32_t)mLights.size()));
+                mLights.push_back(TLightSharedPtr(light));
+
+                light = new AreaLight(c[3], c[0], c[1]);
+                light->SetPower(lightPower);
+                mMaterial2Light.insert(std::make_pair(matID + 1, (int32_t)mLights.size()));
+                mLights.push_back(TLightSharedPtr(light));
+            }
+        }
+
         if (useEnvMap)
         {
             BackgroundLight *light = new BackgroundLight();
+            light->SetEnvironmentMapStorage(aEmStorageFormat);
+            light->SetEnvironmentMapDistribution(aEmDistributionMethod);
 
             switch (aEnvironmentMapType)
             {
@@ -953,6 +1093,8 @@ public:
                 mBackgroundLightId = (int32_t)(mLights.size() - 1);
             }
         }
+
+        BuildLightTree();
     }
 
     static std::string GetEnvMapName(
@@ -1036,7 +1178,8 @@ public:
     static std::string GetSceneName(
         BoxMask              aBoxMask = kDefault,
         EnvironmentMapType   aEnvironmentMapType = kEMInvalid,
-        std::string         *oAcronym = nullptr)
+        std::string         *oAcronym = nullptr,
+        const std::string   &aMeshName = std::string()) // mesh replacing the spheres, if any
     {
         std::string name;
         std::string acronym;
@@ -1063,14 +1206,14 @@ public:
             acronym += "w";
         }
 
-        if (Utils::IsMasked(aBoxMask, k2Spheres))
+        if (Utils::IsMasked(aBoxMask, k2Spheres) && aMeshName.empty())
         {
             GEOMETRY_ADD_COMMA_AND_SPACE_IF_NEEDED
             name    += "2 spheres";
             acronym += "2s";
         }
 
-        if (Utils::IsMasked(aBoxMask, k1Sphere))
+        if (Utils::IsMasked(aBoxMask, k1Sphere) && aMeshName.empty())
         {
             GEOMETRY_ADD_COMMA_AND_SPACE_IF_NEEDED
             name    += "1 sphere";
@@ -1098,7 +1241,14 @@ public:
             acronym += "dr";
         }
 
-        if ((aBoxMask & kAllGeometry) == 0)
+        if (!aMeshName.empty()) // replaces the spheres
+        {
+            GEOMETRY_ADD_COMMA_AND_SPACE_IF_NEEDED
+            name    += "mesh " + aMeshName;
+            acronym += "m-" + aMeshName;
+        }
+
+        if (((aBoxMask & kAllGeometry) == 0) && aMeshName.empty())
         {
             GEOMETRY_ADD_COMMA_AND_SPACE_IF_NEEDED
             name    += "empty";
@@ -1143,6 +1293,13 @@ public:
             acronym += "p";
         }
         
+        if (Utils::IsMasked(aBoxMask, kLightGrid))
+        {
+            LIGHTS_ADD_COMMA_AND_SPACE_IF_NEEDED
+            name    += "light grid";
+            acronym += "g";
+        }
+
         if (Utils::IsMasked(aBoxMask, kLightEnv))
         {
             LIGHTS_ADD_COMMA_AND_SPACE_IF_NEEDED
@@ -1284,7 +1441,11 @@ public:
     std::map<int32_t, int32_t>           mMaterial2Light;
     TLightSharedPtr                      mBackgroundLight;
     int32_t                              mBackgroundLightId;
+    LightTree                            mLightTree;
 
     std::string                          mSceneName;
     std::string                          mSceneAcronym;
+
+    // Own the mesh triangles referenced by mGeometry, therefore released after it
+    std::vector<std::unique_ptr<TriangleMesh>>  mMeshes;
 };
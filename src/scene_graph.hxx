@@ -40,6 +40,12 @@ public:
             delete geometry;
     };
 
+    // Memory taken by the list (or hierarchy) itself, without the referenced geometry
+    virtual size_t GetStorageSize() const
+    {
+        return mGeometry.capacity() * sizeof(AbstractGeometry*);
+    }
+
     virtual bool Intersect(const Ray& aRay, RayIntersection& oResult) const override
     {
         bool anyIntersection = false;
@@ -154,6 +160,100 @@ public:
     Vec3f   mNormal;
 };
 
+// Triangle of a TriangleMesh. It references its vertices in the vertex buffer shared by the whole
+// mesh and computes the normal on the fly, which makes it half the size of Triangle. Its results
+// are bit-identical to a Triangle made of the same vertices.
+class MeshTriangle : public AbstractGeometry
+{
+public:
+
+    MeshTriangle(
+        const Vec3f     *aVertices,
+        const uint32_t   aIndex0,
+        const uint32_t   aIndex1,
+        const uint32_t   aIndex2,
+        const int32_t    aMatID) :
+        mVertices(aVertices),
+        mMatId(aMatID)
+    {
+        mIndices[0] = aIndex0;
+        mIndices[1] = aIndex1;
+        mIndices[2] = aIndex2;
+    }
+
+    // Instances are only created in the triangle pool of a TriangleMesh, which owns their storage.
+    // Deleting them (e.g. by GeometryList) therefore just runs the destructor.
+    static void* operator new(size_t aSize, void *aPlacement)
+    {
+        aSize; // unused param
+        return aPlacement;
+    }
+    static void operator delete(void*, void*) {}
+    static void operator delete(void*) {}
+
+    const Vec3f &GetVertex(const uint32_t aIdx) const
+    {
+        return mVertices[mIndices[aIdx]];
+    }
+
+    // The same as the precomputed normal of Triangle
+    Vec3f GetNormal() const
+    {
+        return Normalize(Cross(GetVertex(1) - GetVertex(0), GetVertex(2) - GetVertex(0)));
+    }
+
+    virtual bool Intersect(
+        const Ray       &aRay,
+        RayIntersection &oResult) const override
+    {
+        const Vec3f ao = GetVertex(0) - aRay.org;
+        const Vec3f bo = GetVertex(1) - aRay.org;
+        const Vec3f co = GetVertex(2) - aRay.org;
+
+        const Vec3f v0 = Cross(co, bo);
+        const Vec3f v1 = Cross(bo, ao);
+        const Vec3f v2 = Cross(ao, co);
+
+        const float v0d = Dot(v0, aRay.dir);
+        const float v1d = Dot(v1, aRay.dir);
+        const float v2d = Dot(v2, aRay.dir);
+
+        if (((v0d < 0.f)  && (v1d < 0.f)  && (v2d < 0.f)) ||
+            ((v0d >= 0.f) && (v1d >= 0.f) && (v2d >= 0.f)))
+        {
+            const Vec3f normal = GetNormal();
+            const float distance = Dot(normal, ao) / Dot(normal, aRay.dir);
+
+            if ((distance > aRay.tmin) & (distance < oResult.dist))
+            {
+                oResult.normal = normal;
+                oResult.matID  = mMatId;
+                oResult.dist   = distance;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax) const override
+    {
+        for (uint32_t i = 0; i < 3; i++)
+        {
+            aoBBoxMin = Min(aoBBoxMin, GetVertex(i));
+            aoBBoxMax = Max(aoBBoxMax, GetVertex(i));
+        }
+    }
+
+public:
+
+    const Vec3f    *mVertices;
+    uint32_t        mIndices[3];
+    int32_t         mMatId;
+};
+
 class Sphere : public AbstractGeometry
 {
 public:
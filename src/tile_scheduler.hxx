@@ -0,0 +1,206 @@
+#pragma once
+
+#include "math.hxx"
+#include "debugging.hxx"
+#include "types.hxx"
+#include "memory.hxx"
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+// Rectangular block of pixels [minX, maxX) x [minY, maxY)
+struct ImageTile
+{
+    uint32_t    minX, minY;
+    uint32_t    maxX, maxY;
+    uint32_t    index;      // Position in the list of all image tiles
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Distributes the tiles of one rendering iteration among threads.
+//
+// Every thread owns a queue, which is a contiguous range of tile indices. At the beginning of
+// each iteration the tiles are split evenly among the queues (neighbouring tiles go to the same
+// thread). A thread takes tiles from the front of its own queue and, once it is empty, steals
+// from the back of the other threads' queues. Each queue range is packed into a single 64-bit
+// atomic, so both the owner and the thieves only need one compare-and-swap per tile.
+//
+// Each tile is processed exactly once per iteration, therefore threads can write into a shared
+// framebuffer without synchronisation. Random sequences are seeded per tile and iteration (see
+// TileSeed()) which makes the result independent of the number of threads.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class TileScheduler
+{
+public:
+
+    static const uint32_t kDefaultTileSize = 32;
+
+    TileScheduler(
+        const Vec2f     &aResolution,
+        const uint32_t   aThreadCount,
+        const uint32_t   aTileSize = kDefaultTileSize)
+        :
+        mThreadCount(std::max(aThreadCount, 1u)),
+        mQueues(nullptr)
+    {
+        PG3_ASSERT_INTEGER_POSITIVE(aTileSize);
+
+        // Each queue occupies exactly one cache line
+        mQueues = static_cast<Queue*>(
+            Memory::AlignedMalloc(mThreadCount * sizeof(Queue), Memory::kCacheLine, false));
+        if (mQueues == nullptr)
+            PG3_FATAL_ERROR("Unable to allocate the tile queues!");
+
+        const uint32_t resX = uint32_t(aResolution.x);
+        const uint32_t resY = uint32_t(aResolution.y);
+
+        for (uint32_t minY = 0; minY < resY; minY += aTileSize)
+        {
+            for (uint32_t minX = 0; minX < resX; minX += aTileSize)
+            {
+                ImageTile tile;
+                tile.minX  = minX;
+                tile.minY  = minY;
+                tile.maxX  = std::min(minX + aTileSize, resX);
+                tile.maxY  = std::min(minY + aTileSize, resY);
+                tile.index = (uint32_t)mTiles.size();
+                mTiles.push_back(tile);
+            }
+        }
+
+        for (uint32_t i = 0; i < mThreadCount; i++)
+            new (&mQueues[i]) Queue(PackRange(0, 0));
+    }
+
+    ~TileScheduler()
+    {
+        for (uint32_t i = 0; i < mThreadCount; i++)
+            mQueues[i].~Queue();
+        Memory::AlignedFree(mQueues);
+    }
+
+    TileScheduler(const TileScheduler&) = delete;
+    TileScheduler & operator=(const TileScheduler&) = delete;
+
+    uint32_t GetTileCount() const
+    {
+        return (uint32_t)mTiles.size();
+    }
+
+    const ImageTile &GetTile(const uint32_t aTileIndex) const
+    {
+        PG3_ASSERT_INTEGER_LESS_THAN(aTileIndex, (uint32_t)mTiles.size());
+
+        return mTiles[aTileIndex];
+    }
+
+    // Fills the queues with all tiles. Must not run concurrently with NextTile().
+    void StartIteration()
+    {
+        const uint32_t tileCount = GetTileCount();
+        for (uint32_t i = 0; i < mThreadCount; i++)
+        {
+            const uint32_t begin = (uint32_t)(((uint64_t)tileCount *  i     ) / mThreadCount);
+            const uint32_t end   = (uint32_t)(((uint64_t)tileCount * (i + 1)) / mThreadCount);
+            mQueues[i].range.store(PackRange(begin, end));
+        }
+    }
+
+    // Returns false if there is no tile left in the current iteration
+    bool NextTile(
+        const uint32_t   aThreadId,
+        uint32_t        &oTileIndex)
+    {
+        PG3_ASSERT_INTEGER_LESS_THAN(aThreadId, mThreadCount);
+
+        if (PopFront(mQueues[aThreadId], oTileIndex))
+            return true;
+
+        // Own queue is empty: steal from the others
+        for (uint32_t i = 1; i < mThreadCount; i++)
+        {
+            const uint32_t victim = (aThreadId + i) % mThreadCount;
+            if (PopBack(mQueues[victim], oTileIndex))
+                return true;
+        }
+
+        return false;
+    }
+
+    // Seed of the random number generator for the given tile in the given iteration
+    static int32_t TileSeed(
+        const int32_t    aBaseSeed,
+        const uint32_t   aIteration,
+        const uint32_t   aTileIndex)
+    {
+        // SplitMix64 finaliser
+        uint64_t z = ((uint64_t)aIteration << 32) | aTileIndex;
+        z += 0x9E3779B97F4A7C15ull * ((uint64_t)(uint32_t)aBaseSeed + 1);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        z =  z ^ (z >> 31);
+        return (int32_t)(uint32_t)z;
+    }
+
+protected:
+
+    // Padded to a cache line and allocated cache-line aligned to avoid false sharing among
+    // threads
+    struct Queue
+    {
+        explicit Queue(const uint64_t aRange) : range(aRange) {}
+
+        std::atomic<uint64_t>   range;
+        uint8_t                 padding[Memory::kCacheLine - sizeof(std::atomic<uint64_t>)];
+    };
+
+    static uint64_t PackRange(const uint32_t aBegin, const uint32_t aEnd)
+    {
+        return ((uint64_t)aEnd << 32) | aBegin;
+    }
+
+    static uint32_t RangeBegin(const uint64_t aRange) { return (uint32_t)(aRange & 0xFFFFFFFFull); }
+    static uint32_t RangeEnd  (const uint64_t aRange) { return (uint32_t)(aRange >> 32); }
+
+    static bool PopFront(Queue &aQueue, uint32_t &oTileIndex)
+    {
+        uint64_t range = aQueue.range.load();
+        for (;;)
+        {
+            const uint32_t begin = RangeBegin(range);
+            const uint32_t end   = RangeEnd(range);
+            if (begin >= end)
+                return false;
+            if (aQueue.range.compare_exchange_weak(range, PackRange(begin + 1, end)))
+            {
+                oTileIndex = begin;
+                return true;
+            }
+        }
+    }
+
+    static bool PopBack(Queue &aQueue, uint32_t &oTileIndex)
+    {
+        uint64_t range = aQueue.range.load();
+        for (;;)
+        {
+            const uint32_t begin = RangeBegin(range);
+            const uint32_t end   = RangeEnd(range);
+            if (begin >= end)
+                return false;
+            if (aQueue.range.compare_exchange_weak(range, PackRange(begin, end - 1)))
+            {
+                oTileIndex = end - 1;
+                return true;
+            }
+        }
+    }
+
+protected:
+
+    const uint32_t              mThreadCount;
+    Queue                      *mQueues;
+    std::vector<ImageTile>      mTiles;
+};
@@ -0,0 +1,1507 @@
+#pragma once
+
+#include "scene_graph.hxx"
+#include "mapped_file.hxx"
+#include "memory.hxx"
+#include "math.hxx"
+#include "types.hxx"
+#include "debugging.hxx"
+#include "unit_testing.hxx"
+#include "benchmarking.hxx"
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#if defined PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER || defined PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+#include "bvh.hxx"
+#endif
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+#include "geometry_soa.hxx"
+#include "rng.hxx"
+#include "sampling.hxx"
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Triangle mesh loaded from a Wavefront OBJ or a Stanford PLY (ascii or binary) file.
+//
+// The mesh keeps one shared vertex buffer and a pool of MeshTriangle objects which index into it.
+// Both are single cache-line aligned allocations of exactly the needed size: the file is mapped
+// into memory and read in two passes, the first one just counts the vertices and faces and the
+// second one parses them directly into the final storage. Peak memory is therefore the size of
+// the loaded mesh, no matter how large the file is.
+//
+// The triangles are handed over to a GeometryList (or BVH) by AddTriangles(). The list may delete
+// them (it only runs their destructor), but the mesh must outlive it.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class TriangleMesh
+{
+public:
+
+    TriangleMesh() :
+        mVertices(nullptr),
+        mTriangles(nullptr),
+        mVertexCapacity(0),
+        mTriangleCapacity(0),
+        mVertexCount(0),
+        mTriangleCount(0),
+        mFileSize(0),
+        mLoadSeconds(0.)
+    {}
+
+    ~TriangleMesh()
+    {
+        Clear();
+    }
+
+    TriangleMesh(const TriangleMesh&) = delete;
+    TriangleMesh & operator=(const TriangleMesh&) = delete;
+
+    // Loads an .obj or .ply file (chosen by the extension) and assigns the material to all its
+    // triangles. Polygons are triangulated as fans, degenerate triangles (repeated indices) are
+    // skipped. On failure, the mesh is left empty and oError describes the problem.
+    bool Load(
+        const char      *aPath,
+        const int32_t    aMatID,
+        std::string     &oError)
+    {
+        Clear();
+
+        const Benchmarking::Timer timer;
+
+        std::string extension(aPath);
+        const size_t dotPos = extension.find_last_of('.');
+        extension = (dotPos != std::string::npos) ? extension.substr(dotPos) : std::string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+        bool isObj;
+        if (extension == ".obj")
+            isObj = true;
+        else if (extension == ".ply")
+            isObj = false;
+        else
+        {
+            oError = "Unsupported file extension (only .obj and .ply are supported)";
+            return false;
+        }
+
+        MappedFile file;
+        if (!file.Open(aPath))
+        {
+            oError = "Cannot open the file";
+            return false;
+        }
+
+        const char *begin = reinterpret_cast<const char*>(file.GetData());
+        const char *end   = begin + file.GetSize();
+
+        const bool success = isObj
+            ? LoadObj(begin, end, aMatID, oError)
+            : LoadPly(begin, end, aMatID, oError);
+        if (!success)
+        {
+            Clear();
+            return false;
+        }
+
+        mFileSize       = file.GetSize();
+        mLoadSeconds    = timer.ElapsedSeconds();
+
+        return true;
+    }
+
+    void Clear()
+    {
+        // Triangles have trivial destructors, the pool is just released
+        Memory::AlignedFree(mVertices);
+        Memory::AlignedFree(mTriangles);
+
+        mVertices           = nullptr;
+        mTriangles          = nullptr;
+        mVertexCapacity     = 0;
+        mTriangleCapacity   = 0;
+        mVertexCount        = 0;
+        mTriangleCount      = 0;
+        mFileSize           = 0;
+        mLoadSeconds        = 0.;
+    }
+
+    // Most scanned models are stored with the y axis pointing up, while the renderer uses z
+    void ConvertYUpToZUp()
+    {
+        for (uint32_t i = 0; i < mVertexCount; i++)
+        {
+            const Vec3f vertex = mVertices[i];
+            mVertices[i] = Vec3f(vertex.x, -vertex.z, vertex.y);
+        }
+    }
+
+    // Uniformly scales and moves the mesh so that it fits into the given box. The mesh is centered
+    // in the x and y axes and it stands on the bottom of the box.
+    void FitIntoBox(
+        const Vec3f &aBoxMin,
+        const Vec3f &aBoxMax)
+    {
+        if (mVertexCount == 0)
+            return;
+
+        Vec3f meshMin(Math::InfinityF());
+        Vec3f meshMax(-Math::InfinityF());
+        for (uint32_t i = 0; i < mVertexCount; i++)
+        {
+            meshMin = Min(meshMin, mVertices[i]);
+            meshMax = Max(meshMax, mVertices[i]);
+        }
+
+        const Vec3f meshSize = meshMax - meshMin;
+        const Vec3f boxSize  = aBoxMax - aBoxMin;
+        float scale = Math::InfinityF();
+        for (uint32_t axis = 0; axis < 3; axis++)
+            if (meshSize.Get(axis) > 0.f)
+                scale = std::min(scale, boxSize.Get(axis) / meshSize.Get(axis));
+        if (scale == Math::InfinityF())
+            scale = 1.f;
+
+        const Vec3f meshAnchor(
+            0.5f * (meshMin.x + meshMax.x), 0.5f * (meshMin.y + meshMax.y), meshMin.z);
+        const Vec3f boxAnchor(
+            0.5f * (aBoxMin.x + aBoxMax.x), 0.5f * (aBoxMin.y + aBoxMax.y), aBoxMin.z);
+        for (uint32_t i = 0; i < mVertexCount; i++)
+            mVertices[i] = (mVertices[i] - meshAnchor) * scale + boxAnchor;
+    }
+
+    // The triangles stay owned by the mesh (see the class description)
+    void AddTriangles(std::vector<AbstractGeometry*> &aoGeometry) const
+    {
+        aoGeometry.reserve(aoGeometry.size() + mTriangleCount);
+        for (uint32_t i = 0; i < mTriangleCount; i++)
+            aoGeometry.push_back(&mTriangles[i]);
+    }
+
+    uint32_t GetVertexCount() const
+    {
+        return mVertexCount;
+    }
+
+    uint32_t GetTriangleCount() const
+    {
+        return mTriangleCount;
+    }
+
+    const Vec3f &GetVertex(const uint32_t aIdx) const
+    {
+        PG3_ASSERT_INTEGER_LESS_THAN(aIdx, mVertexCount);
+        return mVertices[aIdx];
+    }
+
+    const MeshTriangle &GetTriangle(const uint32_t aIdx) const
+    {
+        PG3_ASSERT_INTEGER_LESS_THAN(aIdx, mTriangleCount);
+        return mTriangles[aIdx];
+    }
+
+    // Allocated size of the vertex buffer and the triangle pool. Each MeshTriangle takes 32 B
+    // on 64-bit platforms (vtable and vertex buffer pointers, indices, material); it computes its
+    // normal on the fly. Acceleration structures add their own per-triangle storage on top of
+    // this, e.g. BVH keeps a SIMD copy of the vertices and normals (see BVH::GetStorageSize()).
+    size_t GetStorageSize() const
+    {
+        return mVertexCapacity * sizeof(Vec3f) + mTriangleCapacity * sizeof(MeshTriangle);
+    }
+
+    size_t GetFileSize() const
+    {
+        return mFileSize;
+    }
+
+    double GetLoadSeconds() const
+    {
+        return mLoadSeconds;
+    }
+
+protected:
+
+    //////////////////////////////////////////////////////////////////////////
+    // Storage
+
+    bool Allocate(
+        const uint64_t   aVertexCount,
+        const uint64_t   aTriangleCount,
+        std::string     &oError)
+    {
+        if ((aVertexCount > std::numeric_limits<uint32_t>::max())
+            || (aTriangleCount > std::numeric_limits<uint32_t>::max()))
+        {
+            oError = "Too many vertices or faces";
+            return false;
+        }
+        if (aTriangleCount == 0)
+        {
+            oError = "The file contains no faces";
+            return false;
+        }
+
+        // AlignedMalloc doesn't support zero-sized blocks
+        mVertices = static_cast<Vec3f*>(Memory::AlignedMalloc(
+            std::max<size_t>((size_t)aVertexCount, 1) * sizeof(Vec3f), Memory::kCacheLine, false));
+        mTriangles = static_cast<MeshTriangle*>(Memory::AlignedMalloc(
+            (size_t)aTriangleCount * sizeof(MeshTriangle), Memory::kCacheLine, false));
+        if ((mVertices == nullptr) || (mTriangles == nullptr))
+        {
+            oError = "Not enough memory";
+            return false;
+        }
+
+        mVertexCapacity     = (uint32_t)aVertexCount;
+        mTriangleCapacity   = (uint32_t)aTriangleCount;
+
+        return true;
+    }
+
+    // Degenerate triangles are skipped, so the pool may end up not completely used
+    void AddTriangle(
+        const uint32_t   aIndex0,
+        const uint32_t   aIndex1,
+        const uint32_t   aIndex2,
+        const int32_t    aMatID)
+    {
+        if ((aIndex0 == aIndex1) || (aIndex1 == aIndex2) || (aIndex2 == aIndex0))
+            return;
+
+        PG3_ASSERT_INTEGER_LESS_THAN(mTriangleCount, mTriangleCapacity);
+
+        new (&mTriangles[mTriangleCount++]) MeshTriangle(mVertices, aIndex0, aIndex1, aIndex2, aMatID);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Text parsing
+    //
+    // The mapped file is not null-terminated, therefore the standard conversion functions
+    // can't be used.
+
+    static bool IsBlank(const char aChar)
+    {
+        return (aChar == ' ') || (aChar == '\t') || (aChar == '\r');
+    }
+
+    static void SkipBlanks(const char *&aoCur, const char *aEnd)
+    {
+        while ((aoCur < aEnd) && IsBlank(*aoCur))
+            aoCur++;
+    }
+
+    static void SkipWhitespace(const char *&aoCur, const char *aEnd)
+    {
+        while ((aoCur < aEnd) && (IsBlank(*aoCur) || (*aoCur == '\n')))
+            aoCur++;
+    }
+
+    // Skips leading whitespace and one whitespace-delimited token. Fails if there is none.
+    static bool SkipToken(const char *&aoCur, const char *aEnd)
+    {
+        SkipWhitespace(aoCur, aEnd);
+        if (aoCur >= aEnd)
+            return false;
+        while ((aoCur < aEnd) && !IsBlank(*aoCur) && (*aoCur != '\n'))
+            aoCur++;
+        return true;
+    }
+
+    // Moves right behind the end of the current line
+    static void SkipLine(const char *&aoCur, const char *aEnd)
+    {
+        if (aoCur >= aEnd)
+            return;
+        const void *newLine = std::memchr(aoCur, '\n', (size_t)(aEnd - aoCur));
+        aoCur = (newLine != nullptr) ? (static_cast<const char*>(newLine) + 1) : aEnd;
+    }
+
+    // Decimal number with an optional sign, fraction and exponent, e.g. "-1.25e-3"
+    static bool ParseNumber(const char *&aoCur, const char *aEnd, double &oValue)
+    {
+        SkipBlanks(aoCur, aEnd);
+
+        const char *cur = aoCur;
+        bool negative = false;
+        if ((cur < aEnd) && ((*cur == '-') || (*cur == '+')))
+            negative = (*cur++ == '-');
+
+        // Only the first 19 significant digits fit into the mantissa
+        uint64_t mantissa   = 0;
+        int32_t digitCount  = 0;
+        int32_t exponent    = 0;
+        for (; (cur < aEnd) && (*cur >= '0') && (*cur <= '9'); cur++, digitCount++)
+        {
+            if (mantissa < 1000000000000000000ull)
+                mantissa = mantissa * 10 + (*cur - '0');
+            else
+                exponent++;
+        }
+        if ((cur < aEnd) && (*cur == '.'))
+        {
+            for (cur++; (cur < aEnd) && (*cur >= '0') && (*cur <= '9'); cur++, digitCount++)
+            {
+                if (mantissa < 1000000000000000000ull)
+                {
+                    mantissa = mantissa * 10 + (*cur - '0');
+                    exponent--;
+                }
+            }
+        }
+        if (digitCount == 0)
+            return false;
+
+        if ((cur < aEnd) && ((*cur == 'e') || (*cur == 'E')))
+        {
+            const char *expCur = cur + 1;
+            bool expNegative = false;
+            if ((expCur < aEnd) && ((*expCur == '-') || (*expCur == '+')))
+                expNegative = (*expCur++ == '-');
+            if ((expCur < aEnd) && (*expCur >= '0') && (*expCur <= '9'))
+            {
+                int32_t expValue = 0;
+                for (; (expCur < aEnd) && (*expCur >= '0') && (*expCur <= '9'); expCur++)
+                    expValue = std::min(expValue * 10 + (*expCur - '0'), 10000);
+                exponent += expNegative ? -expValue : expValue;
+                cur = expCur;
+            }
+        }
+
+        // Powers of ten up to 1e22 are exact in double, so the common cases are correctly rounded
+        static const double kPowersOf10[] = {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+        double value = (double)mantissa;
+        if (mantissa != 0)
+        {
+            if ((exponent >= 0) && (exponent <= 22))
+                value *= kPowersOf10[exponent];
+            else if ((exponent < 0) && (exponent >= -22))
+                value /= kPowersOf10[-exponent];
+            else
+                value *= std::pow(10., (double)exponent);
+        }
+
+        oValue = negative ? -value : value;
+        aoCur  = cur;
+        return true;
+    }
+
+    static bool ParseFloat(const char *&aoCur, const char *aEnd, float &oValue)
+    {
+        double value;
+        if (!ParseNumber(aoCur, aEnd, value))
+            return false;
+        oValue = (float)value;
+        return true;
+    }
+
+    static bool ParseInt(const char *&aoCur, const char *aEnd, int64_t &oValue)
+    {
+        SkipBlanks(aoCur, aEnd);
+
+        const char *cur = aoCur;
+        bool negative = false;
+        if ((cur < aEnd) && ((*cur == '-') || (*cur == '+')))
+            negative = (*cur++ == '-');
+
+        const char *digitsBegin = cur;
+        int64_t value = 0;
+        for (; (cur < aEnd) && (*cur >= '0') && (*cur <= '9'); cur++)
+            if (value < (1ll << 40))
+                value = value * 10 + (*cur - '0');
+        if (cur == digitsBegin)
+            return false;
+
+        oValue = negative ? -value : value;
+        aoCur  = cur;
+        return true;
+    }
+
+    static bool LineError(std::string &oError, const uint64_t aLine, const char *aMessage)
+    {
+        std::ostringstream error;
+        error << aMessage << " on line " << aLine;
+        oError = error.str();
+        return false;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Wavefront OBJ
+    //
+    // Only vertex positions ("v") and faces ("f") are read, everything else is ignored.
+
+    bool LoadObj(
+        const char      *aBegin,
+        const char      *aEnd,
+        const int32_t    aMatID,
+        std::string     &oError)
+    {
+        uint64_t vertexCount;
+        uint64_t triangleCount;
+        if (!ParseObj(aBegin, aEnd, true, aMatID, vertexCount, triangleCount, oError))
+            return false;
+        if (!Allocate(vertexCount, triangleCount, oError))
+            return false;
+        if (!ParseObj(aBegin, aEnd, false, aMatID, vertexCount, triangleCount, oError))
+            return false;
+
+        mVertexCount = (uint32_t)vertexCount;
+        return true;
+    }
+
+    // The counting pass only recognizes the lines and counts the face indices, it doesn't parse
+    // any numbers. The triangle count is then an upper bound (includes degenerate triangles).
+    bool ParseObj(
+        const char      *aBegin,
+        const char      *aEnd,
+        const bool       aCountOnly,
+        const int32_t    aMatID,
+        uint64_t        &oVertexCount,
+        uint64_t        &oTriangleCount,
+        std::string     &oError)
+    {
+        oVertexCount    = 0;
+        oTriangleCount  = 0;
+
+        uint64_t line = 1;
+        for (const char *cur = aBegin; cur < aEnd; SkipLine(cur, aEnd), line++)
+        {
+            SkipBlanks(cur, aEnd);
+
+            // Only "v " and "f " lines are interesting
+            if ((cur + 1 >= aEnd) || !IsBlank(cur[1]))
+                continue;
+
+            if (*cur == 'v')
+            {
+                if (!aCountOnly)
+                {
+                    cur++;
+                    Vec3f &vertex = mVertices[oVertexCount];
+                    if (!ParseFloat(cur, aEnd, vertex.x)
+                        || !ParseFloat(cur, aEnd, vertex.y)
+                        || !ParseFloat(cur, aEnd, vertex.z))
+                        return LineError(oError, line, "Invalid vertex");
+                }
+                oVertexCount++;
+            }
+            else if (*cur == 'f')
+            {
+                cur++;
+                uint32_t indexCount = 0;
+                uint32_t firstIndex = 0;
+                uint32_t prevIndex  = 0;
+                for (;;)
+                {
+                    SkipBlanks(cur, aEnd);
+                    if ((cur >= aEnd) || (*cur == '\n') || (*cur == '#'))
+                        break;
+
+                    if (!aCountOnly)
+                    {
+                        // Indices are 1-based, negative ones are relative to the last vertex read so far
+                        int64_t index;
+                        if (!ParseInt(cur, aEnd, index))
+                            return LineError(oError, line, "Invalid face");
+                        const int64_t absIndex = (index > 0) ? (index - 1) : ((int64_t)oVertexCount + index);
+                        if ((index == 0) || (absIndex < 0) || (absIndex >= (int64_t)mVertexCapacity))
+                            return LineError(oError, line, "Vertex index out of range");
+
+                        const uint32_t currIndex = (uint32_t)absIndex;
+                        if (indexCount == 0)
+                            firstIndex = currIndex;
+                        else if (indexCount >= 2)
+                            AddTriangle(firstIndex, prevIndex, currIndex, aMatID);
+                        prevIndex = currIndex;
+                    }
+                    indexCount++;
+
+                    // Skip the rest of the "v/vt/vn" token
+                    while ((cur < aEnd) && !IsBlank(*cur) && (*cur != '\n'))
+                        cur++;
+                }
+                if (indexCount < 3)
+                    return LineError(oError, line, "Face with less than 3 vertices");
+                oTriangleCount += indexCount - 2;
+            }
+        }
+
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Stanford PLY
+    //
+    // Reads the "x", "y", "z" properties of the "vertex" element and the "vertex_indices"
+    // (or "vertex_index") list of the "face" element, all other elements and properties are
+    // skipped.
+
+    enum PlyFormat
+    {
+        kPlyAscii,
+        kPlyBinaryLittleEndian,
+        kPlyBinaryBigEndian
+    };
+
+    enum PlyType
+    {
+        kPlyInt8,
+        kPlyUint8,
+        kPlyInt16,
+        kPlyUint16,
+        kPlyInt32,
+        kPlyUint32,
+        kPlyFloat32,
+        kPlyFloat64,
+        kPlyTypeCount
+    };
+
+    struct PlyProperty
+    {
+        std::string name;
+        PlyType     type;
+        PlyType     countType;  // only for lists
+        bool        isList;
+    };
+
+    struct PlyElement
+    {
+        std::string                 name;
+        uint64_t                    count;
+        std::vector<PlyProperty>    properties;
+    };
+
+    static bool GetPlyType(const std::string &aName, PlyType &oType)
+    {
+        static const char * const kNames[kPlyTypeCount][2] = {
+            { "char",   "int8" },
+            { "uchar",  "uint8" },
+            { "short",  "int16" },
+            { "ushort", "uint16" },
+            { "int",    "int32" },
+            { "uint",   "uint32" },
+            { "float",  "float32" },
+            { "double", "float64" },
+        };
+        for (uint32_t type = 0; type < kPlyTypeCount; type++)
+            if ((aName == kNames[type][0]) || (aName == kNames[type][1]))
+            {
+                oType = (PlyType)type;
+                return true;
+            }
+        return false;
+    }
+
+    static size_t GetPlyTypeSize(const PlyType aType)
+    {
+        static const size_t kSizes[kPlyTypeCount] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+        return kSizes[aType];
+    }
+
+    static bool ReadPlyValue(
+        const char      *&aoCur,
+        const char       *aEnd,
+        const PlyFormat   aFormat,
+        const PlyType     aType,
+        double           &oValue)
+    {
+        if (aFormat == kPlyAscii)
+        {
+            SkipWhitespace(aoCur, aEnd);
+            return ParseNumber(aoCur, aEnd, oValue);
+        }
+
+        const size_t size = GetPlyTypeSize(aType);
+        if ((size_t)(aEnd - aoCur) < size)
+            return false;
+
+        uint8_t bytes[8];
+        std::memcpy(bytes, aoCur, size);
+        if ((aFormat == kPlyBinaryBigEndian) != IsBigEndianMachine())
+            std::reverse(bytes, bytes + size);
+        aoCur += size;
+
+        switch (aType)
+        {
+        case kPlyInt8:      { int8_t   v; std::memcpy(&v, bytes, size); oValue = v; break; }
+        case kPlyUint8:     { uint8_t  v; std::memcpy(&v, bytes, size); oValue = v; break; }
+        case kPlyInt16:     { int16_t  v; std::memcpy(&v, bytes, size); oValue = v; break; }
+        case kPlyUint16:    { uint16_t v; std::memcpy(&v, bytes, size); oValue = v; break; }
+        case kPlyInt32:     { int32_t  v; std::memcpy(&v, bytes, size); oValue = v; break; }
+        case kPlyUint32:    { uint32_t v; std::memcpy(&v, bytes, size); oValue = v; break; }
+        case kPlyFloat32:   { float    v; std::memcpy(&v, bytes, size); oValue = v; break; }
+        case kPlyFloat64:   { double   v; std::memcpy(&v, bytes, size); oValue = v; break; }
+        default:
+            return false;
+        }
+        return true;
+    }
+
+    static bool IsBigEndianMachine()
+    {
+        const uint16_t probe = 1;
+        uint8_t firstByte;
+        std::memcpy(&firstByte, &probe, 1);
+        return firstByte == 0;
+    }
+
+    // Reads the header and moves the cursor to the beginning of the data
+    static bool ParsePlyHeader(
+        const char                  *&aoCur,
+        const char                   *aEnd,
+        PlyFormat                    &oFormat,
+        std::vector<PlyElement>      &oElements,
+        std::string                  &oError)
+    {
+        const char *cur = aoCur;
+        uint64_t line = 1;
+        bool hasFormat = false;
+        for (;; line++)
+        {
+            if (cur >= aEnd)
+            {
+                oError = "Missing end of the header";
+                return false;
+            }
+
+            const char *lineBegin = cur;
+            SkipLine(cur, aEnd);
+            std::istringstream lineStream(std::string(lineBegin, cur));
+
+            std::string keyword;
+            lineStream >> keyword;
+            if (line == 1)
+            {
+                if (keyword != "ply")
+                {
+                    oError = "Not a PLY file";
+                    return false;
+                }
+            }
+            else if (keyword == "format")
+            {
+                std::string format;
+                lineStream >> format;
+                if (format == "ascii")
+                    oFormat = kPlyAscii;
+                else if (format == "binary_little_endian")
+                    oFormat = kPlyBinaryLittleEndian;
+                else if (format == "binary_big_endian")
+                    oFormat = kPlyBinaryBigEndian;
+                else
+                    return LineError(oError, line, "Unknown format");
+                hasFormat = true;
+            }
+            else if (keyword == "element")
+            {
+                PlyElement element;
+                if (!(lineStream >> element.name >> element.count))
+                    return LineError(oError, line, "Invalid element");
+                oElements.push_back(element);
+            }
+            else if (keyword == "property")
+            {
+                if (oElements.empty())
+                    return LineError(oError, line, "Property without an element");
+
+                PlyProperty property;
+                std::string typeName;
+                lineStream >> typeName;
+                property.isList = (typeName == "list");
+                if (property.isList)
+                {
+                    std::string countTypeName;
+                    lineStream >> countTypeName >> typeName;
+                    if (!GetPlyType(countTypeName, property.countType))
+                        return LineError(oError, line, "Unknown property type");
+                }
+                if (!GetPlyType(typeName, property.type) || !(lineStream >> property.name))
+                    return LineError(oError, line, "Invalid property");
+                oElements.back().properties.push_back(property);
+            }
+            else if (keyword == "end_header")
+                break;
+            // comments, obj_info, ... are ignored
+        }
+
+        if (!hasFormat)
+        {
+            oError = "Missing format in the header";
+            return false;
+        }
+
+        aoCur = cur;
+        return true;
+    }
+
+    bool LoadPly(
+        const char      *aBegin,
+        const char      *aEnd,
+        const int32_t    aMatID,
+        std::string     &oError)
+    {
+        const char *dataBegin = aBegin;
+        PlyFormat format = kPlyAscii;
+        std::vector<PlyElement> elements;
+        if (!ParsePlyHeader(dataBegin, aEnd, format, elements, oError))
+            return false;
+
+        uint64_t vertexCount;
+        uint64_t triangleCount;
+        if (!ParsePlyData(dataBegin, aEnd, format, elements, true, aMatID, vertexCount, triangleCount, oError))
+            return false;
+        if (!Allocate(vertexCount, triangleCount, oError))
+            return false;
+        if (!ParsePlyData(dataBegin, aEnd, format, elements, false, aMatID, vertexCount, triangleCount, oError))
+            return false;
+
+        mVertexCount = (uint32_t)vertexCount;
+        return true;
+    }
+
+    // The counting pass skips vertices and other elements as fast as possible and only reads
+    // the index counts of the faces
+    bool ParsePlyData(
+        const char                      *aBegin,
+        const char                      *aEnd,
+        const PlyFormat                  aFormat,
+        const std::vector<PlyElement>   &aElements,
+        const bool                       aCountOnly,
+        const int32_t                    aMatID,
+        uint64_t                        &oVertexCount,
+        uint64_t                        &oTriangleCount,
+        std::string                     &oError)
+    {
+        oVertexCount    = 0;
+        oTriangleCount  = 0;
+
+        const char *cur = aBegin;
+        bool hasVertices = false;
+        bool hasFaces    = false;
+        for (const auto &element : aElements)
+        {
+            const bool isVertex = !hasVertices && (element.name == "vertex");
+            const bool isFace   = !hasFaces    && (element.name == "face");
+            hasVertices |= isVertex;
+            hasFaces    |= isFace;
+
+            // Roles of the properties: 0-2 for the vertex coordinates, 3 for the face indices
+            std::vector<int32_t> roles(element.properties.size(), -1);
+            bool hasList = false;
+            size_t stride = 0;
+            for (size_t i = 0; i < element.properties.size(); i++)
+            {
+                const PlyProperty &property = element.properties[i];
+                hasList |= property.isList;
+                stride  += GetPlyTypeSize(property.type);
+                if (isVertex && !property.isList)
+                {
+                    if (property.name == "x")
+                        roles[i] = 0;
+                    else if (property.name == "y")
+                        roles[i] = 1;
+                    else if (property.name == "z")
+                        roles[i] = 2;
+                }
+                else if (isFace && property.isList
+                         && ((property.name == "vertex_indices") || (property.name == "vertex_index")))
+                    roles[i] = 3;
+            }
+            if (isVertex
+                && (std::count(roles.begin(), roles.end(), 0) != 1
+                    || std::count(roles.begin(), roles.end(), 1) != 1
+                    || std::count(roles.begin(), roles.end(), 2) != 1))
+            {
+                oError = "Vertices without x, y and z coordinates";
+                return false;
+            }
+            if (isFace && (std::count(roles.begin(), roles.end(), 3) != 1))
+            {
+                oError = "Faces without a vertex index list";
+                return false;
+            }
+
+            if (isVertex)
+                oVertexCount = element.count;
+
+            // Fast skipping of whole elements
+            if (aCountOnly && !isFace)
+            {
+                if (aFormat == kPlyAscii)
+                {
+                    // Instances may be wrapped or joined across lines: skip one token per value
+                    for (uint64_t instance = 0; instance < element.count; instance++)
+                    {
+                        for (const auto &property : element.properties)
+                        {
+                            uint64_t tokenCount = 1;
+                            if (property.isList)
+                            {
+                                double value;
+                                if (   !ReadPlyValue(cur, aEnd, aFormat, property.countType, value)
+                                    || (value < 0.))
+                                    return DataError(oError, element, instance);
+                                tokenCount = (uint64_t)value;
+                            }
+                            for (uint64_t token = 0; token < tokenCount; token++)
+                                if (!SkipToken(cur, aEnd))
+                                    return DataError(oError, element, instance);
+                        }
+                    }
+                    continue;
+                }
+                else if (!hasList)
+                {
+                    // The header's element count is untrusted: divide instead of multiplying
+                    // to avoid an overflow
+                    if ((stride > 0) && (element.count > (uint64_t)(aEnd - cur) / stride))
+                    {
+                        oError = "Unexpected end of the file";
+                        return false;
+                    }
+                    cur += element.count * stride;
+                    continue;
+                }
+            }
+
+            for (uint64_t instance = 0; instance < element.count; instance++)
+            {
+                Vec3f vertex(0.f);
+                for (size_t i = 0; i < element.properties.size(); i++)
+                {
+                    const PlyProperty &property = element.properties[i];
+
+                    double value;
+                    if (!property.isList)
+                    {
+                        if (!ReadPlyValue(cur, aEnd, aFormat, property.type, value))
+                            return DataError(oError, element, instance);
+                        if (roles[i] >= 0)
+                            vertex.Get(roles[i]) = (float)value;
+                        continue;
+                    }
+
+                    if (!ReadPlyValue(cur, aEnd, aFormat, property.countType, value) || (value < 0.))
+                        return DataError(oError, element, instance);
+                    const uint64_t itemCount = (uint64_t)value;
+
+                    if (roles[i] != 3)
+                    {
+                        // Skipped list
+                        for (uint64_t item = 0; item < itemCount; item++)
+                            if (!ReadPlyValue(cur, aEnd, aFormat, property.type, value))
+                                return DataError(oError, element, instance);
+                        continue;
+                    }
+
+                    if (itemCount < 3)
+                        return DataError(oError, element, instance);
+                    oTriangleCount += itemCount - 2;
+
+                    if (aCountOnly)
+                    {
+                        const size_t itemSize = GetPlyTypeSize(property.type);
+                        if ((aFormat != kPlyAscii) && ((uint64_t)(aEnd - cur) >= itemCount * itemSize))
+                        {
+                            cur += itemCount * itemSize;
+                            continue;
+                        }
+                        for (uint64_t item = 0; item < itemCount; item++)
+                            if (!ReadPlyValue(cur, aEnd, aFormat, property.type, value))
+                                return DataError(oError, element, instance);
+                        continue;
+                    }
+
+                    uint32_t firstIndex = 0;
+                    uint32_t prevIndex  = 0;
+                    for (uint64_t item = 0; item < itemCount; item++)
+                    {
+                        if (!ReadPlyValue(cur, aEnd, aFormat, property.type, value))
+                            return DataError(oError, element, instance);
+                        // Elements may come in any order, so the faces can precede the vertices.
+                        // The vertex buffer is already allocated for the count from the header.
+                        if ((value < 0.) || (value >= (double)mVertexCapacity))
+                            return DataError(oError, element, instance);
+
+                        const uint32_t currIndex = (uint32_t)value;
+                        if (item == 0)
+                            firstIndex = currIndex;
+                        else if (item >= 2)
+                            AddTriangle(firstIndex, prevIndex, currIndex, aMatID);
+                        prevIndex = currIndex;
+                    }
+                }
+
+                if (isVertex && !aCountOnly)
+                    mVertices[instance] = vertex;
+            }
+        }
+
+        if (!hasVertices || !hasFaces)
+        {
+            oError = "Missing vertex or face element";
+            return false;
+        }
+
+        return true;
+    }
+
+    static bool DataError(
+        std::string         &oError,
+        const PlyElement    &aElement,
+        const uint64_t       aInstance)
+    {
+        std::ostringstream error;
+        error << "Invalid or truncated data of " << aElement.name << " " << aInstance;
+        oError = error.str();
+        return false;
+    }
+
+protected:
+
+    Vec3f          *mVertices;          // shared vertex buffer
+    MeshTriangle   *mTriangles;         // triangle pool
+    uint32_t        mVertexCapacity;
+    uint32_t        mTriangleCapacity;
+    uint32_t        mVertexCount;
+    uint32_t        mTriangleCount;
+
+    // Statistics
+    size_t          mFileSize;
+    double          mLoadSeconds;
+
+public:
+
+#ifdef PG3_RUN_UNIT_TESTS_INSTEAD_OF_RENDERER
+
+    // A square made of a quad, two side triangles of a pyramid and one degenerate triangle
+    static const uint32_t   _kUtVertexCount = 5;
+    static const uint32_t   _kUtTriangleCount = 4;
+
+    static Vec3f _UT_Vertex(const uint32_t aIdx)
+    {
+        static const Vec3f kVertices[_kUtVertexCount] = {
+            Vec3f(0.f, 0.f, 0.f), Vec3f(1.f, 0.f, 0.f), Vec3f(1.f, 1.f, 0.f),
+            Vec3f(0.f, 1.f, 0.f), Vec3f(0.5f, 0.5f, 1.f) };
+        return kVertices[aIdx];
+    }
+
+    static Vec3ui _UT_Triangle(const uint32_t aIdx)
+    {
+        static const Vec3ui kTriangles[_kUtTriangleCount] = {
+            Vec3ui(0, 1, 2), Vec3ui(0, 2, 3), Vec3ui(0, 1, 4), Vec3ui(1, 2, 4) };
+        return kTriangles[aIdx];
+    }
+
+    static std::string _UT_ObjContent()
+    {
+        return
+            "# Unit test mesh\n"
+            "o pyramid\n"
+            "v 0 0 0\n"
+            "v 1.0 0 0\n"
+            "  v 1 1e0 0\r\n"
+            "v 0 1 0.0\n"
+            "vt 0 0\n"
+            "vn 0 0 1\n"
+            "v 0.5 0.5 1 1.0\n"
+            "usemtl dummy\n"
+            "f 1/1/1 2/1/1 3/1/1 4/1/1\n"
+            "f 1//1 2//1 5//1 # comment\n"
+            "f -4 -3 -1\n"
+            "f 1 1 2";
+    }
+
+    static std::string _UT_PlyAsciiContent()
+    {
+        return
+            "ply\n"
+            "format ascii 1.0\n"
+            "comment Unit test mesh\n"
+            "element vertex 5\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n"
+            "property uchar red\n"
+            "element face 4\n"
+            "property list uchar int vertex_indices\n"
+            "property int flags\n"
+            "element edge 1\n"
+            "property int vertex1\n"
+            "property int vertex2\n"
+            "end_header\n"
+            "0 0 0 255\n"
+            "1.0 0 0 255\n"
+            "1 1e0 0 255\n"
+            "0 1 0.0 255\n"
+            "0.5 0.5 1 255\n"
+            "4 0 1 2 3 7\n"
+            "3 0 1 4 7\n"
+            "3 1 2 4 7\n"
+            "3 0 0 1 7\n"
+            "0 1\n";
+    }
+
+    // The same mesh with the faces before the vertices and the instances wrapped or joined
+    // across lines
+    static std::string _UT_PlyAsciiReorderedContent()
+    {
+        return
+            "ply\n"
+            "format ascii 1.0\n"
+            "element face 4\n"
+            "property list uchar int vertex_indices\n"
+            "property int flags\n"
+            "element vertex 5\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n"
+            "property uchar red\n"
+            "element edge 1\n"
+            "property int vertex1\n"
+            "property int vertex2\n"
+            "end_header\n"
+            "4 0 1 2 3 7 3 0 1 4 7\n"
+            "3 1 2\n"
+            "4 7\n"
+            "3 0 0 1 7\n"
+            "0 0 0 255 1.0 0 0 255\n"
+            "1 1e0\n"
+            "0 255\n"
+            "0 1 0.0 255 0.5 0.5 1 255 0\n"
+            "1\n";
+    }
+
+    static bool _UT_Equal(const Vec3f &aVec1, const Vec3f &aVec2)
+    {
+        return (aVec1.x == aVec2.x) && (aVec1.y == aVec2.y) && (aVec1.z == aVec2.z);
+    }
+
+    template <typename T>
+    static void _UT_WriteBinary(std::string &aoData, const T aValue, const bool aBigEndian)
+    {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &aValue, sizeof(T));
+        if (aBigEndian != IsBigEndianMachine())
+            std::reverse(bytes, bytes + sizeof(T));
+        aoData.append(bytes, sizeof(T));
+    }
+
+    static std::string _UT_PlyBinaryContent(const bool aBigEndian)
+    {
+        std::string data =
+            "ply\n"
+            + std::string(aBigEndian ? "format binary_big_endian 1.0\n" : "format binary_little_endian 1.0\n")
+            + "element vertex 5\n"
+              "property double x\n"
+              "property float32 y\n"
+              "property float z\n"
+              "property list uchar int texcoord\n"
+              "element face 4\n"
+              "property short flags\n"
+              "property list uchar uint vertex_index\n"
+              "end_header\n";
+
+        for (uint32_t i = 0; i < _kUtVertexCount; i++)
+        {
+            _UT_WriteBinary(data, (double)_UT_Vertex(i).x, aBigEndian);
+            _UT_WriteBinary(data, _UT_Vertex(i).y, aBigEndian);
+            _UT_WriteBinary(data, _UT_Vertex(i).z, aBigEndian);
+            _UT_WriteBinary(data, (uint8_t)2, aBigEndian);
+            _UT_WriteBinary(data, (int32_t)0, aBigEndian);
+            _UT_WriteBinary(data, (int32_t)1, aBigEndian);
+        }
+
+        const uint32_t faces[] = { 4, 0, 1, 2, 3,   3, 0, 1, 4,   3, 1, 2, 4,   3, 0, 0, 1 };
+        for (size_t i = 0; i < sizeof(faces) / sizeof(faces[0]); )
+        {
+            const uint32_t count = faces[i++];
+            _UT_WriteBinary(data, (int16_t)-1, aBigEndian);
+            _UT_WriteBinary(data, (uint8_t)count, aBigEndian);
+            for (uint32_t j = 0; j < count; j++)
+                _UT_WriteBinary(data, faces[i++], aBigEndian);
+        }
+
+        return data;
+    }
+
+    static bool _UT_WriteFile(const char *aPath, const std::string &aContent)
+    {
+        std::ofstream file(aPath, std::ios::binary);
+        file.write(aContent.data(), (std::streamsize)aContent.size());
+        return file.good();
+    }
+
+    static bool _UT_LoadFile(
+        const UnitTestBlockLevel     aMaxUtBlockPrintLevel,
+        const char                  *aTestName,
+        const char                  *aPath,
+        const std::string           &aContent)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", aTestName);
+
+        if (!_UT_WriteFile(aPath, aContent))
+        {
+            PG3_UT_FATAL_ERROR(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s",
+                "Cannot write the test file", aTestName);
+            return false;
+        }
+
+        TriangleMesh mesh;
+        std::string error;
+        const bool loaded = mesh.Load(aPath, 3, error);
+        std::remove(aPath);
+
+        const char *failure = nullptr;
+        if (!loaded)
+            failure = error.c_str();
+        else if (mesh.GetVertexCount() != _kUtVertexCount)
+            failure = "Wrong number of vertices";
+        else if (mesh.GetTriangleCount() != _kUtTriangleCount)
+            failure = "Wrong number of triangles";
+        else
+        {
+            for (uint32_t i = 0; (i < _kUtVertexCount) && (failure == nullptr); i++)
+                if (!_UT_Equal(mesh.GetVertex(i), _UT_Vertex(i)))
+                    failure = "Wrong vertex position";
+            for (uint32_t i = 0; (i < _kUtTriangleCount) && (failure == nullptr); i++)
+            {
+                const MeshTriangle &triangle = mesh.GetTriangle(i);
+                const Vec3ui expected = _UT_Triangle(i);
+                for (uint32_t j = 0; j < 3; j++)
+                    if (!_UT_Equal(triangle.GetVertex(j), _UT_Vertex(expected.Get(j))))
+                        failure = "Wrong triangle vertices";
+                if (triangle.mMatId != 3)
+                    failure = "Wrong triangle material";
+            }
+        }
+
+        if (failure != nullptr)
+        {
+            PG3_UT_FAILED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", failure, aTestName);
+            return false;
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "%s", aTestName);
+        return true;
+    }
+
+    static bool _UT_InvalidFiles(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Invalid files are rejected");
+
+        struct TestCase
+        {
+            const char  *path;
+            const char  *content;
+        };
+        const TestCase testCases[] = {
+            { "pg3_ut_mesh_index.obj",      "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 4\n" },
+            { "pg3_ut_mesh_vertex.obj",     "v 0 0 x\nv 1 0 0\nv 0 1 0\nf 1 2 3\n" },
+            { "pg3_ut_mesh_face.obj",       "v 0 0 0\nv 1 0 0\nf 1 2\n" },
+            { "pg3_ut_mesh_truncated.ply",
+              "ply\nformat ascii 1.0\nelement vertex 3\nproperty float x\nproperty float y\n"
+              "property float z\nelement face 1\nproperty list uchar int vertex_indices\nend_header\n"
+              "0 0 0\n1 0 0\n0 1 0\n3 0 1\n" },
+            { "pg3_ut_mesh_index.ply",
+              "ply\nformat ascii 1.0\nelement vertex 3\nproperty float x\nproperty float y\n"
+              "property float z\nelement face 1\nproperty list uchar int vertex_indices\nend_header\n"
+              "0 0 0\n1 0 0\n0 1 0\n3 0 1 3\n" },
+            { "pg3_ut_mesh_overflow.ply", // 2^61 doubles: the element size overflows 64 bits
+              "ply\nformat binary_little_endian 1.0\nelement extra 2305843009213693952\nproperty double d\n"
+              "element vertex 3\nproperty float x\nproperty float y\nproperty float z\n"
+              "element face 1\nproperty list uchar int vertex_indices\nend_header\n" },
+            { "pg3_ut_mesh.txt",            "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n" },
+        };
+
+        for (const auto &testCase : testCases)
+        {
+            if (!_UT_WriteFile(testCase.path, testCase.content))
+            {
+                PG3_UT_FATAL_ERROR(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Invalid files are rejected",
+                    "Cannot write the test file");
+                return false;
+            }
+
+            TriangleMesh mesh;
+            std::string error;
+            const bool loaded = mesh.Load(testCase.path, 0, error);
+            std::remove(testCase.path);
+
+            if (loaded || error.empty() || (mesh.GetTriangleCount() != 0))
+            {
+                std::ostringstream errorDescription;
+                errorDescription << "File \"" << testCase.path << "\" was accepted";
+                PG3_UT_FAILED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Invalid files are rejected",
+                    errorDescription.str().c_str());
+                return false;
+            }
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Invalid files are rejected");
+        return true;
+    }
+
+    // Mesh triangles must behave exactly like regular triangles, both when intersected directly
+    // and through the SIMD path of the BVH
+    static bool _UT_IntersectionsMatchTriangles(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Intersections match Triangle");
+
+        const char *path = "pg3_ut_mesh_random.obj";
+        {
+            Rng rng(7);
+            std::ostringstream obj;
+            obj.precision(std::numeric_limits<float>::digits10 + 3); // float round trip
+            const uint32_t vertexCount = 500;
+            for (uint32_t i = 0; i < vertexCount; i++)
+            {
+                const Vec3f vertex = rng.GetVec3f();
+                obj << "v " << vertex.x << " " << vertex.y << " " << vertex.z << "\n";
+            }
+            for (uint32_t i = 0; i < 2000; i++)
+            {
+                const uint32_t index0 = (uint32_t)(rng.GetFloat() * vertexCount) % vertexCount;
+                obj << "f " << (index0 + 1);
+                for (uint32_t j = 0; j < 2; j++)
+                    obj << " " << ((index0 + (uint32_t)(rng.GetFloat() * 10)) % vertexCount + 1);
+                obj << "\n";
+            }
+            if (!_UT_WriteFile(path, obj.str()))
+            {
+                PG3_UT_FATAL_ERROR(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Intersections match Triangle",
+                    "Cannot write the test file");
+                return false;
+            }
+        }
+
+        // The mesh must outlive the lists
+        TriangleMesh mesh;
+        std::string error;
+        const bool loaded = mesh.Load(path, 1, error);
+        std::remove(path);
+        if (!loaded)
+        {
+            PG3_UT_FAILED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Intersections match Triangle",
+                error.c_str());
+            return false;
+        }
+
+        GeometryList triangleList;
+        for (uint32_t i = 0; i < mesh.GetTriangleCount(); i++)
+        {
+            const MeshTriangle &triangle = mesh.GetTriangle(i);
+            triangleList.mGeometry.push_back(new Triangle(
+                triangle.GetVertex(0), triangle.GetVertex(1), triangle.GetVertex(2), triangle.mMatId));
+        }
+        GeometryList meshList;
+        mesh.AddTriangles(meshList.mGeometry);
+        BVH meshBvh;
+        mesh.AddTriangles(meshBvh.mGeometry);
+        meshBvh.Build();
+
+        Rng rayRng(13);
+        for (uint32_t rayIdx = 0; rayIdx < 10000; rayIdx++)
+        {
+            const Vec3f org = rayRng.GetVec3f() * 1.5f - Vec3f(0.25f);
+            const Vec3f dir = Sampling::SampleUniformSphereW(rayRng.GetVec2f());
+            const Ray ray(org, dir, 0.f);
+
+            RayIntersection triangleIsect(1e36f);
+            RayIntersection meshIsect(1e36f);
+            RayIntersection bvhIsect(1e36f);
+            const bool triangleHit  = triangleList.Intersect(ray, triangleIsect);
+            const bool meshHit      = meshList.Intersect(ray, meshIsect);
+            const bool bvhHit       = meshBvh.Intersect(ray, bvhIsect);
+
+            RayIntersection meshIsectP(1e36f);
+            RayIntersection bvhIsectP(1e36f);
+            const bool meshHitP = meshList.IntersectP(ray, meshIsectP);
+            const bool bvhHitP  = meshBvh.IntersectP(ray, bvhIsectP);
+
+            const char *failure = nullptr;
+            if (!GeometrySoA::_UT_IsectEqual(triangleHit, triangleIsect, meshHit, meshIsect))
+                failure = "Mesh triangles differ from triangles";
+            else if ((bvhHit != triangleHit) || (triangleHit && (bvhIsect.dist != triangleIsect.dist)))
+                failure = "BVH over mesh triangles differs from triangles";
+            else if ((meshHitP != triangleHit) || (bvhHitP != triangleHit))
+                failure = "Any-hit query differs from closest-hit query";
+
+            if (failure != nullptr)
+            {
+                std::ostringstream errorDescription;
+                errorDescription << failure << " (ray " << rayIdx << ")";
+                PG3_UT_FAILED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Intersections match Triangle",
+                    errorDescription.str().c_str());
+                return false;
+            }
+        }
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblSubTestLevel1, "Intersections match Triangle");
+        return true;
+    }
+
+    static bool _UnitTests(const UnitTestBlockLevel aMaxUtBlockPrintLevel)
+    {
+        PG3_UT_BEGIN(aMaxUtBlockPrintLevel, eutblWholeTest, "TriangleMesh: loading");
+
+        if (!_UT_LoadFile(aMaxUtBlockPrintLevel, "OBJ", "pg3_ut_mesh.obj", _UT_ObjContent()))
+            return false;
+        if (!_UT_LoadFile(aMaxUtBlockPrintLevel, "PLY ascii", "pg3_ut_mesh_ascii.ply", _UT_PlyAsciiContent()))
+            return false;
+        if (!_UT_LoadFile(aMaxUtBlockPrintLevel, "PLY ascii, faces first, wrapped lines",
+                          "pg3_ut_mesh_ascii_reordered.ply", _UT_PlyAsciiReorderedContent()))
+            return false;
+        if (!_UT_LoadFile(aMaxUtBlockPrintLevel, "PLY binary little endian", "pg3_ut_mesh_le.ply",
+                          _UT_PlyBinaryContent(false)))
+            return false;
+        if (!_UT_LoadFile(aMaxUtBlockPrintLevel, "PLY binary big endian", "pg3_ut_mesh_be.ply",
+                          _UT_PlyBinaryContent(true)))
+            return false;
+        if (!_UT_InvalidFiles(aMaxUtBlockPrintLevel))
+            return false;
+        if (!_UT_IntersectionsMatchTriangles(aMaxUtBlockPrintLevel))
+            return false;
+
+        PG3_UT_PASSED(aMaxUtBlockPrintLevel, eutblWholeTest, "TriangleMesh: loading");
+        return true;
+    }
+
+#endif
+
+#ifdef PG3_RUN_BENCHMARKS_INSTEAD_OF_RENDERER
+
+    // Writes a height field grid with 2 * aGridSize^2 triangles in the OBJ or binary PLY format
+    static bool _BM_WriteGrid(const char *aPath, const uint32_t aGridSize, const bool aPly)
+    {
+        std::ofstream file(aPath, std::ios::binary);
+        const uint32_t rowSize = aGridSize + 1;
+        const uint32_t vertexCount = rowSize * rowSize;
+        const uint32_t faceCount = 2 * aGridSize * aGridSize;
+
+        if (aPly)
+            file
+                << "ply\nformat binary_little_endian 1.0\n"
+                << "element vertex " << vertexCount << "\n"
+                << "property float x\nproperty float y\nproperty float z\n"
+                << "element face " << faceCount << "\n"
+                << "property list uchar int vertex_indices\nend_header\n";
+
+        std::string buffer;
+        char line[128];
+        for (uint32_t y = 0; y < rowSize; y++)
+        {
+            buffer.clear();
+            for (uint32_t x = 0; x < rowSize; x++)
+            {
+                const Vec3f vertex(
+                    (float)x / aGridSize, (float)y / aGridSize, 0.1f * std::sin(0.05f * (x + y)));
+                if (aPly)
+                {
+                    _BM_Append(buffer, vertex.x);
+                    _BM_Append(buffer, vertex.y);
+                    _BM_Append(buffer, vertex.z);
+                }
+                else
+                {
+                    const int length = std::snprintf(
+                        line, sizeof(line), "v %.6f %.6f %.6f\n", vertex.x, vertex.y, vertex.z);
+                    buffer.append(line, (size_t)length);
+                }
+            }
+            file.write(buffer.data(), (std::streamsize)buffer.size());
+        }
+        for (uint32_t y = 0; y < aGridSize; y++)
+        {
+            buffer.clear();
+            for (uint32_t x = 0; x < aGridSize; x++)
+            {
+                const int32_t i00 = (int32_t)(y * rowSize + x);
+                const int32_t quad[4] = { i00, i00 + 1, i00 + (int32_t)rowSize + 1, i00 + (int32_t)rowSize };
+                const int32_t triangles[2][3] = {
+                    { quad[0], quad[1], quad[2] }, { quad[0], quad[2], quad[3] } };
+                for (uint32_t t = 0; t < 2; t++)
+                {
+                    if (aPly)
+                    {
+                        buffer.push_back((char)3);
+                        for (uint32_t j = 0; j < 3; j++)
+                            _BM_Append(buffer, triangles[t][j]);
+                    }
+                    else
+                    {
+                        const int length = std::snprintf(line, sizeof(line), "f %d %d %d\n",
+                            triangles[t][0] + 1, triangles[t][1] + 1, triangles[t][2] + 1);
+                        buffer.append(line, (size_t)length);
+                    }
+                }
+            }
+            file.write(buffer.data(), (std::streamsize)buffer.size());
+        }
+
+        return file.good();
+    }
+
+    template <typename T>
+    static void _BM_Append(std::string &aoBuffer, const T aValue)
+    {
+        // Little endian machines only, which is the case of all supported platforms
+        aoBuffer.append(reinterpret_cast<const char*>(&aValue), sizeof(T));
+    }
+
+    static void _Benchmark()
+    {
+        Benchmarking::PrintHeader("Triangle mesh loading");
+
+        const uint32_t gridSize = 1000; // 2M triangles
+        const char * const paths[] = { "pg3_bm_mesh.obj", "pg3_bm_mesh.ply" };
+
+        for (uint32_t format = 0; format < 2; format++)
+        {
+            if (!_BM_WriteGrid(paths[format], gridSize, format == 1))
+            {
+                printf("\tCannot write \"%s\"\n", paths[format]);
+                continue;
+            }
+
+            TriangleMesh mesh;
+            std::string error;
+            if (mesh.Load(paths[format], 0, error))
+            {
+                printf("\t%s: %u vertices, %u triangles, %.1f MB file\n",
+                    paths[format], mesh.GetVertexCount(), mesh.GetTriangleCount(),
+                    mesh.GetFileSize() / (1024. * 1024.));
+                Benchmarking::PrintThroughput(
+                    "  load", mesh.GetTriangleCount(), mesh.GetLoadSeconds(), "triangles");
+                printf("\t  %.1f MB/s, %.1f B/triangle (vertex buffer + triangle pool)\n",
+                    mesh.GetFileSize() / (1024. * 1024.) / mesh.GetLoadSeconds(),
+                    (double)mesh.GetStorageSize() / mesh.GetTriangleCount());
+
+                // The mesh must outlive the hierarchy
+                BVH bvh;
+                mesh.AddTriangles(bvh.mGeometry);
+                bvh.Build();
+                printf("\t  %.1f B/triangle in BVH (nodes, primitive list, SIMD copy), %.1f B/triangle in total\n",
+                    (double)bvh.GetStorageSize() / mesh.GetTriangleCount(),
+                    (double)(mesh.GetStorageSize() + bvh.GetStorageSize()) / mesh.GetTriangleCount());
+            }
+            else
+                printf("\t%s: loading failed: %s\n", paths[format], error.c_str());
+
+            std::remove(paths[format]);
+        }
+
+        printf("\tFor comparison, a separately allocated Triangle takes %d B + heap overhead\n",
+            (int32_t)sizeof(Triangle));
+        fflush(stdout);
+    }
+
+#endif
+};
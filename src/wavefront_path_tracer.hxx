@@ -0,0 +1,531 @@
+#pragma once
+
+#include "path_tracer_base.hxx"
+
+#include <vector>
+#include <algorithm>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Wavefront (breadth-first) path tracer
+//
+// Instead of following paths one by one recursively, all camera paths of a tile are extended
+// together, one vertex per pass. The path state lives in structure-of-arrays buffers and each
+// pass consists of batched stages:
+//  1. intersect the rays of all active paths,
+//  2. sort the hits by material ID and evaluate the background emission of all the missed
+//     rays in one batch,
+//  3. shade the hits material by material: emission (MIS-weighted against light sampling at
+//     the previous vertex), light sampling, Russian roulette and BSDF sampling,
+//  4. trace the queued shadow rays and add contributions of the visible light samples,
+//  5. continue with the paths which generated a new ray.
+//
+// The estimator is the same as the one of the recursive path tracer (PathTracer, kPathTracing)
+// without splitting and indirect illumination clipping: one light sample and one BSDF sample
+// per path vertex, combined with MIS.
+//
+// Each path has its own generator state, restarted for its pixel sample like in the recursive
+// path tracer, so the samples don't depend on the order in which the paths are processed.
+// The state is switched into mRng, which is used by the base class, while a path is processed.
+// The Mersenne Twister can't be restarted per pixel sample; all paths of a tile share its stream.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class WavefrontPathTracer : public PathTracerBase
+{
+public:
+
+    WavefrontPathTracer(
+        const Config    &aConfig,
+        int32_t          aSeed = 1234
+    ) :
+        PathTracerBase(aConfig, aSeed)
+    {}
+
+    virtual void RenderTile(
+        const Algorithm      aAlgorithm,
+        uint32_t             aIteration,
+        const ImageTile     &aTile,
+        Framebuffer         &oFramebuffer) override
+    {
+        aAlgorithm; // unused param
+
+        mRng = Rng(TileScheduler::TileSeed(mConfig.mBaseSeed, aIteration, aTile.index), mConfig.mRngType);
+
+        // One path per pixel sample (adaptive sampling may ask for none or several)
+        uint32_t pathCount = 0;
+        for (uint32_t y = aTile.minY; y < aTile.maxY; y++)
+            for (uint32_t x = aTile.minX; x < aTile.maxX; x++)
+                pathCount += oFramebuffer.GetIterationSampleCount(x, y);
+        ReservePaths(pathCount);
+
+        const uint32_t resX = (uint32_t)mConfig.mScene->mCamera.mResolution.x;
+
+        // Stage 0: generate camera rays
+        uint32_t pathIdx = 0;
+        for (uint32_t y = aTile.minY; y < aTile.maxY; y++)
+        {
+            for (uint32_t x = aTile.minX; x < aTile.maxX; x++)
+            {
+                const uint32_t sampleCount = oFramebuffer.GetIterationSampleCount(x, y);
+                const uint32_t firstSample = oFramebuffer.GetFirstSampleIndex(x, y, aIteration);
+                for (uint32_t sampleIdx = firstSample; sampleIdx < firstSample + sampleCount; sampleIdx++)
+                {
+                    SwitchPathRng(pathIdx);
+
+                    // Counter-based generators depend only on the pixel and the sample index
+                    mRng.StartPixelSample(y * resX + x, sampleIdx, (uint32_t)mConfig.mBaseSeed);
+
+                    const Vec2f sample = Vec2f(float(x), float(y)) + mRng.GetVec2f();
+                    InitPath(pathIdx, mConfig.mScene->mCamera.GenerateRay(sample));
+
+                    SwitchPathRng(pathIdx);
+                    pathIdx++;
+                }
+            }
+        }
+
+        TracePaths(pathCount);
+
+        pathIdx = 0;
+        for (uint32_t y = aTile.minY; y < aTile.maxY; y++)
+            for (uint32_t x = aTile.minX; x < aTile.maxX; x++)
+                for (uint32_t i = oFramebuffer.GetIterationSampleCount(x, y); i > 0; i--)
+                    oFramebuffer.AddRadiance(x, y, mPaths.radiance[pathIdx++]);
+    }
+
+    virtual void EstimateIncomingRadiance(
+        const Algorithm      aAlgorithm,
+        const Ray           &aRay,
+              SpectrumF     &oRadiance
+        ) override
+    {
+        aAlgorithm; // unused param
+
+        // A wavefront of a single path, which continues the current stream of mRng
+        ReservePaths(1);
+        if (UsesPathRng())
+            mPaths.rng[0] = mRng;
+        InitPath(0, aRay);
+        TracePaths(1);
+        if (UsesPathRng())
+            mRng = mPaths.rng[0];
+        oRadiance = mPaths.radiance[0];
+    }
+
+protected:
+
+    // Structure-of-arrays path state
+    struct PathBuffers
+    {
+        // Ray to be traced in the next pass
+        std::vector<Vec3f>                  rayOrg;
+        std::vector<Vec3f>                  rayDir;
+        std::vector<float>                  rayTMin;
+
+        // Result of the intersection stage
+        std::vector<RayIntersection>        isect;
+
+        // Accumulated path contribution
+        std::vector<SpectrumF>              radiance;
+
+        // Weight of the radiance reflected at the next vertex (includes Russian roulette)
+        std::vector<SpectrumF>              throughput;
+
+        // Weight of the radiance emitted at the next vertex (excludes Russian roulette)
+        std::vector<SpectrumF>              emissionWeight;
+
+        // Length of the path ending at the next vertex
+        std::vector<uint32_t>               pathLength;
+
+        // Whether to estimate reflected radiance at the next vertex (false after Russian roulette)
+        std::vector<uint8_t>                estimateReflected;
+
+        // Previous path vertex: needed for MIS weights of emission hit by the BSDF sampled ray.
+        // prevMaterial is null for camera rays; prevBsdfPdfW is zero for Dirac BSDF components.
+        std::vector<Frame>                  prevFrame;
+        std::vector<const AbstractMaterial*> prevMaterial;
+        std::vector<float>                  prevBsdfPdfW;
+        std::vector<LightSamplingContext>   prevLightCtx;
+
+        // Generator state; only used by the counter-based generators (see UsesPathRng())
+        std::vector<Rng>                    rng;
+    };
+
+    // Light sample waiting for its visibility test
+    struct ShadowRay
+    {
+        Vec3f       org;
+        Vec3f       dir;
+        float       dist;
+        uint32_t    pathIdx;
+        SpectrumF   contribution;   // Added to the path radiance if the light is visible
+    };
+
+    void ReservePaths(const uint32_t aPathCount)
+    {
+        if (mPaths.radiance.size() >= aPathCount)
+            return;
+
+        mPaths.rayOrg.resize(aPathCount);
+        mPaths.rayDir.resize(aPathCount);
+        mPaths.rayTMin.resize(aPathCount);
+        mPaths.isect.resize(aPathCount);
+        mPaths.radiance.resize(aPathCount);
+        mPaths.throughput.resize(aPathCount);
+        mPaths.emissionWeight.resize(aPathCount);
+        mPaths.pathLength.resize(aPathCount);
+        mPaths.estimateReflected.resize(aPathCount);
+        mPaths.prevFrame.resize(aPathCount);
+        mPaths.prevMaterial.resize(aPathCount);
+        mPaths.prevBsdfPdfW.resize(aPathCount);
+        mPaths.prevLightCtx.resize(aPathCount);
+        if (UsesPathRng())
+            mPaths.rng.resize(aPathCount, Rng(mConfig.mBaseSeed, mConfig.mRngType));
+
+        mActivePaths.reserve(aPathCount);
+        mNextActivePaths.reserve(aPathCount);
+        mSortedHits.resize(aPathCount);
+        mMissedPaths.reserve(aPathCount);
+        mMissedDirs.reserve(aPathCount);
+        mMissedEmission.reserve(aPathCount);
+        mShadowRays.reserve(aPathCount);
+    }
+
+    bool UsesPathRng() const
+    {
+        return mConfig.mRngType != RngType::kMersenneTwister;
+    }
+
+    // Exchanges the generator state of the path with mRng. Called in pairs around the code
+    // which samples for the path.
+    void SwitchPathRng(const uint32_t aPathIdx)
+    {
+        if (UsesPathRng())
+            std::swap(mRng, mPaths.rng[aPathIdx]);
+    }
+
+    void InitPath(const uint32_t aPathIdx, const Ray &aRay)
+    {
+        mPaths.rayOrg[aPathIdx]             = aRay.org;
+        mPaths.rayDir[aPathIdx]             = aRay.dir;
+        mPaths.rayTMin[aPathIdx]            = aRay.tmin;
+        mPaths.radiance[aPathIdx].MakeZero();
+        mPaths.throughput[aPathIdx].SetGreyAttenuation(1.0f);
+        mPaths.emissionWeight[aPathIdx].SetGreyAttenuation(1.0f);
+        mPaths.pathLength[aPathIdx]         = 1;
+        mPaths.estimateReflected[aPathIdx]  = true;
+        mPaths.prevMaterial[aPathIdx]       = nullptr;
+        mPaths.prevBsdfPdfW[aPathIdx]       = 0.f;
+    }
+
+    // Extends all paths [0, aPathCount) until they terminate
+    void TracePaths(const uint32_t aPathCount)
+    {
+        mActivePaths.resize(aPathCount);
+        for (uint32_t i = 0; i < aPathCount; i++)
+            mActivePaths[i] = i;
+
+        while (!mActivePaths.empty())
+        {
+            IntersectStage();
+            const uint32_t hitCount = SortHitsStage();
+            BackgroundStage();
+            ShadeStage(hitCount);
+            ShadowStage();
+
+            mActivePaths.swap(mNextActivePaths);
+        }
+    }
+
+    // Stage 1: find the closest hits of all active rays
+    void IntersectStage()
+    {
+        for (const uint32_t pathIdx : mActivePaths)
+        {
+            const Ray ray(mPaths.rayOrg[pathIdx], mPaths.rayDir[pathIdx], mPaths.rayTMin[pathIdx]);
+            RayIntersection &isect = mPaths.isect[pathIdx];
+            isect = RayIntersection(1e36f);
+            if (!Intersect(ray, isect, (mPaths.pathLength[pathIdx] == 1) ? kCameraRay : kBsdfRay))
+                isect.matID = -1; // Marks a miss
+        }
+    }
+
+    // Stage 2: collect the missed paths into mMissedPaths and sort the rest by material
+    // (counting sort). Returns the number of hits stored in mSortedHits.
+    uint32_t SortHitsStage()
+    {
+        mMaterialOffsets.assign(mConfig.mScene->GetMaterialCount() + 1, 0);
+        mMissedPaths.clear();
+
+        for (const uint32_t pathIdx : mActivePaths)
+        {
+            const int32_t matID = mPaths.isect[pathIdx].matID;
+            if (matID >= 0)
+                mMaterialOffsets[matID + 1]++;
+            else
+                mMissedPaths.push_back(pathIdx);
+        }
+
+        for (size_t i = 1; i < mMaterialOffsets.size(); i++)
+            mMaterialOffsets[i] += mMaterialOffsets[i - 1];
+        const uint32_t hitCount = mMaterialOffsets.back();
+
+        for (const uint32_t pathIdx : mActivePaths)
+        {
+            const int32_t matID = mPaths.isect[pathIdx].matID;
+            if (matID >= 0)
+                mSortedHits[mMaterialOffsets[matID]++] = pathIdx;
+        }
+
+        return hitCount;
+    }
+
+    // Stage 2b: terminate the missed paths. The background radiance of all of them is evaluated
+    // in one batch: the camera rays escaping from a tile are coherent and share texels.
+    void BackgroundStage()
+    {
+        const BackgroundLight *backgroundLight = mConfig.mScene->GetBackgroundLight();
+
+        mMissedDirs.clear();
+        if (backgroundLight != nullptr)
+            for (const uint32_t pathIdx : mMissedPaths)
+                if (mPaths.pathLength[pathIdx] >= mMinPathLength)
+                    mMissedDirs.push_back(mPaths.rayDir[pathIdx]);
+        mMissedEmission.resize(mMissedDirs.size());
+        if (!mMissedDirs.empty())
+            GetBackgroundEmmision(
+                *backgroundLight, mMissedDirs.data(), mMissedEmission.data(), mMissedDirs.size());
+
+        uint32_t emissionIdx = 0;
+        for (const uint32_t pathIdx : mMissedPaths)
+        {
+            const uint32_t pathLength = mPaths.pathLength[pathIdx];
+
+            if ((backgroundLight != nullptr) && (pathLength >= mMinPathLength))
+            {
+                const SpectrumF &emission = mMissedEmission[emissionIdx++];
+                const AbstractMaterial *prevMaterial = mPaths.prevMaterial[pathIdx];
+                float lightPdfW = 0.f;
+                if ((prevMaterial != nullptr) && !emission.IsZero())
+                    lightPdfW =
+                        GetBackgroundPdfW(
+                            *backgroundLight,
+                            mPaths.rayDir[pathIdx],
+                            mPaths.prevFrame[pathIdx],
+                            *prevMaterial);
+
+                SwitchPathRng(pathIdx);
+                AddEmission(pathIdx, emission, lightPdfW, mConfig.mScene->GetBackgroundLightId());
+                SwitchPathRng(pathIdx);
+            }
+
+            if (mPaths.estimateReflected[pathIdx])
+                mIntrospectionData.AddCorePathLength(pathLength - 1u, kTerminatedByBackground);
+        }
+    }
+
+    // Adds radiance emitted towards the previous path vertex, MIS-weighted if it could have been
+    // generated by light sampling at that vertex
+    void AddEmission(
+        const uint32_t       aPathIdx,
+        const SpectrumF     &aEmission,
+        const float          aLightPdfW,
+        const int32_t        aLightId)
+    {
+        if (aEmission.IsZero() || (aLightId < 0))
+            return;
+
+        const AbstractMaterial *prevMaterial = mPaths.prevMaterial[aPathIdx];
+        const float prevBsdfPdfW = mPaths.prevBsdfPdfW[aPathIdx];
+
+        float misWeight = 1.f;
+        if ((prevMaterial != nullptr) && (prevBsdfPdfW > 0.f))
+        {
+            // Finite BSDF component at the previous vertex
+            const Vec3f prevSurfPt = mPaths.rayOrg[aPathIdx];
+            float lightPickingProb = 0.f;
+            LightPickingProbability(
+                prevSurfPt, mPaths.prevFrame[aPathIdx], *prevMaterial, aLightId,
+                mPaths.prevLightCtx[aPathIdx], lightPickingProb);
+
+            PG3_ASSERT(aLightPdfW != Math::InfinityF()); // BSDF sampling should never hit a point light
+
+            misWeight = MISWeight2(prevBsdfPdfW, 1, aLightPdfW * lightPickingProb, 1);
+        }
+
+        mPaths.radiance[aPathIdx] += mPaths.emissionWeight[aPathIdx] * aEmission * misWeight;
+
+        PG3_ASSERT_VEC3F_NONNEGATIVE(mPaths.radiance[aPathIdx]);
+    }
+
+    // Stage 3: process hits material by material and generate the next rays and shadow rays
+    void ShadeStage(const uint32_t aHitCount)
+    {
+        mNextActivePaths.clear();
+        mShadowRays.clear();
+
+        for (uint32_t i = 0; i < aHitCount; i++)
+        {
+            const uint32_t pathIdx = mSortedHits[i];
+
+            SwitchPathRng(pathIdx);
+            const bool continues = ShadeHit(pathIdx);
+            SwitchPathRng(pathIdx);
+
+            if (continues)
+                mNextActivePaths.push_back(pathIdx);
+        }
+    }
+
+    // Returns true if the path continues
+    bool ShadeHit(const uint32_t aPathIdx)
+    {
+        const RayIntersection &isect = mPaths.isect[aPathIdx];
+        const uint32_t pathLength = mPaths.pathLength[aPathIdx];
+        const Vec3f &rayOrg = mPaths.rayOrg[aPathIdx];
+        const Vec3f &rayDir = mPaths.rayDir[aPathIdx];
+
+        const Vec3f surfPt = rayOrg + rayDir * isect.dist;
+        Frame surfFrame;
+        surfFrame.SetFromZ(isect.normal);
+        const Vec3f wol = surfFrame.ToLocal(-rayDir);
+        const AbstractMaterial &mat = mConfig.mScene->GetMaterial(isect.matID);
+
+        // If light source was hit, get its emmision
+        if ((isect.lightID >= 0) && (pathLength >= mMinPathLength))
+        {
+            const AbstractLight *light = mConfig.mScene->GetLightPtr(isect.lightID);
+            if (light != nullptr)
+            {
+                const AbstractMaterial *prevMaterial = mPaths.prevMaterial[aPathIdx];
+                float lightPdfW = 0.f;
+                const SpectrumF emission =
+                    light->GetEmmision(
+                        surfPt, wol, rayOrg,
+                        (prevMaterial != nullptr) ? &lightPdfW : nullptr,
+                        (prevMaterial != nullptr) ? &mPaths.prevFrame[aPathIdx] : nullptr,
+                        prevMaterial);
+                AddEmission(aPathIdx, emission, lightPdfW, isect.lightID);
+            }
+        }
+
+        if (!mPaths.estimateReflected[aPathIdx])
+            // Path was cut by Russian roulette, it was only extended to get the emission
+            return false;
+
+        if (mat.IsReflectanceZero())
+        {
+            // Zero reflectivity - there is no chance of contribution behing this reflection;
+            // we can safely cut the path without incorporation of bias
+            mIntrospectionData.AddCorePathLength(pathLength, kTerminatedByBlocker);
+            return false;
+        }
+
+        if ((mMaxPathLength > 0) && (pathLength >= mMaxPathLength))
+        {
+            mIntrospectionData.AddCorePathLength(pathLength, kTerminatedByMaxLimit);
+            return false;
+        }
+
+        // The light sampling context now belongs to this vertex
+        LightSamplingContext &lightCtx = mPaths.prevLightCtx[aPathIdx];
+        lightCtx.mValid = false;
+
+        // Generate a light sample, its visibility is tested later in a batch
+        if ((pathLength + 1) >= mMinPathLength)
+        {
+            LightSample lightSample;
+            if (   SampleLightsSingle(surfPt, surfFrame, mat, lightCtx, lightSample)
+                && (lightSample.sample.Max() > 0.))
+            {
+                SpectrumF contribution;
+                contribution.MakeZero();
+                AddUnoccludedMISLightSampleContribution(
+                    lightSample, 1, 1, surfFrame, wol, mat, contribution);
+
+                if (!contribution.IsZero())
+                {
+                    ShadowRay shadowRay;
+                    shadowRay.org           = surfPt;
+                    shadowRay.dir           = lightSample.wig;
+                    shadowRay.dist          = lightSample.dist;
+                    shadowRay.pathIdx       = aPathIdx;
+                    shadowRay.contribution  = mPaths.throughput[aPathIdx] * contribution;
+                    mShadowRays.push_back(shadowRay);
+                }
+            }
+        }
+
+        // Russian roulette (based on reflectance of the whole BSDF)
+        float rrContinuationProb = 1.0f;
+        bool estimateReflected = true;
+        if (mMaxPathLength == 0)
+        {
+            // See PathTracer::EstimateIncomingRadiancePT() for the choice of the clamping value
+            rrContinuationProb = Math::Clamp(mat.GetRRContinuationProb(wol), 0.0f, 0.997f);
+
+            const float rnd = mRng.GetFloat();
+            if (rnd > rrContinuationProb)
+            {
+                estimateReflected = false;
+                mIntrospectionData.AddCorePathLength(pathLength, kTerminatedByRussianRoulette);
+            }
+        }
+
+        // Sample BSDF
+        MaterialRecord matRecord(wol);
+        SampleBsdf(mat, matRecord);
+        if (matRecord.IsBlocker())
+            return false;
+
+        const SpectrumF &throughput = mPaths.throughput[aPathIdx];
+        if (matRecord.IsFiniteComp())
+        {
+            const float bsdfPdfW = matRecord.pdfW * matRecord.compProb;
+            const SpectrumF weight = throughput * matRecord.attenuation * matRecord.ThetaInCosAbs();
+            mPaths.emissionWeight[aPathIdx] = weight / bsdfPdfW;
+            mPaths.throughput[aPathIdx]     = weight / (bsdfPdfW * rrContinuationProb);
+            mPaths.prevBsdfPdfW[aPathIdx]   = bsdfPdfW;
+        }
+        else
+        {
+            // Dirac BSDF: no MIS for emission hit by this ray
+            const SpectrumF weight = throughput * matRecord.attenuation;
+            mPaths.emissionWeight[aPathIdx] = weight / matRecord.compProb;
+            mPaths.throughput[aPathIdx]     = weight / (matRecord.compProb * rrContinuationProb);
+            mPaths.prevBsdfPdfW[aPathIdx]   = 0.f;
+        }
+
+        PG3_ASSERT_VEC3F_NONNEGATIVE(mPaths.throughput[aPathIdx]);
+
+        mPaths.prevFrame[aPathIdx]          = surfFrame;
+        mPaths.prevMaterial[aPathIdx]       = &mat;
+        mPaths.estimateReflected[aPathIdx]  = estimateReflected;
+        mPaths.pathLength[aPathIdx]         = pathLength + 1;
+
+        mPaths.rayOrg[aPathIdx]  = surfPt;
+        mPaths.rayDir[aPathIdx]  = surfFrame.ToWorld(matRecord.wil);
+        mPaths.rayTMin[aPathIdx] = Geom::EpsRayCos(matRecord.ThetaInCosAbs());
+
+        return true;
+    }
+
+    // Stage 4: test visibility of the queued light samples
+    void ShadowStage()
+    {
+        for (const ShadowRay &shadowRay : mShadowRays)
+            if (!Occluded(shadowRay.org, shadowRay.dir, shadowRay.dist))
+                mPaths.radiance[shadowRay.pathIdx] += shadowRay.contribution;
+    }
+
+protected:
+
+    PathBuffers             mPaths;
+
+    std::vector<uint32_t>   mActivePaths;
+    std::vector<uint32_t>   mNextActivePaths;
+    std::vector<uint32_t>   mSortedHits;
+    std::vector<uint32_t>   mMissedPaths;
+    std::vector<Vec3f>      mMissedDirs;
+    std::vector<SpectrumF>  mMissedEmission;
+    std::vector<uint32_t>   mMaterialOffsets;
+    std::vector<ShadowRay>  mShadowRays;
+};